@@ -1,15 +1,15 @@
 #include "jelloMesh.h"
+#include "springKernels.h"
 #ifdef __APPLE__
 #include <GLUT/glut.h>
 #else
 #include <GL/glut.h>
 #endif
 #include <algorithm>
+#include <string.h>
 
 #define PRINT_NORMAL_DIST(n, d) {printf("normal: (%0.3f, %0.3f, %0.3f) :: dist = %0.5f\n", n[0], n[1], n[2], d); fflush(stdout); }
 
-#define USE_DIAG_SHEAR false 
-
 double JelloMesh::g_structuralKs = 1000.0; 
 double JelloMesh::g_structuralKd = 20.0; 
 double JelloMesh::g_attachmentKs = 0.0;
@@ -22,13 +22,22 @@ double JelloMesh::g_penaltyKs = 200000.0;
 double JelloMesh::g_penaltyKd = 100.0;
 double JelloMesh::g_shearDiagKs = 500.0;
 double JelloMesh::g_shearDiagKd = 1.0;
+double JelloMesh::g_implicitTolerance = 1e-6;
+int JelloMesh::g_implicitMaxIterations = 200;
+int JelloMesh::g_projectiveIterations = 10;
+
+int JelloMesh::g_structuralRadius = 1;
+int JelloMesh::g_bendRadius = 2;
+int JelloMesh::g_shearRadius = 2;
+int JelloMesh::g_shearDiagRadius = 0;
 
 
 double JelloMesh::contactThres = 0.05;
 
 JelloMesh::JelloMesh() :     
     m_integrationType(JelloMesh::RK4), m_drawflags(MESH | STRUCTURAL),
-    m_cols(0), m_rows(0), m_stacks(0), m_width(0.0), m_height(0.0), m_depth(0.0) {
+    m_cols(0), m_rows(0), m_stacks(0), m_width(0.0), m_height(0.0), m_depth(0.0),
+    m_projectiveTimeStep(0.01) {
   SetSize(1.0, 1.0, 1.0);
   SetGridSize(6, 6, 6);
   //SetGridSize(20, 20, 20);
@@ -40,30 +49,14 @@ void JelloMesh::Reset() {
   InitJelloMesh();
 }
 
-JelloMesh::Particle& JelloMesh::GetParticle(JelloMesh::ParticleGrid& grid, int i, int j, int k) {
-  return grid[i][j][k];
-}
-
-JelloMesh::Particle& JelloMesh::GetParticle(JelloMesh::ParticleGrid& grid, int idx) {
-  int i,j,k;
-  GetCell(idx, i, j, k);
-  return GetParticle(grid, i,j,k);
-}
-
-const JelloMesh::Particle& JelloMesh::GetParticle(const JelloMesh::ParticleGrid& grid, int i, int j, int k) const {
-  return grid[i][j][k];
+int JelloMesh::GetParticleCount() const {
+  return (m_rows+1)*(m_cols+1)*(m_stacks+1);
 }
 
-const JelloMesh::Particle& JelloMesh::GetParticle(const JelloMesh::ParticleGrid& grid, int idx) const {
-  int i,j,k;
-  GetCell(idx, i, j, k);
-  return GetParticle(grid, i,j,k);
-}
-
-bool JelloMesh::isInterior(const JelloMesh::Spring& s) const {
+bool JelloMesh::isSpringInterior(int spring) const {
   int i1,j1,k1,i2,j2,k2;
-  GetCell(s.m_p1, i1, j1, k1);
-  GetCell(s.m_p2, i2, j2, k2);
+  GetCell(m_springs.m_p1[spring], i1, j1, k1);
+  GetCell(m_springs.m_p2[spring], i2, j2, k2);
   return isInterior(i1,j1,k1) || isInterior(i2,j2,k2);
 }
 
@@ -84,13 +77,14 @@ void JelloMesh::SetGridSize(int cols, int rows, int stacks) {
   m_stacks = stacks;
 
   if (m_cols > 0 && m_rows > 0 && m_stacks > 0) {
-    m_vparticles.resize(m_rows+1);
-    for (int i = 0; i < m_rows+1; i++) {
-      m_vparticles[i].resize(m_cols+1);
-      for (int j = 0; j < m_cols+1; j++) {
-        m_vparticles[i][j].resize(m_stacks+1);
-      }
-    }
+    int count = GetParticleCount();
+    m_vparticles.Resize(count);
+    m_vparticlesPrev.Resize(count);
+    m_vstage.Resize(count);
+    m_vstageSum.resize(6 * (size_t) count);
+    m_vmass.resize(count);
+    m_vinvMass.resize(count);
+    m_vsolver.resize(9 * 3 * (size_t) count);
   }
   InitJelloMesh();
 }
@@ -133,23 +127,19 @@ int JelloMesh::GetIndex(int i, int j, int k) const {
   return cols + rows + stacks;
 }
 
-#define ROUND(x) (floor(x + 0.5))
-#define FLOOR(x) (floor(x))
-#define FRACT(x) (x - FLOOR(x))
 void JelloMesh::GetCell(int idx, int& i, int &j, int& k) const {
-  float rows = m_rows+1;
-  float cols = m_cols+1;
-  float stacks = m_stacks+1;
+  int rows = m_rows+1;
+  int cols = m_cols+1;
 
-  // derived from idx = cols*(rows*k + i) + j
-  float tmp = FLOOR(idx/cols);
-  j = (int) ROUND(cols*(FRACT(idx/cols)));
-  i = (int) ROUND(rows*(FRACT(tmp/rows)));
-  k = (int) FLOOR(tmp/rows);
+  // inverse of idx = cols*(rows*k + i) + j
+  int tmp = idx / cols;
+  j = idx - tmp*cols;
+  i = tmp % rows;
+  k = tmp / rows;
 }
 
 void JelloMesh::InitJelloMesh() {
-  m_vsprings.clear();
+  m_springs.Clear();
 
   if (m_width < 0.01 || m_height < 0.01 || m_depth < 0.01) return;
   if (m_cols < 1 || m_rows < 1 || m_stacks < 1) return;
@@ -159,8 +149,8 @@ void JelloMesh::InitJelloMesh() {
   float hcellsize = m_height / m_rows;
   float dcellsize = m_depth / m_stacks;
   float mass = (1.0 * 7*7*7) / ((m_cols+1)* (m_rows+1) * (m_stacks+1));
-  vec3 zero(0, 0, 0);
-    
+  ParticleGrid& g = m_vparticles;
+  
   for (int i = 0; i < m_rows+1; i++) {
     for (int j = 0; j < m_cols+1; j++) {
       for (int k = 0; k < m_stacks+1; k++) {
@@ -180,7 +170,12 @@ void JelloMesh::InitJelloMesh() {
         //y += 1.0;
         x += 0.0;
         y += 0.5;
-        m_vparticles[i][j][k] = Particle(GetIndex(i,j,k), vec3(x, y, z), zero, mass);
+        int idx = GetIndex(i,j,k);
+        g.SetPosition(idx, vec3(x, y, z));
+        g.SetVelocity(idx, vec3(0, 0, 0));
+        g.fx[idx] = g.fy[idx] = g.fz[idx] = 0.0;
+        m_vmass[idx] = mass;
+        m_vinvMass[idx] = 1/m_vmass[idx];
       }
     }
   }
@@ -188,103 +183,12 @@ void JelloMesh::InitJelloMesh() {
   // store copy of particles as previous
   m_vparticlesPrev = m_vparticles;
 
+  InitSprings();
 
-  ParticleGrid& g = m_vparticles;
-  
-  // Setup structural/bend springs
-  for (int d = 1; d < max(max(m_rows, m_cols), m_stacks); d++) {
-    for (int i = 0; i < m_rows+1; i++) {
-      for (int j = 0; j < m_cols+1; j++) {
-        for (int k = 0; k < m_stacks+1; k++) {
-          if (j < m_cols+1-d) {
-            AddStructuralSpring(GetParticle(g,i,j,k), GetParticle(g,i,j+d,k));
-          }
-          if (i < m_rows+1-d) { 
-            AddStructuralSpring(GetParticle(g,i,j,k), GetParticle(g,i+d,j,k));
-          }
-          if (k < m_stacks+1-d) {
-            AddStructuralSpring(GetParticle(g,i,j,k), GetParticle(g,i,j,k+d));
-          }
-        }
-      }
-    }
-  }
-
-  // Setup shear springs
-  //for (int d = 1; d < max(max(m_rows, m_cols), m_stacks); d++) {
-  for (int d = 1; d < max(max(m_rows, m_cols), m_stacks); d++) {
-    for (int i = 0; i < m_rows+1; i++) {
-      for (int j = 0; j < m_cols+1; j++) {
-        for (int k = 0; k < m_stacks+1; k++) {
-          // xy plane springs
-          if (j < m_cols+1-d && i < m_rows+1-d) {
-            // add right side spring
-            AddShearSpring(GetParticle(g,i,j,k), GetParticle(g,i+d,j+d,k));
-          }
-          if (j > 0-1+d && i < m_rows+1-d) {
-            // add left side spring
-            AddShearSpring(GetParticle(g,i,j,k), GetParticle(g,i+d,j-j,k));
-          }
-
-          // yz plane
-          if (k < m_stacks+1-d && j < m_cols+1-d) {
-            // add right side spring
-            AddShearSpring(GetParticle(g,i,j,k), GetParticle(g,i,j+d,k+d));
-          }
-          if (k > 0-1+d && j < m_cols+1-d) {
-            // add right side spring
-            AddShearSpring(GetParticle(g,i,j,k), GetParticle(g,i,j+d,k-d));
-          }
-
-          // xz plane
-          if (i < m_rows+1-d && k < m_stacks+1-d) {
-            // add right side spring
-            AddShearSpring(GetParticle(g,i,j,k), GetParticle(g,i+d,j,k+d));
-          }
-          if (i > 0-1+d && k < m_stacks+1-d) {
-            // add right side spring
-            AddShearSpring(GetParticle(g,i,j,k), GetParticle(g,i-d,j,k+d));
-          }
-        }
-      }
-    }
-  }
-
-  if (USE_DIAG_SHEAR) {
-    // Setup diag shear springs
-    //for (int d = 1; d < max(max(m_rows, m_cols), m_stacks); d++) {
-    for (int d = 1; d < 2; d++) {
-      for (int i = 0; i < m_rows+1; i++) {
-        for (int j = 0; j < m_cols+1; j++) {
-          for (int k = 0; k < m_stacks+1; k++) {
-            // right forward
-            if (j < m_cols+1-d && i < m_rows+1-d && k < m_stacks+1-d) {
-              // add right side spring
-              AddShearDiagSpring(GetParticle(g,i,j,k), GetParticle(g,i+d,j+d,k+d));
-            }
-            // left forward
-            if (j > 0-1+d && i < m_rows+1-d && k < m_stacks+1-d) {
-              // add right side spring
-              AddShearDiagSpring(GetParticle(g,i,j,k), GetParticle(g,i+d,j-d,k+d));
-            }
-
-            // right back 
-            if (j < m_cols+1-d && i > 0-1+d && k < m_stacks+1-d) {
-              // add right side spring
-              AddShearDiagSpring(GetParticle(g,i,j,k), GetParticle(g,i-d,j+d,k+d));
-            }
-            // left back 
-            if (j > 0-1+d && i > 0-1+d && k < m_stacks+d-1) {
-              // add right side spring
-              AddShearDiagSpring(GetParticle(g,i,j,k), GetParticle(g,i-d,j-d,k+d));
-            }
-
-          }
-        }
-      }
-    }
-  }
-
+  // The system matrix only changes with the springs, masses and time
+  // step, so it is factored here rather than every step.
+  m_projectiveSystem.Clear();
+  if (m_integrationType == PROJECTIVE) FactorProjectiveSystem(m_projectiveTimeStep);
 
   // Init mesh geometry
   m_mesh.clear();
@@ -296,24 +200,46 @@ void JelloMesh::InitJelloMesh() {
   m_mesh.push_back(FaceMesh(*this,ZBACK));
 }
 
-void JelloMesh::AddStructuralSpring(Particle& p1, Particle& p2) {
-  double restLen = (p1.position - p2.position).Length();
-  m_vsprings.push_back(Spring(STRUCTURAL, p1.index, p2.index, g_structuralKs, g_structuralKd, restLen));
-}
+void JelloMesh::InitSprings() {
+  m_springs.Clear();
 
-void JelloMesh::AddBendSpring(JelloMesh::Particle& p1, JelloMesh::Particle& p2) {
-  double restLen = (p1.position - p2.position).Length();
-  m_vsprings.push_back(Spring(BEND, p1.index, p2.index, g_bendKs, g_bendKd, restLen));
-}
+  int structural = m_springs.AddKind(STRUCTURAL, g_structuralKs, g_structuralKd);
+  int bend = m_springs.AddKind(BEND, g_bendKs, g_bendKd);
+  int shear = m_springs.AddKind(SHEAR, g_shearKs, g_shearKd);
+  int shearDiag = m_springs.AddKind(SHEAR, g_shearDiagKs, g_shearDiagKd);
 
-void JelloMesh::AddShearSpring(JelloMesh::Particle& p1, JelloMesh::Particle& p2) {
-  double restLen = (p1.position - p2.position).Length();
-  m_vsprings.push_back(Spring(SHEAR, p1.index, p2.index, g_shearKs, g_shearKd, restLen));
-}
+  // earlier kinds win where the stencils overlap
+  m_springs.AddOffsets(structural, SpringTopology::AXIS, 1, g_structuralRadius);
+  m_springs.AddOffsets(bend, SpringTopology::AXIS, 2, g_bendRadius);
+  m_springs.AddOffsets(shear, SpringTopology::FACE_DIAGONAL, 1, g_shearRadius);
+  m_springs.AddOffsets(shearDiag, SpringTopology::BODY_DIAGONAL, 1, g_shearDiagRadius);
+
+  // Walk the particles in index order so each particle's springs are
+  // stored together.
+  const ParticleGrid& g = m_vparticles;
+  const std::vector<SpringTopology::Offset>& offsets = m_springs.GetOffsets();
+  for (int k = 0; k < m_stacks+1; k++) {
+    for (int i = 0; i < m_rows+1; i++) {
+      for (int j = 0; j < m_cols+1; j++) {
+        int p1 = GetIndex(i,j,k);
+        for (unsigned int o = 0; o < offsets.size(); o++) {
+          const SpringTopology::Offset& offset = offsets[o];
+          int i2 = i + offset.m_di;
+          int j2 = j + offset.m_dj;
+          int k2 = k + offset.m_dk;
+          if (i2 < 0 || i2 > m_rows || j2 < 0 || j2 > m_cols || k2 < 0 || k2 > m_stacks) continue;
+
+          int p2 = GetIndex(i2,j2,k2);
+          double restLen = (g.Position(p1) - g.Position(p2)).Length();
+          m_springs.AddSpring(offset.m_kind, p1, p2, restLen);
+        }
+      }
+    }
+  }
 
-void JelloMesh::AddShearDiagSpring(JelloMesh::Particle& p1, JelloMesh::Particle& p2) {
-  double restLen = (p1.position - p2.position).Length();
-  m_vsprings.push_back(Spring(SHEAR, p1.index, p2.index, g_shearDiagKs, g_shearDiagKd, restLen));
+  m_springs.BuildAdjacency(GetParticleCount());
+  m_vspringForce.resize(3 * (size_t) m_springs.GetSpringCount());
+  m_vspringJacobian.resize(5 * (size_t) m_springs.GetSpringCount());
 }
 
 void JelloMesh::SetIntegrationType(JelloMesh::IntegrationType type) {
@@ -362,11 +288,12 @@ void JelloMesh::DrawMesh(const vec3& eyePos) {
 void JelloMesh::DrawSprings(double a) {
   const ParticleGrid& g = m_vparticles;
   glBegin(GL_LINES);
-  for (unsigned int i = 0; i < m_vsprings.size(); i++) {
-    if (!(m_vsprings[i].m_type & m_drawflags)) continue;
-    if (isInterior(m_vsprings[i])) continue;
+  for (int i = 0; i < m_springs.GetSpringCount(); i++) {
+    unsigned int type = m_springs.GetType(i);
+    if (!(type & m_drawflags)) continue;
+    if (isSpringInterior(i)) continue;
 
-    switch (m_vsprings[i].m_type) {
+    switch (type) {
       case BEND:       
         glColor4f(1.0, 1.0, 0.0, a); 
         break;
@@ -378,8 +305,8 @@ void JelloMesh::DrawSprings(double a) {
         break;
     };
 
-    vec3 p1 = GetParticle(g, m_vsprings[i].m_p1).position;
-    vec3 p2 = GetParticle(g, m_vsprings[i].m_p2).position;
+    vec3 p1 = g.Position(m_springs.m_p1[i]);
+    vec3 p2 = g.Position(m_springs.m_p2[i]);
     glVertex3f(p1[0], p1[1], p1[2]);
     glVertex3f(p2[0], p2[1], p2[2]);
   }
@@ -397,10 +324,10 @@ void JelloMesh::DrawCollisionNormals() {
       continue;
     }
 
-    const Particle& pt = GetParticle(g, intersection.m_p);
+    vec3 pt = g.Position(intersection.m_p);
     vec3 normal = intersection.m_normal;
-    vec3 end = pt.position + 0.3 * normal;
-    glVertex3f(pt.position[0], pt.position[1], pt.position[2]);
+    vec3 end = pt + 0.3 * normal;
+    glVertex3f(pt[0], pt[1], pt[2]);
     glVertex3f(end[0], end[1], end[2]);
   }     
   /*
@@ -410,10 +337,10 @@ void JelloMesh::DrawCollisionNormals() {
       continue;
     }
 
-    const Particle& pt = GetParticle(g, intersection.m_p);
+    vec3 pt = g.Position(intersection.m_p);
     vec3 normal = intersection.m_normal;
-    vec3 end = pt.position + 1.0 * normal;
-    glVertex3f(pt.position[0], pt.position[1], pt.position[2]);
+    vec3 end = pt + 1.0 * normal;
+    glVertex3f(pt[0], pt[1], pt[2]);
     glVertex3f(end[0], end[1], end[2]);
   }     
   */
@@ -421,19 +348,21 @@ void JelloMesh::DrawCollisionNormals() {
 }
 
 void JelloMesh::DrawForces() {
+  const ParticleGrid& g = m_vparticles;
   glBegin(GL_LINES);
   glColor3f(1.0, 0.0, 0.0);
   for (int i = 0; i < m_rows+1; i++) {
     for (int j = 0; j < m_cols+1; j++) {
       for (int k = 0; k < m_stacks+1; k++) {
-        Particle p = m_vparticles[i][j][k];
         if (isInterior(i,j,k)) {
           continue;
         }
 
-        vec3 normal = p.force.Normalize();
-        vec3 end = p.position + 0.1 * normal;
-        glVertex3f(p.position[0], p.position[1], p.position[2]);
+        int idx = GetIndex(i,j,k);
+        vec3 pos = g.Position(idx);
+        vec3 normal = g.Force(idx).Normalize();
+        vec3 end = pos + 0.1 * normal;
+        glVertex3f(pos[0], pos[1], pos[2]);
         glVertex3f(end[0], end[1], end[2]);
       }
     }
@@ -476,8 +405,12 @@ void JelloMesh::Update(double dt, const World& world, const vec3& externalForces
 	ResolveContacts2(m_vparticles);
 	ResolveCollisions2(m_vparticles);
 
-  // copy the current points
-  ParticleGrid currParticlesCopy = m_vparticles;
+  // keep the current points as the previous ones; Verlet keeps them
+  // itself since it still needs the old ones
+  if (m_integrationType != VERLET) {
+    int count = m_vparticles.Size();
+    if (count > 0) memcpy(m_vparticlesPrev.px, m_vparticles.px, 3 * count * sizeof(double));
+  }
 
   switch (m_integrationType) {
     case EULER: 
@@ -492,10 +425,13 @@ void JelloMesh::Update(double dt, const World& world, const vec3& externalForces
     case VERLET: 
       VerletIntegrate(dt); 
       break;
+    case IMPLICIT:
+      ImplicitIntegrate(dt);
+      break;
+    case PROJECTIVE:
+      ProjectiveIntegrate(dt, world);
+      break;
   }
-
-  // set copy of the original particle positions as the previous
-  m_vparticlesPrev = currParticlesCopy;
 }
 
 void JelloMesh::CheckForCollisions(ParticleGrid& grid, const World& world) {
@@ -505,35 +441,14 @@ void JelloMesh::CheckForCollisions(ParticleGrid& grid, const World& world) {
   for (int i = 0; i < m_rows+1; i++) {
     for (int j = 0; j < m_cols+1; j++) {
       for (int k = 0; k < m_stacks+1; k++) {
-        Particle& p = GetParticle(grid, i,j,k);
+        int p = GetIndex(i,j,k);
+        vec3 pos = grid.Position(p);
 
         // 1. Check collisions with world objects 
         for (unsigned int i = 0; i < world.m_shapes.size(); i++) {
           Intersection intersection;
 
-          if (world.m_shapes[i]->GetType() == World::CYLINDER 
-              && CylinderIntersection2(p, (World::Cylinder*) world.m_shapes[i], intersection)) {
-            if (intersection.m_type == CONTACT) {
-              m_vcontacts.push_back(intersection);
-            } else if (intersection.m_type == COLLISION) {
-              m_vcollisions.push_back(intersection);
-            }
-          } else if (world.m_shapes[i]->GetType() == World::SPHERE
-              && SphereIntersection(p, (World::Sphere*) world.m_shapes[i], intersection)) {
-            if (intersection.m_type == CONTACT) {
-              m_vcontacts.push_back(intersection);
-            } else if (intersection.m_type == COLLISION) {
-              m_vcollisions.push_back(intersection);
-            }
-          } else if (world.m_shapes[i]->GetType() == World::CUBE
-              && CubeIntersection(p, (World::Cube*) world.m_shapes[i], intersection)) {
-            if (intersection.m_type == CONTACT) {
-              m_vcontacts.push_back(intersection);
-            } else if (intersection.m_type == COLLISION) {
-              m_vcollisions.push_back(intersection);
-            }
-          } else if (world.m_shapes[i]->GetType() == World::GROUND 
-                      && FloorIntersection(p, intersection)) {
+          if (ShapeIntersection(p, pos, world.m_shapes[i], intersection)) {
             if (intersection.m_type == CONTACT) {
               m_vcontacts.push_back(intersection);
             } else if (intersection.m_type == COLLISION) {
@@ -548,40 +463,76 @@ void JelloMesh::CheckForCollisions(ParticleGrid& grid, const World& world) {
 }
 
 void JelloMesh::ComputeForces(ParticleGrid& grid) {
-  // Add external froces to all points
-  for (int i = 0; i < m_rows+1; i++) {
-    for (int j = 0; j < m_cols+1; j++) {
-      for (int k = 0; k < m_stacks+1; k++) {
-        Particle& p = GetParticle(grid, i,j,k);
-        p.force = m_externalForces * p.mass;
+  // Spring forces are computed in two parallel passes so that no two
+  // threads ever write the same value: first the force of every spring on
+  // its p1 end (vectorized, see springKernels.h), then every particle
+  // gathers the springs it is on.  Each particle adds its springs in spring
+  // order, the same order a serial scatter would, so the sums don't depend
+  // on the number of threads.
+  const SpringTopology& springs = m_springs;
+  int numSprings = springs.GetSpringCount();
+  double* sfx = numSprings > 0 ? &m_vspringForce[0] : NULL;
+  double* sfy = sfx + numSprings;
+  double* sfz = sfy + numSprings;
+
+  SpringKernels::Input in;
+  in.px = grid.px; in.py = grid.py; in.pz = grid.pz;
+  in.vx = grid.vx; in.vy = grid.vy; in.vz = grid.vz;
+  in.p1 = numSprings > 0 ? &springs.m_p1[0] : NULL;
+  in.p2 = numSprings > 0 ? &springs.m_p2[0] : NULL;
+  in.restLen = numSprings > 0 ? &springs.m_restLen[0] : NULL;
+  in.kind = numSprings > 0 ? &springs.m_kind[0] : NULL;
+  in.Ks = springs.m_kindKs.empty() ? NULL : &springs.m_kindKs[0];
+  in.Kd = springs.m_kindKd.empty() ? NULL : &springs.m_kindKd[0];
+  in.fx = sfx; in.fy = sfy; in.fz = sfz;
+
+  const int chunk = 1024;
+  int numChunks = (numSprings + chunk - 1) / chunk;
+  #pragma omp parallel for schedule(static)
+  for (int c = 0; c < numChunks; c++) {
+    SpringKernels::Compute(in, c*chunk, min((c+1)*chunk, numSprings));
+  }
+
+  // External forces plus Fa = f, Fb = -Fa for every spring
+  const int* adjStart = springs.m_adjStart.empty() ? NULL : &springs.m_adjStart[0];
+  const int* adjSpring = springs.m_adjSpring.empty() ? NULL : &springs.m_adjSpring[0];
+  const int* p1 = in.p1;
+  double* fx = grid.fx;
+  double* fy = grid.fy;
+  double* fz = grid.fz;
+
+  int count = grid.Size();
+  #pragma omp parallel for schedule(static)
+  for (int n = 0; n < count; n++) {
+    double forcex = m_externalForces[0] * m_vmass[n];
+    double forcey = m_externalForces[1] * m_vmass[n];
+    double forcez = m_externalForces[2] * m_vmass[n];
+    for (int e = adjStart[n]; e < adjStart[n+1]; e++) {
+      int s = adjSpring[e];
+      if (p1[s] == n) {
+        forcex += sfx[s]; forcey += sfy[s]; forcez += sfz[s];
+      } else {
+        forcex -= sfx[s]; forcey -= sfy[s]; forcez -= sfz[s];
       }
     }
+    fx[n] = forcex;
+    fy[n] = forcey;
+    fz[n] = forcez;
   }
+}
 
-  // Update springs
-  for(unsigned int i = 0; i < m_vsprings.size(); i++) {
-    Spring& spring = m_vsprings[i];
-    Particle& a = GetParticle(grid, spring.m_p1);
-    Particle& b = GetParticle(grid, spring.m_p2);
-
-    // calculate spring force from hooks law
-    // F = -(ks * (|l| - r) + kd * (ldot*l)/|l|) * (l/|l|)
-    // l = a-b
-    // ldot = va - vb
-    vec3 l = a.position - b.position;
-    float lnorm = l.Length();
-    vec3 ldot = a.velocity - b.velocity;
-
-    // proportional term
-    double prop = spring.m_Ks * (lnorm - spring.m_restLen);
-    // damping force
-    double damp = spring.m_Kd * (Dot(ldot, l)/lnorm);
-    // combined force
-    vec3 force = -(prop + damp) * (l/lnorm);
-
-    // Fa = f; Fb = -Fa;
-    a.force += force;
-    b.force += -force;
+bool JelloMesh::ShapeIntersection(int p, const vec3& pos, World::Shape* shape, Intersection& intersection) {
+  switch (shape->GetType()) {
+    case World::CYLINDER:
+      return CylinderIntersection2(p, pos, (World::Cylinder*) shape, intersection);
+    case World::SPHERE:
+      return SphereIntersection(p, pos, (World::Sphere*) shape, intersection);
+    case World::CUBE:
+      return CubeIntersection(p, pos, (World::Cube*) shape, intersection);
+    case World::GROUND:
+      return FloorIntersection(p, pos, intersection);
+    default:
+      return false;
   }
 }
 
@@ -593,31 +544,32 @@ void JelloMesh::ResolveContacts(ParticleGrid& grid) {
 
   for (unsigned int i = 0; i < m_vcontacts.size(); i++) {
     const Intersection& contact = m_vcontacts[i];
-    Particle& p = GetParticle(grid, contact.m_p);
+    int p = contact.m_p;
+    vec3 velocity = grid.Velocity(p);
     vec3 normal = contact.m_normal; 
 
-    double vdotn = Dot(p.velocity, normal);
+    double vdotn = Dot(velocity, normal);
 
     // reflect particle based on collision normal
     // project velocity onto normal
     vec3 Nproj = vdotn * normal;
     // reflect velocity (factor in bounciness of object, coefficient of restitution)
-    vec3 vprime = p.velocity - 2 * Nproj * coefOfRestitution;
+    vec3 vprime = velocity - 2 * Nproj * coefOfRestitution;
 
     // set particles velocity
-    p.velocity = vprime;
+    grid.SetVelocity(p, vprime);
   }
 }
 
 void JelloMesh::ResolveCollisions(ParticleGrid& grid) {
   for(unsigned int i = 0; i < m_vcollisions.size(); i++) {
     Intersection result = m_vcollisions[i];
-    Particle& pt = GetParticle(grid, result.m_p);
+    int pt = result.m_p;
     vec3 normal = result.m_normal;
     float dist = result.m_distance;
 
     // for now just move the particle to surface
-    pt.position += dist * normal;
+    grid.SetPosition(pt, grid.Position(pt) + dist * normal);
 	}
 }
 
@@ -629,28 +581,29 @@ void JelloMesh::ResolveContacts2(ParticleGrid& grid) {
 
   for (unsigned int i = 0; i < m_vcontacts.size(); i++) {
     const Intersection& contact = m_vcontacts[i];
-    Particle& p = GetParticle(grid, contact.m_p);
+    int p = contact.m_p;
+    vec3 velocity = grid.Velocity(p);
     vec3 normal = contact.m_normal; 
 
-    double vdotn = Dot(p.velocity, normal);
+    double vdotn = Dot(velocity, normal);
 
     if (vdotn < 0) {
       // reflect particle based on collision normal
       // project velocity onto normal
       vec3 Nproj = vdotn * normal;
       // reflect velocity (factor in bounciness of object, coefficient of restitution)
-      vec3 vprime = p.velocity - 2 * Nproj * coefOfRestitution;
+      vec3 vprime = velocity - 2 * Nproj * coefOfRestitution;
 
       // set particles velocity
-      p.velocity = vprime;
+      grid.SetVelocity(p, vprime);
     }
 
     // subtract out force into obstacle
     /*
-    double ndotf = Dot(normal, p.force);
+    double ndotf = Dot(normal, grid.Force(p));
     if (ndotf < 0) {
       vec3 forceProj = ndotf * normal;
-      p.force -= forceProj;
+      grid.AddForce(p, -forceProj);
     }
     */
   }
@@ -660,14 +613,15 @@ void JelloMesh::ResolveCollisions2(ParticleGrid& grid) {
   for(unsigned int i = 0; i < m_vcollisions.size(); i++) {
     double coefOfRestitution = 0.6;
     Intersection result = m_vcollisions[i];
-    Particle& pt = GetParticle(grid, result.m_p);
+    int pt = result.m_p;
+    vec3 velocity = grid.Velocity(pt);
     vec3 normal = result.m_normal;
     float dist = result.m_distance;
 
-    double vdotn = Dot(pt.velocity, normal);
+    double vdotn = Dot(velocity, normal);
 
     // subtract out force into obstacle
-    double ndotf = Dot(normal, pt.force);
+    double ndotf = Dot(normal, grid.Force(pt));
     if (ndotf < 0) {
       vec3 forceProj = ndotf * normal;
       //pt.force -= forceProj;
@@ -686,14 +640,14 @@ void JelloMesh::ResolveCollisions2(ParticleGrid& grid) {
     // proportional term
     double prop = g_penaltyKs * (llen - 0);
     // damping force
-    double damp = g_penaltyKd * (Dot(pt.velocity, l)/llen);
+    double damp = g_penaltyKd * (Dot(velocity, l)/llen);
     // combined force
     vec3 force = -(prop + damp) * (l/llen);
 
     // add spring collision force
     /*
     printf("------------------------------\n");
-    printf("vel: (%0.3f, %0.3f, %0.3f)\n", pt.velocity[0], pt.velocity[1], pt.velocity[2]);
+    printf("vel: (%0.3f, %0.3f, %0.3f)\n", velocity[0], velocity[1], velocity[2]);
     printf("prop: %0.3f\n", prop);
     printf("damp: %0.3f\n", damp);
     printf("force: (%0.3f, %0.3f, %0.3f)\n", force[0], force[1], force[2]);
@@ -701,18 +655,18 @@ void JelloMesh::ResolveCollisions2(ParticleGrid& grid) {
     printf("dist: %0.3f\n", dist);
     fflush(stdout);
     */
-    pt.force += force;
+    grid.AddForce(pt, force);
 	}
 }
 
-bool JelloMesh::FloorIntersection(Particle& p, Intersection& intersection) {
+bool JelloMesh::FloorIntersection(int p, const vec3& pos, Intersection& intersection) {
   // test if point is intersecting with the floor
   // up direction is Y and floor is at Y = 0;
   //float contactThres = 0.01;
 
-  if (p.position[1] > contactThres) {
+  if (pos[1] > contactThres) {
     return false;
-  } else if (p.position[1] >= 0.0) {
+  } else if (pos[1] >= 0.0) {
     // CONTACT
     intersection.m_type = CONTACT;
   } else {
@@ -721,25 +675,25 @@ bool JelloMesh::FloorIntersection(Particle& p, Intersection& intersection) {
   }
 
   // store particle index
-  intersection.m_p = p.index;
+  intersection.m_p = p;
   // set collision normal
   // for floor it is just up vector
   intersection.m_normal = vec3(0, 1, 0);
   // compute distance from edge
-  intersection.m_distance = p.position[1];
+  intersection.m_distance = pos[1];
 
 
   return true;
 }
 
-bool JelloMesh::CubeIntersection(Particle& p, World::Cube* cube, JelloMesh::Intersection& intersection) {
+bool JelloMesh::CubeIntersection(int p, const vec3& pos, World::Cube* cube, JelloMesh::Intersection& intersection) {
   // test if point is intersecting with a box
   //float contactThres = 0.01;
 
   // only supports boxes aligned with the world axes
   vec3 sideHalfLen = vec3(cube->hx, cube->hy, cube->hz);
   // vector from particle to box center
-  vec3 d = p.position - cube->pos;
+  vec3 d = pos - cube->pos;
 
   // outside box?
   if (abs(d[0]) > sideHalfLen[0] + contactThres
@@ -769,7 +723,7 @@ bool JelloMesh::CubeIntersection(Particle& p, World::Cube* cube, JelloMesh::Inte
   }
 
   // store particle index
-  intersection.m_p = p.index;
+  intersection.m_p = p;
   // determine wall normal
   intersection.m_normal = vec3(0,0,0);
   intersection.m_normal[aind] = d[aind]/abs(d[aind]);
@@ -781,13 +735,13 @@ bool JelloMesh::CubeIntersection(Particle& p, World::Cube* cube, JelloMesh::Inte
 
 
 
-bool JelloMesh::SphereIntersection(Particle& p, World::Sphere* sphere, JelloMesh::Intersection& intersection) {
+bool JelloMesh::SphereIntersection(int p, const vec3& pos, World::Sphere* sphere, JelloMesh::Intersection& intersection) {
   // test if point is intersecting with the floor
   // up direction is Y and floor is at Y = 0;
   //float contactThres = 0.01;
 
   double r = sphere->r;
-  double d = (p.position - sphere->pos).Length();
+  double d = (pos - sphere->pos).Length();
 
   if (d > r + contactThres) {
     return false;
@@ -801,10 +755,10 @@ bool JelloMesh::SphereIntersection(Particle& p, World::Sphere* sphere, JelloMesh
   }
 
   // store particle index
-  intersection.m_p = p.index;
+  intersection.m_p = p;
   // set collision normal
   // for floor it is just up vector
-  intersection.m_normal = (p.position - sphere->pos).Normalize();
+  intersection.m_normal = (pos - sphere->pos).Normalize();
   // compute distance from edge
   intersection.m_distance = d - r;
 
@@ -812,7 +766,7 @@ bool JelloMesh::SphereIntersection(Particle& p, World::Sphere* sphere, JelloMesh
   return true;
 }
 
-bool JelloMesh::CylinderIntersection(Particle& p, World::Cylinder* cylinder, JelloMesh::Intersection& intersection) {
+bool JelloMesh::CylinderIntersection(int p, const vec3& pos, World::Cylinder* cylinder, JelloMesh::Intersection& intersection) {
   vec3 start = cylinder->start;
   vec3 end = cylinder->end;
   vec3 axis = end - start;
@@ -827,17 +781,17 @@ bool JelloMesh::CylinderIntersection(Particle& p, World::Cylinder* cylinder, Jel
   double sqLenPlusContact = pow((cylinderLen + contactThres),2);
 
   // projection of p onto cylinder axis
-  double pdota = Dot((p.position - start), naxis);
+  double pdota = Dot((pos - start), naxis);
   vec3 pproj = pdota * naxis;
   double projLen = pproj.Length();
   // rejection of p from cylinder axis
-  vec3 prej = (p.position - start) - pproj;
+  vec3 prej = (pos - start) - pproj;
   // d is the distance from the particle to the axis
   double d = prej.Length();
   vec3 nprej = prej / d;
 
   int i, j, k;
-  GetCell(p.index, i, j, k); 
+  GetCell(p, i, j, k); 
 
   // if p is outside the radius then no contact
   if (d > r + contactThres) {
@@ -850,11 +804,11 @@ bool JelloMesh::CylinderIntersection(Particle& p, World::Cylinder* cylinder, Jel
 
   // There is a contact/collision
   // store particle index
-  intersection.m_p = p.index;
+  intersection.m_p = p;
 
   // determine if it is an end cap collision
-  vec3 pstart = p.position - start;
-  vec3 pend = p.position - end;
+  vec3 pstart = pos - start;
+  vec3 pend = pos - end;
   double pstartLen = pstart.Length();
   double pendLen = pend.Length();
 
@@ -912,7 +866,7 @@ bool JelloMesh::CylinderIntersection(Particle& p, World::Cylinder* cylinder, Jel
   return true;
 }
 
-bool JelloMesh::CylinderIntersection2(Particle& p, World::Cylinder* cylinder, JelloMesh::Intersection& intersection) {
+bool JelloMesh::CylinderIntersection2(int p, const vec3& pos, World::Cylinder* cylinder, JelloMesh::Intersection& intersection) {
   // attempt at making cylinder intersection better
   vec3 start = cylinder->start;
   vec3 end = cylinder->end;
@@ -928,17 +882,17 @@ bool JelloMesh::CylinderIntersection2(Particle& p, World::Cylinder* cylinder, Je
   //double sqLenPlusContact = pow((cylinderLen + contactThres),2);
 
   // projection of p onto cylinder axis
-  double pdota = Dot((p.position - start), naxis);
+  double pdota = Dot((pos - start), naxis);
   vec3 pproj = pdota * naxis;
   double projLen = pproj.Length();
   // rejection of p from cylinder axis
-  vec3 prej = (p.position - start) - pproj;
+  vec3 prej = (pos - start) - pproj;
   // d is the distance from the particle to the axis
   double d = prej.Length();
   vec3 nprej = prej / d;
 
   int i, j, k;
-  GetCell(p.index, i, j, k); 
+  GetCell(p, i, j, k); 
 
   // if p is outside the radius then no contact
   if (d > r + contactThres) {
@@ -949,17 +903,17 @@ bool JelloMesh::CylinderIntersection2(Particle& p, World::Cylinder* cylinder, Je
     return false;
   }
   /*
-  printf("pos(%0.2f, %0.2f, %0.2f): pdota: %0.3f :: d: %0.3f\n", p.position[0], p.position[1], p.position[2],
+  printf("pos(%0.2f, %0.2f, %0.2f): pdota: %0.3f :: d: %0.3f\n", pos[0], pos[1], pos[2],
                                                                                 pdota, d);
   fflush(stdout);
   */
 
   // There is a contact/collision
   // store particle index
-  intersection.m_p = p.index;
+  intersection.m_p = p;
 
 
-  vec3 pstart = p.position - start;
+  vec3 pstart = pos - start;
 
   // determine which wall the particle is closest to (end cap or cylinder wall)
   // distance to cylinder edge (circular part)
@@ -979,7 +933,7 @@ bool JelloMesh::CylinderIntersection2(Particle& p, World::Cylinder* cylinder, Je
       intersection.m_type = COLLISION;
       /*
       printf("-----------------------\n");
-      printf("pos: (%0.2f, %0.2f, %0.2f): pdota: %0.3f :: d: %0.3f\n", p.position[0], p.position[1], p.position[2],
+      printf("pos: (%0.2f, %0.2f, %0.2f): pdota: %0.3f :: d: %0.3f\n", pos[0], pos[1], pos[2],
                                                                                 pdota, d);
       printf("start: (%0.2f, %0.2f, %0.2f): end: (%0.2f, %0.2f, %0.2f)\n", start[0], start[1], start[2], end[0], end[1], end[2]);
       printf("axis: (%0.2f, %0.2f, %0.2f): paxis: (%0.2f, %0.2f, %0.2f)\n", axis[0], axis[1], axis[2], pstart[0], pstart[1], pstart[2]);
@@ -1037,261 +991,753 @@ bool JelloMesh::CylinderIntersection2(Particle& p, World::Cylinder* cylinder, Je
 }
 
 void JelloMesh::EulerIntegrate(double dt) {
-  ParticleGrid& particles = m_vparticles;  // source is a ptr!
-
-  // Step 1
-  for (int i = 0; i < m_rows+1; i++) {
-    for (int j = 0; j < m_cols+1; j++) {
-      for (int k = 0; k < m_stacks+1; k++) {
-        // get current particle
-        Particle& p = GetParticle(particles, i,j,k);
-
-        vec3 dv = dt * p.force * (1/p.mass); 
-        vec3 vel = p.velocity + dv;
-        vec3 pos = p.position + dt * p.velocity;
-
-        p.velocity = vel;
-        p.position = pos;
-      }
-    }
+  ParticleGrid& p = m_vparticles;
+  const double* invMass = &m_vinvMass[0];
+
+  int count = p.Size();
+  for (int n = 0; n < count; n++) {
+    double velx = p.vx[n] + dt * p.fx[n] * invMass[n];
+    double vely = p.vy[n] + dt * p.fy[n] * invMass[n];
+    double velz = p.vz[n] + dt * p.fz[n] * invMass[n];
+    p.px[n] = p.px[n] + dt * p.vx[n];
+    p.py[n] = p.py[n] + dt * p.vy[n];
+    p.pz[n] = p.pz[n] + dt * p.vz[n];
+    p.vx[n] = velx;
+    p.vy[n] = vely;
+    p.vz[n] = velz;
   }
 }
 
 void JelloMesh::MidPointIntegrate(double dt) {
-  // pointer to current particles
-  ParticleGrid& particles = m_vparticles;
+  ParticleGrid& p = m_vparticles;
+  const double* invMass = &m_vinvMass[0];
+  int count = p.Size();
 
   // First step -- h/2 integration
-  // get copy of particle grid for storage
-  ParticleGrid midpoint = m_vparticles;
-  for (int i = 0; i < m_rows+1; i++) {
-    for (int j = 0; j < m_cols+1; j++) {
-      for (int k = 0; k < m_stacks+1; k++) {
-        // get current particle
-        Particle& p = GetParticle(particles, i,j,k);
-
-        vec3 dv = (dt/2) * p.force * (1/p.mass); 
-        vec3 vel = p.velocity + dv;
-        vec3 pos = p.position + (dt/2) * p.velocity;
-        
-        // store new computed values in midpoint grid
-        Particle& m = GetParticle(midpoint, i,j,k);
-        m.velocity = vel;
-        m.position = pos;
-      }
-    }
+  ParticleGrid& m = m_vstage;
+  for (int n = 0; n < count; n++) {
+    m.vx[n] = p.vx[n] + (dt/2) * p.fx[n] * invMass[n];
+    m.vy[n] = p.vy[n] + (dt/2) * p.fy[n] * invMass[n];
+    m.vz[n] = p.vz[n] + (dt/2) * p.fz[n] * invMass[n];
+    m.px[n] = p.px[n] + (dt/2) * p.vx[n];
+    m.py[n] = p.py[n] + (dt/2) * p.vy[n];
+    m.pz[n] = p.pz[n] + (dt/2) * p.vz[n];
   }
 
   // compute new forces on midpoint matrix
-  ComputeForces(midpoint);
-
-  for (int i = 0; i < m_rows+1; i++) {
-    for (int j = 0; j < m_cols+1; j++) {
-      for (int k = 0; k < m_stacks+1; k++) {
-        // get current particle
-        Particle& m = GetParticle(midpoint, i,j,k);
-        Particle& p = GetParticle(particles, i,j,k);
-
-        vec3 dv = dt * m.force * (1/m.mass); 
-        vec3 vel = p.velocity + dv;
-        vec3 pos = p.position + dt * m.velocity;
-        
-        // store final paritcle velocity and position
-        p.velocity = vel;
-        p.position = pos;
-      }
-    }
+  ComputeForces(m);
+
+  // store final particle velocity and position
+  for (int n = 0; n < count; n++) {
+    p.vx[n] = p.vx[n] + dt * m.fx[n] * invMass[n];
+    p.vy[n] = p.vy[n] + dt * m.fy[n] * invMass[n];
+    p.vz[n] = p.vz[n] + dt * m.fz[n] * invMass[n];
+    p.px[n] = p.px[n] + dt * m.vx[n];
+    p.py[n] = p.py[n] + dt * m.vy[n];
+    p.pz[n] = p.pz[n] + dt * m.vz[n];
   }
-
-
 }
 
 void JelloMesh::RK4Integrate(double dt) {
-    ParticleGrid target = m_vparticles;  // target is a copy!
-    ParticleGrid& source = m_vparticles;  // source is a ptr!
+    ParticleGrid& source = m_vparticles;
+    ParticleGrid& target = m_vstage;
+    const double* invMass = &m_vinvMass[0];
+    int count = source.Size();
+
+    // Each stage's derivatives k = (dt*a, dt*v) only feed the next stage
+    // and the weighted sum, so they are never stored; the sum adds the
+    // stages up in order, starting from the source state.
+    double* sumvx = &m_vstageSum[0];
+    double* sumvy = sumvx + count;
+    double* sumvz = sumvy + count;
+    double* sumpx = sumvz + count;
+    double* sumpy = sumpx + count;
+    double* sumpz = sumpy + count;
+    double asixth = 1/6.0;
+    double athird = 1/3.0;
 
     // Step 1
-    ParticleGrid accum1 = m_vparticles;
-    for (int i = 0; i < m_rows+1; i++)
     {
-        for (int j = 0; j < m_cols+1; j++)
+        ParticleGrid& s = source;
+        ParticleGrid& t = target;
+        for (int n = 0; n < count; n++)
         {
-            for (int k = 0; k < m_stacks+1; k++)
-            {
-                Particle& s = GetParticle(source, i,j,k);
-
-                Particle& k1 = GetParticle(accum1, i,j,k);
-                k1.force = dt * s.force * 1/s.mass;
-                k1.velocity = dt * s.velocity;
-
-                Particle& t = GetParticle(target, i,j,k);
-                t.velocity = s.velocity + k1.force * 0.5;
-                t.position = s.position + k1.velocity * 0.5;
-            }
+            double kfx = dt * s.fx[n] * invMass[n];
+            double kfy = dt * s.fy[n] * invMass[n];
+            double kfz = dt * s.fz[n] * invMass[n];
+            double kvx = dt * s.vx[n];
+            double kvy = dt * s.vy[n];
+            double kvz = dt * s.vz[n];
+
+            sumvx[n] = s.vx[n] + asixth * kfx;
+            sumvy[n] = s.vy[n] + asixth * kfy;
+            sumvz[n] = s.vz[n] + asixth * kfz;
+            sumpx[n] = s.px[n] + asixth * kvx;
+            sumpy[n] = s.py[n] + asixth * kvy;
+            sumpz[n] = s.pz[n] + asixth * kvz;
+
+            t.vx[n] = s.vx[n] + kfx * 0.5;
+            t.vy[n] = s.vy[n] + kfy * 0.5;
+            t.vz[n] = s.vz[n] + kfz * 0.5;
+            t.px[n] = s.px[n] + kvx * 0.5;
+            t.py[n] = s.py[n] + kvy * 0.5;
+            t.pz[n] = s.pz[n] + kvz * 0.5;
         }
     }
 
     ComputeForces(target);
 
-    // Step 2
-    ParticleGrid accum2 = m_vparticles;
-    for (int i = 0; i < m_rows+1; i++)
+    // Steps 2 and 3: half step, then full step from the source
+    double fractions[2] = { 0.5, 1.0 };
+    for (int step = 0; step < 2; step++)
     {
-        for (int j = 0; j < m_cols+1; j++)
+        ParticleGrid& s = source;
+        ParticleGrid& t = target;
+        double h = fractions[step];
+        for (int n = 0; n < count; n++)
         {
-            for (int k = 0; k < m_stacks+1; k++)
-            {
-                Particle& t = GetParticle(target, i,j,k);
-                Particle& k2 = GetParticle(accum2, i,j,k);
+            double kfx = dt * t.fx[n] * invMass[n];
+            double kfy = dt * t.fy[n] * invMass[n];
+            double kfz = dt * t.fz[n] * invMass[n];
+            double kvx = dt * t.vx[n];
+            double kvy = dt * t.vy[n];
+            double kvz = dt * t.vz[n];
+
+            sumvx[n] = sumvx[n] + athird * kfx;
+            sumvy[n] = sumvy[n] + athird * kfy;
+            sumvz[n] = sumvz[n] + athird * kfz;
+            sumpx[n] = sumpx[n] + athird * kvx;
+            sumpy[n] = sumpy[n] + athird * kvy;
+            sumpz[n] = sumpz[n] + athird * kvz;
+
+            t.vx[n] = s.vx[n] + kfx * h;
+            t.vy[n] = s.vy[n] + kfy * h;
+            t.vz[n] = s.vz[n] + kfz * h;
+            t.px[n] = s.px[n] + kvx * h;
+            t.py[n] = s.py[n] + kvy * h;
+            t.pz[n] = s.pz[n] + kvz * h;
+        }
 
-                k2.force = dt * t.force * 1/t.mass;
-                k2.velocity = dt * t.velocity;
+        ComputeForces(target);
+    }
 
-                Particle& s = GetParticle(source, i,j,k);
-                t.velocity = s.velocity + k2.force * 0.5;
-                t.position = s.position + k2.velocity * 0.5;
-            }
+    // Step 4, and put it all together
+    {
+        ParticleGrid& p = m_vparticles;
+        ParticleGrid& t = target;
+        for (int n = 0; n < count; n++)
+        {
+            p.vx[n] = sumvx[n] + asixth * (dt * t.fx[n] * invMass[n]);
+            p.vy[n] = sumvy[n] + asixth * (dt * t.fy[n] * invMass[n]);
+            p.vz[n] = sumvz[n] + asixth * (dt * t.fz[n] * invMass[n]);
+
+            p.px[n] = sumpx[n] + asixth * (dt * t.vx[n]);
+            p.py[n] = sumpy[n] + asixth * (dt * t.vy[n]);
+            p.pz[n] = sumpz[n] + asixth * (dt * t.vz[n]);
         }
     }
+}
 
-    ComputeForces(target);
+void JelloMesh::VerletIntegrate(double dt) {
+  ParticleGrid& cp = m_vparticles;
+  ParticleGrid& pp = m_vparticlesPrev;
+  const double* invMass = &m_vinvMass[0];
+  double dt2 = pow(dt,2);
+  double inv2dt = 1.0/(2 * dt);
+
+  int count = cp.Size();
+  for (int n = 0; n < count; n++) {
+    double x = cp.px[n], y = cp.py[n], z = cp.pz[n];
+
+    // compute central difference
+    cp.px[n] = 2 * x - pp.px[n] + cp.fx[n] * invMass[n] * dt2;
+    cp.py[n] = 2 * y - pp.py[n] + cp.fy[n] * invMass[n] * dt2;
+    cp.pz[n] = 2 * z - pp.pz[n] + cp.fz[n] * invMass[n] * dt2;
+
+    // compute velocity
+    cp.vx[n] = (cp.px[n] - pp.px[n]) * inv2dt;
+    cp.vy[n] = (cp.py[n] - pp.py[n]) * inv2dt;
+    cp.vz[n] = (cp.pz[n] - pp.pz[n]) * inv2dt;
+
+    // the start of this step is the previous one for the next
+    pp.px[n] = x;
+    pp.py[n] = y;
+    pp.pz[n] = z;
+  }
+}
 
-    // Step 3
-    ParticleGrid accum3 = m_vparticles;
-    for (int i = 0; i < m_rows+1; i++)
-    {
-        for (int j = 0; j < m_cols+1; j++)
-        {
-            for (int k = 0; k < m_stacks+1; k++)
-            {
-            Particle& t = GetParticle(target, i,j,k);
-            Particle& k3 = GetParticle(accum3, i,j,k);
+void JelloMesh::VelocityVerletIntegrate(double dt) {
+  ParticleGrid& cp = m_vparticles;
+  const double* invMass = &m_vinvMass[0];
+  double dt2 = pow(dt,2);
+  int count = cp.Size();
 
-            k3.force = dt * t.force * 1/t.mass;
-            k3.velocity = dt * t.velocity;
+  // the new forces are taken at the new positions and old velocities
+  ParticleGrid& t = m_vstage;
+  memcpy(t.vx, cp.vx, 3 * count * sizeof(double));
 
-            Particle& s = GetParticle(source, i,j,k);
-            t.velocity = s.velocity + k3.force;
-            t.position = s.position + k3.velocity;
-            }
-        }
+  // Velocity Verlet
+  for (int n = 0; n < count; n++) {
+    t.px[n] = cp.px[n] + cp.vx[n] * dt + 0.5 * (cp.fx[n] * invMass[n]) * dt2;
+    t.py[n] = cp.py[n] + cp.vy[n] * dt + 0.5 * (cp.fy[n] * invMass[n]) * dt2;
+    t.pz[n] = cp.pz[n] + cp.vz[n] * dt + 0.5 * (cp.fz[n] * invMass[n]) * dt2;
+  }
+
+  // compute new forces
+  ComputeForces(t);
+
+  // compute new velocities from the accelerations at t and t+1
+  for (int n = 0; n < count; n++) {
+    cp.vx[n] = cp.vx[n] + 0.5 * dt * (cp.fx[n] * invMass[n] + t.fx[n] * invMass[n]);
+    cp.vy[n] = cp.vy[n] + 0.5 * dt * (cp.fy[n] * invMass[n] + t.fy[n] * invMass[n]);
+    cp.vz[n] = cp.vz[n] + 0.5 * dt * (cp.fz[n] * invMass[n] + t.fz[n] * invMass[n]);
+    cp.px[n] = t.px[n];
+    cp.py[n] = t.py[n];
+    cp.pz[n] = t.pz[n];
+  }
+}
+
+// Sum of a[i]*b[i], added up in order so that the solver gives the same
+// result for any number of threads.
+static double DotProduct(const double* a, const double* b, int size) {
+  double sum = 0.0;
+  for (int i = 0; i < size; i++) {
+    sum += a[i] * b[i];
+  }
+  return sum;
+}
+
+void JelloMesh::ImplicitIntegrate(double dt) {
+  // Backward Euler as in Baraff and Witkin, "Large Steps in Cloth
+  // Simulation".  With the forces linearized about the current state the
+  // velocity change dv solves
+  //   (M + dt D + dt^2 K) dv = dt (f - dt K v),  K = -df/dx, D = -df/dv
+  // The matrix is symmetric positive definite, so dv comes from conjugate
+  // gradients preconditioned with its diagonal.  The matrix is never
+  // built; ApplyImplicitMatrix multiplies by it one spring at a time.
+  ParticleGrid& p = m_vparticles;
+  int count = p.Size();
+  int size = 3 * count;
+  double dt2 = dt * dt;
+
+  LinearizeSprings(p);
+
+  double* b = &m_vsolver[0];
+  double* x = b + size;
+  double* r = x + size;
+  double* z = r + size;
+  double* d = z + size;
+  double* q = d + size;
+  double* diag = q + size;
+
+  // Velocities and forces are each three consecutive arrays in the
+  // particle grid, so they are used as vectors in place.
+  ApplyImplicitMatrix(p.vx, q, 0.0, 1.0, 0.0);
+  GetImplicitDiagonal(diag, 1.0, dt2, dt);
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < size; i++) {
+    b[i] = dt * p.fx[i] - dt2 * q[i];
+    x[i] = 0.0;
+    r[i] = b[i];
+    z[i] = r[i] / diag[i];
+    d[i] = z[i];
+  }
+
+  double rz = DotProduct(r, z, size);
+  double rr = DotProduct(r, r, size);
+  double threshold = g_implicitTolerance * g_implicitTolerance * rr;
+  for (int iter = 0; iter < g_implicitMaxIterations && rr > threshold; iter++) {
+    ApplyImplicitMatrix(d, q, 1.0, dt2, dt);
+    double alpha = rz / DotProduct(d, q, size);
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < size; i++) {
+      x[i] += alpha * d[i];
+      r[i] -= alpha * q[i];
+      z[i] = r[i] / diag[i];
     }
-    ComputeForces(target);
 
-    // Step 4
-    ParticleGrid accum4 = m_vparticles;
-    for (int i = 0; i < m_rows+1; i++)
-    {
-        for (int j = 0; j < m_cols+1; j++)
-        {
-            for (int k = 0; k < m_stacks+1; k++)
-            {
-                Particle& t = GetParticle(target, i,j,k);
-                Particle& k4 = GetParticle(accum4, i,j,k);
+    double rzNext = DotProduct(r, z, size);
+    double beta = rzNext / rz;
+    rz = rzNext;
+    rr = DotProduct(r, r, size);
 
-                k4.force = dt * t.force * 1/t.mass;
-                k4.velocity = dt * t.velocity;
-            }
-        }
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < size; i++) {
+      d[i] = z[i] + beta * d[i];
     }
+  }
 
-    // Put it all together
-    double asixth = 1/6.0;
-    double athird = 1/3.0;
-    for (int i = 0; i < m_rows+1; i++)
-    {
-        for (int j = 0; j < m_cols+1; j++)
-        {
-            for (int k = 0; k < m_stacks+1; k++)
-            {
-                Particle& p = GetParticle(m_vparticles, i,j,k);
-                Particle& k1 = GetParticle(accum1, i,j,k);
-                Particle& k2 = GetParticle(accum2, i,j,k);
-                Particle& k3 = GetParticle(accum3, i,j,k);
-                Particle& k4 = GetParticle(accum4, i,j,k);
-                
-                p.velocity = p.velocity + asixth * k1.force + 
-                    athird * k2.force + athird * k3.force + asixth * k4.force;
-
-                p.position = p.position + asixth * k1.velocity + 
-                    athird * k2.velocity + athird * k3.velocity + asixth * k4.velocity;
-            }
-        }
+  // step with the new velocity
+  #pragma omp parallel for schedule(static)
+  for (int n = 0; n < count; n++) {
+    p.vx[n] += x[n];
+    p.vy[n] += x[n + count];
+    p.vz[n] += x[n + 2*count];
+    p.px[n] += dt * p.vx[n];
+    p.py[n] += dt * p.vy[n];
+    p.pz[n] += dt * p.vz[n];
+  }
+}
+
+void JelloMesh::LinearizeSprings(const ParticleGrid& grid) {
+  // The force on p1 is f = -(Ks (|l| - r) + Kd (ldot.u)) u with u = l/|l|,
+  // so with c = 1 - r/|l|
+  //   -df/dx1 = Ks u u^T + Ks c (I - u u^T) = Ks (1 - c) u u^T + Ks c I
+  //   -df/dv1 = Kd u u^T
+  // (leaving out the damping term's change with position).  The part
+  // across the spring is negative for compressed springs and is dropped
+  // there, which keeps the system matrix positive definite.
+  const SpringTopology& springs = m_springs;
+  int numSprings = springs.GetSpringCount();
+  double* ux = numSprings > 0 ? &m_vspringJacobian[0] : NULL;
+  double* uy = ux + numSprings;
+  double* uz = uy + numSprings;
+  double* kn = uz + numSprings;
+  double* kt = kn + numSprings;
+
+  #pragma omp parallel for schedule(static)
+  for (int s = 0; s < numSprings; s++) {
+    int a = springs.m_p1[s];
+    int b = springs.m_p2[s];
+    double lx = grid.px[a] - grid.px[b], ly = grid.py[a] - grid.py[b], lz = grid.pz[a] - grid.pz[b];
+    double inv = 1.0 / sqrt(lx*lx + ly*ly + lz*lz);
+    double Ks = springs.m_kindKs[springs.m_kind[s]];
+    double across = Ks * max(0.0, 1.0 - springs.m_restLen[s] * inv);
+
+    ux[s] = lx * inv;
+    uy[s] = ly * inv;
+    uz[s] = lz * inv;
+    kn[s] = Ks - across;
+    kt[s] = across;
+  }
+}
+
+void JelloMesh::ApplyImplicitMatrix(const double* y, double* out, double mass, double cx, double cv) {
+  // out = (mass M + cx K + cv D) y, for K and D from LinearizeSprings plus
+  // the penalty springs of the current collisions.  y and out hold the x,
+  // y and z components as three arrays of one per particle.  The springs
+  // go through the same two passes as in ComputeForces, reusing its
+  // per-spring buffer.
+  const SpringTopology& springs = m_springs;
+  int numSprings = springs.GetSpringCount();
+  int count = GetParticleCount();
+  const double* ux = numSprings > 0 ? &m_vspringJacobian[0] : NULL;
+  const double* uy = ux + numSprings;
+  const double* uz = uy + numSprings;
+  const double* kn = uz + numSprings;
+  const double* kt = kn + numSprings;
+  double* sfx = numSprings > 0 ? &m_vspringForce[0] : NULL;
+  double* sfy = sfx + numSprings;
+  double* sfz = sfy + numSprings;
+  const double* yx = y;
+  const double* yy = y + count;
+  const double* yz = y + 2*count;
+
+  #pragma omp parallel for schedule(static)
+  for (int s = 0; s < numSprings; s++) {
+    int a = springs.m_p1[s];
+    int b = springs.m_p2[s];
+    double dx = yx[a] - yx[b], dy = yy[a] - yy[b], dz = yz[a] - yz[b];
+    double along = (cx * kn[s] + cv * springs.m_kindKd[springs.m_kind[s]])
+        * (ux[s]*dx + uy[s]*dy + uz[s]*dz);
+    double across = cx * kt[s];
+    sfx[s] = along * ux[s] + across * dx;
+    sfy[s] = along * uy[s] + across * dy;
+    sfz[s] = along * uz[s] + across * dz;
+  }
+
+  const int* adjStart = springs.m_adjStart.empty() ? NULL : &springs.m_adjStart[0];
+  const int* adjSpring = springs.m_adjSpring.empty() ? NULL : &springs.m_adjSpring[0];
+  const int* p1 = numSprings > 0 ? &springs.m_p1[0] : NULL;
+  double* outx = out;
+  double* outy = out + count;
+  double* outz = out + 2*count;
+
+  #pragma omp parallel for schedule(static)
+  for (int n = 0; n < count; n++) {
+    double m = mass * m_vmass[n];
+    double sumx = m * yx[n], sumy = m * yy[n], sumz = m * yz[n];
+    for (int e = adjStart[n]; e < adjStart[n+1]; e++) {
+      int s = adjSpring[e];
+      if (p1[s] == n) {
+        sumx += sfx[s]; sumy += sfy[s]; sumz += sfz[s];
+      } else {
+        sumx -= sfx[s]; sumy -= sfy[s]; sumz -= sfz[s];
+      }
     }
+    outx[n] = sumx;
+    outy[n] = sumy;
+    outz[n] = sumz;
+  }
+
+  // penalty springs act along the collision normal
+  double penalty = cx * g_penaltyKs + cv * g_penaltyKd;
+  for (unsigned int i = 0; i < m_vcollisions.size(); i++) {
+    int pt = m_vcollisions[i].m_p;
+    const vec3& normal = m_vcollisions[i].m_normal;
+    double along = penalty * (normal[0]*yx[pt] + normal[1]*yy[pt] + normal[2]*yz[pt]);
+    outx[pt] += along * normal[0];
+    outy[pt] += along * normal[1];
+    outz[pt] += along * normal[2];
+  }
 }
 
-void JelloMesh::VerletIntegrate(double dt) {
-  ParticleGrid& particles = m_vparticles;  // source is a ptr!
-  ParticleGrid& prev = m_vparticlesPrev;  // source is a ptr!
+void JelloMesh::GetImplicitDiagonal(double* diag, double mass, double cx, double cv) {
+  // diagonal of the matrix ApplyImplicitMatrix multiplies by
+  const SpringTopology& springs = m_springs;
+  int numSprings = springs.GetSpringCount();
+  int count = GetParticleCount();
+  const double* ux = numSprings > 0 ? &m_vspringJacobian[0] : NULL;
+  const double* uy = ux + numSprings;
+  const double* uz = uy + numSprings;
+  const double* kn = uz + numSprings;
+  const double* kt = kn + numSprings;
+  const int* adjStart = springs.m_adjStart.empty() ? NULL : &springs.m_adjStart[0];
+  const int* adjSpring = springs.m_adjSpring.empty() ? NULL : &springs.m_adjSpring[0];
+  double* diagx = diag;
+  double* diagy = diag + count;
+  double* diagz = diag + 2*count;
+
+  #pragma omp parallel for schedule(static)
+  for (int n = 0; n < count; n++) {
+    double m = mass * m_vmass[n];
+    double sumx = m, sumy = m, sumz = m;
+    for (int e = adjStart[n]; e < adjStart[n+1]; e++) {
+      int s = adjSpring[e];
+      double along = cx * kn[s] + cv * springs.m_kindKd[springs.m_kind[s]];
+      double across = cx * kt[s];
+      sumx += along * ux[s] * ux[s] + across;
+      sumy += along * uy[s] * uy[s] + across;
+      sumz += along * uz[s] * uz[s] + across;
+    }
+    diagx[n] = sumx;
+    diagy[n] = sumy;
+    diagz[n] = sumz;
+  }
 
-  for (int i = 0; i < m_rows+1; i++) {
-    for (int j = 0; j < m_cols+1; j++) {
-      for (int k = 0; k < m_stacks+1; k++) {
-        // get previous particle
-        Particle& pp = GetParticle(prev, i,j,k);
-        // get current particle
-        Particle& cp = GetParticle(particles, i,j,k);
+  double penalty = cx * g_penaltyKs + cv * g_penaltyKd;
+  for (unsigned int i = 0; i < m_vcollisions.size(); i++) {
+    int pt = m_vcollisions[i].m_p;
+    const vec3& normal = m_vcollisions[i].m_normal;
+    diagx[pt] += penalty * normal[0] * normal[0];
+    diagy[pt] += penalty * normal[1] * normal[1];
+    diagz[pt] += penalty * normal[2] * normal[2];
+  }
+}
+
+void JelloMesh::FactorProjectiveSystem(double dt) {
+  // Projective dynamics (Bouaziz et al., "Projective Dynamics: Fusing
+  // Constraint Projections for Fast Simulation") treats spring s as the
+  // energy Ks/2 |(x_a - x_b) - p_s|^2, where p_s is the current spring
+  // direction scaled to the rest length.  Its global step solves
+  //   (M/dt^2 + sum Ks S_s^T S_s) x = M/dt^2 y + sum Ks S_s^T p_s
+  // with S_s x = x_a - x_b.  The matrix is the same for all three
+  // coordinates and for every step, so it is built once per particle
+  // and factored.
+  const SpringTopology& springs = m_springs;
+  int count = GetParticleCount();
+  double invDt2 = 1.0 / (dt * dt);
+
+  // Eliminating the particles in nested dissection order keeps the factor
+  // several times sparser than the lattice order.  A slab of the lattice
+  // as thick as the longest spring reach cuts the springs across it.
+  int reach = 1;
+  const std::vector<SpringTopology::Offset>& offsets = springs.GetOffsets();
+  for (unsigned int i = 0; i < offsets.size(); i++) {
+    reach = std::max(reach, std::max(abs(offsets[i].m_di),
+        std::max(abs(offsets[i].m_dj), abs(offsets[i].m_dk))));
+  }
+  std::vector<int> order;
+  order.reserve(count);
+  AddDissectionOrder(0, m_rows, 0, m_cols, 0, m_stacks, reach, order);
+
+  // column n: the springs to other particles, then the diagonal
+  std::vector<int> start(1, 0);
+  std::vector<int> rows;
+  std::vector<double> vals;
+  for (int n = 0; n < count; n++) {
+    double diag = m_vmass[n] * invDt2;
+    for (int e = springs.m_adjStart[n]; e < springs.m_adjStart[n+1]; e++) {
+      int s = springs.m_adjSpring[e];
+      double Ks = springs.m_kindKs[springs.m_kind[s]];
+      int other = springs.m_p1[s] == n ? springs.m_p2[s] : springs.m_p1[s];
+      diag += Ks;
+      rows.push_back(other);
+      vals.push_back(-Ks);
+    }
+    rows.push_back(n);
+    vals.push_back(diag);
+    start.push_back((int) rows.size());
+  }
 
-        // compute central difference
-        vec3 a = cp.force * (1/cp.mass);
-        vec3 npos = 2 * cp.position - pp.position + a * pow(dt,2);
+  bool factored = m_projectiveSystem.Factor(count, start, rows, vals, order);
+  assert(factored);
+  m_projectiveTimeStep = dt;
+}
+
+void JelloMesh::AddDissectionOrder(int i0, int i1, int j0, int j1, int k0, int k1, int reach,
+    std::vector<int>& order) {
+  // Numbers the lattice points i0..i1, j0..j1, k0..k1: the two halves on
+  // either side of a separator slab across the longest side first, the
+  // slab last.
+  int ni = i1 - i0 + 1, nj = j1 - j0 + 1, nk = k1 - k0 + 1;
+  int longest = std::max(ni, std::max(nj, nk));
+  if (ni <= 0 || nj <= 0 || nk <= 0) return;
+  if (longest <= 2 * reach) {
+    for (int i = i0; i <= i1; i++)
+      for (int j = j0; j <= j1; j++)
+        for (int k = k0; k <= k1; k++)
+          order.push_back(GetIndex(i, j, k));
+    return;
+  }
 
-        cp.position = npos;
+  if (longest == ni) {
+    int s0 = i0 + (ni - reach) / 2, s1 = s0 + reach - 1;
+    AddDissectionOrder(i0, s0-1, j0, j1, k0, k1, reach, order);
+    AddDissectionOrder(s1+1, i1, j0, j1, k0, k1, reach, order);
+    AddDissectionOrder(s0, s1, j0, j1, k0, k1, reach, order);
+  } else if (longest == nj) {
+    int s0 = j0 + (nj - reach) / 2, s1 = s0 + reach - 1;
+    AddDissectionOrder(i0, i1, j0, s0-1, k0, k1, reach, order);
+    AddDissectionOrder(i0, i1, s1+1, j1, k0, k1, reach, order);
+    AddDissectionOrder(i0, i1, s0, s1, k0, k1, reach, order);
+  } else {
+    int s0 = k0 + (nk - reach) / 2, s1 = s0 + reach - 1;
+    AddDissectionOrder(i0, i1, j0, j1, k0, s0-1, reach, order);
+    AddDissectionOrder(i0, i1, j0, j1, s1+1, k1, reach, order);
+    AddDissectionOrder(i0, i1, j0, j1, s0, s1, reach, order);
+  }
+}
 
+void JelloMesh::ApplyProjectiveMatrix(const double* v, double* out, double invDt2) {
+  // out = (M/dt^2 + sum Ks S_s^T S_s) v, spring by spring and then
+  // gathered per particle
+  const SpringTopology& springs = m_springs;
+  int numSprings = springs.GetSpringCount();
+  int count = GetParticleCount();
+  double* sfx = numSprings > 0 ? &m_vspringForce[0] : NULL;
+  double* sfy = sfx + numSprings;
+  double* sfz = sfy + numSprings;
+
+  #pragma omp parallel for schedule(static)
+  for (int s = 0; s < numSprings; s++) {
+    int a = springs.m_p1[s];
+    int b = springs.m_p2[s];
+    double Ks = springs.m_kindKs[springs.m_kind[s]];
+    sfx[s] = Ks * (v[a] - v[b]);
+    sfy[s] = Ks * (v[a + count] - v[b + count]);
+    sfz[s] = Ks * (v[a + 2*count] - v[b + 2*count]);
+  }
 
-        // compute velocity
-        vec3 vel = (cp.position - pp.position) / (2 * dt);
-        cp.velocity = vel;
+  #pragma omp parallel for schedule(static)
+  for (int n = 0; n < count; n++) {
+    double m = m_vmass[n] * invDt2;
+    double sumx = m * v[n], sumy = m * v[n + count], sumz = m * v[n + 2*count];
+    for (int e = springs.m_adjStart[n]; e < springs.m_adjStart[n+1]; e++) {
+      int s = springs.m_adjSpring[e];
+      if (springs.m_p1[s] == n) {
+        sumx += sfx[s]; sumy += sfy[s]; sumz += sfz[s];
+      } else {
+        sumx -= sfx[s]; sumy -= sfy[s]; sumz -= sfz[s];
       }
     }
+    out[n] = sumx;
+    out[n + count] = sumy;
+    out[n + 2*count] = sumz;
   }
 }
 
-void JelloMesh::VelocityVerletIntegrate(double dt) {
-  ParticleGrid& particles = m_vparticles;  // source is a ptr!
-  ParticleGrid& prev = m_vparticlesPrev;  // source is a ptr!
-
-  ParticleGrid target = m_vparticles;
+void JelloMesh::ProjectiveIntegrate(double dt, const World& world) {
+  if (!m_projectiveSystem.IsFactored() || dt != m_projectiveTimeStep) {
+    FactorProjectiveSystem(dt);
+  }
 
-  // Velocity Verlet
-  for (int i = 0; i < m_rows+1; i++) {
-    for (int j = 0; j < m_cols+1; j++) {
-      for (int k = 0; k < m_stacks+1; k++) {
-        // get current particle
-        Particle& cp = GetParticle(particles, i,j,k);
-        Particle& t = GetParticle(target, i,j,k);
+  ParticleGrid& p = m_vparticles;
+  int count = p.Size();
+  int size = 3 * count;
+  double invDt2 = 1.0 / (dt * dt);
+  const SpringTopology& springs = m_springs;
+  int numSprings = springs.GetSpringCount();
+
+  // The step's vectors; SolveProjectiveContacts works on the same ones.
+  // normal is the contact normal of each particle, zero for free ones,
+  // and offset the c of its contact plane n.x = c.
+  double* y = &m_vsolver[0];
+  double* x = y + size;
+  double* b = x + size;
+  double* normal = b + 5*size;
+  double* offset = normal + size;
+
+  // Inertial target y from the external forces, also the first guess
+  // for the new positions.  Spring damping is not modeled; the implicit
+  // steps damp on their own.
+  #pragma omp parallel for schedule(static)
+  for (int n = 0; n < count; n++) {
+    y[n] = x[n] = p.px[n] + dt * (p.vx[n] + dt * m_externalForces[0]);
+    y[n + count] = x[n + count] = p.py[n] + dt * (p.vy[n] + dt * m_externalForces[1]);
+    y[n + 2*count] = x[n + 2*count] = p.pz[n] + dt * (p.vz[n] + dt * m_externalForces[2]);
+  }
+  for (int i = 0; i < size; i++) normal[i] = 0.0;
+  m_vprojectiveContacts.clear();
+
+  double* sfx = numSprings > 0 ? &m_vspringForce[0] : NULL;
+  double* sfy = sfx + numSprings;
+  double* sfz = sfy + numSprings;
+  const int* adjStart = springs.m_adjStart.empty() ? NULL : &springs.m_adjStart[0];
+  const int* adjSpring = springs.m_adjSpring.empty() ? NULL : &springs.m_adjSpring[0];
+  const int* p1 = numSprings > 0 ? &springs.m_p1[0] : NULL;
+
+  for (int iter = 0; iter < g_projectiveIterations; iter++) {
+    // local step: Ks p_s for every spring, in the per-spring force buffer
+    #pragma omp parallel for schedule(static)
+    for (int s = 0; s < numSprings; s++) {
+      int a = springs.m_p1[s];
+      int b = springs.m_p2[s];
+      double lx = x[a] - x[b];
+      double ly = x[a + count] - x[b + count];
+      double lz = x[a + 2*count] - x[b + 2*count];
+      double scale = springs.m_kindKs[springs.m_kind[s]] * springs.m_restLen[s]
+          / sqrt(lx*lx + ly*ly + lz*lz);
+      sfx[s] = scale * lx;
+      sfy[s] = scale * ly;
+      sfz[s] = scale * lz;
+    }
 
-        // compute central difference
-        vec3 a = cp.force * (1/cp.mass);
-        vec3 pos = cp.position + cp.velocity * dt + (0.5) * a * pow(dt,2);
+    // global step: gather the right hand side, then back-substitute
+    #pragma omp parallel for schedule(static)
+    for (int n = 0; n < count; n++) {
+      double m = m_vmass[n] * invDt2;
+      double sumx = m * y[n], sumy = m * y[n + count], sumz = m * y[n + 2*count];
+      for (int e = adjStart[n]; e < adjStart[n+1]; e++) {
+        int s = adjSpring[e];
+        if (p1[s] == n) {
+          sumx += sfx[s]; sumy += sfy[s]; sumz += sfz[s];
+        } else {
+          sumx -= sfx[s]; sumy -= sfy[s]; sumz -= sfz[s];
+        }
+      }
+      b[n] = x[n] = sumx;
+      b[n + count] = x[n + count] = sumy;
+      b[n + 2*count] = x[n + 2*count] = sumz;
+    }
 
-        t.position = pos;
+    m_projectiveSystem.Solve(x, 3);
+
+    // The penalty springs are far too stiff to go into the matrix, so a
+    // particle found inside an obstacle is held on the obstacle's tangent
+    // plane for the rest of the step instead.  Checking the new positions
+    // keeps large steps from carrying particles straight through.
+    for (int n = 0; n < count; n++) {
+      if (normal[n] != 0.0 || normal[n + count] != 0.0 || normal[n + 2*count] != 0.0) continue;
+      vec3 pos(x[n], x[n + count], x[n + 2*count]);
+      for (unsigned int i = 0; i < world.m_shapes.size(); i++) {
+        Intersection intersection;
+        if (ShapeIntersection(n, pos, world.m_shapes[i], intersection)
+            && intersection.m_type == COLLISION) {
+          const vec3& nrm = intersection.m_normal;
+          normal[n] = nrm[0];
+          normal[n + count] = nrm[1];
+          normal[n + 2*count] = nrm[2];
+          offset[n] = Dot(nrm, pos) - intersection.m_distance;
+          m_vprojectiveContacts.push_back(n);
+          break;
+        }
       }
     }
+    // One conjugate gradient step is enough to keep the contacts for the
+    // next local step; the last iteration solves to the tolerance.
+    if (!m_vprojectiveContacts.empty()) {
+      bool last = iter + 1 == g_projectiveIterations;
+      SolveProjectiveContacts(dt, last ? g_implicitMaxIterations : 1);
+    }
   }
 
-  // compute new forces
-  ComputeForces(target);
+  double invDt = 1.0 / dt;
+  #pragma omp parallel for schedule(static)
+  for (int n = 0; n < count; n++) {
+    p.vx[n] = (x[n] - p.px[n]) * invDt;
+    p.vy[n] = (x[n + count] - p.py[n]) * invDt;
+    p.vz[n] = (x[n + 2*count] - p.pz[n]) * invDt;
+    p.px[n] = x[n];
+    p.py[n] = x[n + count];
+    p.pz[n] = x[n + 2*count];
+  }
+}
 
-  // compute new velocities
-  for (int i = 0; i < m_rows+1; i++) {
-    for (int j = 0; j < m_cols+1; j++) {
-      for (int k = 0; k < m_stacks+1; k++) {
-        // get current particle
-        Particle& cp = GetParticle(particles, i,j,k);
-        Particle& t = GetParticle(target, i,j,k);
+// Removes the normal component at every particle held on a contact plane.
+static void FilterContacts(const std::vector<int>& contacts, const double* normal, int count, double* v) {
+  for (unsigned int i = 0; i < contacts.size(); i++) {
+    int n = contacts[i];
+    double nx = normal[n], ny = normal[n + count], nz = normal[n + 2*count];
+    double along = nx * v[n] + ny * v[n + count] + nz * v[n + 2*count];
+    v[n] -= along * nx;
+    v[n + count] -= along * ny;
+    v[n + 2*count] -= along * nz;
+  }
+}
 
-        // compute positiion
-        vec3 a = cp.force * (1/cp.mass);
-        vec3 pos = cp.position + cp.velocity * dt + (0.5) * a * pow(dt,2);
+void JelloMesh::SolveProjectiveContacts(double dt, int maxIterations) {
+  // Solves the global step A x = b again with the contact particles kept
+  // on their planes, by conjugate gradients on the directions the
+  // contacts leave free (the filtered CG of Baraff and Witkin).  The
+  // factored A is the preconditioner; it only misses the contacts, so a
+  // few iterations are enough.  Stops after maxIterations.
+  int count = GetParticleCount();
+  int size = 3 * count;
+  double invDt2 = 1.0 / (dt * dt);
+  double* x = &m_vsolver[size];
+  const double* b = x + size;
+  double* r = x + 2*size;
+  double* z = r + size;
+  double* d = z + size;
+  double* q = d + size;
+  const double* normal = q + size;
+  const double* offset = normal + size;
+  const std::vector<int>& contacts = m_vprojectiveContacts;
+
+  // start from the unconstrained solution moved onto the planes
+  for (unsigned int i = 0; i < contacts.size(); i++) {
+    int n = contacts[i];
+    double nx = normal[n], ny = normal[n + count], nz = normal[n + 2*count];
+    double along = nx * x[n] + ny * x[n + count] + nz * x[n + 2*count] - offset[n];
+    x[n] -= along * nx;
+    x[n + count] -= along * ny;
+    x[n + 2*count] -= along * nz;
+  }
 
-        // compute accel at t+1
-        vec3 a1 = t.force * (1/t.mass);
-        vec3 vel = cp.velocity + (0.5) * dt * (a + a1);
+  ApplyProjectiveMatrix(x, q, invDt2);
+  #pragma omp parallel for schedule(static)
+  for (int i = 0; i < size; i++) {
+    r[i] = b[i] - q[i];
+  }
+  FilterContacts(contacts, normal, count, r);
+  double threshold = g_implicitTolerance * g_implicitTolerance * DotProduct(b, b, size);
+
+  double rz = 0.0;
+  for (int iter = 0; iter < maxIterations; iter++) {
+    double rr = DotProduct(r, r, size);
+    if (rr <= threshold) break;
+
+    memcpy(z, r, size * sizeof(double));
+    m_projectiveSystem.Solve(z, 3);
+    FilterContacts(contacts, normal, count, z);
+
+    double rzNext = DotProduct(r, z, size);
+    double beta = iter == 0 ? 0.0 : rzNext / rz;
+    rz = rzNext;
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < size; i++) {
+      d[i] = z[i] + beta * d[i];
+    }
 
-        cp.position = pos;
-        cp.velocity = vel;
-      }
+    ApplyProjectiveMatrix(d, q, invDt2);
+    FilterContacts(contacts, normal, count, q);
+    double alpha = rz / DotProduct(d, q, size);
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < size; i++) {
+      x[i] += alpha * d[i];
+      r[i] -= alpha * q[i];
     }
   }
 }
@@ -1299,75 +1745,65 @@ void JelloMesh::VelocityVerletIntegrate(double dt) {
 
 
 //---------------------------------------------------------------------
-// Spring
+// ParticleGrid
 //---------------------------------------------------------------------
-JelloMesh::Spring::Spring() :
-    m_type(JelloMesh::STRUCTURAL), 
-    m_p1(-1), 
-    m_p2(-1), 
-    m_Ks(1.0), m_Kd(1.0), m_restLen(1.0)
+
+JelloMesh::ParticleGrid::ParticleGrid() : m_count(0)
 {
+    Bind();
 }
 
-JelloMesh::Spring::Spring(const JelloMesh::Spring& p) :
-    m_type(p.m_type), m_p1(p.m_p1), m_p2(p.m_p2),
-    m_Ks(p.m_Ks), m_Kd(p.m_Kd), m_restLen(p.m_restLen)
+JelloMesh::ParticleGrid::ParticleGrid(const JelloMesh::ParticleGrid& g) :
+    m_count(g.m_count), m_data(g.m_data)
 {
+    Bind();
 }
 
-JelloMesh::Spring& JelloMesh::Spring::operator=(const JelloMesh::Spring& p)
+JelloMesh::ParticleGrid& JelloMesh::ParticleGrid::operator=(const JelloMesh::ParticleGrid& g)
 {
-    if (&p == this) return *this;
+    if (&g == this) return *this;
 
-    m_type = p.m_type;
-    m_p1 = p.m_p1;
-    m_p2 = p.m_p2;
-    m_Ks = p.m_Ks;
-    m_Kd = p.m_Kd;
-    m_restLen = p.m_restLen;
+    if (g.m_count != m_count) Resize(g.m_count);
+    if (m_count > 0) memcpy(&m_data[0], &g.m_data[0], m_data.size() * sizeof(double));
     return *this;
 }
 
-JelloMesh::Spring::Spring(JelloMesh::SpringType t, 
-    int p1, int p2, double Ks, double Kd, double restLen) :
-    m_type(t), m_Ks(Ks), m_Kd(Kd), m_p1(p1), m_p2(p2), m_restLen(restLen)
+void JelloMesh::ParticleGrid::Resize(int count)
 {
+    m_count = count;
+    m_data.assign(9 * (size_t) count, 0.0);
+    Bind();
 }
 
-//---------------------------------------------------------------------
-// Particle
-//---------------------------------------------------------------------
-
-JelloMesh::Particle JelloMesh::Particle::EMPTY;
-
-JelloMesh::Particle::Particle(int idx, const vec3& p, const vec3& v, double m)
+void JelloMesh::ParticleGrid::Bind()
 {
-    index = idx;
-    position = p;
-    velocity = v;
-    force = vec3(0,0,0);
-    mass = m;
+    double* base = m_data.empty() ? NULL : &m_data[0];
+    double** fields[9] = { &px, &py, &pz, &vx, &vy, &vz, &fx, &fy, &fz };
+    for (int f = 0; f < 9; f++)
+    {
+        *fields[f] = base ? base + f * m_count : NULL;
+    }
 }
 
-JelloMesh::Particle::Particle() : index(-1), position(0,0,0), velocity(0,0,0), force(0,0,0), mass(1.0)
+void JelloMesh::ParticleGrid::SetPosition(int idx, const vec3& p)
 {
+    px[idx] = p[0];
+    py[idx] = p[1];
+    pz[idx] = p[2];
 }
 
-JelloMesh::Particle::Particle(const JelloMesh::Particle& p) : 
-    index(p.index), position(p.position), velocity(p.velocity), force(p.force), mass(p.mass)
+void JelloMesh::ParticleGrid::SetVelocity(int idx, const vec3& v)
 {
+    vx[idx] = v[0];
+    vy[idx] = v[1];
+    vz[idx] = v[2];
 }
 
-JelloMesh::Particle& JelloMesh::Particle::operator=(const JelloMesh::Particle& p)
+void JelloMesh::ParticleGrid::AddForce(int idx, const vec3& f)
 {
-    if (&p == this) return *this;
-
-    index = p.index;
-    position = p.position;
-    velocity = p.velocity;
-    force = p.force;
-    mass = p.mass;
-    return *this;
+    fx[idx] += f[0];
+    fy[idx] += f[1];
+    fz[idx] += f[2];
 }
 
 //---------------------------------------------------------------------
@@ -1415,16 +1851,16 @@ void JelloMesh::FaceMesh::Draw(const JelloMesh& m)
         for (unsigned int pi = 0; pi < points.size(); pi++)
         {
             int idx = points[pi];
-            vec3 p = m.GetParticle(g, idx).position;
+            vec3 p = g.Position(idx);
 
             vec3 n(0,0,0);
             const std::vector<int>& neighbors = m_neighbors[idx];
             if (neighbors.size() > 0)
             {
-                vec3 pup = m.GetParticle(g, neighbors[0]).position;
-                vec3 pdown = m.GetParticle(g, neighbors[1]).position;
-                vec3 pleft = m.GetParticle(g, neighbors[2]).position;
-                vec3 pright = m.GetParticle(g, neighbors[3]).position;
+                vec3 pup = g.Position(neighbors[0]);
+                vec3 pdown = g.Position(neighbors[1]);
+                vec3 pleft = g.Position(neighbors[2]);
+                vec3 pright = g.Position(neighbors[3]);
 
                 vec3 n1 = -((pright - p) ^ (pup - p));
                 vec3 n2 = -((pdown - p) ^ (pright - p));
@@ -1456,15 +1892,15 @@ void JelloMesh::FaceMesh::DrawNormals(const JelloMesh& m)
         for (unsigned int pi = 0; pi < points.size(); pi++)
         {
             int idx = points[pi];
-            vec3 p = m.GetParticle(g, idx).position;
+            vec3 p = g.Position(idx);
 
             const std::vector<int>& neighbors = m_neighbors[idx];
             if (neighbors.size() == 0) continue;
 
-            vec3 pup = m.GetParticle(g, neighbors[0]).position;
-            vec3 pdown = m.GetParticle(g, neighbors[1]).position;
-            vec3 pleft = m.GetParticle(g, neighbors[2]).position;
-            vec3 pright = m.GetParticle(g, neighbors[3]).position;
+            vec3 pup = g.Position(neighbors[0]);
+            vec3 pdown = g.Position(neighbors[1]);
+            vec3 pleft = g.Position(neighbors[2]);
+            vec3 pright = g.Position(neighbors[3]);
 
             vec3 n1 = -((pright - p) ^ (pup - p));
             vec3 n2 = -((pdown - p) ^ (pright - p));
@@ -1613,7 +2049,7 @@ void JelloMesh::FaceMesh::CalcDistToEye(const JelloMesh& m, const vec3& eyePos)
 {
     std::vector<int> points = m_strips[(int) (m_strips.size()*0.5)];
     int idx = points[(int) (points.size()*0.5)];
-    vec3 pos = m.GetParticle(m.m_vparticles, idx).position;
+    vec3 pos = m.m_vparticles.Position(idx);
     distToEye = (pos - eyePos).Length();
 }
 
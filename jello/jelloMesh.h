@@ -5,6 +5,8 @@
 #include <map>
 #include "vec.h"
 #include "world.h"
+#include "springTopology.h"
+#include "sparseCholesky.h"
 
 class JelloMesh {
   public:
@@ -33,7 +35,7 @@ class JelloMesh {
     virtual float GetDepth() const;
 
     // Set/Get our numerical integration type
-    enum IntegrationType { EULER, MIDPOINT, RK4, VERLET };
+    enum IntegrationType { EULER, MIDPOINT, RK4, VERLET, IMPLICIT, PROJECTIVE };
     virtual void SetIntegrationType(IntegrationType type);
     virtual IntegrationType GetIntegrationType() const;
 
@@ -49,26 +51,48 @@ class JelloMesh {
 
   protected:
 
-    class Particle;
-    class Spring;
+    // Particle state as a structure of arrays, one entry per grid point
+    // indexed by GetIndex(i,j,k).  All nine fields share one allocation, so
+    // loops over particles stream through memory and copying a whole state
+    // is a single memcpy.
+    class ParticleGrid {
+      public:
+        ParticleGrid();
+        ParticleGrid(const ParticleGrid& g);
+        ParticleGrid& operator=(const ParticleGrid& g);
+
+        void Resize(int count);
+        int Size() const { return m_count; }
+
+        vec3 Position(int idx) const { return vec3(px[idx], py[idx], pz[idx]); }
+        vec3 Velocity(int idx) const { return vec3(vx[idx], vy[idx], vz[idx]); }
+        vec3 Force(int idx) const { return vec3(fx[idx], fy[idx], fz[idx]); }
+        void SetPosition(int idx, const vec3& p);
+        void SetVelocity(int idx, const vec3& v);
+        void AddForce(int idx, const vec3& f);
+
+        double *px, *py, *pz;
+        double *vx, *vy, *vz;
+        double *fx, *fy, *fz;
+
+      private:
+        void Bind();
+
+        int m_count;
+        std::vector<double> m_data;
+    };
+
     friend class FaceMesh;
     friend class TestJelloMesh;
 
-    typedef std::vector< std::vector< std::vector<Particle> > > ParticleGrid;
-    Particle& GetParticle(ParticleGrid& grid, int i, int j, int k);
-    Particle& GetParticle(ParticleGrid& grid, int idx);
-    const Particle& GetParticle(const ParticleGrid& grid, int i, int j, int k) const;
-    const Particle& GetParticle(const ParticleGrid& grid, int idx) const;
+    int GetParticleCount() const;
 
-    bool isInterior(const Spring& s) const;
+    bool isSpringInterior(int spring) const;
     bool isInterior(int idx) const;
     bool isInterior(int i, int j, int k) const;
 
     virtual void InitJelloMesh();
-    virtual void AddStructuralSpring(Particle& p1, Particle& p2);
-    virtual void AddBendSpring(Particle& p1, Particle& p2);
-    virtual void AddShearSpring(Particle& p1, Particle& p2);
-    virtual void AddShearDiagSpring(Particle& p1, Particle& p2);
+    virtual void InitSprings();
 
     class Intersection;
     virtual void CheckForCollisions(ParticleGrid& grid, const World& world);
@@ -76,11 +100,12 @@ class JelloMesh {
     virtual void ResolveContacts(ParticleGrid& grid);
     virtual void ResolveCollisions2(ParticleGrid& grid);
     virtual void ResolveContacts2(ParticleGrid& grid);
-    virtual bool FloorIntersection(Particle& p, Intersection& intersection);
-    virtual bool CylinderIntersection(Particle& p, World::Cylinder* cylinder, Intersection& intersection);
-    virtual bool CylinderIntersection2(Particle& p, World::Cylinder* cylinder, Intersection& intersection);
-    virtual bool SphereIntersection(Particle& p, World::Sphere* shpere, Intersection& intersection);
-    virtual bool CubeIntersection(Particle& p, World::Cube* cube, JelloMesh::Intersection& intersection);
+    virtual bool ShapeIntersection(int p, const vec3& pos, World::Shape* shape, Intersection& intersection);
+    virtual bool FloorIntersection(int p, const vec3& pos, Intersection& intersection);
+    virtual bool CylinderIntersection(int p, const vec3& pos, World::Cylinder* cylinder, Intersection& intersection);
+    virtual bool CylinderIntersection2(int p, const vec3& pos, World::Cylinder* cylinder, Intersection& intersection);
+    virtual bool SphereIntersection(int p, const vec3& pos, World::Sphere* shpere, Intersection& intersection);
+    virtual bool CubeIntersection(int p, const vec3& pos, World::Cube* cube, JelloMesh::Intersection& intersection);
 
     virtual void ComputeForces(ParticleGrid& grid);
     virtual void EulerIntegrate(double dt);
@@ -88,6 +113,16 @@ class JelloMesh {
     virtual void RK4Integrate(double dt);
     virtual void VerletIntegrate(double dt);
     virtual void VelocityVerletIntegrate(double dt);
+    virtual void ImplicitIntegrate(double dt);
+    void LinearizeSprings(const ParticleGrid& grid);
+    void ApplyImplicitMatrix(const double* y, double* out, double mass, double cx, double cv);
+    void GetImplicitDiagonal(double* diag, double mass, double cx, double cv);
+    virtual void ProjectiveIntegrate(double dt, const World& world);
+    void FactorProjectiveSystem(double dt);
+    void AddDissectionOrder(int i0, int i1, int j0, int j1, int k0, int k1, int reach,
+        std::vector<int>& order);
+    void ApplyProjectiveMatrix(const double* v, double* out, double invDt2);
+    void SolveProjectiveContacts(double dt, int maxIterations);
 
     enum Face {
       XLEFT, 
@@ -127,9 +162,35 @@ class JelloMesh {
     IntegrationType m_integrationType;
     std::vector<FaceMesh> m_mesh;
     ParticleGrid m_vparticles;
+    // Positions at the start of the last step, for Verlet integration;
+    // the other fields are not kept.
     ParticleGrid m_vparticlesPrev;
-
-    std::vector<Spring> m_vsprings;
+    // Stage storage for the midpoint, RK4 and velocity Verlet integrators,
+    // sized with the grid so that a step allocates nothing: the state at
+    // an intermediate stage, and RK4's weighted sum of the stage
+    // derivatives, three velocity arrays then three position arrays.
+    ParticleGrid m_vstage;
+    std::vector<double> m_vstageSum;
+    // Per-particle mass and its inverse; these never change during a step,
+    // so they live outside the state that integrators copy.
+    std::vector<double> m_vmass;
+    std::vector<double> m_vinvMass;
+
+    SpringTopology m_springs;
+    // Force of each spring on its m_p1 end, three arrays of one per spring.
+    std::vector<double> m_vspringForce;
+    // Springs linearized for implicit integration: the unit direction and
+    // the stiffness along it and across it, five arrays of one per spring.
+    std::vector<double> m_vspringJacobian;
+    // Work vectors for the implicit and projective integrators, nine
+    // vectors of three arrays of one per particle.
+    std::vector<double> m_vsolver;
+    // Cholesky factor of the projective dynamics system matrix for time
+    // step m_projectiveTimeStep, one matrix shared by x, y and z.
+    SparseCholesky m_projectiveSystem;
+    double m_projectiveTimeStep;
+    // particles held on a contact plane during a projective step
+    std::vector<int> m_vprojectiveContacts;
     std::vector<Intersection> m_vcontacts;
     std::vector<Intersection> m_vcollisions;
 
@@ -149,45 +210,31 @@ class JelloMesh {
     static double g_shearDiagKs;
     static double g_shearDiagKd;
 
+    // Implicit integration stops once the conjugate gradient residual
+    // drops below g_implicitTolerance times the right hand side, or after
+    // g_implicitMaxIterations iterations.
+    static double g_implicitTolerance;
+    static int g_implicitMaxIterations;
+
+    // Local/global iterations per projective dynamics step; more give
+    // stiffer, more accurate springs at a proportional cost.
+    static int g_projectiveIterations;
+
+    // Stencil radius per spring type, in lattice steps: structural springs
+    // join axis neighbors up to g_structuralRadius apart, bend springs the
+    // axis neighbors beyond that up to g_bendRadius, shear springs face
+    // diagonals and diagonal shear springs body diagonals.  0 disables a type.
+    static int g_structuralRadius;
+    static int g_bendRadius;
+    static int g_shearRadius;
+    static int g_shearDiagRadius;
+
     static const unsigned int MESH = 0x10;
     static const unsigned int NORMALS = 0x100;
     static const unsigned int FORCES = 0x1000;
 
   protected:
 
-    class Particle {
-      public:
-        Particle();
-        Particle(const Particle& p);
-        Particle& operator=(const Particle& p);
-        Particle(int idx, const vec3& pos, const vec3& vel = vec3(0,0,0), double m = 1);
-
-        int index;
-        vec3 position;
-        vec3 velocity;
-        vec3 force;
-        double mass;
-
-        static Particle EMPTY;
-    };
-
-    class Spring {
-      public:
-        Spring();
-        Spring(const Spring& p);
-        Spring& operator=(const Spring& p);
-        Spring(SpringType t, int p1, int p2, 
-            double Ks, double Kd, double restLen);
-
-        SpringType m_type;
-        int m_p1;
-        int m_p2;
-        double m_Ks;
-        double m_Kd;
-        double m_restLen;
-    };
-
-
     enum IntersectionType { 
       CONTACT, 
       COLLISION 
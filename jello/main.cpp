@@ -148,6 +148,8 @@ void onKeyboardCb(unsigned char key, int x, int y)
    else if (key == '9') theJello.SetIntegrationType(JelloMesh::MIDPOINT);
    else if (key == '0') theJello.SetIntegrationType(JelloMesh::RK4);
    else if (key == '-') theJello.SetIntegrationType(JelloMesh::VERLET);
+   else if (key == '7') theJello.SetIntegrationType(JelloMesh::IMPLICIT);
+   else if (key == 'p') theJello.SetIntegrationType(JelloMesh::PROJECTIVE);
    else if (key == '>') isRunning = true;
    else if (key == '=') isRunning = false;
    else if (key == '<') theJello.Reset();
@@ -232,6 +234,8 @@ void drawOverlay()
      case JelloMesh::MIDPOINT: intstr = "Midpoint"; break;
      case JelloMesh::RK4: intstr = "RK4"; break;
      case JelloMesh::VERLET: intstr = "Verlet"; break;
+     case JelloMesh::IMPLICIT: intstr = "Implicit"; break;
+     case JelloMesh::PROJECTIVE: intstr = "Projective"; break;
      }
 
      char info[1024];
@@ -349,6 +353,8 @@ int main(int argc, char **argv)
     glutAddMenuEntry("Midpoint\t'9'", '9');
     glutAddMenuEntry("RK4\t'0'", '0');
     glutAddMenuEntry("Verlet\t'-'", '-');
+    glutAddMenuEntry("Implicit\t'7'", '7');
+    glutAddMenuEntry("Projective\t'p'", 'p');
 
     int displayMenu = glutCreateMenu(onMenuCb);
     glutAddMenuEntry("Mesh\t'1'", '1');
@@ -0,0 +1,153 @@
+#include "sparseCholesky.h"
+#include <math.h>
+
+SparseCholesky::SparseCholesky() { }
+
+void SparseCholesky::Clear() {
+  m_L = Eigen::SparseMatrix<double>();
+  m_order.clear();
+}
+
+bool SparseCholesky::IsFactored() const {
+  return m_L.rows() > 0;
+}
+
+int SparseCholesky::GetNonZeros() const {
+  return m_L.nonZeros();
+}
+
+// Pushes onto stack[top-1], stack[top-2], ... the rows of L with a
+// nonzero in row k, found by walking the elimination tree up from the
+// nonzeros of column k of A; returns the new top.  The rows come out in
+// an order that respects their dependencies.
+static int Reach(int k, const std::vector<int>& start, const std::vector<int>& rows,
+    const std::vector<int>& parent, std::vector<int>& mark, std::vector<int>& stack) {
+  int n = (int) parent.size();
+  int top = n;
+  mark[k] = k;
+  for (int p = start[k]; p < start[k+1]; p++) {
+    int i = rows[p];
+    if (i > k) continue;
+    int len = 0;
+    // the path is pushed at the bottom of the stack, then moved on top
+    for (; mark[i] != k; i = parent[i]) {
+      stack[len++] = i;
+      mark[i] = k;
+    }
+    while (len > 0) stack[--top] = stack[--len];
+  }
+  return top;
+}
+
+bool SparseCholesky::Factor(int n, const std::vector<int>& inStart, const std::vector<int>& inRows,
+    const std::vector<double>& inVals, const std::vector<int>& order) {
+  Clear();
+  if (n <= 0) return false;
+
+  // upper triangle of the reordered matrix, by columns
+  std::vector<int> position(n);
+  for (int k = 0; k < n; k++) position[order[k]] = k;
+  std::vector<int> start(n+1, 0);
+  for (int j = 0; j < n; j++) {
+    for (int p = inStart[j]; p < inStart[j+1]; p++) {
+      if (position[inRows[p]] <= position[j]) start[position[j]+1]++;
+    }
+  }
+  for (int k = 0; k < n; k++) start[k+1] += start[k];
+  std::vector<int> rows(start[n]);
+  std::vector<double> vals(start[n]);
+  std::vector<int> fill(start.begin(), start.end()-1);
+  for (int j = 0; j < n; j++) {
+    for (int p = inStart[j]; p < inStart[j+1]; p++) {
+      int i = position[inRows[p]];
+      if (i > position[j]) continue;
+      rows[fill[position[j]]] = i;
+      vals[fill[position[j]]++] = inVals[p];
+    }
+  }
+
+  // elimination tree
+  std::vector<int> parent(n, -1);
+  std::vector<int> ancestor(n, -1);
+  for (int k = 0; k < n; k++) {
+    for (int p = start[k]; p < start[k+1]; p++) {
+      int i = rows[p];
+      while (i != -1 && i < k) {
+        int next = ancestor[i];
+        ancestor[i] = k;
+        if (next == -1) parent[i] = k;
+        i = next;
+      }
+    }
+  }
+
+  // column counts of L, from the pattern of each row
+  std::vector<int> mark(n, -1);
+  std::vector<int> stack(n);
+  std::vector<int> colStart(n+1, 0);
+  for (int k = 0; k < n; k++) {
+    int top = Reach(k, start, rows, parent, mark, stack);
+    for (int t = top; t < n; t++) colStart[stack[t]+1]++;
+    colStart[k+1]++;
+  }
+  for (int k = 0; k < n; k++) colStart[k+1] += colStart[k];
+
+  // Row k of L solves L(0:k-1,0:k-1) l = A(0:k-1,k), then
+  // L(k,k) = sqrt(A(k,k) - l.l).  Every column keeps its diagonal first,
+  // and rows are added in increasing order.
+  std::vector<int> Li(colStart[n]);
+  std::vector<double> Lx(colStart[n]);
+  std::vector<int> next(colStart.begin(), colStart.end()-1);
+  std::vector<double> x(n, 0.0);
+  mark.assign(n, -1);
+  for (int k = 0; k < n; k++) {
+    int top = Reach(k, start, rows, parent, mark, stack);
+    for (int p = start[k]; p < start[k+1]; p++) {
+      if (rows[p] <= k) x[rows[p]] = vals[p];
+    }
+    double d = x[k];
+    x[k] = 0.0;
+    for (int t = top; t < n; t++) {
+      int i = stack[t];
+      double lki = x[i] / Lx[colStart[i]];
+      x[i] = 0.0;
+      for (int p = colStart[i]+1; p < next[i]; p++) {
+        x[Li[p]] -= Lx[p] * lki;
+      }
+      d -= lki * lki;
+      Li[next[i]] = k;
+      Lx[next[i]++] = lki;
+    }
+    if (d <= 0.0) return false;
+    Li[next[k]] = k;
+    Lx[next[k]++] = sqrt(d);
+  }
+
+  m_L.resize(n, n);
+  m_L.reserve(colStart[n]);
+  for (int j = 0; j < n; j++) {
+    m_L.startVec(j);
+    for (int p = colStart[j]; p < colStart[j+1]; p++) {
+      m_L.insertBack(Li[p], j) = Lx[p];
+    }
+  }
+  m_L.finalize();
+  m_order = order;
+  return true;
+}
+
+void SparseCholesky::Solve(double* b, int numRhs) {
+  int n = (int) m_L.rows();
+  if (m_work.size() < (size_t) n * numRhs) m_work.resize((size_t) n * numRhs);
+
+  #pragma omp parallel for schedule(static)
+  for (int c = 0; c < numRhs; c++) {
+    double* rhs = b + (size_t) c * n;
+    double* work = &m_work[(size_t) c * n];
+    for (int k = 0; k < n; k++) work[k] = rhs[m_order[k]];
+    Eigen::Map<Eigen::VectorXd> x(work, n);
+    m_L.triangularView<Eigen::Lower>().solveInPlace(x);
+    m_L.transpose().triangularView<Eigen::Upper>().solveInPlace(x);
+    for (int k = 0; k < n; k++) rhs[m_order[k]] = work[k];
+  }
+}
@@ -0,0 +1,47 @@
+#ifndef sparseCholesky_H_
+#define sparseCholesky_H_
+
+#include <vector>
+#define EIGEN_YES_I_KNOW_SPARSE_MODULE_IS_NOT_STABLE_YET
+#include <Eigen/Sparse>
+
+// Sparse Cholesky factorization A = L L^T of a symmetric positive definite
+// matrix, for a matrix that is factored once and solved with many times.
+//
+// The factor is kept in an Eigen sparse matrix and the solves are Eigen's
+// sparse triangular solves.  The factorization itself is done here, row
+// by row along the elimination tree ("up-looking", as in Davis, "Direct
+// Methods for Sparse Linear Systems"), since the Eigen we ship has no
+// sparse Cholesky of its own.  The unknowns are eliminated in an order
+// the caller picks to keep fill-in low; nested dissection works well for
+// meshes.
+class SparseCholesky {
+  public:
+    SparseCholesky();
+
+    // Factors the n by n matrix given column by column: column j holds
+    // rows[start[j]] up to rows[start[j+1]-1] with values in vals, both
+    // triangles.  The unknowns are eliminated in the order order[0],
+    // order[1], ...  Returns false, leaving nothing factored, if the
+    // matrix is not positive definite.
+    bool Factor(int n, const std::vector<int>& start, const std::vector<int>& rows,
+        const std::vector<double>& vals, const std::vector<int>& order);
+    void Clear();
+    bool IsFactored() const;
+
+    // Overwrites the numRhs right hand sides b, b+n, b+2n, ... with the
+    // solutions x of A x = b, solving them in parallel.
+    void Solve(double* b, int numRhs);
+
+    // nonzeros in L
+    int GetNonZeros() const;
+
+  protected:
+    // L of the reordered matrix
+    Eigen::SparseMatrix<double> m_L;
+    std::vector<int> m_order;
+    // reordered right hand sides
+    std::vector<double> m_work;
+};
+
+#endif
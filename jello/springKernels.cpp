@@ -0,0 +1,225 @@
+#include "springKernels.h"
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPRING_KERNELS_X86
+#include <immintrin.h>
+#include <cpuid.h>
+#define TARGET_AVX2 __attribute__((target("avx2")))
+// AVX-512F brings FMA along, and GCC would fuse the separate multiplies
+// and adds below unless told not to
+#define TARGET_AVX512 __attribute__((target("avx512f"), optimize("fp-contract=off")))
+#elif defined(_MSC_VER) && _MSC_VER >= 1911 && (defined(_M_X64) || defined(_M_IX86))
+#define SPRING_KERNELS_X86
+#include <immintrin.h>
+#include <intrin.h>
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+typedef SpringKernels::Input Input;
+
+static void ComputeScalar(const Input& in, int begin, int end) {
+  for (int i = begin; i < end; i++) {
+    int a = in.p1[i];
+    int b = in.p2[i];
+
+    // calculate spring force from hooks law
+    // F = -(ks * (|l| - r) + kd * (ldot*l)/|l|) * (l/|l|)
+    // l = a-b
+    // ldot = va - vb
+    double lx = in.px[a] - in.px[b], ly = in.py[a] - in.py[b], lz = in.pz[a] - in.pz[b];
+    double lnorm = sqrt(lx*lx + ly*ly + lz*lz);
+    double ldx = in.vx[a] - in.vx[b], ldy = in.vy[a] - in.vy[b], ldz = in.vz[a] - in.vz[b];
+
+    double inv = 1.0/lnorm;
+
+    // proportional term
+    double prop = in.Ks[in.kind[i]] * (lnorm - in.restLen[i]);
+    // damping force
+    double damp = in.Kd[in.kind[i]] * ((ldx*lx + ldy*ly + ldz*lz)*inv);
+    // combined force
+    double scale = -(prop + damp);
+    in.fx[i] = scale * (lx*inv);
+    in.fy[i] = scale * (ly*inv);
+    in.fz[i] = scale * (lz*inv);
+  }
+}
+
+#ifdef SPRING_KERNELS_X86
+
+// The vector kernels repeat ComputeScalar operation for operation.  Only
+// separate multiplies and adds are used, never fused ones, and negation
+// flips the sign bit, so the results match bit for bit.
+
+// AVX2 gathers are microcoded and slow on many CPUs; four scalar loads
+// into one register are as fast or faster.
+template<class Index>
+TARGET_AVX2 static inline __m256d Load4(const double* base, const Index* idx) {
+  return _mm256_set_pd(base[idx[3]], base[idx[2]], base[idx[1]], base[idx[0]]);
+}
+
+TARGET_AVX2 static void ComputeAvx2(const Input& in, int begin, int end) {
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d sign = _mm256_set1_pd(-0.0);
+
+  int i = begin;
+  for (; i + 4 <= end; i += 4) {
+    const int* a = in.p1 + i;
+    const int* b = in.p2 + i;
+    const unsigned char* k = in.kind + i;
+
+    __m256d lx = _mm256_sub_pd(Load4(in.px, a), Load4(in.px, b));
+    __m256d ly = _mm256_sub_pd(Load4(in.py, a), Load4(in.py, b));
+    __m256d lz = _mm256_sub_pd(Load4(in.pz, a), Load4(in.pz, b));
+    __m256d lnorm = _mm256_sqrt_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(lx, lx),
+        _mm256_mul_pd(ly, ly)), _mm256_mul_pd(lz, lz)));
+    __m256d ldx = _mm256_sub_pd(Load4(in.vx, a), Load4(in.vx, b));
+    __m256d ldy = _mm256_sub_pd(Load4(in.vy, a), Load4(in.vy, b));
+    __m256d ldz = _mm256_sub_pd(Load4(in.vz, a), Load4(in.vz, b));
+
+    __m256d prop = _mm256_mul_pd(Load4(in.Ks, k),
+        _mm256_sub_pd(lnorm, _mm256_loadu_pd(in.restLen + i)));
+    __m256d dot = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ldx, lx), _mm256_mul_pd(ldy, ly)),
+        _mm256_mul_pd(ldz, lz));
+    __m256d inv = _mm256_div_pd(one, lnorm);
+    __m256d damp = _mm256_mul_pd(Load4(in.Kd, k), _mm256_mul_pd(dot, inv));
+    __m256d scale = _mm256_xor_pd(_mm256_add_pd(prop, damp), sign);
+
+    _mm256_storeu_pd(in.fx + i, _mm256_mul_pd(scale, _mm256_mul_pd(lx, inv)));
+    _mm256_storeu_pd(in.fy + i, _mm256_mul_pd(scale, _mm256_mul_pd(ly, inv)));
+    _mm256_storeu_pd(in.fz + i, _mm256_mul_pd(scale, _mm256_mul_pd(lz, inv)));
+  }
+  ComputeScalar(in, i, end);
+}
+
+// Eight doubles from base by 32-bit index, and a square root.  The masked
+// forms with a zero source keep GCC from warning that the unmasked ones,
+// which start from an undefined vector, may be uninitialized.
+TARGET_AVX512 static inline __m512d Gather8(__m256i index, const double* base) {
+  return _mm512_mask_i32gather_pd(_mm512_setzero_pd(), 0xFF, index, base, 8);
+}
+
+TARGET_AVX512 static inline __m512d Sqrt8(__m512d x) {
+  return _mm512_mask_sqrt_pd(_mm512_setzero_pd(), 0xFF, x);
+}
+
+TARGET_AVX512 static void ComputeAvx512(const Input& in, int begin, int end) {
+  const __m512d one = _mm512_set1_pd(1.0);
+  const __m512i sign = _mm512_set1_epi64(0x8000000000000000LL);
+
+  int i = begin;
+  for (; i + 8 <= end; i += 8) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (in.p1 + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*) (in.p2 + i));
+    __m256i k = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) (in.kind + i)));
+
+    __m512d lx = _mm512_sub_pd(Gather8(a, in.px), Gather8(b, in.px));
+    __m512d ly = _mm512_sub_pd(Gather8(a, in.py), Gather8(b, in.py));
+    __m512d lz = _mm512_sub_pd(Gather8(a, in.pz), Gather8(b, in.pz));
+    __m512d lnorm = Sqrt8(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(lx, lx),
+        _mm512_mul_pd(ly, ly)), _mm512_mul_pd(lz, lz)));
+    __m512d ldx = _mm512_sub_pd(Gather8(a, in.vx), Gather8(b, in.vx));
+    __m512d ldy = _mm512_sub_pd(Gather8(a, in.vy), Gather8(b, in.vy));
+    __m512d ldz = _mm512_sub_pd(Gather8(a, in.vz), Gather8(b, in.vz));
+
+    __m512d prop = _mm512_mul_pd(Gather8(k, in.Ks),
+        _mm512_sub_pd(lnorm, _mm512_loadu_pd(in.restLen + i)));
+    __m512d dot = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ldx, lx), _mm512_mul_pd(ldy, ly)),
+        _mm512_mul_pd(ldz, lz));
+    __m512d inv = _mm512_div_pd(one, lnorm);
+    __m512d damp = _mm512_mul_pd(Gather8(k, in.Kd), _mm512_mul_pd(dot, inv));
+    // xor on the integer side; _mm512_xor_pd needs AVX-512DQ
+    __m512d scale = _mm512_castsi512_pd(_mm512_xor_si512(
+        _mm512_castpd_si512(_mm512_add_pd(prop, damp)), sign));
+
+    _mm512_storeu_pd(in.fx + i, _mm512_mul_pd(scale, _mm512_mul_pd(lx, inv)));
+    _mm512_storeu_pd(in.fy + i, _mm512_mul_pd(scale, _mm512_mul_pd(ly, inv)));
+    _mm512_storeu_pd(in.fz + i, _mm512_mul_pd(scale, _mm512_mul_pd(lz, inv)));
+  }
+  ComputeScalar(in, i, end);
+}
+
+static void CpuId(unsigned int leaf, unsigned int regs[4]) {
+#ifdef _MSC_VER
+  __cpuidex((int*) regs, leaf, 0);
+#else
+  __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Register state the operating system saves on context switches.
+static unsigned long long GetXcr0() {
+#ifdef _MSC_VER
+  return _xgetbv(0);
+#else
+  unsigned int lo, hi;
+  __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return ((unsigned long long) hi << 32) | lo;
+#endif
+}
+
+SpringKernels::Level SpringKernels::GetSupportedLevel() {
+  unsigned int regs[4];
+  CpuId(0, regs);
+  if (regs[0] < 7) return SCALAR;
+
+  // AVX needs the CPU bit and the OS saving the ymm registers
+  CpuId(1, regs);
+  bool osxsave = (regs[2] & (1u << 27)) != 0;
+  bool avx = (regs[2] & (1u << 28)) != 0;
+  if (!osxsave || !avx) return SCALAR;
+  unsigned long long xcr0 = GetXcr0();
+  if ((xcr0 & 0x6) != 0x6) return SCALAR;
+
+  CpuId(7, regs);
+  bool avx2 = (regs[1] & (1u << 5)) != 0;
+  bool avx512f = (regs[1] & (1u << 16)) != 0;
+  // AVX-512 also needs the opmask and zmm register state
+  if (avx512f && avx2 && (xcr0 & 0xe6) == 0xe6) return AVX512;
+  if (avx2) return AVX2;
+  return SCALAR;
+}
+
+#else
+
+SpringKernels::Level SpringKernels::GetSupportedLevel() {
+  return SCALAR;
+}
+
+#endif
+
+static SpringKernels::Level theLevel = SpringKernels::GetSupportedLevel();
+
+void SpringKernels::Compute(const Input& in, int begin, int end) {
+  switch (theLevel) {
+#ifdef SPRING_KERNELS_X86
+    case AVX512:
+      ComputeAvx512(in, begin, end);
+      break;
+    case AVX2:
+      ComputeAvx2(in, begin, end);
+      break;
+#endif
+    default:
+      ComputeScalar(in, begin, end);
+      break;
+  }
+}
+
+void SpringKernels::SetLevel(Level level) {
+  Level supported = GetSupportedLevel();
+  theLevel = level < supported ? level : supported;
+}
+
+SpringKernels::Level SpringKernels::GetLevel() {
+  return theLevel;
+}
+
+const char* SpringKernels::GetLevelName(Level level) {
+  switch (level) {
+    case AVX512: return "avx512";
+    case AVX2: return "avx2";
+    default: return "scalar";
+  }
+}
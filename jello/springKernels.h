@@ -0,0 +1,45 @@
+#ifndef springKernels_H_
+#define springKernels_H_
+
+// Spring force kernels.  Each computes, for the springs [begin, end), the
+// Hooke's law plus damping force on every spring's p1 end; the p2 end gets
+// the negative.
+//
+// Besides the scalar loop there are AVX2 and AVX-512 versions that handle
+// 4 and 8 springs per instruction, loading the endpoint positions and
+// velocities by index (AVX-512 with its gather instruction).  They are
+// compiled for their instruction sets function by function and only picked
+// at run time when the CPU and the operating system support them, so the
+// program still runs on any x86 machine.  Every version does the same IEEE double operations in the same
+// order, so they all give the same forces to the last bit.
+class SpringKernels {
+  public:
+    enum Level { SCALAR, AVX2, AVX512 };
+
+    class Input {
+      public:
+        // particle state
+        const double *px, *py, *pz;
+        const double *vx, *vy, *vz;
+        // springs
+        const int *p1, *p2;
+        const double* restLen;
+        const unsigned char* kind;
+        // kind table
+        const double *Ks, *Kd;
+        // force on each spring's p1 end
+        double *fx, *fy, *fz;
+    };
+
+    static void Compute(const Input& in, int begin, int end);
+
+    // Best level this machine can run.
+    static Level GetSupportedLevel();
+    // The level Compute uses, the best supported one by default.  Asking
+    // for more than the machine supports gives the supported level.
+    static void SetLevel(Level level);
+    static Level GetLevel();
+    static const char* GetLevelName(Level level);
+};
+
+#endif
@@ -0,0 +1,106 @@
+#include "springTopology.h"
+#include <assert.h>
+
+SpringTopology::SpringTopology() { }
+
+void SpringTopology::Clear() {
+  m_kindType.clear();
+  m_kindKs.clear();
+  m_kindKd.clear();
+  m_offsets.clear();
+  m_p1.clear();
+  m_p2.clear();
+  m_restLen.clear();
+  m_kind.clear();
+  m_adjStart.clear();
+  m_adjSpring.clear();
+}
+
+int SpringTopology::AddKind(unsigned int type, double Ks, double Kd) {
+  // m_kind stores kinds in a byte
+  assert(m_kindType.size() < 256);
+  m_kindType.push_back(type);
+  m_kindKs.push_back(Ks);
+  m_kindKd.push_back(Kd);
+  return (int) m_kindType.size() - 1;
+}
+
+void SpringTopology::AddOffsets(int kind, Stencil stencil, int minRadius, int maxRadius) {
+  if (minRadius < 1) minRadius = 1;
+
+  for (int d = minRadius; d <= maxRadius; d++) {
+    switch (stencil) {
+      case AXIS:
+        AddOffset(d, 0, 0, kind);
+        AddOffset(0, d, 0, kind);
+        AddOffset(0, 0, d, kind);
+        break;
+      case FACE_DIAGONAL:
+        AddOffset(d, d, 0, kind);
+        AddOffset(d, -d, 0, kind);
+        AddOffset(d, 0, d, kind);
+        AddOffset(d, 0, -d, kind);
+        AddOffset(0, d, d, kind);
+        AddOffset(0, d, -d, kind);
+        break;
+      case BODY_DIAGONAL:
+        AddOffset(d, d, d, kind);
+        AddOffset(d, d, -d, kind);
+        AddOffset(d, -d, d, kind);
+        AddOffset(d, -d, -d, kind);
+        break;
+    }
+  }
+}
+
+void SpringTopology::AddOffset(int di, int dj, int dk, int kind) {
+  // canonical form: the first nonzero component is positive
+  if (di < 0 || (di == 0 && (dj < 0 || (dj == 0 && dk < 0)))) {
+    di = -di;
+    dj = -dj;
+    dk = -dk;
+  }
+  if (di == 0 && dj == 0 && dk == 0) return;
+
+  for (unsigned int i = 0; i < m_offsets.size(); i++) {
+    const Offset& o = m_offsets[i];
+    if (o.m_di == di && o.m_dj == dj && o.m_dk == dk) return;
+  }
+  m_offsets.push_back(Offset(di, dj, dk, kind));
+}
+
+const std::vector<SpringTopology::Offset>& SpringTopology::GetOffsets() const {
+  return m_offsets;
+}
+
+void SpringTopology::AddSpring(int kind, int p1, int p2, double restLen) {
+  m_p1.push_back(p1);
+  m_p2.push_back(p2);
+  m_restLen.push_back(restLen);
+  m_kind.push_back((unsigned char) kind);
+}
+
+void SpringTopology::BuildAdjacency(int numParticles) {
+  int numSprings = GetSpringCount();
+
+  // count the springs on each particle, then place them in spring order
+  m_adjStart.assign(numParticles+1, 0);
+  for (int s = 0; s < numSprings; s++) {
+    m_adjStart[m_p1[s]+1]++;
+    m_adjStart[m_p2[s]+1]++;
+  }
+  for (int n = 0; n < numParticles; n++) {
+    m_adjStart[n+1] += m_adjStart[n];
+  }
+
+  std::vector<int> next(m_adjStart.begin(), m_adjStart.end()-1);
+  m_adjSpring.resize(2*numSprings);
+  for (int s = 0; s < numSprings; s++) {
+    m_adjSpring[next[m_p1[s]]++] = s;
+    m_adjSpring[next[m_p2[s]]++] = s;
+  }
+}
+
+int SpringTopology::GetSpringCount() const {
+  return (int) m_p1.size();
+}
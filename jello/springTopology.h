@@ -0,0 +1,73 @@
+#ifndef springTopology_H_
+#define springTopology_H_
+
+#include <vector>
+
+// Springs of a particle lattice, stored as flat arrays: the two endpoint
+// indices, the rest length and a small index into a table of spring kinds
+// holding the coefficients and draw type.  A spring takes 17 bytes instead
+// of a full object with its own Ks and Kd.
+//
+// The springs are generated from a stencil: each kind contributes lattice
+// offsets (axis neighbors, face diagonals or body diagonals) out to its
+// own radius.  Offsets are kept in canonical form, pointing into the
+// positive half space, and an offset claimed by an earlier kind is not
+// added again, so every pair of particles gets at most one spring.
+class SpringTopology {
+  public:
+    enum Stencil {
+      AXIS,           // (d,0,0), (0,d,0), (0,0,d)
+      FACE_DIAGONAL,  // (d,+-d,0), (d,0,+-d), (0,d,+-d)
+      BODY_DIAGONAL   // (d,+-d,+-d)
+    };
+
+    class Offset {
+      public:
+        Offset(int di, int dj, int dk, int kind) : m_di(di), m_dj(dj), m_dk(dk), m_kind(kind) {}
+        int m_di, m_dj, m_dk;
+        int m_kind;
+    };
+
+    SpringTopology();
+
+    // Drops all kinds, offsets and springs.
+    void Clear();
+
+    // Adds a kind of spring and returns its index in the kind table.
+    int AddKind(unsigned int type, double Ks, double Kd);
+    // Adds the stencil's offsets with minRadius <= d <= maxRadius for kind.
+    void AddOffsets(int kind, Stencil stencil, int minRadius, int maxRadius);
+    const std::vector<Offset>& GetOffsets() const;
+
+    void AddSpring(int kind, int p1, int p2, double restLen);
+    int GetSpringCount() const;
+
+    // JelloMesh::SpringType of a spring, for drawing
+    unsigned int GetType(int spring) const { return m_kindType[m_kind[spring]]; }
+
+    // Rebuilds the per-particle spring lists once all springs are added.
+    // The springs of particle n are m_adjSpring[m_adjStart[n]] up to
+    // m_adjSpring[m_adjStart[n+1]-1], in increasing spring order.
+    void BuildAdjacency(int numParticles);
+
+    // kind table
+    std::vector<unsigned int> m_kindType;
+    std::vector<double> m_kindKs;
+    std::vector<double> m_kindKd;
+
+    // per spring
+    std::vector<int> m_p1;
+    std::vector<int> m_p2;
+    std::vector<double> m_restLen;
+    std::vector<unsigned char> m_kind;
+
+    std::vector<int> m_adjStart;
+    std::vector<int> m_adjSpring;
+
+  protected:
+    void AddOffset(int di, int dj, int dk, int kind);
+
+    std::vector<Offset> m_offsets;
+};
+
+#endif
@@ -0,0 +1,210 @@
+// Advection accuracy against cost.
+// Spins a slotted ball of density (Zalesak's disk, extruded along y) one
+// full turn in a rigid rotation about the y axis, using MACGrid's own
+// advectDensity, and compares what comes back with the field it started
+// from.  The same setup runs at every grid size and advection scheme asked
+// for, with the number of steps scaled to the size so every run sees the
+// same CFL number, so a row at 64^3 and a row at 128^3 describe the same
+// motion at two resolutions.
+//
+//   smoke_advection -sizes 64,128 -schemes semi-lagrangian,maccormack
+//
+// For each run it prints
+//   error      sum |d - d0| / sum d0, the fraction of the density out of place
+//   peak       largest density left (starts at 1)
+//   sharpness  sum |grad d|^2 relative to the start, how much edge survives
+// and the time per step and per turn.
+
+#include "mac_grid.h"
+#include "constants.h"
+#include "custom_output.h"
+#include <chrono>
+#include <string>
+#include <vector>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#undef max
+#undef min
+#include <algorithm>
+
+static double secondsNow()
+{
+   using namespace std::chrono;
+   return duration_cast<duration<double> >(steady_clock::now().time_since_epoch()).count();
+}
+
+static void usage()
+{
+   PRINT_LINE("usage: smoke_advection [options]\n"
+      "  -sizes LIST           comma separated grid sizes n, each run on n^3 (default 32,64,128)\n"
+      "  -schemes LIST         advection schemes: semi-lagrangian, maccormack, bfecc (default all)\n"
+      "  -cfl C                largest cells moved per step at the edge of the disk (default 1)");
+}
+
+// Face samples along each axis, in storage order.
+#define FOR_X for (int j = 0; j < theDim[Y]; j++) for (int k = 0; k < theDim[Z]; k++) for (int i = 0; i <= theDim[X]; i++)
+#define FOR_Y for (int j = 0; j <= theDim[Y]; j++) for (int k = 0; k < theDim[Z]; k++) for (int i = 0; i < theDim[X]; i++)
+#define FOR_Z for (int j = 0; j < theDim[Y]; j++) for (int k = 0; k <= theDim[Z]; k++) for (int i = 0; i < theDim[X]; i++)
+
+// Exposes the density and velocity fields for the test setup.
+class AdvectionGrid : public MACGrid
+{
+public:
+   // Rotation about the y axis through the center of the grid, one turn in
+   // `steps` steps, and the slotted disk in the density.
+   void setup(int steps)
+   {
+      double cx = 0.5 * theDim[X] * theCellSize;
+      double cz = 0.5 * theDim[Z] * theCellSize;
+      double omega = 2.0 * M_PI / (steps * theTimeStep);
+      FOR_X { mU(i,j,k) = -omega * ((k + 0.5) * theCellSize - cz); }
+      FOR_Y { mV(i,j,k) = 0.0; }
+      FOR_Z { mW(i,j,k) = omega * ((i + 0.5) * theCellSize - cx); }
+
+      for (int j = 0; j < theDim[Y]; j++)
+         for (int k = 0; k < theDim[Z]; k++)
+            for (int i = 0; i < theDim[X]; i++)
+               mD(i,j,k) = disk(i, k);
+      mInitial = mD.data();
+   }
+
+   // A disk of radius 0.15 n a quarter of the grid from the center, with a
+   // slot 0.05 n wide cut towards the center.
+   double disk(int i, int k) const
+   {
+      double n = theDim[X];
+      double x = (i + 0.5) / n, z = (k + 0.5) / n;
+      double dx = x - 0.5, dz = z - 0.75;
+      if (dx * dx + dz * dz > 0.15 * 0.15) return 0.0;
+      if (fabs(dx) < 0.025 && z < 0.85) return 0.0;
+      return 1.0;
+   }
+
+   void compare(double& error, double& peak, double& sharpness) const
+   {
+      const GridData::Storage& d = mD.data();
+      double diff = 0.0, mass = 0.0;
+      peak = 0.0;
+      for (size_t n = 0; n < d.size(); n++)
+      {
+         diff += fabs(d[n] - mInitial[n]);
+         mass += mInitial[n];
+         peak = std::max(peak, d[n]);
+      }
+      error = diff / std::max(mass, 1e-300);
+      sharpness = gradientEnergy(d) / std::max(gradientEnergy(mInitial), 1e-300);
+   }
+
+   void advect() { advectDensity(theTimeStep); }
+
+protected:
+   // Sum of squared central differences in the x-z plane over interior cells.
+   static double gradientEnergy(const GridData::Storage& d)
+   {
+      int nx = theDim[X], nz = theDim[Z];
+      double sum = 0.0;
+      for (int j = 0; j < theDim[Y]; j++)
+         for (int k = 1; k < nz - 1; k++)
+            for (int i = 1; i < nx - 1; i++)
+            {
+               size_t n = i + (size_t) k * nx + (size_t) j * nx * nz;
+               double gx = 0.5 * (d[n + 1] - d[n - 1]);
+               double gz = 0.5 * (d[n + nx] - d[n - nx]);
+               sum += gx * gx + gz * gz;
+            }
+      return sum;
+   }
+
+   GridData::Storage mInitial;
+};
+
+static bool parseSizes(const char* text, std::vector<int>& sizes)
+{
+   sizes.clear();
+   std::string list(text);
+   size_t start = 0;
+   while (start <= list.size())
+   {
+      size_t end = list.find(',', start);
+      if (end == std::string::npos) end = list.size();
+      int n = atoi(list.substr(start, end - start).c_str());
+      if (n < 8) return false;
+      sizes.push_back(n);
+      start = end + 1;
+   }
+   return !sizes.empty();
+}
+
+static bool parseSchemes(const char* text, std::vector<MACGrid::AdvectionScheme>& schemes)
+{
+   schemes.clear();
+   std::string list(text);
+   size_t start = 0;
+   while (start <= list.size())
+   {
+      size_t end = list.find(',', start);
+      if (end == std::string::npos) end = list.size();
+      MACGrid::AdvectionScheme scheme;
+      if (!MACGrid::parseAdvection(list.substr(start, end - start).c_str(), scheme)) return false;
+      schemes.push_back(scheme);
+      start = end + 1;
+   }
+   return !schemes.empty();
+}
+
+int main(int argc, char **argv)
+{
+   std::vector<int> sizes;
+   sizes.push_back(32);
+   sizes.push_back(64);
+   sizes.push_back(128);
+   std::vector<MACGrid::AdvectionScheme> schemes;
+   schemes.push_back(MACGrid::SEMI_LAGRANGIAN);
+   schemes.push_back(MACGrid::MACCORMACK);
+   schemes.push_back(MACGrid::BFECC);
+   double cfl = 1.0;
+
+   for (int a = 1; a < argc; a++)
+   {
+      bool hasValue = a + 1 < argc;
+      if (!strcmp(argv[a], "-sizes") && hasValue && parseSizes(argv[++a], sizes)) {}
+      else if (!strcmp(argv[a], "-schemes") && hasValue && parseSchemes(argv[++a], schemes)) {}
+      else if (!strcmp(argv[a], "-cfl") && hasValue && (cfl = atof(argv[++a])) > 0.0) {}
+      else
+      {
+         usage();
+         return 1;
+      }
+   }
+
+   printf("%6s %-16s %6s %10s %10s %10s %8s %10s\n", "n", "scheme", "steps", "ms/step", "s/turn",
+      "error", "peak", "sharpness");
+   for (size_t s = 0; s < sizes.size(); s++)
+   {
+      int n = sizes[s];
+      // The disk's outer edge sits 0.4 n from the axis.
+      int steps = (int) ceil(2.0 * M_PI * 0.4 * n / cfl);
+      setGridDim(n, n, n);
+      for (size_t m = 0; m < schemes.size(); m++)
+      {
+         AdvectionGrid grid;
+         MACGrid::Parameters params;
+         params.advection = schemes[m];
+         grid.setParameters(params);
+         grid.setup(steps);
+
+         double start = secondsNow();
+         for (int step = 0; step < steps; step++) grid.advect();
+         double seconds = secondsNow() - start;
+
+         double error, peak, sharpness;
+         grid.compare(error, peak, sharpness);
+         printf("%6d %-16s %6d %10.2f %10.2f %10.4f %8.4f %10.4f\n", n, MACGrid::advectionName(schemes[m]),
+            steps, 1000.0 * seconds / steps, seconds, error, peak, sharpness);
+         fflush(stdout);
+      }
+   }
+   return 0;
+}
@@ -6,9 +6,13 @@
 
 const int theMillisecondsPerFrame = 10;
 
+// Simulation time per SmokeSim::step():
+const double theTimeStep = 0.04;
+//const double theTimeStep = 0.1;
+
 #ifdef _DEBUG
 //const int theDim[3] = {2, 2, 1};
-const int theDim[3] = {20, 20, 1};
+int theDim[3] = {20, 20, 1};
 #else
 //const int theDim[3] = {12, 12, 4};
 //const int theDim[3] = {2, 2, 1};
@@ -17,9 +21,16 @@ const int theDim[3] = {20, 20, 1};
 //const int theDim[3] = {4, 4, 1};
 //const int theDim[3] = {14, 14, 1};
 //const int theDim[3] = {40,40,1};
-const int theDim[3] = {40,40,20};
+int theDim[3] = {40,40,20};
 #endif
 
+void setGridDim(int x, int y, int z)
+{
+   theDim[0] = x;
+   theDim[1] = y;
+   theDim[2] = z;
+}
+
 //const double theCellSize = 0.5;
 const double theCellSize = 1.0;
 
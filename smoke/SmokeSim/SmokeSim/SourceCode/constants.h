@@ -12,7 +12,8 @@
 // Don't try to modify the values of these here.
 // Modify the values of these in constants.cpp instead.
 extern const int theMillisecondsPerFrame;
-extern const int theDim[3];
+extern const double theTimeStep;
+extern int theDim[3];
 extern const double theCellSize;
 extern const double fluidDensity;
 extern const double buoyAlpha;
@@ -22,4 +23,9 @@ extern const double Tmin;
 extern const double Tmax; 
 extern const double vorticityEpsilon; 
 
+// theDim starts out as the size compiled into constants.cpp.  Tools that
+// work at several sizes in one process (smoke_bench) change it here before
+// creating any grid; grids created earlier must not be used afterwards.
+void setGridDim(int x, int y, int z);
+
 #endif
@@ -0,0 +1,742 @@
+#include "distributed_grid.h"
+#include "constants.h"
+#include "custom_output.h"
+#include <math.h>
+#include <string.h>
+#undef max
+#undef min
+#include <algorithm>
+
+// Cells a backtrace can cross beyond the CFL distance: the trilinear
+// stencil's second sample, the velocity lookup around the start point, and
+// the vorticity stencil (velocity -> vorticity -> its gradient -> face force).
+static const int MIN_HALO = 4;
+
+SlabField::SlabField() :
+   mKind(CENTER), mRowBegin(0), mRowEnd(0), mHalo(0), mHaloMisses(0)
+{
+   mDim[0] = mDim[1] = mDim[2] = 0;
+   mSize[0] = mSize[1] = mSize[2] = 0;
+}
+
+void SlabField::allocate(Kind kind, const int globalDim[3], int rowBegin, int rowEnd, int halo)
+{
+   mKind = kind;
+   for (int d = 0; d < 3; d++)
+   {
+      mDim[d] = globalDim[d];
+      mSize[d] = globalDim[d] + ((int) kind == d + 1? 1 : 0);
+      mMax[d] = theCellSize*mSize[d];
+      // GridData samples sit at cell centers, face grids on their faces.
+      mOffset[d] = ((int) kind == d + 1)? 0.0 : theCellSize*0.5;
+   }
+   mRowBegin = rowBegin;
+   mRowEnd = rowEnd;
+   mHalo = halo;
+   mHaloMisses = 0;
+   int rows = rowEnd - rowBegin + 2*halo + (kind == FACE_Y? 1 : 0);
+   mData.assign((size_t) rows*getRowSize(), 0.0);
+}
+
+void SlabField::setHalo(int halo)
+{
+   SlabField grown;
+   grown.allocate(mKind, mDim, mRowBegin, mRowEnd, halo);
+   int owned = ownedEnd() - mRowBegin;
+   memcpy(grown.row(mRowBegin), row(mRowBegin), (size_t) owned*getRowSize()*sizeof(double));
+   grown.mHaloMisses = mHaloMisses;
+   std::swap(*this, grown);
+}
+
+void SlabField::fill(double value)
+{
+   std::fill(mData.begin(), mData.end(), value);
+}
+
+int SlabField::ownedEnd() const
+{
+   return (mKind == FACE_Y && mRowEnd == mDim[1])? mRowEnd + 1 : mRowEnd;
+}
+
+double SlabField::get(int i, int j, int k) const
+{
+   const int nx = mDim[0], ny = mDim[1], nz = mDim[2];
+   switch (mKind)
+   {
+   case CENTER:
+      if (i < 0 || j < 0 || k < 0 || i > nx-1 || j > ny-1 || k > nz-1) return 0.0;
+      break;
+   case FACE_X:
+      if (i < 0 || i > nx) return 0.0;
+      j = std::min(std::max(j, 0), ny-1);
+      k = std::min(std::max(k, 0), nz-1);
+      break;
+   case FACE_Y:
+      if (j < 0 || j > ny) return 0.0;
+      i = std::min(std::max(i, 0), nx-1);
+      k = std::min(std::max(k, 0), nz-1);
+      break;
+   case FACE_Z:
+      if (k < 0 || k > nz) return 0.0;
+      i = std::min(std::max(i, 0), nx-1);
+      j = std::min(std::max(j, 0), ny-1);
+      break;
+   }
+
+   int stored = (int) (mData.size() / getRowSize());
+   int r = j - mRowBegin + mHalo;
+   if (r < 0 || r >= stored)
+   {
+      mHaloMisses++;
+      r = std::min(std::max(r, 0), stored-1);
+   }
+   return mData[i + k*mSize[0] + r*getRowSize()];
+}
+
+double SlabField::interpolate(const vec3& pt) const
+{
+   // Step for step GridData::interpolate, so results match the serial grid exactly.
+   vec3 pos;
+   pos[0] = std::min(std::max(0.0, pt[0] - mOffset[0]), mMax[0]);
+   pos[1] = std::min(std::max(0.0, pt[1] - mOffset[1]), mMax[1]);
+   pos[2] = std::min(std::max(0.0, pt[2] - mOffset[2]), mMax[2]);
+
+   int i = (int) (pos[0]/theCellSize);
+   int j = (int) (pos[1]/theCellSize);
+   int k = (int) (pos[2]/theCellSize);
+
+   double scale = 1.0/theCellSize;
+   double fractx = scale*(pos[0] - i*theCellSize);
+   double fracty = scale*(pos[1] - j*theCellSize);
+   double fractz = scale*(pos[2] - k*theCellSize);
+
+   double tmp1 = get(i,j,k);
+   double tmp2 = get(i,j+1,k);
+   double tmp3 = get(i+1,j,k);
+   double tmp4 = get(i+1,j+1,k);
+   double tmp5 = get(i,j,k+1);
+   double tmp6 = get(i,j+1,k+1);
+   double tmp7 = get(i+1,j,k+1);
+   double tmp8 = get(i+1,j+1,k+1);
+
+   double tmp12 = LERP(tmp1, tmp2, fracty);
+   double tmp34 = LERP(tmp3, tmp4, fracty);
+   double tmp56 = LERP(tmp5, tmp6, fracty);
+   double tmp78 = LERP(tmp7, tmp8, fracty);
+   double tmp1234 = LERP (tmp12, tmp34, fractx);
+   double tmp5678 = LERP (tmp56, tmp78, fractx);
+   return LERP(tmp1234, tmp5678, fractz);
+}
+
+/////////////////////////////////////////////////////////////////////
+
+DistributedGrid::DistributedGrid(MPI_Comm comm, const int globalDim[3]) :
+   mComm(comm), mPreconditioned(true)
+{
+   MPI_Comm_rank(comm, &mRank);
+   MPI_Comm_size(comm, &mNumRanks);
+   for (int d = 0; d < 3; d++) mDim[d] = globalDim[d];
+
+   // Even split of the y rows; the first ranks take the remainder.
+   mRowBegin = (int) ((long long) mRank * mDim[1] / mNumRanks);
+   mRowEnd = (int) ((long long) (mRank + 1) * mDim[1] / mNumRanks);
+   mMinRows = mDim[1] / mNumRanks;
+   if (mMinRows <= MIN_HALO)
+   {
+      if (mRank == 0)
+      {
+         PRINT_LINE("A " << mDim[1] << " row grid is too thin for " << mNumRanks
+            << " ranks: every slab needs more than " << MIN_HALO << " rows");
+      }
+      MPI_Abort(comm, 1);
+   }
+
+   allocateFields(MIN_HALO);
+   buildPreconditioner();
+   reset();
+}
+
+void DistributedGrid::setPreconditioner(bool on)
+{
+   mPreconditioned = on;
+}
+
+void DistributedGrid::allocateFields(int halo)
+{
+   SlabField* centered[] = { &mP, &mD, &mT, &mNewScalar, &mWX, &mWY, &mWZ, &mFX, &mFY, &mFZ };
+   for (int n = 0; n < (int) (sizeof(centered)/sizeof(centered[0])); n++)
+   {
+      centered[n]->allocate(SlabField::CENTER, mDim, mRowBegin, mRowEnd, halo);
+   }
+   mU.allocate(SlabField::FACE_X, mDim, mRowBegin, mRowEnd, halo);
+   mV.allocate(SlabField::FACE_Y, mDim, mRowBegin, mRowEnd, halo);
+   mW.allocate(SlabField::FACE_Z, mDim, mRowBegin, mRowEnd, halo);
+   mNewU.allocate(SlabField::FACE_X, mDim, mRowBegin, mRowEnd, halo);
+   mNewV.allocate(SlabField::FACE_Y, mDim, mRowBegin, mRowEnd, halo);
+   mNewW.allocate(SlabField::FACE_Z, mDim, mRowBegin, mRowEnd, halo);
+
+   // The matrix-vector product only reaches one row across.
+   SlabField* solver[] = { &mDiv, &mR, &mZ, &mS };
+   for (int n = 0; n < 4; n++) solver[n]->allocate(SlabField::CENTER, mDim, mRowBegin, mRowEnd, 1);
+}
+
+void DistributedGrid::reset()
+{
+   allocateFields(MIN_HALO);
+   memset(&mStats, 0, sizeof(mStats));
+   mStats.halo = MIN_HALO;
+}
+
+SlabField& DistributedGrid::field(Field f)
+{
+   switch (f)
+   {
+   case VELOCITY_X: return mU;
+   case VELOCITY_Y: return mV;
+   case VELOCITY_Z: return mW;
+   case PRESSURE: return mP;
+   case DENSITY: return mD;
+   default: return mT;
+   }
+}
+
+double DistributedGrid::allreduce(double value, MPI_Op op)
+{
+   double start = MPI_Wtime();
+   double result;
+   MPI_Allreduce(&value, &result, 1, MPI_DOUBLE, op, mComm);
+   mStats.reduceSeconds += MPI_Wtime() - start;
+   return result;
+}
+
+void DistributedGrid::exchange(SlabField& f, int rows)
+{
+   double start = MPI_Wtime();
+   int up = mRank + 1 < mNumRanks? mRank + 1 : MPI_PROC_NULL;
+   int down = mRank > 0? mRank - 1 : MPI_PROC_NULL;
+   int count = rows*f.getRowSize();
+   // A slab's upper halo of y faces includes the face on its top boundary.
+   int upperCount = (rows + (f.getKind() == SlabField::FACE_Y? 1 : 0))*f.getRowSize();
+
+   // Top owned rows go up and become the lower halo there.
+   MPI_Sendrecv(f.row(mRowEnd - rows), count, MPI_DOUBLE, up, 0,
+                f.row(mRowBegin - rows), count, MPI_DOUBLE, down, 0, mComm, MPI_STATUS_IGNORE);
+   // Bottom owned rows go down and become the upper halo there.
+   MPI_Sendrecv(f.row(mRowBegin), upperCount, MPI_DOUBLE, down, 1,
+                f.row(mRowEnd), upperCount, MPI_DOUBLE, up, 1, mComm, MPI_STATUS_IGNORE);
+
+   if (up != MPI_PROC_NULL) mStats.haloBytes += (long long) count*sizeof(double);
+   if (down != MPI_PROC_NULL) mStats.haloBytes += (long long) upperCount*sizeof(double);
+   mStats.exchangeSeconds += MPI_Wtime() - start;
+}
+
+double DistributedGrid::globalMaxVelocity()
+{
+   double local = 0.0;
+   SlabField* velocity[] = { &mU, &mV, &mW };
+   for (int c = 0; c < 3; c++)
+   {
+      SlabField& f = *velocity[c];
+      const double* p = f.row(f.ownedBegin());
+      size_t count = (size_t) (f.ownedEnd() - f.ownedBegin())*f.getRowSize();
+      for (size_t n = 0; n < count; n++) local = std::max(local, fabs(p[n]));
+   }
+   return allreduce(local, MPI_MAX);
+}
+
+void DistributedGrid::ensureHalo(double dt)
+{
+   // Trilinear lookups never exceed the largest stored speed, so a backtrace
+   // moves at most maxVelocity*dt; add the stencil around both of its ends.
+   double cfl = globalMaxVelocity() * dt / theCellSize;
+   int needed = std::max(MIN_HALO, (int) ceil(cfl) + 3);
+   if (needed <= mStats.halo) return;
+
+   if (needed >= mMinRows)
+   {
+      if (mRank == 0)
+      {
+         PRINT_LINE("CFL " << cfl << " needs " << needed << " halo rows but the thinnest slab has "
+            << mMinRows << "; use fewer ranks or a smaller time step");
+      }
+      MPI_Abort(mComm, 1);
+   }
+
+   SlabField* kept[] = { &mU, &mV, &mW, &mP, &mD, &mT };
+   for (int n = 0; n < 6; n++)
+   {
+      kept[n]->setHalo(needed);
+      exchange(*kept[n], needed);
+   }
+   SlabField* scratch[] = { &mNewU, &mNewV, &mNewW, &mNewScalar, &mWX, &mWY, &mWZ, &mFX, &mFY, &mFZ };
+   for (int n = 0; n < (int) (sizeof(scratch)/sizeof(scratch[0])); n++) scratch[n]->setHalo(needed);
+   mStats.halo = needed;
+}
+
+void DistributedGrid::setSource(SlabField& f, int i, int j, int k, double value)
+{
+   // Halo copies are set too, so neighbors see the source without an exchange.
+   if (j >= mRowBegin - f.getHalo() && j < mRowEnd + f.getHalo()) f.at(i,j,k) = value;
+}
+
+void DistributedGrid::updateSources()
+{
+   // Same sources as MACGrid::updateSources.
+   setSource(mD, 4,4,4, 1.0);
+   setSource(mD, 4,5,4, 1.0);
+   setSource(mD, 4,4,5, 1.0);
+   setSource(mD, 4,5,5, 1.0);
+   setSource(mT, 4,4,4, 100.0);
+   setSource(mT, 4,5,4, 100.0);
+   setSource(mT, 4,4,5, 100.0);
+   setSource(mT, 4,5,5, 100.0);
+
+   setSource(mU, 5,4,4, 4.0);
+   setSource(mU, 5,5,4, 4.0);
+   setSource(mU, 5,4,5, 4.0);
+   setSource(mU, 5,5,5, 4.0);
+}
+
+vec3 DistributedGrid::getVelocity(const vec3& pt) const
+{
+   vec3 vel;
+   vel[0] = mU.interpolate(pt);
+   vel[1] = mV.interpolate(pt);
+   vel[2] = mW.interpolate(pt);
+   return vel;
+}
+
+void DistributedGrid::step(double dt)
+{
+   double start = MPI_Wtime();
+   updateSources();
+   ensureHalo(dt);
+   advectVelocity(dt);
+   exchange(mU, mStats.halo);
+   exchange(mW, mStats.halo);
+   double forces = MPI_Wtime();
+   mStats.advectSeconds += forces - start;
+
+   computeBouyancy(dt);
+   exchange(mV, mStats.halo);
+   computeVorticityConfinement(dt);
+   exchange(mV, 1);
+   double projection = MPI_Wtime();
+   mStats.forceSeconds += projection - forces;
+
+   project(dt);
+   exchange(mU, mStats.halo);
+   exchange(mV, mStats.halo);
+   exchange(mW, mStats.halo);
+   double scalars = MPI_Wtime();
+   mStats.projectSeconds += scalars - projection;
+
+   ensureHalo(dt);
+   advectScalar(mT, dt);
+   advectScalar(mD, dt);
+   mStats.scalarSeconds += MPI_Wtime() - scalars;
+
+   mStats.haloMisses = mU.getHaloMisses() + mV.getHaloMisses() + mW.getHaloMisses() +
+      mD.getHaloMisses() + mT.getHaloMisses() + mFX.getHaloMisses() + mFY.getHaloMisses() +
+      mFZ.getHaloMisses();
+   mStats.steps++;
+}
+
+void DistributedGrid::advectVelocity(double dt) {
+  for (int j = mRowBegin; j < mNewU.ownedEnd(); j++)
+    for (int k = 0; k < mDim[2]; k++)
+      for (int i = 0; i < mDim[0]+1; i++) {
+        vec3 pt(i, j, k);
+        pt *= theCellSize;
+        pt[1] += 0.5 * theCellSize;
+        pt[2] += 0.5 * theCellSize;
+        vec3 bpt = pt - dt * getVelocity(pt);
+        mNewU.at(i,j,k) = mU.interpolate(bpt);
+      }
+
+  for (int j = mRowBegin; j < mNewV.ownedEnd(); j++)
+    for (int k = 0; k < mDim[2]; k++)
+      for (int i = 0; i < mDim[0]; i++) {
+        vec3 pt(i, j, k);
+        pt *= theCellSize;
+        pt[0] += 0.5 * theCellSize;
+        pt[2] += 0.5 * theCellSize;
+        vec3 bpt = pt - dt * getVelocity(pt);
+        mNewV.at(i,j,k) = mV.interpolate(bpt);
+      }
+
+  for (int j = mRowBegin; j < mNewW.ownedEnd(); j++)
+    for (int k = 0; k < mDim[2]+1; k++)
+      for (int i = 0; i < mDim[0]; i++) {
+        vec3 pt(i, j, k);
+        pt *= theCellSize;
+        pt[0] += 0.5 * theCellSize;
+        pt[1] += 0.5 * theCellSize;
+        vec3 bpt = pt - dt * getVelocity(pt);
+        mNewW.at(i,j,k) = mW.interpolate(bpt);
+      }
+
+  std::swap(mU, mNewU);
+  std::swap(mV, mNewV);
+  std::swap(mW, mNewW);
+}
+
+void DistributedGrid::computeBouyancy(double dt) {
+  double a = buoyAlpha;
+  double B = buoyBeta;
+
+  for (int j = mRowBegin; j < mV.ownedEnd(); j++) {
+    if (j == 0 || j == mDim[1]) {
+      // do not update boundary
+      continue;
+    }
+    for (int k = 0; k < mDim[2]; k++)
+      for (int i = 0; i < mDim[0]; i++) {
+        vec3 pt(i,j,k);
+        pt *= theCellSize;
+        pt[0] += 0.5 * theCellSize;
+        pt[2] += 0.5 * theCellSize;
+
+        double T = mT.interpolate(pt);
+        double s = mD.interpolate(pt);
+        double f = -a * s + B * (T - Tamb);
+        mV.at(i,j,k) = mV.at(i,j,k) + dt * f;
+      }
+  }
+}
+
+void DistributedGrid::computeVorticityConfinement(double dt) {
+  const int nx = mDim[0], ny = mDim[1], nz = mDim[2];
+  double xdim = theCellSize*nx;
+  double ydim = theCellSize*ny;
+  double zdim = theCellSize*nz;
+
+  // Face forces interpolate the cell forces one row beyond the slab, and
+  // those take the vorticity gradient another row out.
+  int wBegin = std::max(0, mRowBegin - 2), wEnd = std::min(ny, mRowEnd + 2);
+  int fBegin = std::max(0, mRowBegin - 1), fEnd = std::min(ny, mRowEnd + 1);
+
+  for (int j = wBegin; j < wEnd; j++)
+    for (int k = 0; k < nz; k++)
+      for (int i = 0; i < nx; i++) {
+        vec3 pt(i,j,k);
+        pt *= theCellSize;
+        pt += vec3(1.0,1.0,1.0)*(0.5*theCellSize);
+
+        vec3 ptIplus1 = pt;
+        ptIplus1[0] += 1.0 * theCellSize;
+        vec3 ptJplus1 = pt;
+        ptJplus1[1] += 1.0 * theCellSize;
+        vec3 ptKplus1 = pt;
+        ptKplus1[2] += 1.0 * theCellSize;
+        vec3 ptIminus1 = pt;
+        ptIminus1[0] -= 1.0 * theCellSize;
+        vec3 ptJminus1 = pt;
+        ptJminus1[1] -= 1.0 * theCellSize;
+        vec3 ptKminus1 = pt;
+        ptKminus1[2] -= 1.0 * theCellSize;
+
+        vec3 velIplus1 = getVelocity(ptIplus1);
+        vec3 velJplus1 = getVelocity(ptJplus1);
+        vec3 velKplus1 = getVelocity(ptKplus1);
+        vec3 velIminus1 = getVelocity(ptIminus1);
+        vec3 velJminus1 = getVelocity(ptJminus1);
+        vec3 velKminus1 = getVelocity(ptKminus1);
+
+        mWX.at(i,j,k) = ((velJplus1[2] - velJminus1[2]) - (velKplus1[1] - velKminus1[1])) / (2 * theCellSize);
+        mWY.at(i,j,k) = ((velKplus1[0] - velKminus1[0]) - (velIplus1[2] - velIminus1[2])) / (2 * theCellSize);
+        mWZ.at(i,j,k) = ((velIplus1[1] - velIminus1[1]) - (velJplus1[0] - velJminus1[0])) / (2 * theCellSize);
+      }
+
+  for (int j = fBegin; j < fEnd; j++)
+    for (int k = 0; k < nz; k++)
+      for (int i = 0; i < nx; i++) {
+        vec3 w(mWX.at(i,j,k), mWY.at(i,j,k), mWZ.at(i,j,k));
+
+        // at the edges of the grid, replicate the cell
+        vec3 wIplus1(w), wJplus1(w), wKplus1(w);
+        vec3 wIminus1(w), wJminus1(w), wKminus1(w);
+        if (i + 1 < xdim) wIplus1 = vec3(mWX.at(i+1,j,k), mWY.at(i+1,j,k), mWZ.at(i+1,j,k));
+        if (j + 1 < ydim) wJplus1 = vec3(mWX.at(i,j+1,k), mWY.at(i,j+1,k), mWZ.at(i,j+1,k));
+        if (k + 1 < zdim) wKplus1 = vec3(mWX.at(i,j,k+1), mWY.at(i,j,k+1), mWZ.at(i,j,k+1));
+        if (i - 1 >= 0) wIminus1 = vec3(mWX.at(i-1,j,k), mWY.at(i-1,j,k), mWZ.at(i-1,j,k));
+        if (j - 1 >= 0) wJminus1 = vec3(mWX.at(i,j-1,k), mWY.at(i,j-1,k), mWZ.at(i,j-1,k));
+        if (k - 1 >= 0) wKminus1 = vec3(mWX.at(i,j,k-1), mWY.at(i,j,k-1), mWZ.at(i,j,k-1));
+
+        double gwX = ((fabs(wIplus1[0]) + fabs(wIplus1[1]) + fabs(wIplus1[2])) - (fabs(wIminus1[0]) + fabs(wIminus1[1]) + fabs(wIminus1[2]))) / (2*theCellSize);
+        double gwY = ((fabs(wJplus1[0]) + fabs(wJplus1[1]) + fabs(wJplus1[2])) - (fabs(wJminus1[0]) + fabs(wJminus1[1]) + fabs(wJminus1[2]))) / (2*theCellSize);
+        double gwZ = ((fabs(wKplus1[0]) + fabs(wKplus1[1]) + fabs(wKplus1[2])) - (fabs(wKminus1[0]) + fabs(wKminus1[1]) + fabs(wKminus1[2]))) / (2*theCellSize);
+
+        vec3 gw(gwX, gwY, gwZ);
+        double div = gw.Length() + 10e-20;
+        vec3 n(gwX / div, gwY / div, gwZ / div);
+        vec3 fconf = vorticityEpsilon * (n ^ w);
+
+        mFX.at(i,j,k) = fconf[0];
+        mFY.at(i,j,k) = fconf[1];
+        mFZ.at(i,j,k) = fconf[2];
+      }
+
+  // Only interior faces get the force.
+  for (int j = mRowBegin; j < mU.ownedEnd(); j++)
+    for (int k = 0; k < nz; k++)
+      for (int i = 1; i < xdim; i++) {
+        vec3 pt(i,j,k);
+        pt *= theCellSize;
+        pt += vec3(0.0,1.0,1.0) * (0.5*theCellSize);
+        mU.at(i,j,k) = mU.at(i,j,k) + dt * mFX.interpolate(pt);
+      }
+
+  for (int j = std::max(1, mRowBegin); j < mV.ownedEnd() && j < ydim; j++)
+    for (int k = 0; k < nz; k++)
+      for (int i = 0; i < nx; i++) {
+        vec3 pt(i,j,k);
+        pt *= theCellSize;
+        pt += vec3(1.0,0.0,1.0) * (0.5*theCellSize);
+        mV.at(i,j,k) = mV.at(i,j,k) + dt * mFY.interpolate(pt);
+      }
+
+  for (int j = mRowBegin; j < mW.ownedEnd(); j++)
+    for (int k = 1; k < zdim; k++)
+      for (int i = 0; i < nx; i++) {
+        vec3 pt(i,j,k);
+        pt *= theCellSize;
+        pt += vec3(1.0,1.0,0.0) * (0.5*theCellSize);
+        mW.at(i,j,k) = mW.at(i,j,k) + dt * mFZ.interpolate(pt);
+      }
+}
+
+void DistributedGrid::project(double dt) {
+  const int nx = mDim[0], ny = mDim[1], nz = mDim[2];
+
+  // d(i,j,k) = -((rho)*(dx^2)/dt) * (change in total velocities)
+  double c = -1.0 * fluidDensity * theCellSize * theCellSize / dt;
+  for (int j = mRowBegin; j < mRowEnd; j++)
+    for (int k = 0; k < nz; k++)
+      for (int i = 0; i < nx; i++) {
+        double u = (mU.at(i+1,j,k) - mU.at(i,j,k)) / theCellSize;
+        double v = (mV.at(i,j+1,k) - mV.at(i,j,k)) / theCellSize;
+        double w = (mW.at(i,j,k+1) - mW.at(i,j,k)) / theCellSize;
+        mDiv.at(i,j,k) = c * (u + v + w);
+      }
+
+  conjugateGradient(mP, mDiv, 100000, 0.00001);
+  exchange(mP, 1);
+
+  // vn = v - dt * (1/rho) * dP on interior faces
+  for (int j = mRowBegin; j < mRowEnd; j++)
+    for (int k = 0; k < nz; k++)
+      for (int i = 1; i < nx; i++)
+        mU.at(i,j,k) = mU.at(i,j,k) - dt * (mP.at(i,j,k) - mP.at(i-1,j,k));
+
+  for (int j = std::max(1, mRowBegin); j < std::min(ny, mRowEnd); j++)
+    for (int k = 0; k < nz; k++)
+      for (int i = 0; i < nx; i++)
+        mV.at(i,j,k) = mV.at(i,j,k) - dt * (mP.at(i,j,k) - mP.at(i,j-1,k));
+
+  for (int j = mRowBegin; j < mRowEnd; j++)
+    for (int k = 1; k < nz; k++)
+      for (int i = 0; i < nx; i++)
+        mW.at(i,j,k) = mW.at(i,j,k) - dt * (mP.at(i,j,k) - mP.at(i,j,k-1));
+}
+
+bool DistributedGrid::conjugateGradient(SlabField& p, const SlabField& d, int maxIterations, double tolerance) {
+  // MACGrid::conjugateGradient over the slab; the scaled adds are fused
+  // but do the same arithmetic.
+  const int rowSize = mDim[0]*mDim[2];
+  const size_t count = (size_t) (mRowEnd - mRowBegin) * rowSize;
+  double* pp = p.row(mRowBegin);
+  double* r = mR.row(mRowBegin);
+  double* z = mZ.row(mRowBegin);
+  double* s = mS.row(mRowBegin);
+  const double* dd = const_cast<SlabField&>(d).row(mRowBegin);
+
+  for (size_t n = 0; n < count; n++) {
+    pp[n] = 0.0;
+    r[n] = dd[n];
+    z[n] = 1.0 * r[n];
+  }
+  if (mPreconditioned) applyPreconditioner(mR, mZ);
+  for (size_t n = 0; n < count; n++) s[n] = 1.0 * z[n];
+
+  double sigma = dotProduct(mZ, mR);
+
+  for (int iteration = 0; iteration < maxIterations; iteration++) {
+
+    double rho = sigma;
+
+    apply(mS, mZ);
+
+    double alpha = rho/dotProduct(mZ, mS);
+
+    for (size_t n = 0; n < count; n++) {
+      pp[n] = pp[n] + alpha * s[n];
+      r[n] = r[n] - alpha * z[n];
+    }
+
+    if (maxMagnitude(mR) <= tolerance) {
+      mStats.cgIterations += iteration + 1;
+      return true;
+    }
+
+    if (mPreconditioned) applyPreconditioner(mR, mZ);
+    else for (size_t n = 0; n < count; n++) z[n] = 1.0 * r[n];
+
+    double sigmaNew = dotProduct(mZ, mR);
+
+    double beta = sigmaNew / rho;
+
+    for (size_t n = 0; n < count; n++) s[n] = z[n] + beta * s[n];
+
+    sigma = sigmaNew;
+  }
+
+  mStats.cgIterations += maxIterations;
+  if (mRank == 0) PRINT_LINE( "PCG didn't converge!" );
+  return false;
+}
+
+// Preconditioner entry of an owned cell, and the -1 couplings to the next
+// cell along i, j and k inside the slab (0 past its edge).
+#define PRECON(i,j,k) mPrecon[(i) + (k)*nx + ((j) - mRowBegin)*nx*nz]
+#define PLUS_I(i,j,k) ((i)+1 < nx? -1.0 : 0.0)
+#define PLUS_J(i,j,k) ((j)+1 < mRowEnd? -1.0 : 0.0)
+#define PLUS_K(i,j,k) ((k)+1 < nz? -1.0 : 0.0)
+
+void DistributedGrid::buildPreconditioner() {
+  // MIC(0) of the slab's diagonal block of A.  Cells are ordered as stored,
+  // i fastest, then k, then j; couplings across the slab's edges are left
+  // out, but the diagonal keeps them, so the block stays positive definite.
+  const int nx = mDim[0], ny = mDim[1], nz = mDim[2];
+  const double tau = 0.97;    // modification
+  const double sigma = 0.25;  // safety against a tiny diagonal
+  mPrecon.assign((size_t) (mRowEnd - mRowBegin) * nx * nz, 0.0);
+
+  for (int j = mRowBegin; j < mRowEnd; j++)
+    for (int k = 0; k < nz; k++)
+      for (int i = 0; i < nx; i++) {
+        double diag = (i > 0) + (i+1 < nx) + (j > 0) + (j+1 < ny) + (k > 0) + (k+1 < nz);
+        double e = diag;
+        if (i > 0) {
+          double a = PLUS_I(i-1,j,k) * PRECON(i-1,j,k);
+          e -= a*a + tau * PLUS_I(i-1,j,k) * (PLUS_J(i-1,j,k) + PLUS_K(i-1,j,k))
+            * PRECON(i-1,j,k) * PRECON(i-1,j,k);
+        }
+        if (j > mRowBegin) {
+          double a = PLUS_J(i,j-1,k) * PRECON(i,j-1,k);
+          e -= a*a + tau * PLUS_J(i,j-1,k) * (PLUS_I(i,j-1,k) + PLUS_K(i,j-1,k))
+            * PRECON(i,j-1,k) * PRECON(i,j-1,k);
+        }
+        if (k > 0) {
+          double a = PLUS_K(i,j,k-1) * PRECON(i,j,k-1);
+          e -= a*a + tau * PLUS_K(i,j,k-1) * (PLUS_I(i,j,k-1) + PLUS_J(i,j,k-1))
+            * PRECON(i,j,k-1) * PRECON(i,j,k-1);
+        }
+        if (e < sigma * diag) e = diag;
+        PRECON(i,j,k) = e > 0.0? 1.0 / sqrt(e) : 0.0;
+      }
+}
+
+void DistributedGrid::applyPreconditioner(const SlabField& r, SlabField& z) {
+  // z = (L L^T)^-1 r: forward substitution into z, then backward in place.
+  const int nx = mDim[0], nz = mDim[2];
+  for (int j = mRowBegin; j < mRowEnd; j++)
+    for (int k = 0; k < nz; k++)
+      for (int i = 0; i < nx; i++) {
+        double t = r.at(i,j,k);
+        if (i > 0) t -= PLUS_I(i-1,j,k) * PRECON(i-1,j,k) * z.at(i-1,j,k);
+        if (j > mRowBegin) t -= PLUS_J(i,j-1,k) * PRECON(i,j-1,k) * z.at(i,j-1,k);
+        if (k > 0) t -= PLUS_K(i,j,k-1) * PRECON(i,j,k-1) * z.at(i,j,k-1);
+        z.at(i,j,k) = t * PRECON(i,j,k);
+      }
+
+  for (int j = mRowEnd - 1; j >= mRowBegin; j--)
+    for (int k = nz - 1; k >= 0; k--)
+      for (int i = nx - 1; i >= 0; i--) {
+        double t = z.at(i,j,k);
+        if (i+1 < nx) t -= PLUS_I(i,j,k) * PRECON(i,j,k) * z.at(i+1,j,k);
+        if (j+1 < mRowEnd) t -= PLUS_J(i,j,k) * PRECON(i,j,k) * z.at(i,j+1,k);
+        if (k+1 < nz) t -= PLUS_K(i,j,k) * PRECON(i,j,k) * z.at(i,j,k+1);
+        z.at(i,j,k) = t * PRECON(i,j,k);
+      }
+}
+
+#undef PRECON
+#undef PLUS_I
+#undef PLUS_J
+#undef PLUS_K
+
+double DistributedGrid::dotProduct(const SlabField& a, const SlabField& b) {
+  const size_t count = (size_t) (mRowEnd - mRowBegin) * mDim[0]*mDim[2];
+  const double* x = const_cast<SlabField&>(a).row(mRowBegin);
+  const double* y = const_cast<SlabField&>(b).row(mRowBegin);
+  double result = 0.0;
+  for (size_t n = 0; n < count; n++) result += x[n] * y[n];
+  return allreduce(result, MPI_SUM);
+}
+
+double DistributedGrid::maxMagnitude(const SlabField& a) {
+  const size_t count = (size_t) (mRowEnd - mRowBegin) * mDim[0]*mDim[2];
+  const double* x = const_cast<SlabField&>(a).row(mRowBegin);
+  double result = 0.0;
+  for (size_t n = 0; n < count; n++) {
+    double m = fabs(x[n]);
+    if (m > result) result = m;
+  }
+  return allreduce(result, MPI_MAX);
+}
+
+void DistributedGrid::apply(SlabField& x, SlabField& result) {
+  // The A matrix of an obstacle-free box, in MACGrid::apply's term order:
+  // diagonal = number of neighbors inside the grid, -1 for each of them.
+  const int nx = mDim[0], ny = mDim[1], nz = mDim[2];
+  exchange(x, 1);
+
+  for (int j = mRowBegin; j < mRowEnd; j++)
+    for (int k = 0; k < nz; k++)
+      for (int i = 0; i < nx; i++) {
+        int diag = (i > 0) + (i+1 < nx) + (j > 0) + (j+1 < ny) + (k > 0) + (k+1 < nz);
+        double sum = diag * x.at(i,j,k);
+        if (i+1 < nx) sum += -1.0 * x.at(i+1,j,k);
+        if (j+1 < ny) sum += -1.0 * x.at(i,j+1,k);
+        if (k+1 < nz) sum += -1.0 * x.at(i,j,k+1);
+        if (i > 0) sum += -1.0 * x.at(i-1,j,k);
+        if (j > 0) sum += -1.0 * x.at(i,j-1,k);
+        if (k > 0) sum += -1.0 * x.at(i,j,k-1);
+        result.at(i,j,k) = sum;
+      }
+}
+
+void DistributedGrid::advectScalar(SlabField& scalar, double dt) {
+  for (int j = mRowBegin; j < mRowEnd; j++)
+    for (int k = 0; k < mDim[2]; k++)
+      for (int i = 0; i < mDim[0]; i++) {
+        vec3 pt(i, j, k);
+        pt *= theCellSize;
+        pt[0] += 0.5 * theCellSize;
+        pt[1] += 0.5 * theCellSize;
+        pt[2] += 0.5 * theCellSize;
+        vec3 bpt = pt - dt * getVelocity(pt);
+        mNewScalar.at(i,j,k) = scalar.interpolate(bpt);
+      }
+  std::swap(scalar, mNewScalar);
+  exchange(scalar, mStats.halo);
+}
+
+void DistributedGrid::gather(Field f, std::vector<double>& out)
+{
+   SlabField& slab = field(f);
+   const int* size = slab.getSize();
+   int rowSize = slab.getRowSize();
+   int count = (slab.ownedEnd() - slab.ownedBegin())*rowSize;
+   int offset = slab.ownedBegin()*rowSize;
+
+   std::vector<int> counts(mNumRanks), offsets(mNumRanks);
+   MPI_Gather(&count, 1, MPI_INT, &counts[0], 1, MPI_INT, 0, mComm);
+   MPI_Gather(&offset, 1, MPI_INT, &offsets[0], 1, MPI_INT, 0, mComm);
+
+   out.clear();
+   if (mRank == 0) out.resize((size_t) size[0]*size[1]*size[2]);
+   MPI_Gatherv(slab.row(slab.ownedBegin()), count, MPI_DOUBLE,
+      mRank == 0? &out[0] : NULL, &counts[0], &offsets[0], MPI_DOUBLE, 0, mComm);
+}
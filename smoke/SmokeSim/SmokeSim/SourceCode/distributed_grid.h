@@ -0,0 +1,167 @@
+// MACGrid split across MPI ranks, for grids too big for one node.
+//
+// The grid is cut into slabs of whole y rows.  GridData stores j slowest, so
+// a slab and each of its halos are contiguous runs of memory and a halo
+// exchange is one send/receive per neighbor and field.  Every rank keeps
+// `halo` extra rows on each side, refreshed after each stage that changes a
+// field its neighbors read.  The halo is at least as thick as the furthest
+// semi-Lagrangian backtrace (max |velocity| * dt, checked on every step and
+// grown when needed) plus the interpolation stencil, so advection only ever
+// reads local memory.
+//
+// step() runs the same stages as SmokeSim::step / MACGrid (sources,
+// advection, buoyancy, vorticity confinement, pressure projection, scalar
+// advection) with the same arithmetic, so on one rank it reproduces the
+// serial result bit for bit and on several ranks to within the rounding of
+// the reduced dot products.  The pressure solve is conjugate gradient with
+// the matrix-vector product exchanging one halo row per iteration and the
+// dot products and residual norm reduced across ranks.  It is
+// preconditioned block by block: each rank applies a modified incomplete
+// Cholesky factor (MIC(0), as in Bridson's "Fluid Simulation for Computer
+// Graphics") of its own slab's part of the matrix, dropping the couplings
+// to other slabs, so the preconditioner needs no communication at all.
+// With the preconditioner off the solve is MACGrid's unpreconditioned CG,
+// which is what the bit for bit comparison above needs.  Obstacles aren't
+// supported here.
+//
+// The global grid size is independent of theDim; theCellSize and the
+// constants in constants.h still apply.  Each slab needs more rows than the
+// halo is thick.
+
+#ifndef DISTRIBUTED_GRID_H
+#define DISTRIBUTED_GRID_H
+
+#include <mpi.h>
+#include <vector>
+#include "vec.h"
+
+// One field's slab plus halos, addressed with global indices.
+class SlabField
+{
+public:
+   enum Kind { CENTER, FACE_X, FACE_Y, FACE_Z };
+
+   SlabField();
+   // Rows [rowBegin, rowEnd) of a field on a globalDim[0..2] cell grid.
+   void allocate(Kind kind, const int globalDim[3], int rowBegin, int rowEnd, int halo);
+   // Keeps the owned rows; halo rows are zero until the next exchange.
+   void setHalo(int halo);
+   void fill(double value);
+
+   // Same out-of-grid rules as GridData / GridDataX / Y / Z: centered
+   // fields read 0 outside the grid, face fields read 0 past their normal
+   // axis and clamp the other two.
+   double get(int i, int j, int k) const;
+   // Stored row, no checks.
+   double& at(int i, int j, int k) { return mData[index(i, j, k)]; }
+   double at(int i, int j, int k) const { return mData[index(i, j, k)]; }
+   // GridData::interpolate on the slab.
+   double interpolate(const vec3& pt) const;
+
+   Kind getKind() const { return mKind; }
+   int getHalo() const { return mHalo; }
+   // Size of the whole field (faces included) and of one row.
+   const int* getSize() const { return mSize; }
+   int getRowSize() const { return mSize[0]*mSize[2]; }
+   // Owned rows; the top Y face row belongs to the last rank.
+   int ownedBegin() const { return mRowBegin; }
+   int ownedEnd() const;
+   // Pointer to global row j (must be stored).
+   double* row(int j) { return &mData[(size_t) (j - mRowBegin + mHalo) * getRowSize()]; }
+
+   // Rows that reached for memory outside the halo (0 unless the halo is too thin).
+   int getHaloMisses() const { return mHaloMisses; }
+
+protected:
+   int index(int i, int j, int k) const
+   {
+      return i + k*mSize[0] + (j - mRowBegin + mHalo)*mSize[0]*mSize[2];
+   }
+
+   Kind mKind;
+   int mDim[3];      // cells
+   int mSize[3];     // samples, one more than mDim along a face's normal
+   int mRowBegin, mRowEnd, mHalo;
+   vec3 mMax, mOffset;
+   std::vector<double> mData;
+   mutable int mHaloMisses;
+};
+
+class DistributedGrid
+{
+public:
+   struct Stats
+   {
+      int steps;
+      int cgIterations;          // total over all steps
+      int halo;                  // current halo thickness in rows
+      int haloMisses;            // reads outside the halo; 0 when the CFL check works
+      long long haloBytes;       // sent by this rank
+      double advectSeconds, forceSeconds, projectSeconds, scalarSeconds;
+      double exchangeSeconds;    // halo exchanges, included in the stages above
+      double reduceSeconds;      // CG reductions, included in projectSeconds
+   };
+
+   DistributedGrid(MPI_Comm comm, const int globalDim[3]);
+
+   void reset();
+   void step(double dt);
+
+   // Block MIC(0) preconditioning of the pressure solve, on by default.
+   void setPreconditioner(bool on);
+   bool getPreconditioner() const { return mPreconditioned; }
+
+   int getRank() const { return mRank; }
+   int getNumRanks() const { return mNumRanks; }
+   const int* getDim() const { return mDim; }
+   int rowBegin() const { return mRowBegin; }
+   int rowEnd() const { return mRowEnd; }
+   const Stats& getStats() const { return mStats; }
+
+   enum Field { VELOCITY_X, VELOCITY_Y, VELOCITY_Z, PRESSURE, DENSITY, TEMPERATURE, NUM_FIELDS };
+   // Collects a whole field on rank 0, in GridData order (faces included).
+   // Other ranks get an empty vector.  Collective.
+   void gather(Field field, std::vector<double>& out);
+
+protected:
+   SlabField& field(Field f);
+   void allocateFields(int halo);
+   void exchange(SlabField& f, int rows);
+   double globalMaxVelocity();
+   void ensureHalo(double dt);
+   double allreduce(double value, MPI_Op op);
+
+   // Stages, same order and arithmetic as MACGrid:
+   void updateSources();
+   void advectVelocity(double dt);
+   void computeBouyancy(double dt);
+   void computeVorticityConfinement(double dt);
+   void project(double dt);
+   void advectScalar(SlabField& scalar, double dt);
+   void setSource(SlabField& f, int i, int j, int k, double value);
+
+   bool conjugateGradient(SlabField& p, const SlabField& d, int maxIterations, double tolerance);
+   void buildPreconditioner();
+   void applyPreconditioner(const SlabField& r, SlabField& z);
+   double dotProduct(const SlabField& a, const SlabField& b);
+   double maxMagnitude(const SlabField& a);
+   void apply(SlabField& x, SlabField& result);
+
+   vec3 getVelocity(const vec3& pt) const;
+
+   MPI_Comm mComm;
+   int mRank, mNumRanks;
+   int mDim[3];
+   int mRowBegin, mRowEnd;
+   int mMinRows;              // thinnest slab of any rank
+
+   SlabField mU, mV, mW, mP, mD, mT;
+   SlabField mNewU, mNewV, mNewW, mNewScalar;      // advection output
+   SlabField mWX, mWY, mWZ, mFX, mFY, mFZ;         // vorticity and confinement force
+   SlabField mDiv, mR, mZ, mS;                     // CG vectors
+   bool mPreconditioned;
+   std::vector<double> mPrecon;                    // MIC(0) of the slab, one per owned cell
+   Stats mStats;
+};
+
+#endif // DISTRIBUTED_GRID_H
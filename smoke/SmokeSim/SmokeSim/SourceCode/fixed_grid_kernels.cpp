@@ -0,0 +1,207 @@
+#include "fixed_grid_kernels.h"
+#include "constants.h"
+#include <stddef.h>
+#undef max
+#undef min
+#include <algorithm>
+
+// Grid sizes with their own kernels: the compiled-in default and the cube
+// sizes used for previews.  Each one costs a copy of every kernel below.
+#define FIXED_GRID_SIZES(SIZE) \
+   SIZE(40, 40, 20) \
+   SIZE(32, 32, 32) \
+   SIZE(48, 48, 48) \
+   SIZE(64, 64, 64)
+
+namespace
+{
+
+// One kind of grid: cell centered (AXIS -1) or faces normal to AXIS.  The
+// lookups and interpolation repeat GridData's step for step, so they give
+// exactly the same numbers.
+template <int NX, int NY, int NZ, int AXIS>
+struct Layout
+{
+   enum
+   {
+      SX = NX + (AXIS == 0 ? 1 : 0),
+      SY = NY + (AXIS == 1 ? 1 : 0),
+      SZ = NZ + (AXIS == 2 ? 1 : 0)
+   };
+
+   static inline int index(int i, int j, int k)
+   {
+      return i + k * SX + j * SX * SZ;
+   }
+
+   // Faces: false outside the grid along AXIS; the other axes clamp.
+   static inline bool inside(int axis, int& n, int dim)
+   {
+      if (axis == AXIS) return n >= 0 && n <= dim;
+      if (n < 0) n = 0;
+      if (n > dim - 1) n = dim - 1;
+      return true;
+   }
+
+   // GridData::operator() and its X, Y and Z face versions.
+   static inline double at(const double* data, double dflt, int i, int j, int k)
+   {
+      if (AXIS < 0)
+      {
+         if (i < 0 || j < 0 || k < 0 || i > NX - 1 || j > NY - 1 || k > NZ - 1) return dflt;
+      }
+      else if (!inside(0, i, NX) || !inside(1, j, NY) || !inside(2, k, NZ))
+      {
+         return dflt;
+      }
+      return data[index(i, j, k)];
+   }
+
+   // worldToSelf on one axis.
+   static inline double toSelf(int axis, double p, int samples)
+   {
+      double h = theCellSize;
+      double q = axis == AXIS ? p : p - h * 0.5;
+      return std::min(std::max(0.0, q), h * samples);
+   }
+
+   // GridData::interpolate (linear).
+   static inline double interpolate(const double* data, double dflt, double x, double y, double z)
+   {
+      double h = theCellSize;
+      double px = toSelf(0, x, SX), py = toSelf(1, y, SY), pz = toSelf(2, z, SZ);
+
+      int i = (int) (px / h);
+      int j = (int) (py / h);
+      int k = (int) (pz / h);
+
+      double scale = 1.0 / h;
+      double fractx = scale * (px - i * h);
+      double fracty = scale * (py - j * h);
+      double fractz = scale * (pz - k * h);
+
+      double tmp1 = at(data, dflt, i, j, k);
+      double tmp2 = at(data, dflt, i, j + 1, k);
+      double tmp3 = at(data, dflt, i + 1, j, k);
+      double tmp4 = at(data, dflt, i + 1, j + 1, k);
+      double tmp5 = at(data, dflt, i, j, k + 1);
+      double tmp6 = at(data, dflt, i, j + 1, k + 1);
+      double tmp7 = at(data, dflt, i + 1, j, k + 1);
+      double tmp8 = at(data, dflt, i + 1, j + 1, k + 1);
+
+      double tmp12 = LERP(tmp1, tmp2, fracty);
+      double tmp34 = LERP(tmp3, tmp4, fracty);
+      double tmp56 = LERP(tmp5, tmp6, fracty);
+      double tmp78 = LERP(tmp7, tmp8, fracty);
+      double tmp1234 = LERP(tmp12, tmp34, fractx);
+      double tmp5678 = LERP(tmp56, tmp78, fractx);
+      return LERP(tmp1234, tmp5678, fractz);
+   }
+};
+
+template <int NX, int NY, int NZ, int AXIS>
+void trace(const GridDataX& u, const GridDataY& v, const GridDataZ& w,
+   const GridData& field, GridData& result, double dt)
+{
+   typedef Layout<NX, NY, NZ, AXIS> Out;
+   typedef Layout<NX, NY, NZ, 0> U;
+   typedef Layout<NX, NY, NZ, 1> V;
+   typedef Layout<NX, NY, NZ, 2> W;
+
+   const double* du = &u.data()[0];
+   const double* dv = &v.data()[0];
+   const double* dw = &w.data()[0];
+   const double* src = &field.data()[0];
+   double* out = &result.data()[0];
+   double uDflt = u.getDefaultValue(), vDflt = v.getDefaultValue(), wDflt = w.getDefaultValue();
+   double srcDflt = field.getDefaultValue();
+   double h = theCellSize;
+
+   GridStorage::forEachRow(Out::SY, Out::SX * Out::SZ, [&](int j) {
+      for (int k = 0; k < Out::SZ; k++)
+         for (int i = 0; i < Out::SX; i++)
+         {
+            double x = i * h, y = j * h, z = k * h;
+            if (AXIS != 0) x += 0.5 * h;
+            if (AXIS != 1) y += 0.5 * h;
+            if (AXIS != 2) z += 0.5 * h;
+
+            double velX = U::interpolate(du, uDflt, x, y, z);
+            double velY = V::interpolate(dv, vDflt, x, y, z);
+            double velZ = W::interpolate(dw, wDflt, x, y, z);
+
+            out[Out::index(i, j, k)] = Out::interpolate(src, srcDflt, x - dt * velX, y - dt * velY, z - dt * velZ);
+         }
+   });
+}
+
+template <int NX, int NY, int NZ>
+void apply(const GridDataMatrix& matrix, const int* cells, int count, const GridData& vector, GridData& result)
+{
+   const int strideI = 1;
+   const int strideJ = NX * NZ;
+   const int strideK = NX;
+   const int numCells = strideJ * NY;
+
+   const double* diag = &matrix.diag.data()[0];
+   const double* plusI = &matrix.plusI.data()[0];
+   const double* plusJ = &matrix.plusJ.data()[0];
+   const double* plusK = &matrix.plusK.data()[0];
+   const double* x = &vector.data()[0];
+   double* out = &result.data()[0];
+
+   for (int c = 0; c < count; c++)
+   {
+      int n = cells[c];
+
+      double sum = diag[n] * x[n];
+      if (n + strideI < numCells) sum += plusI[n] * x[n + strideI];
+      if (n + strideJ < numCells) sum += plusJ[n] * x[n + strideJ];
+      if (n + strideK < numCells) sum += plusK[n] * x[n + strideK];
+      if (n - strideI >= 0) sum += plusI[n - strideI] * x[n - strideI];
+      if (n - strideJ >= 0) sum += plusJ[n - strideJ] * x[n - strideJ];
+      if (n - strideK >= 0) sum += plusK[n - strideK] * x[n - strideK];
+
+      out[n] = sum;
+   }
+}
+
+#define FIXED_GRID_ENTRY(X, Y, Z) \
+   { { X, Y, Z }, { trace<X, Y, Z, -1>, trace<X, Y, Z, 0>, trace<X, Y, Z, 1>, trace<X, Y, Z, 2> }, apply<X, Y, Z> },
+
+const FixedGridKernels theKernels[] = { FIXED_GRID_SIZES(FIXED_GRID_ENTRY) };
+const int theNumKernels = sizeof(theKernels) / sizeof(theKernels[0]);
+
+bool theEnabled = true;
+
+}
+
+const FixedGridKernels* FixedGridKernels::find(int x, int y, int z)
+{
+   for (int n = 0; n < theNumKernels; n++)
+   {
+      const FixedGridKernels& k = theKernels[n];
+      if (k.dim[0] == x && k.dim[1] == y && k.dim[2] == z) return &k;
+   }
+   return NULL;
+}
+
+int FixedGridKernels::count()
+{
+   return theNumKernels;
+}
+
+const FixedGridKernels& FixedGridKernels::get(int n)
+{
+   return theKernels[n];
+}
+
+void FixedGridKernels::setEnabled(bool on)
+{
+   theEnabled = on;
+}
+
+bool FixedGridKernels::isEnabled()
+{
+   return theEnabled;
+}
@@ -0,0 +1,43 @@
+// Solver kernels compiled for fixed grid dimensions.
+//
+// The generic kernels read theDim on every index computation and go
+// through GridData's virtual operator() for every sample, which keeps the
+// compiler from resolving strides and boundary tests.  For a few grid
+// sizes used for previews and interactive work, fixed_grid_kernels.cpp
+// instantiates the same kernels with the dimensions as template
+// parameters.  MACGrid looks up the set matching theDim when it is reset
+// and uses it instead of the generic code; every other size keeps the
+// generic path.  Results are bit for bit the same on either path.
+
+#ifndef FIXED_GRID_KERNELS_H
+#define FIXED_GRID_KERNELS_H
+
+#include "grid_data.h"
+#include "grid_data_matrix.h"
+
+struct FixedGridKernels
+{
+   // Semi-Lagrangian trace of field into result through the velocity
+   // (u, v, w), as MACGrid::traceField.
+   typedef void (*TraceKernel)(const GridDataX& u, const GridDataY& v, const GridDataZ& w,
+      const GridData& field, GridData& result, double dt);
+   // result = A x over count cells, as MACGrid::apply.
+   typedef void (*ApplyKernel)(const GridDataMatrix& A, const int* cells, int count,
+      const GridData& x, GridData& result);
+
+   int dim[3];
+   TraceKernel trace[4];  // cell centered fields first, then X, Y and Z faces
+   ApplyKernel apply;
+
+   // The kernels compiled for exactly these dimensions, or NULL.
+   static const FixedGridKernels* find(int x, int y, int z);
+   // Dimensions that have kernels, for listing in tools.
+   static int count();
+   static const FixedGridKernels& get(int n);
+
+   // On by default; off sends every grid through the generic kernels.
+   static void setEnabled(bool on);
+   static bool isEnabled();
+};
+
+#endif // FIXED_GRID_KERNELS_H
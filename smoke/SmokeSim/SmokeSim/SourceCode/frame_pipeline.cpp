@@ -0,0 +1,147 @@
+#include "frame_pipeline.h"
+#include "stb_image_write.h"
+#include "custom_output.h"
+#include <chrono>
+#undef max
+#undef min
+#include <algorithm>
+
+static double secondsNow()
+{
+   using namespace std::chrono;
+   return duration_cast<duration<double> >(steady_clock::now().time_since_epoch()).count();
+}
+
+//---------------------------------------------------------------------
+// FrameSnapshot
+//---------------------------------------------------------------------
+
+FrameSnapshot::FrameSnapshot() : frame(0), width(0), height(0)
+{
+}
+
+void FrameSnapshot::savePng(const char* fileName) const
+{
+   if (image.empty()) return;
+   stbi_write_png(fileName, width, height, 3, &image[0], width * 3);
+}
+
+//---------------------------------------------------------------------
+// FramePipeline
+//---------------------------------------------------------------------
+
+FramePipeline::FramePipeline(int numWorkers, int maxQueued) :
+   mMaxQueued(std::max(1, maxQueued)), mActive(0), mStopping(false)
+{
+   if (numWorkers <= 0)
+   {
+      int hw = (int) std::thread::hardware_concurrency();
+      numWorkers = std::max(1, hw - 1);
+   }
+
+   mStats.jobs = 0;
+   mStats.workSeconds = 0.0;
+   mStats.stallSeconds = 0.0;
+   mStats.wallSeconds = 0.0;
+   mStartTime = secondsNow();
+
+   for (int i = 0; i < numWorkers; i++)
+   {
+      mWorkers.push_back(std::thread(&FramePipeline::workerLoop, this));
+   }
+}
+
+FramePipeline::~FramePipeline()
+{
+   {
+      std::unique_lock<std::mutex> lock(mMutex);
+      mStopping = true;
+   }
+   mHasWork.notify_all();
+   for (size_t i = 0; i < mWorkers.size(); i++)
+   {
+      mWorkers[i].join();
+   }
+}
+
+int FramePipeline::getNumWorkers() const
+{
+   return (int) mWorkers.size();
+}
+
+void FramePipeline::submit(const Job& job)
+{
+   std::unique_lock<std::mutex> lock(mMutex);
+   if (mQueue.size() >= mMaxQueued)
+   {
+      double start = secondsNow();
+      mHasRoom.wait(lock, [this] { return mQueue.size() < mMaxQueued; });
+      mStats.stallSeconds += secondsNow() - start;
+   }
+   mQueue.push_back(job);
+   lock.unlock();
+   mHasWork.notify_one();
+}
+
+void FramePipeline::flush()
+{
+   std::unique_lock<std::mutex> lock(mMutex);
+   if (mQueue.empty() && mActive == 0) return;
+
+   double start = secondsNow();
+   mIdle.wait(lock, [this] { return mQueue.empty() && mActive == 0; });
+   mStats.stallSeconds += secondsNow() - start;
+}
+
+void FramePipeline::workerLoop()
+{
+   for (;;)
+   {
+      Job job;
+      {
+         std::unique_lock<std::mutex> lock(mMutex);
+         mHasWork.wait(lock, [this] { return mStopping || !mQueue.empty(); });
+         // Drain whatever is left before shutting down.
+         if (mQueue.empty()) return;
+         job = mQueue.front();
+         mQueue.pop_front();
+         mActive++;
+      }
+      mHasRoom.notify_one();
+
+      double start = secondsNow();
+      job();
+      double elapsed = secondsNow() - start;
+
+      {
+         std::unique_lock<std::mutex> lock(mMutex);
+         mActive--;
+         mStats.jobs++;
+         mStats.workSeconds += elapsed;
+      }
+      mIdle.notify_all();
+   }
+}
+
+FramePipeline::Stats FramePipeline::getStats() const
+{
+   std::unique_lock<std::mutex> lock(mMutex);
+   Stats stats = mStats;
+   stats.wallSeconds = secondsNow() - mStartTime;
+   return stats;
+}
+
+double FramePipeline::Stats::overlap() const
+{
+   if (workSeconds <= 0.0) return 1.0;
+   return std::max(0.0, std::min(1.0, 1.0 - stallSeconds / workSeconds));
+}
+
+void FramePipeline::printStats() const
+{
+   Stats stats = getStats();
+   if (stats.jobs == 0) return;
+   PRINT_LINE("Output pipeline: " << stats.jobs << " frames, "
+      << stats.workSeconds << "s encoding on " << mWorkers.size() << " worker(s), "
+      << stats.stallSeconds << "s stalled, overlap " << (int) (100.0 * stats.overlap()) << "%");
+}
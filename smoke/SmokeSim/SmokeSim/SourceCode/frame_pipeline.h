@@ -0,0 +1,89 @@
+// Background output pipeline for recording.
+// The simulation thread hands finished frames to a bounded queue and keeps
+// stepping while worker threads do the slow encoding/file I/O.  When the
+// queue is full submit() blocks, so memory use stays bounded no matter how
+// far the encoders fall behind.
+
+#ifndef FRAME_PIPELINE_H
+#define FRAME_PIPELINE_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+
+// Immutable copy of everything needed to write one recorded frame.
+// Once a snapshot is submitted the simulation never touches it again.
+struct FrameSnapshot
+{
+   FrameSnapshot();
+
+   int frame;
+
+   // RGB framebuffer, top row first (already flipped for stb_image_write).
+   int width;
+   int height;
+   std::vector<unsigned char> image;
+
+   // Saves the framebuffer as a PNG.
+   void savePng(const char* fileName) const;
+};
+
+typedef std::shared_ptr<const FrameSnapshot> FrameSnapshotPtr;
+
+class FramePipeline
+{
+public:
+   typedef std::function<void()> Job;
+
+   // numWorkers <= 0 picks one worker per spare hardware thread.
+   FramePipeline(int numWorkers = 0, int maxQueued = 4);
+   ~FramePipeline();
+
+   // Queues a job.  Blocks while maxQueued jobs are already waiting (backpressure).
+   void submit(const Job& job);
+
+   // Waits until every submitted job has finished.
+   void flush();
+
+   int getNumWorkers() const;
+
+   struct Stats
+   {
+      int jobs;              // jobs completed
+      double workSeconds;    // summed time spent inside jobs (all workers)
+      double stallSeconds;   // time the submitting thread spent blocked
+      double wallSeconds;    // time since the pipeline was created
+
+      // Fraction of the output work that was hidden behind simulation,
+      // 1 = fully overlapped, 0 = no better than writing synchronously.
+      double overlap() const;
+   };
+   Stats getStats() const;
+   void printStats() const;
+
+private:
+   FramePipeline(const FramePipeline&);
+   FramePipeline& operator=(const FramePipeline&);
+
+   void workerLoop();
+
+   std::vector<std::thread> mWorkers;
+   std::deque<Job> mQueue;
+   size_t mMaxQueued;
+   int mActive;
+   bool mStopping;
+
+   mutable std::mutex mMutex;
+   std::condition_variable mHasWork;   // signalled when a job is queued or on shutdown
+   std::condition_variable mHasRoom;   // signalled when a job is dequeued
+   std::condition_variable mIdle;      // signalled when a job finishes
+
+   Stats mStats;
+   double mStartTime;
+};
+
+#endif // FRAME_PIPELINE_H
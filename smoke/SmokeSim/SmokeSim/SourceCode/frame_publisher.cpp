@@ -0,0 +1,115 @@
+#include "frame_publisher.h"
+#include "mac_grid.h"
+#include "constants.h"
+#include "custom_output.h"
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+static_assert(sizeof(SharedFrameHeader) == 64, "SharedFrameHeader must stay 64 bytes");
+static_assert(sizeof(SharedSlotHeader) == 64, "SharedSlotHeader must stay 64 bytes");
+
+static const int theNumSlots = 2;
+
+FramePublisher::FramePublisher() : mBase(NULL), mSize(0), mCells(0)
+{
+}
+
+FramePublisher::~FramePublisher()
+{
+   close();
+}
+
+bool FramePublisher::open(const char* name)
+{
+   close();
+
+#ifdef _WIN32
+   PRINT_LINE("Shared memory publishing needs POSIX shared memory");
+   return false;
+#else
+   mName = (name[0] == '/')? name : std::string("/") + name;
+   mCells = (size_t) theDim[0]*theDim[1]*theDim[2];
+   size_t slotBytes = sizeof(SharedSlotHeader) + 2*mCells*sizeof(double);
+   mSize = sizeof(SharedFrameHeader) + theNumSlots*slotBytes;
+
+   int fd = shm_open(mName.c_str(), O_CREAT | O_RDWR, 0644);
+   if (fd < 0 || ftruncate(fd, mSize) != 0)
+   {
+      PRINT_LINE("Could not create shared memory " << mName);
+      if (fd >= 0) ::close(fd);
+      return false;
+   }
+   void* base = mmap(NULL, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   ::close(fd);
+   if (base == MAP_FAILED)
+   {
+      PRINT_LINE("Could not map shared memory " << mName);
+      shm_unlink(mName.c_str());
+      return false;
+   }
+   mBase = (char*) base;
+
+   SharedFrameHeader* header = (SharedFrameHeader*) mBase;
+   memset(mBase, 0, sizeof(SharedFrameHeader));
+   header->version = 1;
+   for (int d = 0; d < 3; d++) header->dim[d] = theDim[d];
+   header->numChannels = 2;
+   header->cellSize = theCellSize;
+   header->slotBytes = slotBytes;
+   for (int s = 0; s < theNumSlots; s++)
+   {
+      SharedSlotHeader* slot = (SharedSlotHeader*) (mBase + sizeof(SharedFrameHeader) + s*slotBytes);
+      memset((void*) slot, 0, sizeof(SharedSlotHeader));
+      slot->frame = -1;
+   }
+   // The magic goes in last, so a viewer never sees a half initialized header.
+   std::atomic_thread_fence(std::memory_order_release);
+   memcpy(header->magic, "SSHM", 4);
+   return true;
+#endif
+}
+
+void FramePublisher::close()
+{
+#ifndef _WIN32
+   if (mBase)
+   {
+      munmap(mBase, mSize);
+      shm_unlink(mName.c_str());
+   }
+#endif
+   mBase = NULL;
+   mSize = 0;
+}
+
+bool FramePublisher::isOpen() const
+{
+   return mBase != NULL;
+}
+
+void FramePublisher::publish(const MACGrid& grid, int frame)
+{
+   if (!mBase) return;
+
+   SharedFrameHeader* header = (SharedFrameHeader*) mBase;
+   unsigned long long next = 1 - header->latest.load(std::memory_order_relaxed);
+   SharedSlotHeader* slot = (SharedSlotHeader*) (mBase + sizeof(SharedFrameHeader) + next*header->slotBytes);
+   double* fields = (double*) (slot + 1);
+
+   // Seqlock write: odd while the fields are changing.
+   unsigned long long sequence = slot->sequence.load(std::memory_order_relaxed);
+   slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_release);
+
+   memcpy(fields, &grid.getDensityGrid().data()[0], mCells*sizeof(double));
+   memcpy(fields + mCells, &grid.getTemperatureGrid().data()[0], mCells*sizeof(double));
+   slot->frame = frame;
+
+   slot->sequence.store(sequence + 2, std::memory_order_release);
+   header->latest.store(next, std::memory_order_release);
+}
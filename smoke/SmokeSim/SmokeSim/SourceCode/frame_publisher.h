@@ -0,0 +1,70 @@
+// Live publication of simulated frames through POSIX shared memory.
+//
+// A viewer process can watch a long run while it is going without touching
+// the simulation.  The segment (/dev/shm/<name> on Linux) holds two frame
+// slots; each completed frame is copied straight from the grid into the slot
+// readers aren't looking at, and then becomes the latest.  Every slot has a
+// seqlock counter that is odd while the slot is being written, so a reader
+// that copies a frame can check it wasn't overwritten underneath it.  The
+// solver thread never waits on a reader.  Layout (little endian):
+//
+//   SharedFrameHeader               64 bytes, at offset 0
+//   for each of the 2 slots, at 64 + slot * slotBytes:
+//     SharedSlotHeader              64 bytes: sequence, frame number
+//     density                       double[dim[0]*dim[1]*dim[2]], GridData order
+//     temperature                   double[dim[0]*dim[1]*dim[2]], GridData order
+//
+// Reading protocol: read latest, read that slot's sequence (retry if odd),
+// copy the fields, re-read the sequence and retry if it changed.
+// python/smokeshm.py implements it.
+
+#ifndef FRAME_PUBLISHER_H
+#define FRAME_PUBLISHER_H
+
+#include <string>
+#include <atomic>
+#include <stddef.h>
+
+class MACGrid;
+
+struct SharedFrameHeader
+{
+   char magic[4];                    // "SSHM"
+   unsigned int version;
+   int dim[3];
+   unsigned int numChannels;         // density, temperature
+   double cellSize;
+   unsigned long long slotBytes;     // slot header plus fields
+   std::atomic<unsigned long long> latest;  // slot holding the newest complete frame
+   unsigned long long reserved[2];
+};
+
+struct SharedSlotHeader
+{
+   std::atomic<unsigned long long> sequence;  // odd while the slot is being written
+   long long frame;
+   unsigned long long reserved[6];
+};
+
+class FramePublisher
+{
+public:
+   FramePublisher();
+   ~FramePublisher();
+
+   // Creates (or replaces) the named segment.  Not available on Windows.
+   bool open(const char* name);
+   // Unmaps and unlinks the segment; viewers that already mapped it keep their mapping.
+   void close();
+   bool isOpen() const;
+
+   void publish(const MACGrid& grid, int frame);
+
+protected:
+   std::string mName;
+   char* mBase;
+   size_t mSize;
+   size_t mCells;
+};
+
+#endif // FRAME_PUBLISHER_H
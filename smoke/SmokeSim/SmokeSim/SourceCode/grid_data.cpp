@@ -4,14 +4,14 @@
 //#define __BRIDSON_NOTATION__
 
 GridData::GridData() :
-   mDfltValue(0.0), mMax(0.0,0.0,0.0)
+   mDfltValue(0.0), mMax(0.0,0.0,0.0), mRows(0), mRowSize(0)
 {
 }
 
 GridData::GridData(const GridData& orig) :
-   mDfltValue(orig.mDfltValue)
+   mDfltValue(orig.mDfltValue), mRows(0), mRowSize(0)
 {
-   mData = orig.mData;
+   copyData(orig);
    mMax = orig.mMax;
 }
 
@@ -19,7 +19,12 @@ GridData::~GridData()
 {
 }
 
-std::vector<double>& GridData::data()
+GridData::Storage& GridData::data()
+{
+   return mData;
+}
+
+const GridData::Storage& GridData::data() const
 {
    return mData;
 }
@@ -36,24 +41,49 @@ GridData& GridData::operator=(const GridData& orig)
       return *this;
    }
    mDfltValue = orig.mDfltValue;
-   mData = orig.mData;
+   copyData(orig);
    mMax = orig.mMax;
    return *this;
 }
 
+void GridData::allocate(int rows, int rowSize, double value)
+{
+   size_t size = (size_t) rows * rowSize;
+   if (mData.size() != size)
+   {
+      // Fresh, untouched pages for GridStorage::fill to place.
+      Storage().swap(mData);
+      mData.resize(size);
+   }
+   mRows = rows;
+   mRowSize = rowSize;
+   if (size > 0) GridStorage::fill(&mData[0], rows, rowSize, value);
+}
+
+void GridData::copyData(const GridData& orig)
+{
+   if (mData.size() != orig.mData.size())
+   {
+      Storage().swap(mData);
+      mData.resize(orig.mData.size());
+   }
+   mRows = orig.mRows;
+   mRowSize = orig.mRowSize;
+   if (!mData.empty()) GridStorage::copy(&mData[0], &orig.mData[0], mRows, mRowSize);
+}
+
 void GridData::initialize(double dfltValue)
 {
    mDfltValue = dfltValue;
    mMax[0] = theCellSize*theDim[0];
    mMax[1] = theCellSize*theDim[1];
    mMax[2] = theCellSize*theDim[2];
-   mData.resize(theDim[0]*theDim[1]*theDim[2], false);
-   std::fill(mData.begin(), mData.end(), mDfltValue);
+   allocate(theDim[1], theDim[0]*theDim[2], mDfltValue);
 }
 
 double& GridData::operator()(int i, int j, int k)
 {
-   static double dflt = 0;
+   static thread_local double dflt = 0;
    dflt = mDfltValue;  // HACK: Protect against setting the default value
 
    if (i< 0 || j<0 || k<0 || 
@@ -70,7 +100,7 @@ double& GridData::operator()(int i, int j, int k)
 
 const double GridData::operator()(int i, int j, int k) const
 {
-   static double dflt = 0;
+   static thread_local double dflt = 0;
    dflt = mDfltValue;  // HACK: Protect against setting the default value
 
    if (i< 0 || j<0 || k<0 || 
@@ -458,6 +488,22 @@ double GridData::interpolate(const vec3& pt) {
   #endif
 }
 
+void GridData::interpolationBounds(const vec3& pt, double& lo, double& hi)
+{
+   vec3 pos = worldToSelf(pt);
+   int i = (int) (pos[0]/theCellSize);
+   int j = (int) (pos[1]/theCellSize);
+   int k = (int) (pos[2]/theCellSize);
+
+   lo = hi = (*this)(i,j,k);
+   for (int n = 1; n < 8; n++)
+   {
+      double value = (*this)(i + (n & 1), j + ((n >> 1) & 1), k + ((n >> 2) & 1));
+      if (value < lo) lo = value;
+      if (value > hi) hi = value;
+   }
+}
+
 vec3 GridData::worldToSelf(const vec3& pt) const
 {
    vec3 out;
@@ -477,17 +523,16 @@ GridDataX::~GridDataX()
 
 void GridDataX::initialize(double dfltValue)
 {
-   GridData::initialize(dfltValue);
+   mDfltValue = dfltValue;
    mMax[0] = theCellSize*(theDim[0]+1);
    mMax[1] = theCellSize*theDim[1];
    mMax[2] = theCellSize*theDim[2];
-   mData.resize((theDim[0]+1)*theDim[1]*theDim[2], false);
-   std::fill(mData.begin(), mData.end(), mDfltValue);
+   allocate(theDim[1], (theDim[0]+1)*theDim[2], mDfltValue);
 }
 
 double& GridDataX::operator()(int i, int j, int k)
 {
-   static double dflt = 0;
+   static thread_local double dflt = 0;
    dflt = mDfltValue;  // Protect against setting the default value
 
    if (i < 0 || i > theDim[0]) return dflt;
@@ -505,7 +550,7 @@ double& GridDataX::operator()(int i, int j, int k)
 
 const double GridDataX::operator()(int i, int j, int k) const
 {
-   static double dflt = 0;
+   static thread_local double dflt = 0;
    dflt = mDfltValue;  // Protect against setting the default value
 
    if (i < 0 || i > theDim[0]) return dflt;
@@ -540,17 +585,16 @@ GridDataY::~GridDataY()
 
 void GridDataY::initialize(double dfltValue)
 {
-   GridData::initialize(dfltValue);
+   mDfltValue = dfltValue;
    mMax[0] = theCellSize*theDim[0];
    mMax[1] = theCellSize*(theDim[1]+1);
    mMax[2] = theCellSize*theDim[2];
-   mData.resize(theDim[0]*(theDim[1]+1)*theDim[2], false);
-   std::fill(mData.begin(), mData.end(), mDfltValue);
+   allocate(theDim[1]+1, theDim[0]*theDim[2], mDfltValue);
 }
 
 double& GridDataY::operator()(int i, int j, int k)
 {
-   static double dflt = 0;
+   static thread_local double dflt = 0;
    dflt = mDfltValue;  // Protect against setting the default value
 
    if (j < 0 || j > theDim[1]) return dflt;
@@ -568,7 +612,7 @@ double& GridDataY::operator()(int i, int j, int k)
 
 const double GridDataY::operator()(int i, int j, int k) const
 {
-   static double dflt = 0;
+   static thread_local double dflt = 0;
    dflt = mDfltValue;  // Protect against setting the default value
 
    if (j < 0 || j > theDim[1]) return dflt;
@@ -603,17 +647,16 @@ GridDataZ::~GridDataZ()
 
 void GridDataZ::initialize(double dfltValue)
 {
-   GridData::initialize(dfltValue);
+   mDfltValue = dfltValue;
    mMax[0] = theCellSize*theDim[0];
    mMax[1] = theCellSize*theDim[1];
    mMax[2] = theCellSize*(theDim[2]+1);
-   mData.resize(theDim[0]*theDim[1]*(theDim[2]+1), false);
-   std::fill(mData.begin(), mData.end(), mDfltValue);
+   allocate(theDim[1], theDim[0]*(theDim[2]+1), mDfltValue);
 }
 
 double& GridDataZ::operator()(int i, int j, int k)
 {
-   static double dflt = 0;
+   static thread_local double dflt = 0;
    dflt = mDfltValue;  // Protect against setting the default value
 
    if (k < 0 || k > theDim[2]) return dflt;
@@ -632,7 +675,7 @@ double& GridDataZ::operator()(int i, int j, int k)
 
 const double GridDataZ::operator()(int i, int j, int k) const
 {
-   static double dflt = 0;
+   static thread_local double dflt = 0;
    dflt = mDfltValue;  // Protect against setting the default value
 
    if (k < 0 || k > theDim[2]) return dflt;
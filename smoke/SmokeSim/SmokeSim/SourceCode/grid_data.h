@@ -9,6 +9,7 @@
 #include <vector>
 #include "vec.h"
 #include "constants.h"
+#include "grid_storage.h"
 #include <stdio.h>
 
 #define SIGN(x) (x > 0 ? +1 : (x < 0 ? -1 : 0))
@@ -23,9 +24,14 @@
 // each X,Y,Z direction.  theCellSize defines the size of each cell.
 // GridData's world space dimensions extend from (0,0,0) to mMax, where mMax is
 // (theCellSize*theDim[0], theCellSize*theDim[1], theCellSize*theDim[2])
+//
+// Storage comes from GridStorage, which decides how its pages are first
+// touched (see grid_storage.h); copies are made the same way.
 class GridData
 {
 public:
+   typedef std::vector<double, GridAllocator<double> > Storage;
+
    GridData();
    GridData(const GridData& orig);
    virtual ~GridData();
@@ -46,8 +52,13 @@ public:
    // outside of our grid dimensions
    virtual double interpolate(const vec3& pt);
 
+   // Smallest and largest of the 8 samples around pt that the linear
+   // interpolation blends, for limiting higher order advection.
+   virtual void interpolationBounds(const vec3& pt, double& lo, double& hi);
+
    // Access underlying data structure (for use with other UBLAS objects)
-   std::vector<double>& data();
+   Storage& data();
+   const Storage& data() const;
 
    // Given a point in world coordinates, return the cell index (i,j,k)
    // corresponding to it
@@ -56,12 +67,20 @@ public:
    // return the dimension
    vec3 getDim();
 
+   // The value returned for samples outside the grid
+   double getDefaultValue() const { return mDfltValue; }
+
 protected:
 
    virtual vec3 worldToSelf(const vec3& pt) const;
+   // Sizes mData to rows of rowSize samples (j is the row) and fills it.
+   void allocate(int rows, int rowSize, double value);
+   void copyData(const GridData& orig);
+
    double mDfltValue;
    vec3 mMax;
-   std::vector<double> mData;
+   int mRows, mRowSize;
+   Storage mData;
 };
 
 class GridDataX : public GridData
@@ -0,0 +1,49 @@
+// Trilinear lookup of a cell-centered field stored in GridData order (i
+// fastest, then k, then j), reading the raw storage.  Unlike
+// GridData::interpolate it makes no virtual calls, works on float fields
+// too and clamps to the nearest cell instead of returning the default value
+// outside the grid.
+
+#ifndef GRID_SAMPLE_H
+#define GRID_SAMPLE_H
+
+#include "constants.h"
+
+// x, y, z are in cell units with cell centers at integers; points outside
+// the grid are clamped to the nearest cell center.  dim is the field's size.
+template <class T>
+inline double sampleCentered(const T* field, const int dim[3], double x, double y, double z)
+{
+   const int nx = dim[0], ny = dim[1], nz = dim[2];
+   x = x < 0.0? 0.0 : (x > nx - 1.0? nx - 1.0 : x);
+   y = y < 0.0? 0.0 : (y > ny - 1.0? ny - 1.0 : y);
+   z = z < 0.0? 0.0 : (z > nz - 1.0? nz - 1.0 : z);
+   int i = (int) x, j = (int) y, k = (int) z;
+   if (i > nx - 2) i = nx > 1? nx - 2 : 0;
+   if (j > ny - 2) j = ny > 1? ny - 2 : 0;
+   if (k > nz - 2) k = nz > 1? nz - 2 : 0;
+   double fx = x - i, fy = y - j, fz = z - k;
+
+   // Neighbour offsets; a single-cell axis reuses the same sample.
+   int di = nx > 1? 1 : 0;
+   int dk = nz > 1? nx : 0;
+   int dj = ny > 1? nx*nz : 0;
+   const T* p = field + i + k*nx + j*nx*nz;
+
+   double c00 = p[0]*(1-fx) + p[di]*fx;
+   double c01 = p[dk]*(1-fx) + p[dk+di]*fx;
+   double c10 = p[dj]*(1-fx) + p[dj+di]*fx;
+   double c11 = p[dj+dk]*(1-fx) + p[dj+dk+di]*fx;
+   double c0 = c00*(1-fz) + c01*fz;
+   double c1 = c10*(1-fz) + c11*fz;
+   return c0*(1-fy) + c1*fy;
+}
+
+// Same, for a field of theDim cells.
+template <class T>
+inline double sampleCentered(const T* field, double x, double y, double z)
+{
+   return sampleCentered(field, theDim, x, y, z);
+}
+
+#endif // GRID_SAMPLE_H
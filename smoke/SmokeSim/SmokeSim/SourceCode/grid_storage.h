@@ -0,0 +1,115 @@
+// Where grid field memory comes from.
+//
+// Linux puts a page on the memory node of the thread that first writes it.
+// GridData used to zero its vector on one thread, so on a multi-socket
+// machine a whole field lived on one node and parallel passes pulled most
+// of it across the socket link.  With first touch on, new storage is left
+// unwritten when it is allocated and GridData fills it with fill()/copy(),
+// which hand each thread the block of j rows parallelForStatic gives it.
+// Passes that split their rows the same way (forEachRow) then mostly read
+// local memory.
+//
+// Huge pages asks for 2 MB transparent huge pages (madvise(MADV_HUGEPAGE))
+// on large fields, which takes most TLB misses out of strided passes along
+// j and k.  Only fields allocated after setPolicy() follow the new policy.
+// Fields smaller than MIN_PARALLEL_BYTES are always filled on the calling
+// thread; starting threads would cost more than it saves.
+//
+// Pinning binds row block t to the t-th CPU the process may use, so the
+// scheduler can't move a block away from the node holding its pages.  It
+// is off by default because the slots are the same for every caller:
+// grids stepping concurrently on different threads (smoke_sweep) would
+// all put block 0 on the first CPU, block 1 on the second, and so on.
+// Turn it on only when one grid owns the machine; runners that step many
+// grids at once should leave it off or set numThreads to 1.
+
+#ifndef GRID_STORAGE_H
+#define GRID_STORAGE_H
+
+#include "parallel.h"
+#include <stddef.h>
+#include <new>
+
+namespace GridStorage
+{
+   enum
+   {
+      HUGE_PAGE_BYTES = 2 << 20,
+      MIN_PARALLEL_BYTES = 4 << 20
+   };
+
+   struct Policy
+   {
+      bool firstTouch;     // fill new storage in parallel, row blocks per thread
+      bool hugePages;      // request transparent huge pages for large fields
+      int numThreads;      // 0 = parallelThreadCount()
+      bool pinThreads;     // bind row block t to CPU slot t (see above)
+      Policy() : firstTouch(true), hugePages(false), numThreads(0), pinThreads(false) {}
+   };
+
+   const Policy& getPolicy();
+   void setPolicy(const Policy& policy);
+
+   // Raw storage; nothing is written, so the pages aren't placed yet.
+   void* allocate(size_t bytes);
+   void release(void* p);
+
+   // Writes rows*rowSize doubles, row blocks split across threads like
+   // parallelForStatic(0, rows) when the policy asks for first touch.
+   void fill(double* data, int rows, int rowSize, double value);
+   void copy(double* dst, const double* src, int rows, int rowSize);
+
+   // Threads fill/copy use for rows*rowSize doubles (1 = serial).
+   int fillThreads(int rows, int rowSize);
+
+   // Calls body(j) for every row j in [0, rows), row j running on the
+   // thread fill() and copy() used for it.
+   template <class Body>
+   void forEachRow(int rows, int rowSize, const Body& body)
+   {
+      parallelForStatic(0, rows, body, fillThreads(rows, rowSize), getPolicy().pinThreads);
+   }
+}
+
+// std::vector allocator over GridStorage.  Value-initialization is skipped
+// (construct() with no arguments default-initializes), so resize() doesn't
+// touch the pages; the owner fills them with GridStorage::fill.
+template <class T>
+class GridAllocator
+{
+public:
+   typedef T value_type;
+   typedef T* pointer;
+   typedef const T* const_pointer;
+   typedef T& reference;
+   typedef const T& const_reference;
+   typedef size_t size_type;
+   typedef ptrdiff_t difference_type;
+   template <class U> struct rebind { typedef GridAllocator<U> other; };
+
+   GridAllocator() {}
+   template <class U> GridAllocator(const GridAllocator<U>&) {}
+
+   pointer allocate(size_type n, const void* = 0)
+   {
+      void* p = GridStorage::allocate(n * sizeof(T));
+      if (!p) throw std::bad_alloc();
+      return static_cast<pointer>(p);
+   }
+   void deallocate(pointer p, size_type) { GridStorage::release(p); }
+
+   template <class U> void construct(U* p) { ::new((void*) p) U; }
+   void construct(pointer p, const T& value) { ::new((void*) p) T(value); }
+   template <class U> void destroy(U* p) { p->~U(); }
+
+   pointer address(reference x) const { return &x; }
+   const_pointer address(const_reference x) const { return &x; }
+   size_type max_size() const { return ((size_type) -1) / sizeof(T); }
+};
+
+template <class T, class U>
+bool operator==(const GridAllocator<T>&, const GridAllocator<U>&) { return true; }
+template <class T, class U>
+bool operator!=(const GridAllocator<T>&, const GridAllocator<U>&) { return false; }
+
+#endif // GRID_STORAGE_H
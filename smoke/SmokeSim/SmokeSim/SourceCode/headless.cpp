@@ -0,0 +1,400 @@
+// Headless smoke runner.
+// Steps the simulation without opening a window, for long batch runs on
+// machines without a display.  Prints timing for the steps and any
+// checkpoints at the end.
+
+#include "smoke_sim.h"
+#include "volume_renderer.h"
+#include "transmittance_grid.h"
+#include "wavelet_turbulence.h"
+#include "grid_storage.h"
+#include "parallel.h"
+#include "constants.h"
+#include "custom_output.h"
+#include <chrono>
+#include <string>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#undef max
+#undef min
+#include <algorithm>
+
+static double secondsNow()
+{
+   using namespace std::chrono;
+   return duration_cast<duration<double> >(steady_clock::now().time_since_epoch()).count();
+}
+
+// Huge pages backing this process's anonymous memory, in MB (Linux only).
+static double hugePageMegabytes()
+{
+   double kb = 0.0;
+#ifdef LINUX
+   FILE* fp = fopen("/proc/self/smaps_rollup", "r");
+   if (!fp) return 0.0;
+   char line[256];
+   while (fgets(line, sizeof(line), fp))
+   {
+      if (sscanf(line, "AnonHugePages: %lf", &kb) == 1) break;
+   }
+   fclose(fp);
+#endif
+   return kb / 1024.0;
+}
+
+// Times grid storage under each allocation policy on n^3 fields: the fill
+// that places the pages, then two statically partitioned passes over whole
+// rows (an axpy and the 7-point stencil the pressure solve applies), the
+// way a parallel solver would walk the same memory.
+static void storageBenchmark(int n, int reps)
+{
+   const int numFields = 4;
+   int rows = n, rowSize = n*n;
+   size_t cells = (size_t) rows * rowSize;
+   int numThreads = parallelThreadCount();
+   GridStorage::Policy saved = GridStorage::getPolicy();
+   const bool pin = saved.pinThreads;
+   PRINT_LINE("Grid storage on " << n << "^3 fields (" << numFields << " x " << cells * sizeof(double) / 1e6
+      << " MB), " << numThreads << (pin? " pinned" : "") << " threads, " << reps << " passes each");
+
+   const char* names[3] = { "serial fill", "first touch", "first touch + huge pages" };
+   for (int mode = 0; mode < 3; mode++)
+   {
+      GridStorage::Policy policy;
+      policy.firstTouch = mode > 0;
+      policy.hugePages = mode == 2;
+      policy.pinThreads = pin;
+      GridStorage::setPolicy(policy);
+
+      double hugeBefore = hugePageMegabytes();
+      double start = secondsNow();
+      std::vector<GridData::Storage> fields(numFields);
+      for (int f = 0; f < numFields; f++)
+      {
+         fields[f].resize(cells);
+         GridStorage::fill(&fields[f][0], rows, rowSize, 1.0 + f);
+      }
+      double fillSeconds = secondsNow() - start;
+      double hugeMegabytes = hugePageMegabytes() - hugeBefore;
+
+      double* out = &fields[0][0];
+      const double* x = &fields[1][0];
+      const double* y = &fields[2][0];
+
+      start = secondsNow();
+      for (int r = 0; r < reps; r++)
+      {
+         parallelForStatic(0, rows, [&](int j) {
+            size_t row = (size_t) j * rowSize;
+            for (int c = 0; c < rowSize; c++) out[row + c] = x[row + c] + 0.5 * y[row + c];
+         }, numThreads, pin);
+      }
+      double axpySeconds = (secondsNow() - start) / reps;
+
+      start = secondsNow();
+      for (int r = 0; r < reps; r++)
+      {
+         parallelForStatic(0, rows, [&](int j) {
+            for (int k = 0; k < n; k++)
+            {
+               size_t row = (size_t) j * rowSize + (size_t) k * n;
+               for (int i = 0; i < n; i++)
+               {
+                  size_t c = row + i;
+                  double sum = 6.0 * x[c];
+                  if (i > 0) sum -= x[c - 1];
+                  if (i < n - 1) sum -= x[c + 1];
+                  if (k > 0) sum -= x[c - n];
+                  if (k < n - 1) sum -= x[c + n];
+                  if (j > 0) sum -= x[c - rowSize];
+                  if (j < rows - 1) sum -= x[c + rowSize];
+                  out[c] = sum;
+               }
+            }
+         }, numThreads, pin);
+      }
+      double stencilSeconds = (secondsNow() - start) / reps;
+
+      // Bytes each pass has to move at least once: 3 streams for the axpy,
+      // 2 for the stencil (neighbours come from cache).
+      double gb = cells * sizeof(double) / 1e9;
+      PRINT_LINE("  " << names[mode] << ": fill " << 1000.0 * fillSeconds << " ms, axpy "
+         << 1000.0 * axpySeconds << " ms (" << 3 * gb / axpySeconds << " GB/s), stencil "
+         << 1000.0 * stencilSeconds << " ms (" << 2 * gb / stencilSeconds << " GB/s), "
+         << hugeMegabytes << " MB in huge pages");
+   }
+   GridStorage::setPolicy(saved);
+}
+
+static void usage()
+{
+   PRINT_LINE("usage: smoke_headless [options]\n"
+      "  -frames N             steps to run (default 100)\n"
+      "  -obstacle SHAPE       add sphere:x,y,z,r or box:x0,y0,z0,x1,y1,z1 (world units, repeatable)\n"
+      "  -obstacle-file FILE   load an obstacle mask (see obstacle_mask.h)\n"
+      "  -restore FILE         start from a checkpoint\n"
+      "  -checkpoint FILE      checkpoint file (default smoke.chk)\n"
+      "  -checkpoint-every N   write a checkpoint every N steps (default 0, never)\n"
+      "  -cache FILE           stream every step to a volume cache\n"
+      "  -cache-bits 0|8|16    cache encoding, 0 = raw float32 (default 0)\n"
+      "  -cache-verify         decode quantized frames and fail the run if any exceeds the error bound\n"
+      "  -cache-empty T        quantized tiles within T of zero are stored empty (default 1e-4)\n"
+      "  -publish NAME         publish every step to shared memory segment NAME\n"
+      "  -render-every N       ray march smoke_NNNN.png every N steps (default 0, never)\n"
+      "  -render-size WxH      rendered image size (default 640x480)\n"
+      "  -light                self shadow renders with a light transmittance grid\n"
+      "  -upres N              wavelet turbulence upsampling of density by N per axis\n"
+      "  -upres-cache FILE     volume cache for the upsampled density (default smoke_upres.svol)\n"
+      "  -upres-strength S     turbulence strength (default 1)\n"
+      "  -advection SCHEME     semi-lagrangian, maccormack or bfecc (default semi-lagrangian)\n"
+      "  -telemetry FILE       write per-step solver telemetry as CSV\n"
+      "  -telemetry-every N    divergence and CFL every N steps (default 1, 0 = never)\n"
+      "  -generic-kernels      don't use the kernels compiled for fixed grid sizes\n"
+      "  -serial-fill          fill grid storage on one thread (default: parallel first touch)\n"
+      "  -huge-pages           back large grid fields with transparent huge pages\n"
+      "  -pin-threads          bind each grid row block to its own CPU (see grid_storage.h)\n"
+      "  -storage-bench N      time grid storage policies on N^3 fields and exit");
+}
+
+int main(int argc, char **argv)
+{
+   int frames = 100;
+   int checkpointEvery = 0;
+   int cacheBits = 0;
+   bool cacheVerify = false;
+   float cacheEmpty = -1.0f;
+   std::string checkpointFile = "smoke.chk";
+   std::string restoreFile;
+   std::string cacheFile;
+   std::string publishName;
+   int renderEvery = 0;
+   int renderWidth = 640, renderHeight = 480;
+   bool light = false;
+   int upres = 0;
+   double upresStrength = 1.0;
+   std::string upresCache = "smoke_upres.svol";
+   ObstacleMask obstacles;
+   GridStorage::Policy storage;
+   int storageBench = 0;
+   MACGrid::Parameters params;
+   std::string telemetryFile;
+   int telemetryEvery = 1;
+
+   for (int a = 1; a < argc; a++)
+   {
+      bool hasValue = a + 1 < argc;
+      if (!strcmp(argv[a], "-frames") && hasValue) frames = atoi(argv[++a]);
+      else if (!strcmp(argv[a], "-obstacle") && hasValue)
+      {
+         if (!obstacles.addShape(argv[++a])) return 1;
+      }
+      else if (!strcmp(argv[a], "-obstacle-file") && hasValue)
+      {
+         if (!obstacles.load(argv[++a])) return 1;
+      }
+      else if (!strcmp(argv[a], "-restore") && hasValue) restoreFile = argv[++a];
+      else if (!strcmp(argv[a], "-checkpoint") && hasValue) checkpointFile = argv[++a];
+      else if (!strcmp(argv[a], "-checkpoint-every") && hasValue) checkpointEvery = atoi(argv[++a]);
+      else if (!strcmp(argv[a], "-cache") && hasValue) cacheFile = argv[++a];
+      else if (!strcmp(argv[a], "-cache-bits") && hasValue) cacheBits = atoi(argv[++a]);
+      else if (!strcmp(argv[a], "-cache-verify")) cacheVerify = true;
+      else if (!strcmp(argv[a], "-cache-empty") && hasValue) cacheEmpty = (float) atof(argv[++a]);
+      else if (!strcmp(argv[a], "-publish") && hasValue) publishName = argv[++a];
+      else if (!strcmp(argv[a], "-render-every") && hasValue) renderEvery = atoi(argv[++a]);
+      else if (!strcmp(argv[a], "-render-size") && hasValue &&
+         sscanf(argv[++a], "%dx%d", &renderWidth, &renderHeight) == 2) {}
+      else if (!strcmp(argv[a], "-light")) light = true;
+      else if (!strcmp(argv[a], "-upres") && hasValue) upres = atoi(argv[++a]);
+      else if (!strcmp(argv[a], "-upres-cache") && hasValue) upresCache = argv[++a];
+      else if (!strcmp(argv[a], "-upres-strength") && hasValue) upresStrength = atof(argv[++a]);
+      else if (!strcmp(argv[a], "-advection") && hasValue && MACGrid::parseAdvection(argv[++a], params.advection)) {}
+      else if (!strcmp(argv[a], "-telemetry") && hasValue) telemetryFile = argv[++a];
+      else if (!strcmp(argv[a], "-telemetry-every") && hasValue) telemetryEvery = atoi(argv[++a]);
+      else if (!strcmp(argv[a], "-generic-kernels")) FixedGridKernels::setEnabled(false);
+      else if (!strcmp(argv[a], "-serial-fill")) storage.firstTouch = false;
+      else if (!strcmp(argv[a], "-huge-pages")) storage.hugePages = true;
+      else if (!strcmp(argv[a], "-pin-threads")) storage.pinThreads = true;
+      else if (!strcmp(argv[a], "-storage-bench") && hasValue) storageBench = atoi(argv[++a]);
+      else
+      {
+         usage();
+         return 1;
+      }
+   }
+
+   // Before any grid is allocated.
+   GridStorage::setPolicy(storage);
+   if (storageBench > 0)
+   {
+      storageBenchmark(storageBench, 5);
+      return 0;
+   }
+
+   SmokeSim sim;
+   sim.setParameters(params);
+   if (!obstacles.empty())
+   {
+      sim.setObstacles(obstacles);
+      int numCells = theDim[0]*theDim[1]*theDim[2];
+      PRINT_LINE("Obstacles: " << obstacles.countSolid() << " solid cells, pressure solve over "
+         << sim.getGrid().getNumFluidCells() << " of " << numCells << " cells");
+   }
+
+   if (!restoreFile.empty())
+   {
+      double start = secondsNow();
+      if (!sim.restore(restoreFile.c_str())) return 1;
+      PRINT_LINE("Restored " << restoreFile << " at step " << sim.getTotalFrames()
+         << " in " << 1000.0 * (secondsNow() - start) << " ms");
+   }
+
+   VolumeCache::Encoding encoding = VolumeCache::RAW_FLOAT32;
+   if (cacheBits == 8) encoding = VolumeCache::QUANTIZED8;
+   else if (cacheBits == 16) encoding = VolumeCache::QUANTIZED16;
+   sim.setCacheVerify(cacheVerify);
+   if (cacheEmpty >= 0.0f) sim.setCacheEmptyThreshold(cacheEmpty);
+   if (!cacheFile.empty())
+   {
+      sim.setCacheFile(cacheFile.c_str(), VolumeCache::DEFAULT_CHANNELS, encoding);
+   }
+
+   // Upsampling runs after every coarse step and streams its own cache.
+   WaveletTurbulence* turbulence = NULL;
+   VolumeCacheWriter upresWriter;
+   double upresSeconds = 0.0;
+   if (upres > 0)
+   {
+      turbulence = new WaveletTurbulence(upres);
+      turbulence->setStrength(upresStrength);
+      upresWriter.setVerify(cacheVerify);
+      if (cacheEmpty >= 0.0f) upresWriter.setEmptyThreshold(cacheEmpty);
+      upresWriter.open(upresCache.c_str(), turbulence->getDim(), turbulence->getCellSize(),
+         VolumeCache::DENSITY_BIT, encoding);
+   }
+
+   if (!publishName.empty())
+   {
+      sim.setPublishName(publishName.c_str());
+   }
+
+   // Keep every step of this run when it goes to a file.
+   SolverTelemetry& telemetry = sim.getTelemetry();
+   if (!telemetryFile.empty()) telemetry.setCapacity(std::max(frames, 1));
+   telemetry.setSampleEvery(telemetryEvery);
+
+   PRINT_LINE("Simulating " << frames << " steps on a " << theDim[0] << "x" << theDim[1]
+      << "x" << theDim[2] << " grid, " << MACGrid::advectionName(params.advection) << " advection"
+      << (FixedGridKernels::isEnabled() && FixedGridKernels::find(theDim[0], theDim[1], theDim[2])?
+         ", fixed-size kernels" : ""));
+
+   VolumeRenderer renderer;
+   renderer.setResolution(renderWidth, renderHeight);
+   TransmittanceGrid lighting;
+   double renderSeconds = 0.0, lightSeconds = 0.0;
+   int renders = 0;
+
+   double stepSeconds = 0.0;
+   double checkpointSeconds = 0.0, checkpointMax = 0.0;
+   int checkpoints = 0;
+   double runStart = secondsNow();
+
+   for (int f = 0; f < frames; f++)
+   {
+      double start = secondsNow();
+      sim.step();
+      stepSeconds += secondsNow() - start;
+
+      if (turbulence)
+      {
+         start = secondsNow();
+         turbulence->step(sim.getGrid(), theTimeStep);
+         upresWriter.writeDensity(turbulence->getDensity(), sim.getTotalFrames() - 1);
+         upresSeconds += secondsNow() - start;
+      }
+
+      if (checkpointEvery > 0 && sim.getTotalFrames() % checkpointEvery == 0)
+      {
+         start = secondsNow();
+         sim.checkpoint(checkpointFile.c_str());
+         double pause = secondsNow() - start;
+         checkpointSeconds += pause;
+         checkpointMax = std::max(checkpointMax, pause);
+         checkpoints++;
+      }
+
+      if (renderEvery > 0 && sim.getTotalFrames() % renderEvery == 0)
+      {
+         char fileName[2048];
+         sprintf(fileName, "smoke_%04d.png", sim.getTotalFrames());
+         if (light)
+         {
+            double lightStart = secondsNow();
+            lighting.compute(sim.getGrid().getDensityGrid());
+            lightSeconds += secondsNow() - lightStart;
+         }
+         renderer.render(sim.getGrid().getDensityGrid(), light? &lighting.values() : NULL);
+         renderer.savePng(fileName);
+         renderSeconds += renderer.getStats().seconds;
+         renders++;
+      }
+   }
+
+   sim.flush();
+   double runSeconds = secondsNow() - runStart;
+
+   sim.setCacheFile(NULL);
+   PRINT_LINE("Steps: " << frames << ", " << 1000.0 * stepSeconds / std::max(1, frames)
+      << " ms/step, " << runSeconds << " s total");
+   if (telemetry.size() > 0)
+   {
+      int iterations = 0, unconverged = 0;
+      double maxDivergence = 0.0, maxCfl = 0.0;
+      for (int n = 0; n < telemetry.size(); n++)
+      {
+         const SolverTelemetry::StepRecord& r = telemetry.get(n);
+         iterations += r.cgIterations;
+         if (!r.converged) unconverged++;
+         if (r.sampled)
+         {
+            maxDivergence = std::max(maxDivergence, r.maxDivergence);
+            maxCfl = std::max(maxCfl, r.cfl);
+         }
+      }
+      PRINT_LINE("Pressure solve: " << (double) iterations / telemetry.size() << " CG iterations/step, "
+         << unconverged << " unconverged, max divergence " << maxDivergence << ", max CFL " << maxCfl);
+      if (!telemetryFile.empty())
+      {
+         if (telemetry.writeCsv(telemetryFile.c_str())) PRINT_LINE("Telemetry: " << telemetryFile);
+         else PRINT_LINE("Couldn't write " << telemetryFile);
+      }
+   }
+   if (checkpoints > 0)
+   {
+      PRINT_LINE("Checkpoints: " << checkpoints << ", pause " << 1000.0 * checkpointSeconds / checkpoints
+         << " ms avg, " << 1000.0 * checkpointMax << " ms max");
+   }
+   if (turbulence)
+   {
+      const int* dim = turbulence->getDim();
+      upresWriter.close();
+      PRINT_LINE("Upsampling: " << dim[0] << "x" << dim[1] << "x" << dim[2] << ", "
+         << 1000.0 * upresSeconds / std::max(1, frames) << " ms/step into " << upresCache);
+      upresWriter.printStats();
+      delete turbulence;
+   }
+   if (renders > 0)
+   {
+      PRINT_LINE("Renders: " << renders << ", " << 1000.0 * renderSeconds / renders << " ms/frame at "
+         << renderWidth << "x" << renderHeight << ", " << renderer.getStats().samples << " samples in the last frame");
+      if (light) PRINT_LINE("Lighting: " << 1000.0 * lightSeconds / renders << " ms/frame");
+   }
+
+   int verifyFailures = sim.getCacheVerifyFailures() + upresWriter.getVerifyFailures();
+   if (verifyFailures > 0)
+   {
+      PRINT_LINE("Cache verification failed: " << verifyFailures << " channel(s) over the error bound");
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,635 @@
+// Microbenchmarks for the smoke solver's building blocks, on Google Benchmark.
+//
+//   make smoke_bench
+//   bin/smoke_bench --benchmark_out=bench.json --benchmark_out_format=json
+//
+// Two commits' JSON files can be diffed with Google Benchmark's
+// tools/compare.py.  Kernels, each at 32^3, 64^3 and 128^3 (the stages that
+// rewrite whole grids stop at 64^3):
+//
+//   Interpolate    GridData::interpolate on a centered, X, Y and Z face grid,
+//                  lookups in storage order (coherent) or shuffled (scattered)
+//   Apply          MACGrid::apply, the pressure matrix-vector product
+//   DotProduct     MACGrid::dotProduct
+//   AdvectVelocity, AdvectDensity, VorticityConfinement
+//                  the MACGrid stages, one call per iteration
+//
+// Apply and DotProduct also run with a solid sphere in the middle of the
+// grid.  Apply, AdvectVelocity and AdvectDensity run once with the kernels
+// compiled for the grid size (fixed:1, see fixed_grid_kernels.h; 128^3 has
+// none, so it stays generic) and once with the generic ones (fixed:0).
+// Every benchmark reports cells/s (items_per_second) and the bytes/s a
+// kernel has to move at the least (bytes_per_second, from the per-cell
+// figures next to each benchmark), which is a floor on its real traffic.
+//
+// Before anything is timed, every kernel is checked against the plain
+// reference implementations below on the compiled-in theDim, which has
+// fixed-size kernels, and on a 24x32x16 grid, which doesn't.  The largest
+// difference, relative to the largest reference magnitude, must be within
+// kTolerance; if not, smoke_bench exits with status 1.  --verify-only stops
+// after the check.
+
+#include <benchmark/benchmark.h>
+#include "mac_grid.h"
+#include "obstacle_mask.h"
+#include "constants.h"
+#include "custom_output.h"
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+static const double kTolerance = 1e-12;
+
+enum Layout { CENTER, FACE_X, FACE_Y, FACE_Z };
+static const char* layoutName(int layout)
+{
+   static const char* names[] = { "center", "faceX", "faceY", "faceZ" };
+   return names[layout];
+}
+
+static double noise(unsigned int& state)
+{
+   state = state * 1664525u + 1013904223u;
+   return (state >> 8) / 16777216.0;
+}
+
+//---------------------------------------------------------------------
+// MACGrid with its kernels opened up
+//---------------------------------------------------------------------
+
+class BenchGrid : public MACGrid
+{
+public:
+   using MACGrid::apply;
+   using MACGrid::dotProduct;
+   using MACGrid::computeVorticityConfinement;
+
+   // Smooth swirl plus noise, about one cell of travel per theTimeStep.
+   void randomize(unsigned int seed)
+   {
+      unsigned int state = seed;
+      GridData* fields[6] = { &mU, &mV, &mW, &mD, &mT, &mP };
+      for (int f = 0; f < 6; f++)
+      {
+         GridData::Storage& values = fields[f]->data();
+         for (size_t n = 0; n < values.size(); n++)
+         {
+            double phase = 0.002 * n + f;
+            values[n] = f < 3? 20.0 * sin(phase) + 5.0 * (noise(state) - 0.5) : noise(state);
+         }
+      }
+   }
+
+   GridData& field(int layout)
+   {
+      GridData* fields[4] = { &mD, &mU, &mV, &mW };
+      return *fields[layout];
+   }
+   const GridDataMatrix& matrix() const { return AMatrix; }
+   GridData& pressure() { return mP; }
+
+   // Stages that overwrite the fields start every timed call from here.
+   void save() { mSaved.reset(new BenchGrid::Saved(mU, mV, mW, mD)); }
+   void restore() { mU = mSaved->u; mV = mSaved->v; mW = mSaved->w; mD = mSaved->d; }
+
+protected:
+   struct Saved
+   {
+      Saved(const GridDataX& u_, const GridDataY& v_, const GridDataZ& w_, const GridData& d_) :
+         u(u_), v(v_), w(w_), d(d_) {}
+      GridDataX u;
+      GridDataY v;
+      GridDataZ w;
+      GridData d;
+   };
+   std::shared_ptr<Saved> mSaved;
+};
+
+// Grids are expensive to set up at 128^3, and Google Benchmark calls each
+// benchmark function several times while it settles on an iteration count,
+// so the last grid is kept.
+static BenchGrid& benchGrid(int x, int y, int z, bool obstacle)
+{
+   static std::unique_ptr<BenchGrid> grid;
+   static int key[4] = { 0, 0, 0, -1 };
+   if (!grid || key[0] != x || key[1] != y || key[2] != z || key[3] != (int) obstacle)
+   {
+      grid.reset();
+      setGridDim(x, y, z);
+      grid.reset(new BenchGrid());
+      grid->randomize(12345);
+      if (obstacle)
+      {
+         ObstacleMask mask;
+         mask.addSphere(vec3(0.5*x, 0.5*y, 0.5*z)*theCellSize, 0.3 * std::min(x, std::min(y, z))*theCellSize);
+         grid->setObstacles(mask);
+      }
+      grid->save();
+      key[0] = x; key[1] = y; key[2] = z; key[3] = obstacle;
+   }
+   return *grid;
+}
+
+static int numCells()
+{
+   return theDim[0]*theDim[1]*theDim[2];
+}
+
+//---------------------------------------------------------------------
+// Reference implementations
+//---------------------------------------------------------------------
+
+// Samples along each axis of a field with the given layout.
+static void layoutSize(int layout, int size[3])
+{
+   for (int a = 0; a < 3; a++) size[a] = theDim[a] + (layout == a + 1? 1 : 0);
+}
+
+// GridData's out-of-grid rules: centered fields are 0 outside, face fields
+// are 0 past their normal axis and clamp the other two.
+static double refValue(const double* data, int layout, int i, int j, int k)
+{
+   int size[3];
+   layoutSize(layout, size);
+   int idx[3] = { i, j, k };
+   for (int a = 0; a < 3; a++)
+   {
+      bool normal = layout == a + 1;
+      if (layout == CENTER || normal)
+      {
+         if (idx[a] < 0 || idx[a] >= size[a]) return 0.0;
+      }
+      else
+      {
+         idx[a] = std::max(0, std::min(idx[a], size[a] - 1));
+      }
+   }
+   return data[idx[0] + idx[2]*size[0] + idx[1]*size[0]*size[2]];
+}
+
+// Trilinear lookup at a world position; samples sit at cell centers except
+// along a face grid's normal axis.
+static double refInterpolate(const double* data, int layout, const vec3& pt)
+{
+   int size[3];
+   layoutSize(layout, size);
+   int cell[3];
+   double frac[3];
+   for (int a = 0; a < 3; a++)
+   {
+      double offset = layout == a + 1? 0.0 : 0.5*theCellSize;
+      double pos = std::min(std::max(0.0, pt[a] - offset), theCellSize*size[a]);
+      cell[a] = (int) (pos / theCellSize);
+      frac[a] = (pos - cell[a]*theCellSize) / theCellSize;
+   }
+   double corner[2][2][2];
+   for (int di = 0; di < 2; di++)
+      for (int dj = 0; dj < 2; dj++)
+         for (int dk = 0; dk < 2; dk++)
+            corner[di][dj][dk] = refValue(data, layout, cell[0] + di, cell[1] + dj, cell[2] + dk);
+   // y first, then x, then z, as GridData::interpolate does
+   double x0z0 = (1 - frac[1])*corner[0][0][0] + frac[1]*corner[0][1][0];
+   double x1z0 = (1 - frac[1])*corner[1][0][0] + frac[1]*corner[1][1][0];
+   double x0z1 = (1 - frac[1])*corner[0][0][1] + frac[1]*corner[0][1][1];
+   double x1z1 = (1 - frac[1])*corner[1][0][1] + frac[1]*corner[1][1][1];
+   double z0 = (1 - frac[0])*x0z0 + frac[0]*x1z0;
+   double z1 = (1 - frac[0])*x0z1 + frac[0]*x1z1;
+   return (1 - frac[2])*z0 + frac[2]*z1;
+}
+
+static vec3 refVelocity(const double* u, const double* v, const double* w, const vec3& pt)
+{
+   return vec3(refInterpolate(u, FACE_X, pt), refInterpolate(v, FACE_Y, pt), refInterpolate(w, FACE_Z, pt));
+}
+
+static int refIndex(int i, int j, int k)
+{
+   return i + k*theDim[0] + j*theDim[0]*theDim[2];
+}
+
+// 7-point product over the cells with a nonzero diagonal, by (i, j, k).
+static void refApply(const GridDataMatrix& A, const double* x, std::vector<double>& out)
+{
+   const double* diag = &A.diag.data()[0];
+   const double* plus[3] = { &A.plusI.data()[0], &A.plusJ.data()[0], &A.plusK.data()[0] };
+   out.assign(numCells(), 0.0);
+   for (int j = 0; j < theDim[1]; j++)
+      for (int k = 0; k < theDim[2]; k++)
+         for (int i = 0; i < theDim[0]; i++)
+         {
+            int n = refIndex(i, j, k);
+            if (diag[n] == 0) continue;
+            double sum = diag[n] * x[n];
+            int idx[3] = { i, j, k };
+            for (int a = 0; a < 3; a++)
+            {
+               int up[3] = { i, j, k }, down[3] = { i, j, k };
+               up[a]++;
+               down[a]--;
+               if (idx[a] + 1 < theDim[a]) sum += plus[a][n] * x[refIndex(up[0], up[1], up[2])];
+               if (idx[a] > 0)
+               {
+                  int m = refIndex(down[0], down[1], down[2]);
+                  sum += plus[a][m] * x[m];
+               }
+            }
+            out[n] = sum;
+         }
+}
+
+static void refAdvectDensity(const double* u, const double* v, const double* w, const double* d,
+   double dt, std::vector<double>& out)
+{
+   out.assign(numCells(), 0.0);
+   for (int j = 0; j < theDim[1]; j++)
+      for (int k = 0; k < theDim[2]; k++)
+         for (int i = 0; i < theDim[0]; i++)
+         {
+            vec3 pt = (vec3(i, j, k) + vec3(0.5, 0.5, 0.5)) * theCellSize;
+            vec3 back = pt - dt * refVelocity(u, v, w, pt);
+            out[refIndex(i, j, k)] = refInterpolate(d, CENTER, back);
+         }
+}
+
+// One velocity component advected along the full velocity.
+static void refAdvectFace(int layout, const double* u, const double* v, const double* w, double dt,
+   std::vector<double>& out)
+{
+   int size[3];
+   layoutSize(layout, size);
+   out.assign(size[0]*size[1]*size[2], 0.0);
+   for (int j = 0; j < size[1]; j++)
+      for (int k = 0; k < size[2]; k++)
+         for (int i = 0; i < size[0]; i++)
+         {
+            vec3 pt(i, j, k);
+            for (int a = 0; a < 3; a++) pt[a] = (pt[a] + (layout == a + 1? 0.0 : 0.5)) * theCellSize;
+            vec3 back = pt - dt * refVelocity(u, v, w, pt);
+            out[i + k*size[0] + j*size[0]*size[2]] = refVelocity(u, v, w, back)[layout - 1];
+         }
+}
+
+// Vorticity confinement: central-difference curl at cell centers, gradient
+// of its 1-norm (edges replicate), force = epsilon * (N x w), interpolated
+// to the interior faces.
+static void refVorticity(const double* u, const double* v, const double* w, double epsilon, double dt,
+   std::vector<double> out[3])
+{
+   int cells = numCells();
+   std::vector<double> curl[3], force[3];
+   for (int a = 0; a < 3; a++)
+   {
+      curl[a].assign(cells, 0.0);
+      force[a].assign(cells, 0.0);
+   }
+
+   double h = theCellSize;
+   for (int j = 0; j < theDim[1]; j++)
+      for (int k = 0; k < theDim[2]; k++)
+         for (int i = 0; i < theDim[0]; i++)
+         {
+            vec3 pt = (vec3(i, j, k) + vec3(0.5, 0.5, 0.5)) * h;
+            vec3 ip = refVelocity(u, v, w, pt + vec3(h, 0, 0)), im = refVelocity(u, v, w, pt - vec3(h, 0, 0));
+            vec3 jp = refVelocity(u, v, w, pt + vec3(0, h, 0)), jm = refVelocity(u, v, w, pt - vec3(0, h, 0));
+            vec3 kp = refVelocity(u, v, w, pt + vec3(0, 0, h)), km = refVelocity(u, v, w, pt - vec3(0, 0, h));
+            int n = refIndex(i, j, k);
+            curl[0][n] = ((jp[2] - jm[2]) - (kp[1] - km[1])) / (2 * h);
+            curl[1][n] = ((kp[0] - km[0]) - (ip[2] - im[2])) / (2 * h);
+            curl[2][n] = ((ip[1] - im[1]) - (jp[0] - jm[0])) / (2 * h);
+         }
+
+   for (int j = 0; j < theDim[1]; j++)
+      for (int k = 0; k < theDim[2]; k++)
+         for (int i = 0; i < theDim[0]; i++)
+         {
+            int n = refIndex(i, j, k);
+            vec3 wc(curl[0][n], curl[1][n], curl[2][n]);
+            int idx[3] = { i, j, k };
+            double grad[3];
+            for (int a = 0; a < 3; a++)
+            {
+               int up[3] = { i, j, k }, down[3] = { i, j, k };
+               if (idx[a] + 1 < theDim[a]) up[a]++;
+               if (idx[a] > 0) down[a]--;
+               int nu = refIndex(up[0], up[1], up[2]), nd = refIndex(down[0], down[1], down[2]);
+               double normUp = fabs(curl[0][nu]) + fabs(curl[1][nu]) + fabs(curl[2][nu]);
+               double normDown = fabs(curl[0][nd]) + fabs(curl[1][nd]) + fabs(curl[2][nd]);
+               grad[a] = (normUp - normDown) / (2 * h);
+            }
+            vec3 g(grad[0], grad[1], grad[2]);
+            double length = g.Length() + 10e-20;
+            vec3 normal(grad[0] / length, grad[1] / length, grad[2] / length);
+            vec3 f = epsilon * (normal ^ wc);
+            for (int a = 0; a < 3; a++) force[a][n] = f[a];
+         }
+
+   const double* vel[3] = { u, v, w };
+   for (int a = 0; a < 3; a++)
+   {
+      int layout = a + 1;
+      int size[3];
+      layoutSize(layout, size);
+      out[a].assign(size[0]*size[1]*size[2], 0.0);
+      for (int j = 0; j < size[1]; j++)
+         for (int k = 0; k < size[2]; k++)
+            for (int i = 0; i < size[0]; i++)
+            {
+               int idx[3] = { i, j, k };
+               int n = i + k*size[0] + j*size[0]*size[2];
+               out[a][n] = vel[a][n];
+               if (idx[a] == 0 || idx[a] == theDim[a]) continue;
+               vec3 pt(i, j, k);
+               for (int b = 0; b < 3; b++) pt[b] = (pt[b] + (b == a? 0.0 : 0.5)) * h;
+               out[a][n] = vel[a][n] + dt * refInterpolate(&force[a][0], CENTER, pt);
+            }
+   }
+}
+
+//---------------------------------------------------------------------
+// Verification
+//---------------------------------------------------------------------
+
+// Largest |a - b| over the largest |b|.
+template <class A, class B>
+static double relativeError(const A& a, const B& b)
+{
+   double diff = 0.0, scale = 0.0;
+   for (size_t n = 0; n < b.size(); n++)
+   {
+      diff = std::max(diff, fabs(a[n] - b[n]));
+      scale = std::max(scale, fabs(b[n]));
+   }
+   return a.size() != b.size()? HUGE_VAL : diff / std::max(scale, 1e-300);
+}
+
+static bool report(const char* kernel, const int dim[3], double error, bool& ok)
+{
+   bool pass = error <= kTolerance;
+   char line[256];
+   sprintf(line, "  %-22s %3dx%3dx%3d  error %.3g %s", kernel, dim[0], dim[1], dim[2], error, pass? "ok" : "FAILED");
+   PRINT_LINE(line);
+   ok = ok && pass;
+   return pass;
+}
+
+static bool verifyAt(int x, int y, int z)
+{
+   bool ok = true;
+   const int dim[3] = { x, y, z };
+   double dt = theTimeStep;
+
+   // Lookups at every cell, offset so they land between samples and some
+   // fall outside the grid.
+   {
+      BenchGrid& grid = benchGrid(x, y, z, false);
+      for (int layout = CENTER; layout <= FACE_Z; layout++)
+      {
+         GridData& field = grid.field(layout);
+         std::vector<double> got, want;
+         unsigned int state = 7;
+         for (int n = 0; n < numCells(); n++)
+         {
+            vec3 pt(noise(state) * (x + 2) - 1, noise(state) * (y + 2) - 1, noise(state) * (z + 2) - 1);
+            pt *= theCellSize;
+            got.push_back(field.interpolate(pt));
+            want.push_back(refInterpolate(&field.data()[0], layout, pt));
+         }
+         char name[64];
+         sprintf(name, "Interpolate/%s", layoutName(layout));
+         report(name, dim, relativeError(got, want), ok);
+      }
+   }
+
+   for (int obstacle = 0; obstacle < 2; obstacle++)
+   {
+      BenchGrid& grid = benchGrid(x, y, z, obstacle != 0);
+      GridData& p = grid.pressure();
+      GridData out(p);
+      std::vector<double> want;
+      refApply(grid.matrix(), &p.data()[0], want);
+      std::fill(out.data().begin(), out.data().end(), 0.0);
+      grid.apply(grid.matrix(), p, out);
+      report(obstacle? "Apply/obstacle" : "Apply", dim, relativeError(out.data(), want), ok);
+
+      // Dot product: error relative to the sum of |terms|.
+      GridData& d = grid.field(CENTER);
+      const double* diag = &grid.matrix().diag.data()[0];
+      long double sum = 0.0, magnitude = 0.0;
+      for (int n = 0; n < numCells(); n++)
+      {
+         if (diag[n] == 0) continue;
+         sum += (long double) p.data()[n] * d.data()[n];
+         magnitude += fabsl((long double) p.data()[n] * d.data()[n]);
+      }
+      double error = fabs((double) (grid.dotProduct(p, d) - sum)) / std::max((double) magnitude, 1e-300);
+      report(obstacle? "DotProduct/obstacle" : "DotProduct", dim, error, ok);
+   }
+
+   {
+      BenchGrid& grid = benchGrid(x, y, z, false);
+      std::vector<double> want;
+      grid.restore();
+      refAdvectDensity(&grid.field(FACE_X).data()[0], &grid.field(FACE_Y).data()[0],
+         &grid.field(FACE_Z).data()[0], &grid.field(CENTER).data()[0], dt, want);
+      grid.advectDensity(dt);
+      report("AdvectDensity", dim, relativeError(grid.field(CENTER).data(), want), ok);
+
+      grid.restore();
+      std::vector<double> wantFaces[3];
+      for (int a = 0; a < 3; a++)
+      {
+         refAdvectFace(a + 1, &grid.field(FACE_X).data()[0], &grid.field(FACE_Y).data()[0],
+            &grid.field(FACE_Z).data()[0], dt, wantFaces[a]);
+      }
+      grid.advectVelocity(dt);
+      double error = 0.0;
+      for (int a = 0; a < 3; a++) error = std::max(error, relativeError(grid.field(a + 1).data(), wantFaces[a]));
+      report("AdvectVelocity", dim, error, ok);
+
+      grid.restore();
+      refVorticity(&grid.field(FACE_X).data()[0], &grid.field(FACE_Y).data()[0],
+         &grid.field(FACE_Z).data()[0], grid.getParameters().vorticityEpsilon, dt, wantFaces);
+      grid.computeVorticityConfinement(dt);
+      error = 0.0;
+      for (int a = 0; a < 3; a++) error = std::max(error, relativeError(grid.field(a + 1).data(), wantFaces[a]));
+      report("VorticityConfinement", dim, error, ok);
+      grid.restore();
+   }
+   return ok;
+}
+
+//---------------------------------------------------------------------
+// Benchmarks
+//---------------------------------------------------------------------
+
+// Selects fixed-size or generic kernels for one benchmark run.
+class KernelChoice
+{
+public:
+   explicit KernelChoice(bool fixed) { FixedGridKernels::setEnabled(fixed); }
+   ~KernelChoice() { FixedGridKernels::setEnabled(true); }
+};
+
+static void setCounters(benchmark::State& state, double cells, double bytesPerCell)
+{
+   state.SetItemsProcessed((int64_t) (state.iterations() * cells));
+   state.SetBytesProcessed((int64_t) (state.iterations() * cells * bytesPerCell));
+}
+
+// 8 samples of 8 bytes per lookup.
+static void Interpolate(benchmark::State& state)
+{
+   int n = (int) state.range(0), layout = (int) state.range(1);
+   bool scattered = state.range(2) != 0;
+   BenchGrid& grid = benchGrid(n, n, n, false);
+   GridData& field = grid.field(layout);
+
+   std::vector<vec3> points;
+   points.reserve(numCells());
+   for (int j = 0; j < n; j++)
+      for (int k = 0; k < n; k++)
+         for (int i = 0; i < n; i++)
+            points.push_back(vec3(i + 0.3, j + 0.6, k + 0.2) * theCellSize);
+   if (scattered)
+   {
+      unsigned int seed = 99;
+      for (size_t p = points.size() - 1; p > 0; p--) std::swap(points[p], points[(size_t) (noise(seed) * (p + 1))]);
+   }
+
+   for (auto _ : state)
+   {
+      double sum = 0.0;
+      for (size_t p = 0; p < points.size(); p++) sum += field.interpolate(points[p]);
+      benchmark::DoNotOptimize(sum);
+   }
+   setCounters(state, (double) points.size(), 64.0);
+   state.SetLabel(std::string(layoutName(layout)) + (scattered? " scattered" : " coherent"));
+}
+BENCHMARK(Interpolate)->ArgsProduct({ { 32, 64, 128 }, { CENTER, FACE_X, FACE_Y, FACE_Z }, { 0, 1 } })
+   ->ArgNames({ "n", "layout", "scattered" })->Unit(benchmark::kMillisecond);
+
+// diag, plusI, plusJ, plusK and x read, result written: 48 bytes per fluid cell.
+static void Apply(benchmark::State& state)
+{
+   int n = (int) state.range(0);
+   BenchGrid& grid = benchGrid(n, n, n, state.range(1) != 0);
+   KernelChoice kernels(state.range(2) != 0);
+   GridData& p = grid.pressure();
+   GridData out(p);
+   for (auto _ : state)
+   {
+      grid.apply(grid.matrix(), p, out);
+      benchmark::ClobberMemory();
+   }
+   setCounters(state, grid.getNumFluidCells(), 48.0);
+}
+BENCHMARK(Apply)->ArgsProduct({ { 32, 64, 128 }, { 0, 1 }, { 0, 1 } })->ArgNames({ "n", "obstacle", "fixed" })
+   ->Unit(benchmark::kMillisecond);
+
+// Two vectors read: 16 bytes per fluid cell.
+static void DotProduct(benchmark::State& state)
+{
+   int n = (int) state.range(0);
+   BenchGrid& grid = benchGrid(n, n, n, state.range(1) != 0);
+   GridData& a = grid.pressure();
+   GridData& b = grid.field(CENTER);
+   for (auto _ : state)
+   {
+      double dot = grid.dotProduct(a, b);
+      benchmark::DoNotOptimize(dot);
+   }
+   setCounters(state, grid.getNumFluidCells(), 16.0);
+}
+BENCHMARK(DotProduct)->ArgsProduct({ { 32, 64, 128 }, { 0, 1 } })->ArgNames({ "n", "obstacle" })
+   ->Unit(benchmark::kMillisecond);
+
+// The stages below overwrite their fields; each timed call starts from the
+// same saved state.
+
+// Three velocity components read, one written, per component: 96 bytes per cell.
+static void AdvectVelocity(benchmark::State& state)
+{
+   int n = (int) state.range(0);
+   BenchGrid& grid = benchGrid(n, n, n, false);
+   KernelChoice kernels(state.range(1) != 0);
+   for (auto _ : state)
+   {
+      state.PauseTiming();
+      grid.restore();
+      state.ResumeTiming();
+      grid.advectVelocity(theTimeStep);
+   }
+   setCounters(state, numCells(), 96.0);
+}
+BENCHMARK(AdvectVelocity)->ArgsProduct({ { 32, 64 }, { 0, 1 } })->ArgNames({ "n", "fixed" })
+   ->Unit(benchmark::kMillisecond);
+
+// Three velocity components and density read, density written: 40 bytes per cell.
+static void AdvectDensity(benchmark::State& state)
+{
+   int n = (int) state.range(0);
+   BenchGrid& grid = benchGrid(n, n, n, false);
+   KernelChoice kernels(state.range(1) != 0);
+   for (auto _ : state)
+   {
+      state.PauseTiming();
+      grid.restore();
+      state.ResumeTiming();
+      grid.advectDensity(theTimeStep);
+   }
+   setCounters(state, numCells(), 40.0);
+}
+BENCHMARK(AdvectDensity)->ArgsProduct({ { 32, 64 }, { 0, 1 } })->ArgNames({ "n", "fixed" })
+   ->Unit(benchmark::kMillisecond);
+
+// Three velocity components read and written: 48 bytes per cell.
+static void VorticityConfinement(benchmark::State& state)
+{
+   int n = (int) state.range(0);
+   BenchGrid& grid = benchGrid(n, n, n, false);
+   for (auto _ : state)
+   {
+      state.PauseTiming();
+      grid.restore();
+      state.ResumeTiming();
+      grid.computeVorticityConfinement(theTimeStep);
+   }
+   setCounters(state, numCells(), 48.0);
+}
+BENCHMARK(VorticityConfinement)->Arg(32)->Arg(64)->ArgName("n")->Unit(benchmark::kMillisecond);
+
+int main(int argc, char** argv)
+{
+   bool verifyOnly = false;
+   for (int a = 1; a < argc; a++)
+   {
+      if (strcmp(argv[a], "--verify-only")) continue;
+      verifyOnly = true;
+      for (int b = a; b + 1 < argc; b++) argv[b] = argv[b + 1];
+      argc--;
+      break;
+   }
+
+   const int compiled[3] = { theDim[0], theDim[1], theDim[2] };
+   PRINT_LINE("Checking kernels against the reference implementations (tolerance " << kTolerance << "):");
+   bool ok = verifyAt(compiled[0], compiled[1], compiled[2]);
+   ok = verifyAt(24, 32, 16) && ok;
+   if (!ok)
+   {
+      PRINT_LINE("Verification failed");
+      return 1;
+   }
+   if (verifyOnly) return 0;
+
+   char tolerance[32];
+   sprintf(tolerance, "%g", kTolerance);
+   benchmark::AddCustomContext("verified_tolerance", tolerance);
+   benchmark::Initialize(&argc, argv);
+   if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+   benchmark::RunSpecifiedBenchmarks();
+   benchmark::Shutdown();
+   return 0;
+}
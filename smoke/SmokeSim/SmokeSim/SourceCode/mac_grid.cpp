@@ -6,21 +6,28 @@
 #include "custom_output.h"
 #include "constants.h"
 #include <math.h>
+#include <chrono>
 #include <map>
 #include <stdio.h>
 #undef max
 #undef min
 #include <fstream>
+#include <string>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "dprint.h"
 
-// Globals:
-MACGrid target;
-
-
 // NOTE: x -> cols, z -> rows, y -> stacks
-MACGrid::RenderMode MACGrid::theRenderMode = SHEETS;
+MACGrid::RenderMode MACGrid::theRenderMode = SLICES;
 bool MACGrid::theDisplayVel = false;
+bool MACGrid::theLighting = false;
+bool MACGrid::theTemperatureColor = false;
 
 #define FOR_EACH_CELL \
   for(int k = 0; k < theDim[MACGrid::Z]; k++)  \
@@ -52,12 +59,48 @@ bool MACGrid::theDisplayVel = false;
     for (int j = 0; j < theDim[MACGrid::Y]; j++) \
       for (int i = 0; i < theDim[MACGrid::X]; i++)
 
+// The passes over whole grids below go row by row in j through
+// GridStorage::forEachRow, so each thread works on the rows whose pages it
+// first touched (see grid_storage.h).  The solver's vector operations do
+// the same over the solved cells.  Dot products and norms stay serial so
+// their sums come out the same on any number of threads.
+template <class Body>
+void MACGrid::forEachFluidRow(const Body& body) const {
+  GridStorage::forEachRow(theDim[MACGrid::Y], theDim[MACGrid::X] * theDim[MACGrid::Z], [&](int j) {
+    body(mFluidRowStart[j], mFluidRowStart[j + 1]);
+  });
+}
+
+
+MACGrid::Parameters::Parameters() :
+   buoyAlpha(::buoyAlpha), buoyBeta(::buoyBeta), vorticityEpsilon(::vorticityEpsilon),
+   advection(SEMI_LAGRANGIAN) {
+}
+
+const char* MACGrid::advectionName(AdvectionScheme scheme) {
+   switch (scheme) {
+   case MACCORMACK: return "maccormack";
+   case BFECC: return "bfecc";
+   default: return "semi-lagrangian";
+   }
+}
+
+bool MACGrid::parseAdvection(const char* name, AdvectionScheme& scheme) {
+   const AdvectionScheme schemes[] = { SEMI_LAGRANGIAN, MACCORMACK, BFECC };
+   for (int n = 0; n < 3; n++) {
+      if (!strcmp(name, advectionName(schemes[n]))) {
+         scheme = schemes[n];
+         return true;
+      }
+   }
+   return false;
+}
 
 MACGrid::MACGrid() {
    initialize();
 }
 
-MACGrid::MACGrid(const MACGrid& orig) {
+MACGrid::MACGrid(const MACGrid& orig) : mParams(orig.mParams), mKernels(orig.mKernels) {
    mU = orig.mU;
    mV = orig.mV;
    mW = orig.mW;
@@ -77,6 +120,7 @@ MACGrid& MACGrid::operator=(const MACGrid& orig) {
    mP = orig.mP;
    mD = orig.mD;
    mT = orig.mT;   
+   mParams = orig.mParams;
 
    return *this;
 }
@@ -93,6 +137,59 @@ void MACGrid::reset() {
    mT.initialize(0.0);
 
    setUpAMatrix();
+   mTelemetry.clear();
+   mKernels = FixedGridKernels::find(theDim[MACGrid::X], theDim[MACGrid::Y], theDim[MACGrid::Z]);
+}
+
+static double secondsNow()
+{
+   using namespace std::chrono;
+   return duration_cast<duration<double> >(steady_clock::now().time_since_epoch()).count();
+}
+
+void MACGrid::step(double dt) {
+  SolverTelemetry::StepRecord& record = mTelemetry.current();
+  double start = secondsNow();
+  double last = start;
+  // Charges the time since the previous stage ended to stage s.
+  auto endStage = [&](int s) {
+    double now = secondsNow();
+    record.stageSeconds[s] = now - last;
+    last = now;
+  };
+
+  // Step0: Gather user forces
+  updateSources();
+  endStage(SolverTelemetry::SOURCES);
+
+  // Step1: Calculate new velocities
+  advectVelocity(dt);
+  endStage(SolverTelemetry::ADVECT_VELOCITY);
+  addExternalForces(dt);
+  endStage(SolverTelemetry::FORCES);
+  project(dt);
+  endStage(SolverTelemetry::PROJECT);
+
+  // The sampled diagnostics look at the velocity field just after the
+  // projection.  They count towards the step total but not to any stage.
+  if (mTelemetry.sampleThisStep()) {
+    record.sampled = true;
+    record.maxDivergence = maxDivergence();
+    record.maxVelocity = maxVelocity();
+    record.cfl = record.maxVelocity * dt / theCellSize;
+    last = secondsNow();
+  }
+
+  // Step2: Calculate new temperature
+  advectTemperature(dt);
+  endStage(SolverTelemetry::ADVECT_TEMPERATURE);
+
+  // Step3: Calculate new density 
+  advectDensity(dt);
+  endStage(SolverTelemetry::ADVECT_DENSITY);
+
+  record.totalSeconds = last - start;
+  mTelemetry.commit();
 }
 
 void MACGrid::initialize() {
@@ -100,7 +197,6 @@ void MACGrid::initialize() {
 }
 
 void MACGrid::updateSources() {
-  static int count = 0;
   // TODO: Set initial values for density, temperature, and velocity.
   // 12x12x1
   /*
@@ -152,96 +248,27 @@ void MACGrid::updateSources() {
   mU(5,5,4) = 4.0;
   mU(5,4,5) = 4.0;
   mU(5,5,5) = 4.0;
-
-  if (count >= 1) {
-    //exit(0);
-  }
-
-  count += 1;
 }
 
 void MACGrid::advectVelocity(double dt) {
   // TODO: Calculate new velocities and store in target.
-  target.mU = mU;
-  target.mV = mV;
-  target.mW = mW;
-
-  GridData iX(mU);
-  GridData iY(mU);
-  GridData iZ(mU);
-
-  // iterate over each Z face
-  FOR_EACH_FACE_X {
-    // actual grid point
-    vec3 pt(i, j, k);
-    pt *= theCellSize;
-    pt[1] += 0.5 * theCellSize;
-    pt[2] += 0.5 * theCellSize;
-
-    // get full dimensional velocity
-    vec3 vel = getVelocity(pt);
-    //pt.Print("pt: ");
-    //vel.Print("vel: ");
-    //fflush(stdout);
-    iX(i,j,k) = vel[0];
-    iY(i,j,k) = vel[1];
-    iZ(i,j,k) = vel[2];
-
-    // do backwards euler step
-    vec3 bpt = pt - dt * vel;
-
-    // interpolate new velocity
-    vec3 nvel = getVelocity(bpt);
-
-    // store new velocity
-    target.mU(i, j, k) = nvel[0];
-  }
-
-
-  //printf("y:\n");
-  // iterate over each Y face
-  FOR_EACH_FACE_Y {
-    // actual grid point
-    vec3 pt(i, j, k);
-    pt *= theCellSize;
-    pt[0] += 0.5 * theCellSize;
-    pt[2] += 0.5 * theCellSize;
-
-    // get full dimensional velocity
-    vec3 vel = getVelocity(pt);
-    //pt.Print("pt: ");
-    //vel.Print("vel: ");
-    //fflush(stdout);
-
-    // do backwards euler step
-    vec3 bpt = pt - dt * vel;
-
-    // interpolate new velocity
-    vec3 nvel = getVelocity(bpt);
-
-    // store new velocity
-    target.mV(i, j, k) = nvel[1];
-  }
-
-  // iterate over each Z face
-  FOR_EACH_FACE_Z {
-    // actual grid point
-    vec3 pt(i, j, k);
-    pt *= theCellSize;
-    pt[0] += 0.5 * theCellSize;
-    pt[1] += 0.5 * theCellSize;
-
-    // get full dimensional velocity
-    vec3 vel = getVelocity(pt);
-    
-    // do backwards euler step
-    vec3 bpt = pt - dt * vel;
-
-    // interpolate new velocity
-    vec3 nvel = getVelocity(bpt);
-
-    // store new velocity
-    target.mW(i, j, k) = nvel[2];
+  mTarget.mU = mU;
+  mTarget.mV = mV;
+  mTarget.mW = mW;
+
+  // Every component is traced through the velocity as it was before this
+  // stage; mU, mV and mW only change once all three are done.
+  if (mParams.advection == SEMI_LAGRANGIAN) {
+    traceField(mU, mTarget.mU, MACGrid::X, dt);
+    traceField(mV, mTarget.mV, MACGrid::Y, dt);
+    traceField(mW, mTarget.mW, MACGrid::Z, dt);
+  } else {
+    GridDataX fwdX(mU), backX(mU);
+    advectField(mU, mTarget.mU, fwdX, backX, MACGrid::X, dt);
+    GridDataY fwdY(mV), backY(mV);
+    advectField(mV, mTarget.mV, fwdY, backY, MACGrid::Y, dt);
+    GridDataZ fwdZ(mW), backZ(mW);
+    advectField(mW, mTarget.mW, fwdZ, backZ, MACGrid::Z, dt);
   }
 
   #ifdef __DPRINT__
@@ -254,51 +281,31 @@ void MACGrid::advectVelocity(double dt) {
   print_grid_data(mV);
   printf("mW:\n");
   print_grid_data(mW);
-  printf("iX:\n");
-  print_grid_data(iX);
-  printf("iY:\n");
-  print_grid_data(iY);
-  printf("iZ:\n");
-  print_grid_data(iZ);
-  printf("target.mU:\n");
-  print_grid_data(target.mU);
-  printf("target.mV:\n");
-  print_grid_data(target.mV);
-  printf("target.mW:\n");
-  print_grid_data(target.mW);
+  printf("mTarget.mU:\n");
+  print_grid_data(mTarget.mU);
+  printf("mTarget.mV:\n");
+  print_grid_data(mTarget.mV);
+  printf("mTarget.mW:\n");
+  print_grid_data(mTarget.mW);
   #endif
   #endif
 
   // Then save the result to our object.
-  mU = target.mU;
-  mV = target.mV;
-  mW = target.mW;
+  mU = mTarget.mU;
+  mV = mTarget.mV;
+  mW = mTarget.mW;
 }
 
 void MACGrid::advectTemperature(double dt) {
   // TODO: Calculate new temp and store in target.
-  target.mT = mT;
+  mTarget.mT = mT;
 
   // temperature is stored per cell
-  FOR_EACH_CELL {
-    // compute world point
-    vec3 pt(i, j, k);
-    pt *= theCellSize;
-    pt[0] += 0.5 * theCellSize;
-    pt[1] += 0.5 * theCellSize;
-    pt[2] += 0.5 * theCellSize;
-
-    // get interpolated velocity at the world point
-    vec3 vel = getVelocity(pt);
-
-    // euler step to get previous position
-    vec3 bpt = pt - dt * vel;
-
-    // get the interpolated temperature
-    double nT = getTemperature(bpt);
-
-    // store new temperature
-    target.mT(i,j,k) = nT;
+  if (mParams.advection == SEMI_LAGRANGIAN) {
+    traceField(mT, mTarget.mT, -1, dt);
+  } else {
+    GridData fwd(mT), back(mT);
+    advectField(mT, mTarget.mT, fwd, back, -1, dt);
   }
 
   #ifdef __DPRINT__
@@ -307,39 +314,26 @@ void MACGrid::advectTemperature(double dt) {
   printf("Advected Temperature:\n");
   printf("mT:\n");
   print_grid_data(mT);
-  printf("target.mT:\n");
-  print_grid_data(target.mT);
+  printf("mTarget.mT:\n");
+  print_grid_data(mTarget.mT);
   #endif
   #endif
 
   // Then save the result to our object.
-  mT = target.mT;
+  mT = mTarget.mT;
+  clearSolidCells(mT);
 }
 
 void MACGrid::advectDensity(double dt) {
   // TODO: Calculate new densitities and store in target.
-  target.mD = mD;
+  mTarget.mD = mD;
 
   // density is stored per cell
-  FOR_EACH_CELL {
-    // compute world point
-    vec3 pt(i, j, k);
-    pt *= theCellSize;
-    pt[0] += 0.5 * theCellSize;
-    pt[1] += 0.5 * theCellSize;
-    pt[2] += 0.5 * theCellSize;
-
-    // get interpolated velocity at the world point
-    vec3 vel = getVelocity(pt);
-
-    // euler step to get previous position
-    vec3 bpt = pt - dt * vel;
-
-    // get the interpolated density
-    double nD = getDensity(bpt);
-
-    // store new density 
-    target.mD(i,j,k) = nD;
+  if (mParams.advection == SEMI_LAGRANGIAN) {
+    traceField(mD, mTarget.mD, -1, dt);
+  } else {
+    GridData fwd(mD), back(mD);
+    advectField(mD, mTarget.mD, fwd, back, -1, dt);
   }
 
   #ifdef __DPRINT__
@@ -348,48 +342,145 @@ void MACGrid::advectDensity(double dt) {
   printf("Advected Density:\n");
   printf("mD:\n");
   print_grid_data(mD);
-  printf("target.mD:\n");
-  print_grid_data(target.mD);
+  printf("mTarget.mD:\n");
+  print_grid_data(mTarget.mD);
   #endif
   #endif
 
   // Then save the result to our object.
-  mD = target.mD;
+  mD = mTarget.mD;
+  clearSolidCells(mD);
+}
+
+vec3 MACGrid::getSamplePoint(int faceAxis, int i, int j, int k) {
+  // world point of a cell center, or of a face center on faceAxis
+  vec3 pt(i, j, k);
+  pt *= theCellSize;
+  for (int a = 0; a < 3; a++) {
+    if (a != faceAxis) pt[a] += 0.5 * theCellSize;
+  }
+  return pt;
+}
+
+void MACGrid::traceField(GridData& field, GridData& result, int faceAxis, double dt) {
+  if (mKernels && FixedGridKernels::isEnabled()) {
+    mKernels->trace[faceAxis + 1](mU, mV, mW, field, result, dt);
+    return;
+  }
+
+  int dimX = theDim[MACGrid::X] + (faceAxis == MACGrid::X ? 1 : 0);
+  int dimY = theDim[MACGrid::Y] + (faceAxis == MACGrid::Y ? 1 : 0);
+  int dimZ = theDim[MACGrid::Z] + (faceAxis == MACGrid::Z ? 1 : 0);
+
+  GridStorage::forEachRow(dimY, dimX * dimZ, [&](int j) {
+    for (int k = 0; k < dimZ; k++)
+      for (int i = 0; i < dimX; i++) {
+        vec3 pt = getSamplePoint(faceAxis, i, j, k);
+
+        // euler step back along the velocity at the sample
+        vec3 vel = getVelocity(pt);
+        vec3 bpt = pt - dt * vel;
+
+        result(i,j,k) = field.interpolate(bpt);
+      }
+  });
+}
+
+void MACGrid::limitField(GridData& field, GridData& result, int faceAxis, double dt) {
+  int dimX = theDim[MACGrid::X] + (faceAxis == MACGrid::X ? 1 : 0);
+  int dimY = theDim[MACGrid::Y] + (faceAxis == MACGrid::Y ? 1 : 0);
+  int dimZ = theDim[MACGrid::Z] + (faceAxis == MACGrid::Z ? 1 : 0);
+
+  GridStorage::forEachRow(dimY, dimX * dimZ, [&](int j) {
+    for (int k = 0; k < dimZ; k++)
+      for (int i = 0; i < dimX; i++) {
+        vec3 pt = getSamplePoint(faceAxis, i, j, k);
+        vec3 vel = getVelocity(pt);
+        vec3 bpt = pt - dt * vel;
+
+        double lo, hi;
+        field.interpolationBounds(bpt, lo, hi);
+        double& value = result(i,j,k);
+        if (value < lo) value = lo;
+        if (value > hi) value = hi;
+      }
+  });
+}
+
+void MACGrid::advectField(GridData& field, GridData& result, GridData& fwd, GridData& back, int faceAxis, double dt) {
+  if (mParams.advection == SEMI_LAGRANGIAN) {
+    traceField(field, result, faceAxis, dt);
+    return;
+  }
+
+  // fwd = field traced back; back = fwd traced forward again, which would
+  // be field itself if tracing lost nothing.  Half the difference is the
+  // error of one trace.
+  traceField(field, fwd, faceAxis, dt);
+  traceField(fwd, back, faceAxis, -dt);
+
+  GridData::Storage& out = result.data();
+  const GridData::Storage& src = field.data();
+  const GridData::Storage& f = fwd.data();
+  GridData::Storage& b = back.data();
+  int rows = theDim[MACGrid::Y] + (faceAxis == MACGrid::Y ? 1 : 0);
+  int rowSize = (int) (out.size() / rows);
+  if (mParams.advection == MACCORMACK) {
+    // correct the back trace by the error estimate
+    GridStorage::forEachRow(rows, rowSize, [&](int j) {
+      for (size_t n = (size_t) j * rowSize; n < (size_t) (j + 1) * rowSize; n++) {
+        out[n] = f[n] + 0.5 * (src[n] - b[n]);
+      }
+    });
+  } else {
+    // BFECC: correct the field first, then trace the corrected field back
+    GridStorage::forEachRow(rows, rowSize, [&](int j) {
+      for (size_t n = (size_t) j * rowSize; n < (size_t) (j + 1) * rowSize; n++) {
+        b[n] = src[n] + 0.5 * (src[n] - b[n]);
+      }
+    });
+    traceField(back, result, faceAxis, dt);
+  }
+
+  limitField(field, result, faceAxis, dt);
 }
 
 void MACGrid::computeBouyancy(double dt) {
   // TODO: Calculate bouyancy and store in target.
-  target.mV = mV;
-  double a = buoyAlpha;
-  double B = buoyBeta;
+  mTarget.mV = mV;
+  double a = mParams.buoyAlpha;
+  double B = mParams.buoyBeta;
   // TODO: what is the mass?
   double mass = 1.0;
 
-  FOR_EACH_FACE_Y {
-    if (j == 0 || j == theDim[MACGrid::Y]) {
-      // do not update boundary
-      continue;
-    }
-    // get world point for face
-    vec3 pt(i,j,k);
-    pt *= theCellSize;
-    pt[0] += 0.5 * theCellSize;
-    pt[2] += 0.5 * theCellSize;
-
-    // get interpolated temperature at face
-    double T = getTemperature(pt);
+  GridStorage::forEachRow(theDim[MACGrid::Y]+1, theDim[MACGrid::X] * theDim[MACGrid::Z], [&](int j) {
+    for (int k = 0; k < theDim[MACGrid::Z]; k++)
+      for (int i = 0; i < theDim[MACGrid::X]; i++) {
+        if (j == 0 || j == theDim[MACGrid::Y]) {
+          // do not update boundary
+          continue;
+        }
+        // get world point for face
+        vec3 pt(i,j,k);
+        pt *= theCellSize;
+        pt[0] += 0.5 * theCellSize;
+        pt[2] += 0.5 * theCellSize;
+
+        // get interpolated temperature at face
+        double T = getTemperature(pt);
     
-    // get interpolated density
-    double s = getDensity(pt);
+        // get interpolated density
+        double s = getDensity(pt);
 
-    // buoyancy only affects vertical velocity
-    double f = -a * s + B * (T - Tamb);
+        // buoyancy only affects vertical velocity
+        double f = -a * s + B * (T - Tamb);
 
-    // update target velocity
-    // TODO: convert mass to acceleration?
-    target.mV(i,j,k) = mV(i,j,k) + dt * f;
-    //target.mV(i,j,k) = mV(i,j,k) + dt * f/(s*theCellSize*theCellSize + 10e-20);
-  }
+        // update target velocity
+        // TODO: convert mass to acceleration?
+        mTarget.mV(i,j,k) = mV(i,j,k) + dt * f;
+        //mTarget.mV(i,j,k) = mV(i,j,k) + dt * f/(s*theCellSize*theCellSize + 10e-20);
+      }
+  });
 
   #ifdef __DPRINT__
   #ifdef __DPRINT_BUOY__
@@ -397,24 +488,24 @@ void MACGrid::computeBouyancy(double dt) {
   printf("Buoancy:\n");
   printf("mV:\n");
   print_grid_data(mV);
-  printf("target.mV:\n");
-  print_grid_data(target.mV);
+  printf("mTarget.mV:\n");
+  print_grid_data(mTarget.mV);
   #endif
   #endif
 
   // Then save the result to our object.
-  mV = target.mV;
+  mV = mTarget.mV;
 }
 
 void MACGrid::computeVorticityConfinement(double dt) {
   // TODO: Calculate vorticity confinement forces.
   // Apply the forces to the current velocity and store the result in target.
-  target.mU = mU;
-  target.mV = mV;
-  target.mW = mW;
+  mTarget.mU = mU;
+  mTarget.mV = mV;
+  mTarget.mW = mW;
 
   // vorticity confinement coefficient
-  double e = vorticityEpsilon;
+  double e = mParams.vorticityEpsilon;
 
   // get dimensions
   vec3 dim = mT.getDim();
@@ -429,45 +520,48 @@ void MACGrid::computeVorticityConfinement(double dt) {
   GridData cV(mD);
   GridData cW(mD);
   // compute central differences
-  FOR_EACH_CELL {
-    // get world point of the cell
-    vec3 pt(i,j,k);
-    pt *= theCellSize;
-    pt += vec3(1.0,1.0,1.0)*(0.5*theCellSize);
-
-    // interpolated velocity
-    vec3 vel = getVelocity(pt);
+  GridStorage::forEachRow(theDim[MACGrid::Y], theDim[MACGrid::X] * theDim[MACGrid::Z], [&](int j) {
+    for (int k = 0; k < theDim[MACGrid::Z]; k++)
+      for (int i = 0; i < theDim[MACGrid::X]; i++) {
+        // get world point of the cell
+        vec3 pt(i,j,k);
+        pt *= theCellSize;
+        pt += vec3(1.0,1.0,1.0)*(0.5*theCellSize);
+
+        // interpolated velocity
+        vec3 vel = getVelocity(pt);
     
-    // get neighbor positions and velocities
-    vec3 ptIplus1 = pt;
-    ptIplus1[0] += 1.0 * theCellSize;
-    vec3 ptJplus1 = pt;
-    ptJplus1[1] += 1.0 * theCellSize;
-    vec3 ptKplus1 = pt;
-    ptKplus1[2] += 1.0 * theCellSize;
-    vec3 ptIminus1 = pt;
-    ptIminus1[0] -= 1.0 * theCellSize;
-    vec3 ptJminus1 = pt;
-    ptJminus1[1] -= 1.0 * theCellSize;
-    vec3 ptKminus1 = pt;
-    ptKminus1[2] -= 1.0 * theCellSize;
-
-
-    vec3 velIplus1 = getVelocity(ptIplus1);
-    vec3 velJplus1 = getVelocity(ptJplus1);
-    vec3 velKplus1 = getVelocity(ptKplus1);
-    vec3 velIminus1 = getVelocity(ptIminus1);
-    vec3 velJminus1 = getVelocity(ptJminus1);
-    vec3 velKminus1 = getVelocity(ptKminus1);
-
-    // compute w (voricity)
-    // w_{i,j,k} = (1/(2*dx)) * [ (w_{i,j+1,k} - w_{i,j-1,k}) - (v_{i,j,k+1} - v_{i,j,k-1}),
-    //                            (u_{i,j,k+1} - u_{i,j,k-1}) - (w_{i+1,j,k} - w_{i-1,j,k}),
-    //                            (v_{i+1,j,k} - v_{i-1,j,k}) - (u_{i,j+1,k} - u_{i,j-1,k}) ];
-    wX(i,j,k) = ((velJplus1[2] - velJminus1[2]) - (velKplus1[1] - velKminus1[1])) / (2 * theCellSize);
-    wY(i,j,k) = ((velKplus1[0] - velKminus1[0]) - (velIplus1[2] - velIminus1[2])) / (2 * theCellSize);
-    wZ(i,j,k) = ((velIplus1[1] - velIminus1[1]) - (velJplus1[0] - velJminus1[0])) / (2 * theCellSize);
-  }
+        // get neighbor positions and velocities
+        vec3 ptIplus1 = pt;
+        ptIplus1[0] += 1.0 * theCellSize;
+        vec3 ptJplus1 = pt;
+        ptJplus1[1] += 1.0 * theCellSize;
+        vec3 ptKplus1 = pt;
+        ptKplus1[2] += 1.0 * theCellSize;
+        vec3 ptIminus1 = pt;
+        ptIminus1[0] -= 1.0 * theCellSize;
+        vec3 ptJminus1 = pt;
+        ptJminus1[1] -= 1.0 * theCellSize;
+        vec3 ptKminus1 = pt;
+        ptKminus1[2] -= 1.0 * theCellSize;
+
+
+        vec3 velIplus1 = getVelocity(ptIplus1);
+        vec3 velJplus1 = getVelocity(ptJplus1);
+        vec3 velKplus1 = getVelocity(ptKplus1);
+        vec3 velIminus1 = getVelocity(ptIminus1);
+        vec3 velJminus1 = getVelocity(ptJminus1);
+        vec3 velKminus1 = getVelocity(ptKminus1);
+
+        // compute w (voricity)
+        // w_{i,j,k} = (1/(2*dx)) * [ (w_{i,j+1,k} - w_{i,j-1,k}) - (v_{i,j,k+1} - v_{i,j,k-1}),
+        //                            (u_{i,j,k+1} - u_{i,j,k-1}) - (w_{i+1,j,k} - w_{i-1,j,k}),
+        //                            (v_{i+1,j,k} - v_{i-1,j,k}) - (u_{i,j+1,k} - u_{i,j-1,k}) ];
+        wX(i,j,k) = ((velJplus1[2] - velJminus1[2]) - (velKplus1[1] - velKminus1[1])) / (2 * theCellSize);
+        wY(i,j,k) = ((velKplus1[0] - velKminus1[0]) - (velIplus1[2] - velIminus1[2])) / (2 * theCellSize);
+        wZ(i,j,k) = ((velIplus1[1] - velIminus1[1]) - (velJplus1[0] - velJminus1[0])) / (2 * theCellSize);
+      }
+  });
 
   #ifdef __DPRINT__
   #ifdef __DPRINT_VORT__
@@ -498,125 +592,137 @@ void MACGrid::computeVorticityConfinement(double dt) {
   GridDataY dmV(mV);
   GridDataZ dmW(mW);
   // compute gradient of w
-  FOR_EACH_CELL {
-    // TODO: what to do about difference that are outside the grid?
-    //  gradW_{i,j,k} = ( (|w_{i+1,j,k}| - |w_{i-1,j,k}|), (|w_{i,j+1,k}| - |w_{i,j-1,k}|), (|w_{i,j,k+1}| - |w_{i,j,k-1}|) )/(2*dx)
-    //    where |x| = 1-norm
-    vec3 w(wX(i,j,k), wY(i,j,k), wZ(i,j,k));
+  GridStorage::forEachRow(theDim[MACGrid::Y], theDim[MACGrid::X] * theDim[MACGrid::Z], [&](int j) {
+    for (int k = 0; k < theDim[MACGrid::Z]; k++)
+      for (int i = 0; i < theDim[MACGrid::X]; i++) {
+        // TODO: what to do about difference that are outside the grid?
+        //  gradW_{i,j,k} = ( (|w_{i+1,j,k}| - |w_{i-1,j,k}|), (|w_{i,j+1,k}| - |w_{i,j-1,k}|), (|w_{i,j,k+1}| - |w_{i,j,k-1}|) )/(2*dx)
+        //    where |x| = 1-norm
+        vec3 w(wX(i,j,k), wY(i,j,k), wZ(i,j,k));
     
-    // get neighboring cells
-    //  if border use, replicate the cell data
-    vec3 wIplus1(w), wJplus1(w), wKplus1(w);
-    vec3 wIminus1(w), wJminus1(w), wKminus1(w);
-    if (i + 1 < xdim) {
-      wIplus1 = vec3(wX(i+1,j,k), wY(i+1,j,k), wZ(i+1,j,k));
-    } 
-    if (j + 1 < ydim) {
-      wJplus1 = vec3(wX(i,j+1,k), wY(i,j+1,k), wZ(i,j+1,k));
-    }
-    if (k + 1 < zdim) {
-      wKplus1 = vec3(wX(i,j,k+1), wY(i,j,k+1), wZ(i,j,k+1));
-    }
-    if (i - 1 >= 0) {
-      wIminus1 = vec3(wX(i-1,j,k), wY(i-1,j,k), wZ(i-1,j,k));
-    }
-    if (j - 1 >= 0) {
-      wJminus1 = vec3(wX(i,j-1,k), wY(i,j-1,k), wZ(i,j-1,k));
-    }
-    if (k - 1 >= 0) {
-      wKminus1 = vec3(wX(i,j,k-1), wY(i,j,k-1), wZ(i,j,k-1));
-    }
-
-    /*
-    gwX(i,j,k) = (wIplus1.SqrLength() - wIminus1.SqrLength())/(2*theCellSize);
-    gwY(i,j,k) = (wJplus1.SqrLength() - wJminus1.SqrLength())/(2*theCellSize);
-    gwZ(i,j,k) = (wKplus1.SqrLength() - wKminus1.SqrLength())/(2*theCellSize);
-    */
+        // get neighboring cells
+        //  if border use, replicate the cell data
+        vec3 wIplus1(w), wJplus1(w), wKplus1(w);
+        vec3 wIminus1(w), wJminus1(w), wKminus1(w);
+        if (i + 1 < xdim) {
+          wIplus1 = vec3(wX(i+1,j,k), wY(i+1,j,k), wZ(i+1,j,k));
+        } 
+        if (j + 1 < ydim) {
+          wJplus1 = vec3(wX(i,j+1,k), wY(i,j+1,k), wZ(i,j+1,k));
+        }
+        if (k + 1 < zdim) {
+          wKplus1 = vec3(wX(i,j,k+1), wY(i,j,k+1), wZ(i,j,k+1));
+        }
+        if (i - 1 >= 0) {
+          wIminus1 = vec3(wX(i-1,j,k), wY(i-1,j,k), wZ(i-1,j,k));
+        }
+        if (j - 1 >= 0) {
+          wJminus1 = vec3(wX(i,j-1,k), wY(i,j-1,k), wZ(i,j-1,k));
+        }
+        if (k - 1 >= 0) {
+          wKminus1 = vec3(wX(i,j,k-1), wY(i,j,k-1), wZ(i,j,k-1));
+        }
+
+        /*
+        gwX(i,j,k) = (wIplus1.SqrLength() - wIminus1.SqrLength())/(2*theCellSize);
+        gwY(i,j,k) = (wJplus1.SqrLength() - wJminus1.SqrLength())/(2*theCellSize);
+        gwZ(i,j,k) = (wKplus1.SqrLength() - wKminus1.SqrLength())/(2*theCellSize);
+        */
 
     
 
-    gwX(i,j,k) = ((abs(wIplus1[0]) + abs(wIplus1[1]) + abs(wIplus1[2])) - (abs(wIminus1[0]) + abs(wIminus1[1]) + abs(wIminus1[2]))) / (2*theCellSize); 
-    gwY(i,j,k) = ((abs(wJplus1[0]) + abs(wJplus1[1]) + abs(wJplus1[2])) - (abs(wJminus1[0]) + abs(wJminus1[1]) + abs(wJminus1[2]))) / (2*theCellSize); 
-    gwZ(i,j,k) = ((abs(wKplus1[0]) + abs(wKplus1[1]) + abs(wKplus1[2])) - (abs(wKminus1[0]) + abs(wKminus1[1]) + abs(wKminus1[2]))) / (2*theCellSize); 
+        gwX(i,j,k) = ((abs(wIplus1[0]) + abs(wIplus1[1]) + abs(wIplus1[2])) - (abs(wIminus1[0]) + abs(wIminus1[1]) + abs(wIminus1[2]))) / (2*theCellSize); 
+        gwY(i,j,k) = ((abs(wJplus1[0]) + abs(wJplus1[1]) + abs(wJplus1[2])) - (abs(wJminus1[0]) + abs(wJminus1[1]) + abs(wJminus1[2]))) / (2*theCellSize); 
+        gwZ(i,j,k) = ((abs(wKplus1[0]) + abs(wKplus1[1]) + abs(wKplus1[2])) - (abs(wKminus1[0]) + abs(wKminus1[1]) + abs(wKminus1[2]))) / (2*theCellSize); 
     
 
 
     
-    // normalize
-    vec3 gw(gwX(i,j,k), gwY(i,j,k), gwZ(i,j,k));
-    double div = gw.Length() + 10e-20;
-    gwX(i,j,k) = gwX(i,j,k) / div;
-    gwY(i,j,k) = gwY(i,j,k) / div;
-    gwZ(i,j,k) = gwZ(i,j,k) / div;
-
-    // compute force
-    // f = epsilon * dx * (N cross w);
-    vec3 n(gwX(i,j,k), gwY(i,j,k), gwZ(i,j,k));
-    vec3 fconf = vorticityEpsilon * (n ^ w);
-
-    // store forces
-    fX(i,j,k) = fconf[0];
-    fY(i,j,k) = fconf[1];
-    fZ(i,j,k) = fconf[2];
-  }
+        // normalize
+        vec3 gw(gwX(i,j,k), gwY(i,j,k), gwZ(i,j,k));
+        double div = gw.Length() + 10e-20;
+        gwX(i,j,k) = gwX(i,j,k) / div;
+        gwY(i,j,k) = gwY(i,j,k) / div;
+        gwZ(i,j,k) = gwZ(i,j,k) / div;
+
+        // compute force
+        // f = epsilon * dx * (N cross w);
+        vec3 n(gwX(i,j,k), gwY(i,j,k), gwZ(i,j,k));
+        vec3 fconf = e * (n ^ w);
+
+        // store forces
+        fX(i,j,k) = fconf[0];
+        fY(i,j,k) = fconf[1];
+        fZ(i,j,k) = fconf[2];
+      }
+  });
 
   // update velocities
-  FOR_EACH_FACE_X {
-    // do not add forces to the edge faces
-    if (i > 0 && i < xdim) {
-      // get world pt
-      vec3 pt(i,j,k);
-      pt *= theCellSize;
-      pt += vec3(0.0,1.0,1.0) * (0.5*theCellSize);
+  GridStorage::forEachRow(theDim[MACGrid::Y], (theDim[MACGrid::X]+1) * theDim[MACGrid::Z], [&](int j) {
+    for (int k = 0; k < theDim[MACGrid::Z]; k++)
+      for (int i = 0; i < theDim[MACGrid::X]+1; i++) {
+        // do not add forces to the edge faces
+        if (i > 0 && i < xdim) {
+          // get world pt
+          vec3 pt(i,j,k);
+          pt *= theCellSize;
+          pt += vec3(0.0,1.0,1.0) * (0.5*theCellSize);
       
-      // get interpolated force at face
-      double f = fX.interpolate(pt);
-
-      // update velocity
-      target.mU(i,j,k) = mU(i,j,k) + dt * f;
-      dmU(i,j,k) = dt * f;
-    } else {
-      dmU(i,j,k) = 0;
-    }
-  }
-
-  FOR_EACH_FACE_Y {
-    // do not add forces to the edge faces
-    if (j > 0 && j < ydim) {
-      // get world pt
-      vec3 pt(i,j,k);
-      pt *= theCellSize;
-      pt += vec3(1.0,0.0,1.0) * (0.5*theCellSize);
+          // get interpolated force at face
+          double f = fX.interpolate(pt);
+
+          // update velocity
+          mTarget.mU(i,j,k) = mU(i,j,k) + dt * f;
+          dmU(i,j,k) = dt * f;
+        } else {
+          dmU(i,j,k) = 0;
+        }
+      }
+  });
+
+  GridStorage::forEachRow(theDim[MACGrid::Y]+1, theDim[MACGrid::X] * theDim[MACGrid::Z], [&](int j) {
+    for (int k = 0; k < theDim[MACGrid::Z]; k++)
+      for (int i = 0; i < theDim[MACGrid::X]; i++) {
+        // do not add forces to the edge faces
+        if (j > 0 && j < ydim) {
+          // get world pt
+          vec3 pt(i,j,k);
+          pt *= theCellSize;
+          pt += vec3(1.0,0.0,1.0) * (0.5*theCellSize);
       
-      // get interpolated force at face
-      double f = fY.interpolate(pt);
-
-      // update velocity
-      target.mV(i,j,k) = mV(i,j,k) + dt * f;
-      dmV(i,j,k) = dt * f;
-    } else {
-      dmV(i,j,k) = 0;
-    }
-  }
-
-  FOR_EACH_FACE_Z {
-    // do not add forces to the edge faces
-    if (k > 0 && k < zdim) {
-      // get world pt
-      vec3 pt(i,j,k);
-      pt *= theCellSize;
-      pt += vec3(1.0,1.0,0.0) * (0.5*theCellSize);
+          // get interpolated force at face
+          double f = fY.interpolate(pt);
+
+          // update velocity
+          mTarget.mV(i,j,k) = mV(i,j,k) + dt * f;
+          dmV(i,j,k) = dt * f;
+        } else {
+          dmV(i,j,k) = 0;
+        }
+      }
+  });
+
+  GridStorage::forEachRow(theDim[MACGrid::Y], theDim[MACGrid::X] * (theDim[MACGrid::Z]+1), [&](int j) {
+    for (int k = 0; k < theDim[MACGrid::Z]+1; k++)
+      for (int i = 0; i < theDim[MACGrid::X]; i++) {
+        // do not add forces to the edge faces
+        if (k > 0 && k < zdim) {
+          // get world pt
+          vec3 pt(i,j,k);
+          pt *= theCellSize;
+          pt += vec3(1.0,1.0,0.0) * (0.5*theCellSize);
       
-      // get interpolated force at face
-      double f = fZ.interpolate(pt);
-
-      // update velocity
-      target.mW(i,j,k) = mW(i,j,k) + dt * f;
-      dmW(i,j,k) = dt * f;
-    } else {
-      dmW(i,j,k) = 0;
-    }
-  }
+          // get interpolated force at face
+          double f = fZ.interpolate(pt);
+
+          // update velocity
+          mTarget.mW(i,j,k) = mW(i,j,k) + dt * f;
+          dmW(i,j,k) = dt * f;
+        } else {
+          dmW(i,j,k) = 0;
+        }
+      }
+  });
 
   #ifdef __DPRINT__
   #ifdef __DPRINT_VORT__
@@ -646,9 +752,9 @@ void MACGrid::computeVorticityConfinement(double dt) {
 
 
   // Then save the result to our object.
-  mU = target.mU;
-  mV = target.mV;
-  mW = target.mW;
+  mU = mTarget.mU;
+  mV = mTarget.mV;
+  mW = mTarget.mW;
 }
 
 void MACGrid::addExternalForces(double dt) {
@@ -662,44 +768,50 @@ void MACGrid::project(double dt) {
   // 2. Construct A
   // 3. Solve for p
   // Subtract pressure from our velocity and save in target.
-  target.mP = mP;
-  target.mU = mU;
-  target.mV = mV;
-  target.mW = mW;
+  mTarget.mP = mP;
+
+  // obstacles don't move: faces touching a solid cell carry no flow
+  clearSolidFaces();
+  mTarget.mU = mU;
+  mTarget.mV = mV;
+  mTarget.mW = mW;
 
 
   // construct d (RHS)
   //  change in velocity
   //  d(i,j,k) = -((rho)*(dx^2)/dt) * (change in total velocities)
-  GridData d = mP;
-  FOR_EACH_CELL {
-    // compute constant
-    // TODO: rho is just the denisty right?
-    //double c = -1.0 * mD(i,j,k) * theCellSize * theCellSize / dt;
-    double c = -1.0 * fluidDensity * theCellSize * theCellSize / dt;
-
-    // compute change in x velocity
-    double u = (mU(i+1,j,k) - mU(i,j,k)) / theCellSize;
-    // compute change in y velocity
-    double v = (mV(i,j+1,k) - mV(i,j,k)) / theCellSize;
-    // compute change in y velocity
-    double w = (mW(i,j,k+1) - mW(i,j,k)) / theCellSize;
-
-    // store sum in d
-    d(i,j,k) = c * (u + v + w);
-  }
+  //  only cells in the solve get a row; the rest stay 0
+  GridData d; d.initialize();
+  forEachFluidRow([&](int first, int last) {
+    for (int cell = first; cell < last; cell++) {
+      int i, j, k;
+      getCellIndex(mFluidCells[cell], i, j, k);
+      // compute constant
+      // TODO: rho is just the denisty right?
+      //double c = -1.0 * mD(i,j,k) * theCellSize * theCellSize / dt;
+      double c = -1.0 * fluidDensity * theCellSize * theCellSize / dt;
+
+      // compute change in x velocity
+      double u = (mU(i+1,j,k) - mU(i,j,k)) / theCellSize;
+      // compute change in y velocity
+      double v = (mV(i,j+1,k) - mV(i,j,k)) / theCellSize;
+      // compute change in y velocity
+      double w = (mW(i,j,k+1) - mW(i,j,k)) / theCellSize;
+
+      // store sum in d
+      d(i,j,k) = c * (u + v + w);
+    }
+  });
 
 
-  // construct A
+  // A
   //  matrix consisting of pressure neighbor information
-  //  already constructed for boundaries
-  //  TODO: add support for obstacles in the grid
-  GridDataMatrix A = AMatrix;
+  //  constructed for boundaries and obstacles in setUpAMatrix
 
 
   // solve for new pressures such that the fluid remains incompressible
   // TODO: what maxIterations and tolerance to use?
-  bool ret = conjugateGradient(A, target.mP, d, 100000, 0.00001);
+  bool ret = conjugateGradient(AMatrix, mTarget.mP, d, 100000, 0.00001);
 
 
   #ifdef __DPRINT__
@@ -711,72 +823,68 @@ void MACGrid::project(double dt) {
   printf("d:\n");
   print_grid_data_as_column(d);
   printf("mP:\n");
-  print_grid_data_as_column(target.mP);
+  print_grid_data_as_column(mTarget.mP);
   #endif
   #endif
 
 
   // update velocities from new pressures
   // vn = v - dt * (1/rho) * dP
-  FOR_EACH_CELL {
-    // update velocity faces (+1 cell index)
-    //  boundaries should not change
-
-    // update x velocity
-    if (i < theDim[MACGrid::X] - 1) {
-      target.mU(i+1,j,k) = mU(i+1,j,k) - dt * (target.mP(i+1,j,k) - target.mP(i,j,k));
-    }
-
-    // update y velocity
-    if (j < theDim[MACGrid::Y] - 1) {
-      target.mV(i,j+1,k) = mV(i,j+1,k) - dt * (target.mP(i,j+1,k) - target.mP(i,j,k));
-    }
+  GridStorage::forEachRow(theDim[MACGrid::Y], theDim[MACGrid::X] * theDim[MACGrid::Z], [&](int j) {
+    for (int k = 0; k < theDim[MACGrid::Z]; k++)
+      for (int i = 0; i < theDim[MACGrid::X]; i++) {
+        // update velocity faces (+1 cell index)
+        //  boundaries should not change
+        //  faces next to obstacles were zeroed above and stay that way
+        if (isSolidCell(i,j,k)) continue;
+
+        // update x velocity
+        if (i < theDim[MACGrid::X] - 1 && !isSolidCell(i+1,j,k)) {
+          mTarget.mU(i+1,j,k) = mU(i+1,j,k) - dt * (mTarget.mP(i+1,j,k) - mTarget.mP(i,j,k));
+        }
+
+        // update y velocity
+        if (j < theDim[MACGrid::Y] - 1 && !isSolidCell(i,j+1,k)) {
+          mTarget.mV(i,j+1,k) = mV(i,j+1,k) - dt * (mTarget.mP(i,j+1,k) - mTarget.mP(i,j,k));
+        }
     
-    // update z velocity
-    if (k < theDim[MACGrid::Z] - 1) {
-      target.mW(i,j,k+1) = mW(i,j,k+1) - dt * (target.mP(i,j,k+1) - target.mP(i,j,k));
-    }
-  }
+        // update z velocity
+        if (k < theDim[MACGrid::Z] - 1 && !isSolidCell(i,j,k+1)) {
+          mTarget.mW(i,j,k+1) = mW(i,j,k+1) - dt * (mTarget.mP(i,j,k+1) - mTarget.mP(i,j,k));
+        }
+      }
+  });
 
 
   // Then save the result to our object
-  mP = target.mP;
-  mU = target.mU;
-  mV = target.mV;
-  mW = target.mW;
-  // IMPLEMENT THIS AS A SANITY CHECK: assert (checkDivergence());
-  //assert(checkDivergence());
-  if (!checkDivergence()) {
-    //exit(0);
-  }
+  mP = mTarget.mP;
+  mU = mTarget.mU;
+  mV = mTarget.mV;
+  mW = mTarget.mW;
 }
 
-bool MACGrid::checkDivergence() {
-  double sum = 0;
-  bool ret = true;
-  FOR_EACH_FACE_X {
-    sum += mU(i,j,k);
-  }
-  if (abs(sum) > 10e-6) {
-    //printf("X vel DIVERGENT: %f\n", sum); 
-    ret = false;
-  }
-  FOR_EACH_FACE_Y {
-    sum += mV(i,j,k);
-  }
-  if (abs(sum) > 10e-6) {
-    //printf("Y vel DIVERGENT: %f\n", sum); 
-    ret = false;
-  }
-  FOR_EACH_FACE_Z {
-    sum += mW(i,j,k);
+double MACGrid::maxDivergence() {
+  // Same per-cell divergence the right hand side of the solve is built from.
+  double result = 0.0;
+  for (size_t cell = 0; cell < mFluidCells.size(); cell++) {
+    int i, j, k;
+    getCellIndex(mFluidCells[cell], i, j, k);
+    double div = (mU(i+1,j,k) - mU(i,j,k) + mV(i,j+1,k) - mV(i,j,k) + mW(i,j,k+1) - mW(i,j,k)) / theCellSize;
+    if (fabs(div) > result) result = fabs(div);
   }
-  if (abs(sum) > 10e-6) {
-    //printf("Z vel DIVERGENT: %f\n", sum); 
-    ret = false;
+  return result;
+}
+
+double MACGrid::maxVelocity() {
+  double result = 0.0;
+  const GridData::Storage* fields[3] = { &mU.data(), &mV.data(), &mW.data() };
+  for (int f = 0; f < 3; f++) {
+    const GridData::Storage& v = *fields[f];
+    for (size_t n = 0; n < v.size(); n++) {
+      if (fabs(v[n]) > result) result = fabs(v[n]);
+    }
   }
-  fflush(stdout);
-  return ret; 
+  return result;
 }
 
 
@@ -833,36 +941,106 @@ bool MACGrid::isValidCell(int i, int j, int k) {
 
 void MACGrid::setUpAMatrix() {
 
+  AMatrix.diag.initialize();
+  AMatrix.plusI.initialize();
+  AMatrix.plusJ.initialize();
+  AMatrix.plusK.initialize();
+
+  // Solid cells get no row; their neighbors treat them like the domain walls.
   FOR_EACH_CELL {
+    if (isSolidCell(i,j,k)) continue;
 
     int numFluidNeighbors = 0;
-    if (i-1 >= 0) {
+    if (i-1 >= 0 && !isSolidCell(i-1,j,k)) {
       AMatrix.plusI(i-1,j,k) = -1;
       numFluidNeighbors++;
     }
-    if (i+1 < theDim[MACGrid::X]) {
+    if (i+1 < theDim[MACGrid::X] && !isSolidCell(i+1,j,k)) {
       AMatrix.plusI(i,j,k) = -1;
       numFluidNeighbors++;
     }
-    if (j-1 >= 0) {
+    if (j-1 >= 0 && !isSolidCell(i,j-1,k)) {
       AMatrix.plusJ(i,j-1,k) = -1;
       numFluidNeighbors++;
     }
-    if (j+1 < theDim[MACGrid::Y]) {
+    if (j+1 < theDim[MACGrid::Y] && !isSolidCell(i,j+1,k)) {
       AMatrix.plusJ(i,j,k) = -1;
       numFluidNeighbors++;
     }
-    if (k-1 >= 0) {
+    if (k-1 >= 0 && !isSolidCell(i,j,k-1)) {
       AMatrix.plusK(i,j,k-1) = -1;
       numFluidNeighbors++;
     }
-    if (k+1 < theDim[MACGrid::Z]) {
+    if (k+1 < theDim[MACGrid::Z] && !isSolidCell(i,j,k+1)) {
       AMatrix.plusK(i,j,k) = -1;
       numFluidNeighbors++;
     }
     // Set the diagonal:
     AMatrix.diag(i,j,k) = numFluidNeighbors;
   }
+
+  // The solver only visits rows with a nonzero diagonal, in storage order.
+  // A fluid cell walled in on all six sides has nothing to solve for.
+  mFluidCells.clear();
+  mSolidCells.clear();
+  const GridData::Storage& diag = AMatrix.diag.data();
+  const std::vector<unsigned char>& solid = mObstacles.cells();
+  const int rowSize = theDim[MACGrid::X] * theDim[MACGrid::Z];
+  mFluidRowStart.assign(theDim[MACGrid::Y] + 1, 0);
+  for (int n = 0; n < (int) diag.size(); n++) {
+    if (diag[n] != 0) {
+      mFluidCells.push_back(n);
+      mFluidRowStart[n / rowSize + 1]++;
+    }
+    if (solid[n]) mSolidCells.push_back(n);
+  }
+  for (int j = 0; j < theDim[MACGrid::Y]; j++) {
+    mFluidRowStart[j + 1] += mFluidRowStart[j];
+  }
+}
+
+void MACGrid::setObstacles(const ObstacleMask& obstacles) {
+  mObstacles = obstacles;
+  setUpAMatrix();
+  clearSolidCells(mD);
+  clearSolidCells(mT);
+  clearSolidCells(mP);
+  clearSolidFaces();
+}
+
+const ObstacleMask& MACGrid::getObstacles() const {
+  return mObstacles;
+}
+
+int MACGrid::getNumFluidCells() const {
+  return (int) mFluidCells.size();
+}
+
+bool MACGrid::isSolidCell(int i, int j, int k) const {
+  return mObstacles.isSolid(i, j, k);
+}
+
+void MACGrid::getCellIndex(int n, int& i, int& j, int& k) const {
+  i = n % theDim[MACGrid::X];
+  k = (n / theDim[MACGrid::X]) % theDim[MACGrid::Z];
+  j = n / (theDim[MACGrid::X] * theDim[MACGrid::Z]);
+}
+
+void MACGrid::clearSolidCells(GridData& grid) {
+  GridData::Storage& values = grid.data();
+  for (size_t c = 0; c < mSolidCells.size(); c++) {
+    values[mSolidCells[c]] = 0.0;
+  }
+}
+
+void MACGrid::clearSolidFaces() {
+  for (size_t c = 0; c < mSolidCells.size(); c++) {
+    int i, j, k;
+    getCellIndex(mSolidCells[c], i, j, k);
+    mU(i,j,k) = 0.0; mU(i+1,j,k) = 0.0;
+    mV(i,j,k) = 0.0; mV(i,j+1,k) = 0.0;
+    mW(i,j,k) = 0.0; mW(i,j,k+1) = 0.0;
+  }
 }
 
 
@@ -875,21 +1053,34 @@ void MACGrid::setUpAMatrix() {
 
 bool MACGrid::conjugateGradient(const GridDataMatrix & A, GridData & p, const GridData & d, int maxIterations, double tolerance) {
   // Solves Ap = d for p.
-
-  FOR_EACH_CELL {
-    p(i,j,k) = 0.0; // Initial guess p = 0. 
-  }
+  // Every vector operation below runs over mFluidCells only, so cells
+  // inside obstacles cost nothing; their entries stay 0.
+  // Iterations and residuals go into the current telemetry record.
+  SolverTelemetry::StepRecord& record = mTelemetry.current();
+
+  forEachFluidRow([&](int first, int last) {
+    for (int c = first; c < last; c++) {
+      p.data()[mFluidCells[c]] = 0.0; // Initial guess p = 0. 
+    }
+  });
 
   GridData r = d; // Residual vector.
 
   GridData z; z.initialize();
   // TODO: Apply a preconditioner here.
   // For now, just bypass the preconditioner:
-  z = r;
+  copy(r, z);
 
-  GridData s = z; // Search vector;
+  GridData s; s.initialize(); // Search vector;
+  copy(z, s);
 
   double sigma = dotProduct(z, r);
+  double residual = maxMagnitude(r);
+  record.initialResidual = residual;
+
+  GridData alphaTimesS; alphaTimesS.initialize();
+  GridData alphaTimesZ; alphaTimesZ.initialize();
+  GridData betaTimesS; betaTimesS.initialize();
 
   for (int iteration = 0; iteration < maxIterations; iteration++) {
 
@@ -899,28 +1090,29 @@ bool MACGrid::conjugateGradient(const GridDataMatrix & A, GridData & p, const Gr
 
     double alpha = rho/dotProduct(z, s);
 
-    GridData alphaTimesS; alphaTimesS.initialize();
     multiply(alpha, s, alphaTimesS);
     add(p, alphaTimesS, p);
 
-    GridData alphaTimesZ; alphaTimesZ.initialize();
     multiply(alpha, z, alphaTimesZ);
     subtract(r, alphaTimesZ, r);
 
-    if (maxMagnitude(r) <= tolerance) {
+    residual = maxMagnitude(r);
+    if (residual <= tolerance) {
       //PRINT_LINE("PCG converged in " << (iteration + 1) << " iterations.");
+      record.cgIterations = iteration + 1;
+      record.converged = true;
+      record.finalResidual = residual;
       return true;
     }
 
     // TODO: Apply a preconditioner here.
     // For now, just bypass the preconditioner:
-    z = r;
+    copy(r, z);
 
     double sigmaNew = dotProduct(z, r);
 
     double beta = sigmaNew / rho;
 
-    GridData betaTimesS; betaTimesS.initialize();
     multiply(beta, s, betaTimesS);
     add(z, betaTimesS, s);
     //s = z + beta * s;
@@ -928,7 +1120,10 @@ bool MACGrid::conjugateGradient(const GridDataMatrix & A, GridData & p, const Gr
     sigma = sigmaNew;
   }
 
-  PRINT_LINE( "PCG didn't converge!" );
+  record.cgIterations = maxIterations;
+  record.converged = false;
+  record.finalResidual = residual;
+  PRINT_LINE( "PCG didn't converge! (residual " << residual << " after " << maxIterations << " iterations)" );
   return false;
 
 }
@@ -936,9 +1131,12 @@ bool MACGrid::conjugateGradient(const GridDataMatrix & A, GridData & p, const Gr
 double MACGrid::dotProduct(const GridData & vector1, const GridData & vector2) {
   
   double result = 0.0;
+  const double* v1 = &vector1.data()[0];
+  const double* v2 = &vector2.data()[0];
 
-  FOR_EACH_CELL {
-    result += vector1(i,j,k) * vector2(i,j,k);
+  for (size_t c = 0; c < mFluidCells.size(); c++) {
+    int n = mFluidCells[c];
+    result += v1[n] * v2[n];
   }
 
   return result;
@@ -946,34 +1144,62 @@ double MACGrid::dotProduct(const GridData & vector1, const GridData & vector2) {
 
 void MACGrid::add(const GridData & vector1, const GridData & vector2, GridData & result) {
   
-  FOR_EACH_CELL {
-    result(i,j,k) = vector1(i,j,k) + vector2(i,j,k);
-  }
+  const double* v1 = &vector1.data()[0];
+  const double* v2 = &vector2.data()[0];
+  double* out = &result.data()[0];
+
+  forEachFluidRow([&](int first, int last) {
+    for (int c = first; c < last; c++) {
+      int n = mFluidCells[c];
+      out[n] = v1[n] + v2[n];
+    }
+  });
 
 }
 
 void MACGrid::subtract(const GridData & vector1, const GridData & vector2, GridData & result) {
   
-  FOR_EACH_CELL {
-    result(i,j,k) = vector1(i,j,k) - vector2(i,j,k);
-  }
+  const double* v1 = &vector1.data()[0];
+  const double* v2 = &vector2.data()[0];
+  double* out = &result.data()[0];
+
+  forEachFluidRow([&](int first, int last) {
+    for (int c = first; c < last; c++) {
+      int n = mFluidCells[c];
+      out[n] = v1[n] - v2[n];
+    }
+  });
 
 }
 
 void MACGrid::multiply(const double scalar, const GridData & vector, GridData & result) {
   
-  FOR_EACH_CELL {
-    result(i,j,k) = scalar * vector(i,j,k);
-  }
+  const double* v = &vector.data()[0];
+  double* out = &result.data()[0];
+
+  forEachFluidRow([&](int first, int last) {
+    for (int c = first; c < last; c++) {
+      int n = mFluidCells[c];
+      out[n] = scalar * v[n];
+    }
+  });
+
+}
+
+void MACGrid::copy(const GridData & vector, GridData & result) {
+
+  multiply(1.0, vector, result);
 
 }
 
 double MACGrid::maxMagnitude(const GridData & vector) {
   
   double result = 0.0;
+  const double* v = &vector.data()[0];
 
-  FOR_EACH_CELL {
-    if (abs(vector(i,j,k)) > result) result = abs(vector(i,j,k));
+  for (size_t c = 0; c < mFluidCells.size(); c++) {
+    double m = fabs(v[mFluidCells[c]]);
+    if (m > result) result = m;
   }
 
   return result;
@@ -981,27 +1207,45 @@ double MACGrid::maxMagnitude(const GridData & vector) {
 
 void MACGrid::apply(const GridDataMatrix & matrix, const GridData & vector, GridData & result) {
   
-  FOR_EACH_CELL { // For each row of the matrix.
-
-    double diag = 0;
-    double plusI = 0;
-    double plusJ = 0;
-    double plusK = 0;
-    double minusI = 0;
-    double minusJ = 0;
-    double minusK = 0;
-
-    diag = matrix.diag(i,j,k) * vector(i,j,k);
-    if (isValidCell(i+1,j,k)) plusI = matrix.plusI(i,j,k) * vector(i+1,j,k);
-    if (isValidCell(i,j+1,k)) plusJ = matrix.plusJ(i,j,k) * vector(i,j+1,k);
-    if (isValidCell(i,j,k+1)) plusK = matrix.plusK(i,j,k) * vector(i,j,k+1);
-    if (isValidCell(i-1,j,k)) minusI = matrix.plusI(i-1,j,k) * vector(i-1,j,k);
-    if (isValidCell(i,j-1,k)) minusJ = matrix.plusJ(i,j-1,k) * vector(i,j-1,k);
-    if (isValidCell(i,j,k-1)) minusK = matrix.plusK(i,j,k-1) * vector(i,j,k-1);
-
-    result(i,j,k) = diag + plusI + plusJ + plusK + minusI + minusJ + minusK;
+  // Neighbors by storage offset (GridData order is i, then k, then j).
+  // A coefficient is 0 wherever the neighbor is a wall, an obstacle or a
+  // wrapped index (i+1 past the end of a row lands on the next row, and so
+  // on), so only the ends of the array need checking.
+  if (mKernels && FixedGridKernels::isEnabled()) {
+    forEachFluidRow([&](int first, int last) {
+      mKernels->apply(matrix, mFluidCells.data() + first, last - first, vector, result);
+    });
+    return;
   }
 
+  const int strideI = 1;
+  const int strideJ = theDim[MACGrid::X] * theDim[MACGrid::Z];
+  const int strideK = theDim[MACGrid::X];
+  const int numCells = strideJ * theDim[MACGrid::Y];
+
+  const double* diag = &matrix.diag.data()[0];
+  const double* plusI = &matrix.plusI.data()[0];
+  const double* plusJ = &matrix.plusJ.data()[0];
+  const double* plusK = &matrix.plusK.data()[0];
+  const double* x = &vector.data()[0];
+  double* out = &result.data()[0];
+
+  forEachFluidRow([&](int first, int last) {
+    for (int c = first; c < last; c++) { // For each row of the matrix.
+      int n = mFluidCells[c];
+
+      double sum = diag[n] * x[n];
+      if (n + strideI < numCells) sum += plusI[n] * x[n + strideI];
+      if (n + strideJ < numCells) sum += plusJ[n] * x[n + strideJ];
+      if (n + strideK < numCells) sum += plusK[n] * x[n + strideK];
+      if (n - strideI >= 0) sum += plusI[n - strideI] * x[n - strideI];
+      if (n - strideJ >= 0) sum += plusJ[n - strideJ] * x[n - strideJ];
+      if (n - strideK >= 0) sum += plusK[n - strideK] * x[n - strideK];
+
+      out[n] = sum;
+    }
+  });
+
 }
 
 
@@ -1013,12 +1257,173 @@ void MACGrid::saveSmoke(const char* fileName) {
   std::ofstream fileOut(fileName);
   if (fileOut.is_open()) {
     FOR_EACH_CELL {
-      fileOut << mD(i,j,k) << std::endl;
+      fileOut << mD(i,j,k) << '\n';
     }
     fileOut.close();
   }
 }
 
+// Checkpoint file: this header followed by mU, mV, mW, mP, mD, mT as raw doubles.
+struct CheckpointHeader {
+  char magic[4];  // "SCHK"
+  unsigned int version;
+  int dim[3];
+  int step;
+  double cellSize;
+  unsigned long long fieldBytes;  // bytes of all six fields
+};
+
+static const int theNumCheckpointFields = MACGrid::CheckpointFields::NUM_FIELDS;
+
+// Checkpoints use plain stdio rather than mmap or O_DIRECT.  Every field is
+// one contiguous block, so fwrite/fread already move it in a single call
+// with no per-value work, and O_DIRECT would need sector-aligned buffers
+// and sizes that GridData storage doesn't provide.  Durability comes from
+// syncing the file before it replaces the old checkpoint.
+
+// Forces the file's data to disk.
+static bool syncFile(FILE* file) {
+  if (fflush(file) != 0) return false;
+#ifdef _WIN32
+  return _commit(_fileno(file)) == 0;
+#else
+  return fsync(fileno(file)) == 0;
+#endif
+}
+
+// Forces the directory entry for a rename in fileName's directory to disk.
+static void syncDirectory(const char* fileName) {
+#ifndef _WIN32
+  std::string dir(fileName);
+  size_t slash = dir.rfind('/');
+  dir = slash == std::string::npos ? "." : dir.substr(0, slash + 1);
+  int fd = open(dir.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+#endif
+}
+
+// Writes the six fields, in checkpoint order, to fileName.
+static bool writeCheckpoint(const char* fileName, int step, const GridData::Storage* const fields[]) {
+  CheckpointHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "SCHK", 4);
+  header.version = 1;
+  for (int d = 0; d < 3; d++) header.dim[d] = theDim[d];
+  header.step = step;
+  header.cellSize = theCellSize;
+  for (int f = 0; f < theNumCheckpointFields; f++) {
+    header.fieldBytes += fields[f]->size() * sizeof(double);
+  }
+
+  std::string tempName = std::string(fileName) + ".tmp";
+  FILE* file = fopen(tempName.c_str(), "wb");
+  if (!file) {
+    PRINT_LINE("Could not write checkpoint " << tempName);
+    return false;
+  }
+  // One block write per field, straight out of the grid storage.
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  for (int f = 0; f < theNumCheckpointFields && ok; f++) {
+    ok = fwrite(&(*fields[f])[0], sizeof(double), fields[f]->size(), file) == fields[f]->size();
+  }
+  // The data has to be on disk before the rename, or a crash could leave a
+  // truncated file under the checkpoint's name.
+  ok = ok && syncFile(file);
+  ok = (fclose(file) == 0) && ok;
+  if (!ok) {
+    PRINT_LINE("Could not write checkpoint " << tempName);
+    remove(tempName.c_str());
+    return false;
+  }
+
+#ifdef WIN32
+  remove(fileName);  // rename doesn't replace on Windows
+#endif
+  if (rename(tempName.c_str(), fileName) != 0) return false;
+  syncDirectory(fileName);
+  return true;
+}
+
+bool MACGrid::checkpoint(const char* fileName, int step) const {
+  const GridData::Storage* fields[theNumCheckpointFields] = {
+    &mU.data(), &mV.data(), &mW.data(), &mP.data(), &mD.data(), &mT.data() };
+  return writeCheckpoint(fileName, step, fields);
+}
+
+void MACGrid::copyCheckpointFields(CheckpointFields& fields) const {
+  const GridData::Storage* source[theNumCheckpointFields] = {
+    &mU.data(), &mV.data(), &mW.data(), &mP.data(), &mD.data(), &mT.data() };
+  for (int f = 0; f < theNumCheckpointFields; f++) {
+    fields.field[f] = *source[f];
+  }
+}
+
+bool MACGrid::checkpoint(const char* fileName, int step, const CheckpointFields& fields) {
+  const GridData::Storage* pointers[theNumCheckpointFields];
+  for (int f = 0; f < theNumCheckpointFields; f++) {
+    pointers[f] = &fields.field[f];
+  }
+  return writeCheckpoint(fileName, step, pointers);
+}
+
+bool MACGrid::restore(const char* fileName, int* step) {
+  FILE* file = fopen(fileName, "rb");
+  if (!file) {
+    PRINT_LINE("Could not open checkpoint " << fileName);
+    return false;
+  }
+
+  CheckpointHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "SCHK", 4) != 0 ||
+      header.version != 1) {
+    PRINT_LINE(fileName << " is not a checkpoint");
+    fclose(file);
+    return false;
+  }
+  if (header.dim[0] != theDim[0] || header.dim[1] != theDim[1] || header.dim[2] != theDim[2]) {
+    PRINT_LINE(fileName << " was written for a " << header.dim[0] << "x" << header.dim[1]
+      << "x" << header.dim[2] << " grid");
+    fclose(file);
+    return false;
+  }
+  if (header.cellSize != theCellSize) {
+    PRINT_LINE(fileName << " was written for a cell size of " << header.cellSize);
+    fclose(file);
+    return false;
+  }
+
+  GridData::Storage* fields[theNumCheckpointFields] = {
+    &mU.data(), &mV.data(), &mW.data(), &mP.data(), &mD.data(), &mT.data() };
+  unsigned long long fieldBytes = 0;
+  for (int f = 0; f < theNumCheckpointFields; f++) {
+    fieldBytes += fields[f]->size() * sizeof(double);
+  }
+  if (header.fieldBytes != fieldBytes) {
+    PRINT_LINE(fileName << " holds " << header.fieldBytes << " bytes of fields, expected " << fieldBytes);
+    fclose(file);
+    return false;
+  }
+
+  // Read straight into the (already sized) grid storage.
+  bool ok = true;
+  for (int f = 0; f < theNumCheckpointFields && ok; f++) {
+    ok = fread(&(*fields[f])[0], sizeof(double), fields[f]->size(), file) == fields[f]->size();
+  }
+  bool trailing = ok && fgetc(file) != EOF;
+  fclose(file);
+  if (!ok || trailing) {
+    PRINT_LINE(fileName << (ok ? " is longer than its header says" : " is truncated"));
+    reset();
+    return false;
+  }
+
+  if (step) *step = header.step;
+  return true;
+}
+
 
 
 
@@ -1026,12 +1431,37 @@ void MACGrid::saveSmoke(const char* fileName) {
 /////////////////////////////////////////////////////////////////////
 
 void MACGrid::draw(const Camera& c) {   
+   // One sweep per frame; every vertex below then costs a single lookup.
+   if (theLighting) mLight.compute(mD);
    drawWireGrid();
+   drawObstacles();
    if (theDisplayVel) drawVelocities();   
+   if (theRenderMode == SLICES)
+   {
+      // Falls back to sheets on contexts without 3D textures.
+      mSlices.setColorByTemperature(theTemperatureColor);
+      if (mSlices.draw(mD, mT, theLighting ? &mLight.values() : NULL, -c.getBackward())) return;
+   }
    if (theRenderMode == CUBES) drawSmokeCubes(c);
    else drawSmoke(c);
 }
 
+void MACGrid::releaseGL() {
+   mSlices.release();
+}
+
+void MACGrid::drawObstacles() {
+   MACGrid::Cube cube;
+   cube.color = vec4(0.4, 0.4, 0.45, 1.0);
+   for (size_t c = 0; c < mSolidCells.size(); c++)
+   {
+      int i, j, k;
+      getCellIndex(mSolidCells[c], i, j, k);
+      cube.pos = getCenter(i,j,k);
+      drawCube(cube);
+   }
+}
+
 void MACGrid::drawVelocities() {
   // Draw line at each center
   //glColor4f(0.0, 1.0, 0.0, 1.0); // Use this if you want the lines to be a single color.
@@ -1053,15 +1483,29 @@ void MACGrid::drawVelocities() {
   glEnd();
 }
 
+double MACGrid::getLightShade(const vec3& pt) {
+  // Same ambient share as VolumeRenderer's default.
+  const double ambient = 0.2;
+  return ambient + (1.0 - ambient) * mLight.sample(pt);
+}
+
 vec4 MACGrid::getRenderColor(int i, int j, int k) {
   // Modify this if you want to change the smoke color, or modify it based on other smoke properties.
   double value = mD(i, j, k); 
+  if (theLighting) {
+    double shade = getLightShade(getCenter(i, j, k));
+    return vec4(shade, shade, shade, value);
+  }
   return vec4(1.0, 1.0, 1.0, value);
 }
 
 vec4 MACGrid::getRenderColor(const vec3& pt) {
   // TODO: Modify this if you want to change the smoke color, or modify it based on other smoke properties.
   double value = getDensity(pt); 
+  if (theLighting) {
+    double shade = getLightShade(pt);
+    return vec4(shade, shade, shade, value);
+  }
 
   return vec4(1.0, 1.0, 1.0, value);
 
@@ -9,6 +9,11 @@
 #include "vec.h"
 #include "grid_data.h"
 #include "grid_data_matrix.h"
+#include "transmittance_grid.h"
+#include "obstacle_mask.h"
+#include "solver_telemetry.h"
+#include "fixed_grid_kernels.h"
+#include "slice_renderer.h"
 
 class Camera;
 
@@ -16,6 +21,33 @@ class MACGrid
 {
 
 public:
+	// How the advection stages move fields along the velocity.  The
+	// second order schemes trace back and forth through the same
+	// interpolation to estimate and cancel the error of the first order
+	// trace, and clamp the result to the samples the back trace landed
+	// between so they can't overshoot.
+	enum AdvectionScheme
+	{
+		SEMI_LAGRANGIAN,  // first order back trace
+		MACCORMACK,       // back trace, corrected by a forward trace
+		BFECC             // back and forth error compensation, then a back trace
+	};
+	static const char* advectionName(AdvectionScheme scheme);
+	// Accepts the names advectionName returns ("semi-lagrangian", "maccormack", "bfecc").
+	static bool parseAdvection(const char* name, AdvectionScheme& scheme);
+
+	// Force coefficients.  They start out as buoyAlpha, buoyBeta and
+	// vorticityEpsilon from constants.cpp and can be set per grid, so
+	// differently tuned grids can run side by side (see sweep.cpp).
+	struct Parameters
+	{
+		double buoyAlpha;         // density (weight) coefficient
+		double buoyBeta;          // temperature (lift) coefficient
+		double vorticityEpsilon;  // vorticity confinement strength
+		AdvectionScheme advection;  // SEMI_LAGRANGIAN unless set
+		Parameters();
+	};
+
 	MACGrid();
 	~MACGrid();
 	MACGrid(const MACGrid& orig);
@@ -24,6 +56,11 @@ public:
 	void reset();
 
 	void draw(const Camera& c);
+	// Frees the GL objects draw() made; the context must be current.
+	void releaseGL();
+	// One full time step: every stage below in order, timed into the
+	// telemetry record for the step.
+	void step(double dt);
 	void updateSources();
 	void advectVelocity(double dt);
 	void addExternalForces(double dt);
@@ -40,6 +77,18 @@ protected:
 	void computeBouyancy(double dt);
 	void computeVorticityConfinement(double dt);
 
+	// Advection: field is carried by the current velocity into result using
+	// mParams.advection.  faceAxis is the axis whose faces the field's
+	// samples lie on, or -1 for cell centered fields.  fwd and back are
+	// scratch grids of the same kind as field, used by the second order
+	// schemes.
+	void advectField(GridData& field, GridData& result, GridData& fwd, GridData& back, int faceAxis, double dt);
+	// One semi-Lagrangian pass; negative dt traces forward instead.
+	void traceField(GridData& field, GridData& result, int faceAxis, double dt);
+	// Clamps result to the range of field's samples around each back trace.
+	void limitField(GridData& field, GridData& result, int faceAxis, double dt);
+	vec3 getSamplePoint(int faceAxis, int i, int j, int k);
+
 	// Rendering:
 	struct Cube { vec3 pos; vec4 color; double dist; };
 	void drawWireGrid();
@@ -48,8 +97,10 @@ protected:
 	void drawCube(const MACGrid::Cube& c);
 	void drawFace(const MACGrid::Cube& c);
 	void drawVelocities();
+	void drawObstacles();
 	vec4 getRenderColor(int i, int j, int k);
 	vec4 getRenderColor(const vec3& pt);
+	double getLightShade(const vec3& pt);
 	void drawZSheets(bool backToFront);
 	void drawXSheets(bool backToFront);
 
@@ -72,11 +123,24 @@ protected:
 	void add(const GridData & vector1, const GridData & vector2, GridData & result);
 	void subtract(const GridData & vector1, const GridData & vector2, GridData & result);
 	void multiply(const double scalar, const GridData & vector, GridData & result);
+	void copy(const GridData & vector, GridData & result);
 	double maxMagnitude(const GridData & vector);
 	void apply(const GridDataMatrix & matrix, const GridData & vector, GridData & result);
 	bool isValidCell(int i, int j, int k);
+	// Calls body(first, last) for the mFluidCells of each j row, the rows
+	// split across threads like GridStorage::forEachRow.
+	template <class Body> void forEachFluidRow(const Body& body) const;
+
+	// Obstacles:
+	bool isSolidCell(int i, int j, int k) const;
+	void getCellIndex(int n, int& i, int& j, int& k) const;
+	void clearSolidCells(GridData& grid);
+	void clearSolidFaces();
 
-  bool checkDivergence();
+	// Diagnostics: largest |div u| over the solved cells and largest face
+	// velocity component.  Each is a full pass over the grid.
+	double maxDivergence();
+	double maxVelocity();
 
 	// Fluid grid cell properties:
 	GridDataX mU; // X component of velocity, stored on X faces, size is (dimX+1)*dimY*dimZ
@@ -89,15 +153,93 @@ protected:
 	// The A matrix:
 	GridDataMatrix AMatrix;
 
+	// Static obstacles, and the storage indices of the cells the pressure
+	// solve runs over (fluid cells with at least one fluid neighbor) and of
+	// the solid cells:
+	ObstacleMask mObstacles;
+	std::vector<int> mFluidCells;
+	std::vector<int> mSolidCells;
+	// mFluidCells[mFluidRowStart[j]] up to mFluidRowStart[j+1] lie in row j:
+	std::vector<int> mFluidRowStart;
+
+	// Light reaching each cell, recomputed once per draw when lighting is on:
+	TransmittanceGrid mLight;
+
+	Parameters mParams;
+
+	// Each stage writes its result here before copying it back.  Every grid
+	// has its own, so independent grids can step on different threads.
+	struct Target
+	{
+		GridDataX mU;
+		GridDataY mV;
+		GridDataZ mW;
+		GridData mP;
+		GridData mD;
+		GridData mT;
+	};
+	Target mTarget;
+
+	SolverTelemetry mTelemetry;
+
+	// Kernels compiled for theDim, if there are any (see fixed_grid_kernels.h):
+	const FixedGridKernels* mKernels;
+
+	// 3D texture renderer for SLICES; not copied with the grid:
+	SliceRenderer mSlices;
+
 public:
 
-	enum RenderMode { CUBES, SHEETS };
+	enum RenderMode { CUBES, SHEETS, SLICES };
 	static RenderMode theRenderMode;
 	static bool theDisplayVel;
+	static bool theLighting;
+	// SLICES only: tints hot smoke.
+	static bool theTemperatureColor;
 	
 	// Saves smoke in CIS 460 volumetric format:
 	void saveSmoke(const char* fileName);
 
+	// Binary dump of the full simulation state (velocities, pressure, density,
+	// temperature) plus the caller's step counter, for restarting long runs.
+	// The file is written next to fileName, synced to disk and renamed into
+	// place, so a crash mid-checkpoint leaves the previous checkpoint intact.
+	bool checkpoint(const char* fileName, int step) const;
+	// Reloads a checkpoint written with the same grid dimensions and cell size.
+	bool restore(const char* fileName, int* step);
+
+	// Copies of just the fields a checkpoint holds, so the file can be
+	// written on another thread while the grid keeps stepping.
+	struct CheckpointFields
+	{
+		enum { NUM_FIELDS = 6 };
+		GridData::Storage field[NUM_FIELDS];  // u, v, w, p, d, t
+	};
+	void copyCheckpointFields(CheckpointFields& fields) const;
+	// Writes copied fields the same way checkpoint() writes the grid's own.
+	static bool checkpoint(const char* fileName, int step, const CheckpointFields& fields);
+
+	// Voxelized static obstacles; rebuilds the A matrix.  Obstacles stay
+	// through reset().
+	void setObstacles(const ObstacleMask& obstacles);
+	const ObstacleMask& getObstacles() const;
+	int getNumFluidCells() const;
+
+	void setParameters(const Parameters& params) { mParams = params; }
+	const Parameters& getParameters() const { return mParams; }
+
+	// Per-step solver statistics (see solver_telemetry.h).  Cleared by reset().
+	SolverTelemetry& getTelemetry() { return mTelemetry; }
+	const SolverTelemetry& getTelemetry() const { return mTelemetry; }
+
+	// Read-only access to the fields (for recording and caching):
+	const GridData& getDensityGrid() const { return mD; }
+	const GridData& getTemperatureGrid() const { return mT; }
+	const GridData& getPressureGrid() const { return mP; }
+	const GridDataX& getVelocityXGrid() const { return mU; }
+	const GridDataY& getVelocityYGrid() const { return mV; }
+	const GridDataZ& getVelocityZGrid() const { return mW; }
+
 };
 
 #endif
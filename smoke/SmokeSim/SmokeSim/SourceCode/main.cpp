@@ -35,6 +35,13 @@ void initCamera() {
    theCamera.reset();
 }
 
+// Frees the GL objects the smoke drawing made while the window and its
+// context still exist, then exits.
+void quit() {
+   theSmokeSim.releaseGL();
+   exit(0);
+}
+
 void onMouseMotionCb(int x, int y) {
    int deltaX = lastX - x;
    int deltaY = lastY - y;
@@ -94,19 +101,37 @@ void onKeyboardCb(unsigned char key, int x, int y) {
    if (key == ' ') theCamera.reset();
    else if (key == '0') MACGrid::theRenderMode = MACGrid::CUBES;
    else if (key == '1') MACGrid::theRenderMode = MACGrid::SHEETS;
+   else if (key == '2') MACGrid::theRenderMode = MACGrid::SLICES;
    else if (key == 'v') MACGrid::theDisplayVel = !MACGrid::theDisplayVel;
+   else if (key == 'l') MACGrid::theLighting = !MACGrid::theLighting;
+   else if (key == 't') MACGrid::theTemperatureColor = !MACGrid::theTemperatureColor;
+   else if (key == 'o')
+   {
+      // Toggle a sphere in the path of the plume.
+      ObstacleMask obstacles;
+      if (theSmokeSim.getGrid().getObstacles().empty())
+      {
+         obstacles.addSphere(vec3(8.0, 14.0, 5.0) * theCellSize, 4.0 * theCellSize);
+      }
+      theSmokeSim.setObstacles(obstacles);
+   }
    else if (key == 'r') theSmokeSim.setRecording(!theSmokeSim.isRecording(), savedWidth, savedHeight);
+   else if (key == 'p') theSmokeSim.setPipelined(!theSmokeSim.isPipelined());
+   else if (key == 'c') theSmokeSim.setCacheFile(theSmokeSim.isCaching()? NULL : "smoke.svol");
+   else if (key == 'm') theSmokeSim.setPublishName(theSmokeSim.isPublishing()? NULL : "smoke");
+   else if (key == 'C') theSmokeSim.setCacheFile(theSmokeSim.isCaching()? NULL : "smoke.svol",
+      VolumeCache::DEFAULT_CHANNELS, VolumeCache::QUANTIZED16);
    else if (key == '>') isRunning = true;
    else if (key == '=') isRunning = false;
    else if (key == '<') theSmokeSim.reset();
-   else if (key == 27) exit(0); // ESC Key
+   else if (key == 27) quit(); // ESC Key
    glutPostRedisplay();
 }
 
 void onMenuCb(int value) {
    switch (value)
    {
-   case -1: exit(0);
+   case -1: quit();
    case -6: theSmokeSim.reset(); break;
    default: onKeyboardCb(value, 0, 0); break;
    }
@@ -150,9 +175,10 @@ void drawOverlay() {
   glRasterPos2f(0.01, 0.01);
 
   char info[1024];
-  sprintf(info, "Framerate: %3.1f  |  Frame: %u  |  %s", 
+  sprintf(info, "Framerate: %3.1f  |  Frame: %u  |  %s%s", 
      theFpsTracker.fpsAverage(), theSmokeSim.getTotalFrames(),
-     theSmokeSim.isRecording()? "Recording..." : "");
+     theSmokeSim.isRecording()? (theSmokeSim.isPipelined()? "Recording (pipelined)...  " : "Recording...  ") : "",
+     theSmokeSim.isCaching()? "Caching..." : "");
 
   for (unsigned int i = 0; i < strlen(info); i++)
   {
@@ -207,15 +233,23 @@ int main(int argc, char **argv) {
 
     int viewMenu = glutCreateMenu(onMenuCb);
     glutAddMenuEntry("Toggle velocities\t'v'", 'v');
+    glutAddMenuEntry("Toggle self shadowing\t'l'", 'l');
     glutAddMenuEntry("Render density as cubes\t'0'", '0');
     glutAddMenuEntry("Render density as sheets\t'1'", '1');
+    glutAddMenuEntry("Render density as texture slices\t'2'", '2');
+    glutAddMenuEntry("Toggle temperature color (slices)\t't'", 't');
 
     theMenu = glutCreateMenu(onMenuCb);
     glutAddMenuEntry("Start\t'>'", '>');
     glutAddMenuEntry("Pause\t'='", '=');
     glutAddMenuEntry("Reset\t'<'", '<');
     glutAddMenuEntry("Reset camera\t' '", ' ');
+    glutAddMenuEntry("Toggle sphere obstacle\t'o'", 'o');
     glutAddMenuEntry("Record\t'r'", 'r');
+    glutAddMenuEntry("Pipelined recording\t'p'", 'p');
+    glutAddMenuEntry("Cache volumes to smoke.svol\t'c'", 'c');
+    glutAddMenuEntry("Cache compressed volumes to smoke.svol\t'C'", 'C');
+    glutAddMenuEntry("Publish to shared memory /smoke\t'm'", 'm');
     glutAddSubMenu("Display", viewMenu);
     glutAddMenuEntry("_________________", -1);
     glutAddMenuEntry("Exit", 27);
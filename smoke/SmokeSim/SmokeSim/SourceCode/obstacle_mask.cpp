@@ -0,0 +1,130 @@
+#include "obstacle_mask.h"
+#include "constants.h"
+#include "custom_output.h"
+#include <stdio.h>
+#include <string.h>
+
+static int cellIndex(int i, int j, int k)
+{
+   return i + k*theDim[0] + j*theDim[0]*theDim[2];
+}
+
+template <class Inside>
+static void fill(std::vector<unsigned char>& solid, Inside inside)
+{
+   for (int j = 0; j < theDim[1]; j++)
+      for (int k = 0; k < theDim[2]; k++)
+         for (int i = 0; i < theDim[0]; i++)
+         {
+            vec3 pt((i + 0.5)*theCellSize, (j + 0.5)*theCellSize, (k + 0.5)*theCellSize);
+            if (inside(pt)) solid[cellIndex(i, j, k)] = 1;
+         }
+}
+
+ObstacleMask::ObstacleMask()
+{
+   clear();
+}
+
+void ObstacleMask::clear()
+{
+   mSolid.assign((size_t) theDim[0]*theDim[1]*theDim[2], 0);
+}
+
+void ObstacleMask::addSphere(const vec3& center, double radius)
+{
+   fill(mSolid, [&](const vec3& pt) { return DistanceSqr(pt, center) <= radius*radius; });
+}
+
+void ObstacleMask::addBox(const vec3& lo, const vec3& hi)
+{
+   fill(mSolid, [&](const vec3& pt) {
+      return pt[0] >= lo[0] && pt[0] <= hi[0] &&
+             pt[1] >= lo[1] && pt[1] <= hi[1] &&
+             pt[2] >= lo[2] && pt[2] <= hi[2];
+   });
+}
+
+bool ObstacleMask::addShape(const char* spec)
+{
+   double v[6];
+   if (sscanf(spec, "sphere:%lf,%lf,%lf,%lf", &v[0], &v[1], &v[2], &v[3]) == 4)
+   {
+      addSphere(vec3(v[0], v[1], v[2]), v[3]);
+      return true;
+   }
+   if (sscanf(spec, "box:%lf,%lf,%lf,%lf,%lf,%lf", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) == 6)
+   {
+      addBox(vec3(v[0], v[1], v[2]), vec3(v[3], v[4], v[5]));
+      return true;
+   }
+   PRINT_LINE("Unknown obstacle " << spec << " (expected sphere:x,y,z,r or box:x0,y0,z0,x1,y1,z1)");
+   return false;
+}
+
+bool ObstacleMask::load(const char* fileName)
+{
+   FILE* fp = fopen(fileName, "r");
+   if (!fp)
+   {
+      PRINT_LINE("Couldn't open obstacle mask " << fileName);
+      return false;
+   }
+
+   int dim[3];
+   bool ok = fscanf(fp, "%d %d %d", &dim[0], &dim[1], &dim[2]) == 3 &&
+      dim[0] == theDim[0] && dim[1] == theDim[1] && dim[2] == theDim[2];
+   std::vector<unsigned char> solid(mSolid.size());
+   for (size_t n = 0; ok && n < solid.size(); n++)
+   {
+      int value;
+      ok = fscanf(fp, "%d", &value) == 1;
+      solid[n] = value != 0;
+   }
+   fclose(fp);
+
+   if (!ok)
+   {
+      PRINT_LINE("Obstacle mask " << fileName << " doesn't match a " << theDim[0] << "x"
+         << theDim[1] << "x" << theDim[2] << " grid");
+      return false;
+   }
+   mSolid.swap(solid);
+   return true;
+}
+
+bool ObstacleMask::save(const char* fileName) const
+{
+   FILE* fp = fopen(fileName, "w");
+   if (!fp) return false;
+   fprintf(fp, "%d %d %d\n", theDim[0], theDim[1], theDim[2]);
+   for (size_t n = 0; n < mSolid.size(); n++)
+   {
+      fputc(mSolid[n]? '1' : '0', fp);
+      fputc((n + 1) % theDim[0] == 0? '\n' : ' ', fp);
+   }
+   return fclose(fp) == 0;
+}
+
+bool ObstacleMask::isSolid(int i, int j, int k) const
+{
+   if (i < 0 || j < 0 || k < 0 || i >= theDim[0] || j >= theDim[1] || k >= theDim[2]) return false;
+   return mSolid[cellIndex(i, j, k)] != 0;
+}
+
+bool ObstacleMask::empty() const
+{
+   return countSolid() == 0;
+}
+
+int ObstacleMask::countSolid() const
+{
+   int count = 0;
+   for (size_t n = 0; n < mSolid.size(); n++) count += mSolid[n] != 0;
+   return count;
+}
+
+const std::vector<unsigned char>& ObstacleMask::cells() const
+{
+   return mSolid;
+}
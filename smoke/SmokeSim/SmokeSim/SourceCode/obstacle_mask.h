@@ -0,0 +1,44 @@
+// Voxelized static obstacles.
+//
+// One flag per cell of the simulation grid (GridData order): a cell is solid
+// when its center lies inside an obstacle.  Shapes are given in world
+// coordinates, the same space as MACGrid::getCenter.  Masks can also be read
+// from a text file:
+//
+//   nx ny nz
+//   0 0 1 1 ...        nx*ny*nz values, GridData order (i, then k, then j)
+//
+// Any nonzero value marks a solid cell; the dimensions must match theDim.
+// MACGrid::setObstacles folds the mask into the pressure solve.
+
+#ifndef OBSTACLE_MASK_H
+#define OBSTACLE_MASK_H
+
+#include <vector>
+#include "vec.h"
+
+class ObstacleMask
+{
+public:
+   ObstacleMask();
+
+   void clear();
+   void addSphere(const vec3& center, double radius);
+   void addBox(const vec3& lo, const vec3& hi);
+   // "sphere:x,y,z,r" or "box:x0,y0,z0,x1,y1,z1" (world units).
+   bool addShape(const char* spec);
+
+   bool load(const char* fileName);
+   bool save(const char* fileName) const;
+
+   bool isSolid(int i, int j, int k) const;
+   bool empty() const;
+   int countSolid() const;
+   // One byte per cell, GridData order.
+   const std::vector<unsigned char>& cells() const;
+
+protected:
+   std::vector<unsigned char> mSolid;
+};
+
+#endif // OBSTACLE_MASK_H
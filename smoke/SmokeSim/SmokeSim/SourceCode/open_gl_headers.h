@@ -10,12 +10,13 @@
 #include <OpenGL/glu.h>
 #include <GLUT/glut.h>
 
-#else
+#elif defined(LINUX)
 
-//#include <GL/gl.h>
-//#include <GL/glu.h>
-//#include <GL/glut.h>
+#include <GL/gl.h>
+#include <GL/glu.h>
+#include <GL/glut.h>
 
+#else
 
 // WINDOWS:
 #include <windows.h>
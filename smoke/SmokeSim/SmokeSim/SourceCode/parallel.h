@@ -0,0 +1,117 @@
+// Minimal parallel loops over an index range.
+// parallelFor hands out work in chunks from a shared counter, so uneven items
+// (rays that terminate early, empty slabs) balance across the threads on
+// their own.  parallelForStatic gives every thread the same contiguous block
+// on every call instead, for passes over grid memory that was first touched
+// with the same partition (see grid_storage.h).
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <thread>
+#include <atomic>
+#include <vector>
+#ifdef LINUX
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Threads used when a caller doesn't ask for a specific count.
+inline int parallelThreadCount()
+{
+   int hw = (int) std::thread::hardware_concurrency();
+   return hw > 0? hw : 1;
+}
+
+// Calls body(index) for every index in [begin, end).  body must be safe to
+// run concurrently for different indices.  The calling thread takes part.
+template <class Body>
+void parallelFor(int begin, int end, const Body& body, int numThreads = 0, int chunk = 1)
+{
+   if (end <= begin) return;
+   if (numThreads <= 0) numThreads = parallelThreadCount();
+   if (chunk < 1) chunk = 1;
+   int numChunks = (end - begin + chunk - 1) / chunk;
+   if (numThreads > numChunks) numThreads = numChunks;
+
+   std::atomic<int> next(begin);
+   auto worker = [&]() {
+      for (;;)
+      {
+         int first = next.fetch_add(chunk);
+         if (first >= end) return;
+         int last = first + chunk < end? first + chunk : end;
+         for (int index = first; index < last; index++) body(index);
+      }
+   };
+
+   std::vector<std::thread> threads;
+   for (int t = 1; t < numThreads; t++) threads.push_back(std::thread(worker));
+   worker();
+   for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+}
+
+// Block of [begin, end) that parallelForStatic gives thread t of numThreads.
+inline void staticBlock(int begin, int end, int t, int numThreads, int& first, int& last)
+{
+   long long count = end - begin;
+   first = begin + (int) (count * t / numThreads);
+   last = begin + (int) (count * (t + 1) / numThreads);
+}
+
+// Binds the calling thread to the slot'th CPU it is allowed to run on, so
+// block t of a static loop runs on the same core (and memory node) every
+// call.  No-op where thread affinity isn't available.
+inline void pinThreadToSlot(int slot)
+{
+#ifdef LINUX
+   cpu_set_t allowed;
+   if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+   int numAllowed = CPU_COUNT(&allowed);
+   if (numAllowed <= 1) return;
+   int target = slot % numAllowed;
+   for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+   {
+      if (!CPU_ISSET(cpu, &allowed) || target-- > 0) continue;
+      cpu_set_t one;
+      CPU_ZERO(&one);
+      CPU_SET(cpu, &one);
+      pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+      return;
+   }
+#else
+   (void) slot;
+#endif
+}
+
+// Calls body(index) for every index in [begin, end), thread t taking block t
+// of an even split.  Every thread is a fresh one; the caller only waits, so
+// its own affinity is left alone.  With pin, thread t is bound to slot t
+// (pinThreadToSlot), which keeps block t on one core from call to call but
+// puts block t of every concurrent caller on that same core.
+template <class Body>
+void parallelForStatic(int begin, int end, const Body& body, int numThreads = 0, bool pin = false)
+{
+   if (end <= begin) return;
+   if (numThreads <= 0) numThreads = parallelThreadCount();
+   if (numThreads > end - begin) numThreads = end - begin;
+   if (numThreads == 1)
+   {
+      for (int index = begin; index < end; index++) body(index);
+      return;
+   }
+
+   std::vector<std::thread> threads;
+   for (int t = 0; t < numThreads; t++)
+   {
+      threads.push_back(std::thread([&, t]() {
+         if (pin) pinThreadToSlot(t);
+         int first, last;
+         staticBlock(begin, end, t, numThreads, first, last);
+         for (int index = first; index < last; index++) body(index);
+      }));
+   }
+   for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+}
+
+#endif // PARALLEL_H
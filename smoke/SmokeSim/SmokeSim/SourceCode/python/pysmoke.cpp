@@ -0,0 +1,105 @@
+// Python bindings for the smoke simulation.
+//
+//   import pysmoke
+//   sim = pysmoke.Sim()
+//   sim.step()
+//   d = sim.density()      # numpy view of mD, shape (ny, nz, nx)
+//
+// The field accessors return read-only numpy arrays that point straight at
+// the grid storage; nothing is copied, so they can be inspected every frame
+// even on large grids.  The arrays alias the live fields: after another
+// step() they show the new values (call .copy() to keep a frame).  Each array
+// holds a reference to its Sim, so the storage can't go away underneath it.
+//
+// Values are in GridData order (i fastest, then k, then j), which numpy sees
+// as a C-order array indexed [j, k, i].  The face velocity arrays have one
+// extra sample along their own axis: u is (ny, nz, nx+1), v is (ny+1, nz, nx)
+// and w is (ny, nz+1, nx).
+
+// boost python interface headers
+#include <boost/python/module.hpp>
+#include <boost/python/class.hpp>
+#include <boost/python/def.hpp>
+#include <boost/python/extract.hpp>
+#include <boost/python/tuple.hpp>
+#include <boost/python/numpy.hpp>
+
+#include "../smoke_sim.h"
+#include "../constants.h"
+
+using namespace boost::python;
+namespace np = boost::python::numpy;
+
+// Wraps a grid's storage as a [j][k][i] array of doubles owned by the Sim object.
+static np::ndarray view(object self, const GridData& grid, int nx, int ny, int nz) {
+  const GridData::Storage& data = grid.data();
+  return np::from_data(&data[0], np::dtype::get_builtin<double>(),
+    boost::python::make_tuple(ny, nz, nx),
+    boost::python::make_tuple(sizeof(double) * nx * nz, sizeof(double) * nx, sizeof(double)),
+    self);
+}
+
+static const MACGrid& grid(object self) {
+  return extract<SmokeSim&>(self)().getGrid();
+}
+
+np::ndarray density(object self) {
+  return view(self, grid(self).getDensityGrid(), theDim[0], theDim[1], theDim[2]);
+}
+
+np::ndarray temperature(object self) {
+  return view(self, grid(self).getTemperatureGrid(), theDim[0], theDim[1], theDim[2]);
+}
+
+np::ndarray pressure(object self) {
+  return view(self, grid(self).getPressureGrid(), theDim[0], theDim[1], theDim[2]);
+}
+
+np::ndarray velocityX(object self) {
+  return view(self, grid(self).getVelocityXGrid(), theDim[0]+1, theDim[1], theDim[2]);
+}
+
+np::ndarray velocityY(object self) {
+  return view(self, grid(self).getVelocityYGrid(), theDim[0], theDim[1]+1, theDim[2]);
+}
+
+np::ndarray velocityZ(object self) {
+  return view(self, grid(self).getVelocityZGrid(), theDim[0], theDim[1], theDim[2]+1);
+}
+
+void step(SmokeSim& sim) {
+  // The solver doesn't touch Python, so let other Python threads run meanwhile.
+  PyThreadState* state = PyEval_SaveThread();
+  sim.step();
+  PyEval_RestoreThread(state);
+}
+
+boost::python::tuple dims() {
+  return boost::python::make_tuple(theDim[0], theDim[1], theDim[2]);
+}
+
+double cellSize() {
+  return theCellSize;
+}
+
+BOOST_PYTHON_MODULE(pysmoke) {
+  using namespace boost::python;
+  np::initialize();
+
+  def("dims", dims);
+  def("cell_size", cellSize);
+
+  class_<SmokeSim, boost::noncopyable>("Sim")
+    .def("step", step)
+    .def("reset", &SmokeSim::reset)
+    .def("frame", &SmokeSim::getTotalFrames)
+    .def("checkpoint", &SmokeSim::checkpoint)
+    .def("restore", &SmokeSim::restore)
+    .def("density", density)
+    .def("temperature", temperature)
+    .def("pressure", pressure)
+    .def("u", velocityX)
+    .def("v", velocityY)
+    .def("w", velocityZ)
+    ;
+}
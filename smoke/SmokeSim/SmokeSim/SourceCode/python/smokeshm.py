@@ -0,0 +1,109 @@
+import struct
+import time
+from multiprocessing import resource_tracker, shared_memory
+
+import numpy as np
+
+
+class SmokeShm():
+  '''
+    reader for the frames SmokeSim publishes to shared memory
+    (SmokeSim::setPublishName, smoke_headless -publish NAME)
+
+    see frame_publisher.h for the layout and the seqlock protocol
+  '''
+
+  HEADER = struct.Struct('<4sI3iIdQQ16x')
+  SLOT_HEADER = struct.Struct('<Qq48x')
+  CHANNELS = ('density', 'temperature')
+
+  def __init__(self, name='smoke'):
+    ''' map an existing segment published by the simulation '''
+    try:
+      self.shm = shared_memory.SharedMemory(name=name, create=False)
+    except FileNotFoundError as err:
+      print('Shared Memory Segment doesn\'t exist: %s' % err)
+      raise
+    # we only attach; don't let python unlink the simulation's segment at exit
+    resource_tracker.unregister(self.shm._name, 'shared_memory')
+
+    magic, version, nx, ny, nz, nchannels, cell_size, slot_bytes, _ = \
+      SmokeShm.HEADER.unpack_from(self.shm.buf, 0)
+    if magic != b'SSHM':
+      raise RuntimeError('%s is not a smoke segment' % name)
+
+    self.dim = (nx, ny, nz)
+    self.cell_size = cell_size
+    self.slot_bytes = slot_bytes
+    self._cells = nx * ny * nz
+    self._views = [self._slot_views(s) for s in range(2)]
+
+
+  def _slot_offset(self, slot):
+    return SmokeShm.HEADER.size + slot * self.slot_bytes
+
+
+  def _slot_views(self, slot):
+    '''
+      numpy views of one slot's fields, no copies
+
+      fields are in GridData order, i.e. [j, k, i] in C order
+    '''
+    nx, ny, nz = self.dim
+    offset = self._slot_offset(slot) + SmokeShm.SLOT_HEADER.size
+    views = {}
+    for channel in SmokeShm.CHANNELS:
+      views[channel] = np.ndarray((ny, nz, nx), dtype=np.float64,
+                                  buffer=self.shm.buf, offset=offset)
+      offset += self._cells * 8
+    return views
+
+
+  def _latest(self):
+    return struct.unpack_from('<Q', self.shm.buf, 40)[0]
+
+
+  def _sequence(self, slot):
+    return SmokeShm.SLOT_HEADER.unpack_from(self.shm.buf, self._slot_offset(slot))
+
+
+  def read(self, retries=100):
+    '''
+      copies the newest complete frame
+
+      returns (frame, {'density': ndarray, 'temperature': ndarray}),
+      or (-1, None) before the first frame is published
+    '''
+    for _ in range(retries):
+      slot = self._latest()
+      before, frame = self._sequence(slot)
+      if before % 2:
+        # writer is in this slot; it will flip latest shortly
+        time.sleep(0)
+        continue
+      if frame < 0:
+        return (-1, None)
+
+      fields = dict((c, v.copy()) for c, v in self._views[slot].items())
+
+      after, _ = self._sequence(slot)
+      if after == before:
+        return (frame, fields)
+
+    raise RuntimeError('could not read a consistent frame')
+
+
+  def view(self):
+    '''
+      zero copy views of the newest frame, for quick looks
+
+      unlike read(), the arrays may be overwritten once the simulation
+      has published two more frames
+    '''
+    slot = self._latest()
+    return (self._sequence(slot)[1], self._views[slot])
+
+
+  def close(self):
+    self._views = None
+    self.shm.close()
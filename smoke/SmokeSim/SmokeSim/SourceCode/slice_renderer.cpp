@@ -0,0 +1,409 @@
+#include "slice_renderer.h"
+#include "grid_data.h"
+#include "constants.h"
+#include "open_gl_headers.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#if defined(__APPLE__)
+#include <dlfcn.h>
+#elif defined(LINUX)
+#include <GL/glx.h>
+#endif
+#undef max
+#undef min
+#include <algorithm>
+
+// Windows' gl.h stops at OpenGL 1.1, so everything newer is looked up at
+// run time on every platform.
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+#ifndef GL_TEXTURE_3D
+#define GL_TEXTURE_3D 0x806F
+#endif
+#ifndef GL_TEXTURE_WRAP_R
+#define GL_TEXTURE_WRAP_R 0x8072
+#endif
+#ifndef GL_CLAMP_TO_EDGE
+#define GL_CLAMP_TO_EDGE 0x812F
+#endif
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT 0x0002
+#endif
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#endif
+#ifndef GL_MAP_COHERENT_BIT
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+#ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#endif
+#ifndef GL_SYNC_FLUSH_COMMANDS_BIT
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#endif
+#ifndef GL_TIMEOUT_EXPIRED
+#define GL_TIMEOUT_EXPIRED 0x911B
+#endif
+
+typedef void (APIENTRY *TexImage3DProc)(GLenum target, GLint level, GLint internalFormat, GLsizei width,
+   GLsizei height, GLsizei depth, GLint border, GLenum format, GLenum type, const void* pixels);
+typedef void (APIENTRY *TexSubImage3DProc)(GLenum target, GLint level, GLint x, GLint y, GLint z, GLsizei width,
+   GLsizei height, GLsizei depth, GLenum format, GLenum type, const void* pixels);
+typedef void (APIENTRY *GenBuffersProc)(GLsizei n, GLuint* buffers);
+typedef void (APIENTRY *DeleteBuffersProc)(GLsizei n, const GLuint* buffers);
+typedef void (APIENTRY *BindBufferProc)(GLenum target, GLuint buffer);
+typedef void (APIENTRY *BufferStorageProc)(GLenum target, ptrdiff_t size, const void* data, GLbitfield flags);
+typedef void* (APIENTRY *MapBufferRangeProc)(GLenum target, ptrdiff_t offset, ptrdiff_t length, GLbitfield access);
+typedef GLboolean (APIENTRY *UnmapBufferProc)(GLenum target);
+typedef void* (APIENTRY *FenceSyncProc)(GLenum condition, GLbitfield flags);
+typedef GLenum (APIENTRY *ClientWaitSyncProc)(void* sync, GLbitfield flags, uint64_t timeout);
+typedef void (APIENTRY *DeleteSyncProc)(void* sync);
+
+static struct
+{
+   TexImage3DProc texImage3D;
+   TexSubImage3DProc texSubImage3D;
+   GenBuffersProc genBuffers;
+   DeleteBuffersProc deleteBuffers;
+   BindBufferProc bindBuffer;
+   BufferStorageProc bufferStorage;
+   MapBufferRangeProc mapBufferRange;
+   UnmapBufferProc unmapBuffer;
+   FenceSyncProc fenceSync;
+   ClientWaitSyncProc clientWaitSync;
+   DeleteSyncProc deleteSync;
+} gl;
+
+static void* getProc(const char* name)
+{
+#if defined(__APPLE__)
+   return dlsym(RTLD_DEFAULT, name);
+#elif defined(LINUX)
+   return (void*) glXGetProcAddressARB((const GLubyte*) name);
+#else
+   return (void*) wglGetProcAddress(name);
+#endif
+}
+
+static bool hasExtension(const char* name)
+{
+   const char* extensions = (const char*) glGetString(GL_EXTENSIONS);
+   if (!extensions) return false;
+   size_t length = strlen(name);
+   for (const char* p = strstr(extensions, name); p; p = strstr(p + length, name))
+   {
+      if ((p == extensions || p[-1] == ' ') && (p[length] == ' ' || p[length] == '\0')) return true;
+   }
+   return false;
+}
+
+// Same ambient share as MACGrid::getLightShade.
+static const double theAmbient = 0.2;
+static const int theNumRegions = 3;
+
+SliceRenderer::SliceRenderer() :
+   mSlicesPerCell(0.0), mColorByTemperature(false),
+   mInitialized(false), mSupported(false), mPersistent(false),
+   mTexture(0), mBuffer(0), mMapped(NULL), mRegionBytes(0), mRegion(0)
+{
+   mDim[0] = mDim[1] = mDim[2] = 0;
+   for (int r = 0; r < theNumRegions; r++) mFences[r] = NULL;
+   setSlicesPerCell(2.0);
+}
+
+SliceRenderer::~SliceRenderer()
+{
+}
+
+void SliceRenderer::setSlicesPerCell(double slices)
+{
+   slices = std::max(slices, 0.25);
+   if (slices == mSlicesPerCell) return;
+   mSlicesPerCell = slices;
+   // Each slice stands for 1/slices of a cell, so it lets through
+   // (1 - alpha)^(1/slices) of what one sheet per cell would.
+   for (int n = 0; n < ALPHA_STEPS; n++)
+   {
+      double alpha = 1.0 - pow(1.0 - (double) n / (ALPHA_STEPS - 1), 1.0 / slices);
+      mAlpha[n] = (unsigned char) (255.0 * alpha + 0.5);
+   }
+}
+
+void SliceRenderer::setColorByTemperature(bool on)
+{
+   mColorByTemperature = on;
+}
+
+bool SliceRenderer::initialize()
+{
+   mInitialized = true;
+   int major = 0, minor = 0;
+   const char* version = (const char*) glGetString(GL_VERSION);
+   if (!version || sscanf(version, "%d.%d", &major, &minor) != 2) return false;
+
+   // 3D textures are 1.2; sizes that aren't powers of two need 2.0.
+   gl.texImage3D = (TexImage3DProc) getProc("glTexImage3D");
+   gl.texSubImage3D = (TexSubImage3DProc) getProc("glTexSubImage3D");
+   mSupported = major >= 2 && gl.texImage3D && gl.texSubImage3D;
+   if (!mSupported) return false;
+
+   int number = major * 10 + minor;
+   if ((number >= 44 || hasExtension("GL_ARB_buffer_storage")) &&
+      (number >= 32 || hasExtension("GL_ARB_sync")))
+   {
+      gl.genBuffers = (GenBuffersProc) getProc("glGenBuffers");
+      gl.deleteBuffers = (DeleteBuffersProc) getProc("glDeleteBuffers");
+      gl.bindBuffer = (BindBufferProc) getProc("glBindBuffer");
+      gl.bufferStorage = (BufferStorageProc) getProc("glBufferStorage");
+      gl.mapBufferRange = (MapBufferRangeProc) getProc("glMapBufferRange");
+      gl.unmapBuffer = (UnmapBufferProc) getProc("glUnmapBuffer");
+      gl.fenceSync = (FenceSyncProc) getProc("glFenceSync");
+      gl.clientWaitSync = (ClientWaitSyncProc) getProc("glClientWaitSync");
+      gl.deleteSync = (DeleteSyncProc) getProc("glDeleteSync");
+      mPersistent = gl.genBuffers && gl.deleteBuffers && gl.bindBuffer && gl.bufferStorage &&
+         gl.mapBufferRange && gl.unmapBuffer && gl.fenceSync && gl.clientWaitSync && gl.deleteSync;
+   }
+
+   glGenTextures(1, &mTexture);
+   glBindTexture(GL_TEXTURE_3D, mTexture);
+   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+   glBindTexture(GL_TEXTURE_3D, 0);
+   return true;
+}
+
+void SliceRenderer::allocate(int nx, int ny, int nz)
+{
+   mDim[0] = nx;
+   mDim[1] = ny;
+   mDim[2] = nz;
+   mRegionBytes = (size_t) nx * ny * nz * 4;
+
+   glBindTexture(GL_TEXTURE_3D, mTexture);
+   gl.texImage3D(GL_TEXTURE_3D, 0, GL_RGBA8, nx, nz, ny, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+   glBindTexture(GL_TEXTURE_3D, 0);
+
+   if (!mPersistent) return;
+   for (int r = 0; r < theNumRegions; r++)
+   {
+      if (mFences[r]) gl.deleteSync(mFences[r]);
+      mFences[r] = NULL;
+   }
+   if (mBuffer)
+   {
+      gl.bindBuffer(GL_PIXEL_UNPACK_BUFFER, mBuffer);
+      gl.unmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      gl.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      gl.deleteBuffers(1, &mBuffer);
+      mBuffer = 0;
+   }
+
+   GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+   ptrdiff_t bytes = (ptrdiff_t) (theNumRegions * mRegionBytes);
+   gl.genBuffers(1, &mBuffer);
+   gl.bindBuffer(GL_PIXEL_UNPACK_BUFFER, mBuffer);
+   gl.bufferStorage(GL_PIXEL_UNPACK_BUFFER, bytes, NULL, flags);
+   mMapped = (unsigned char*) gl.mapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, flags);
+   gl.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+   mRegion = 0;
+   if (!mMapped)
+   {
+      // The driver offered buffer storage but wouldn't map it; upload from memory.
+      gl.deleteBuffers(1, &mBuffer);
+      mBuffer = 0;
+      mPersistent = false;
+   }
+}
+
+void SliceRenderer::release()
+{
+   for (int r = 0; r < theNumRegions; r++)
+   {
+      if (mFences[r]) gl.deleteSync(mFences[r]);
+      mFences[r] = NULL;
+   }
+   if (mBuffer)
+   {
+      gl.bindBuffer(GL_PIXEL_UNPACK_BUFFER, mBuffer);
+      gl.unmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      gl.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      gl.deleteBuffers(1, &mBuffer);
+   }
+   if (mTexture) glDeleteTextures(1, &mTexture);
+   mBuffer = mTexture = 0;
+   mMapped = NULL;
+   mInitialized = mSupported = mPersistent = false;
+   mDim[0] = mDim[1] = mDim[2] = 0;
+   std::vector<unsigned char>().swap(mStaging);
+}
+
+void SliceRenderer::fillTexels(unsigned char* texels, const GridData& density, const GridData& temperature,
+   const std::vector<float>* light) const
+{
+   const GridData::Storage& d = density.data();
+   const GridData::Storage& t = temperature.data();
+   bool shaded = light && light->size() == d.size();
+   bool colored = mColorByTemperature && t.size() == d.size();
+   double tempScale = 1.0 / std::max(Tmax - Tamb, 1e-6);
+
+   for (size_t n = 0; n < d.size(); n++)
+   {
+      double value = std::min(std::max(d[n], 0.0), 1.0);
+      double r = 1.0, g = 1.0, b = 1.0;
+      if (colored)
+      {
+         double heat = std::min(std::max((t[n] - Tamb) * tempScale, 0.0), 1.0);
+         g = 1.0 - 0.45 * heat;
+         b = 1.0 - 0.85 * heat;
+      }
+      if (shaded)
+      {
+         double shade = theAmbient + (1.0 - theAmbient) * (*light)[n];
+         r *= shade;
+         g *= shade;
+         b *= shade;
+      }
+      unsigned char* texel = texels + 4 * n;
+      texel[0] = (unsigned char) (255.0 * r + 0.5);
+      texel[1] = (unsigned char) (255.0 * g + 0.5);
+      texel[2] = (unsigned char) (255.0 * b + 0.5);
+      texel[3] = mAlpha[(int) (value * (ALPHA_STEPS - 1) + 0.5)];
+   }
+}
+
+bool SliceRenderer::draw(const GridData& density, const GridData& temperature, const std::vector<float>* light,
+   const vec3& viewDir)
+{
+   if (!mInitialized) initialize();
+   if (!mSupported) return false;
+   if (mDim[0] != theDim[0] || mDim[1] != theDim[1] || mDim[2] != theDim[2])
+   {
+      allocate(theDim[0], theDim[1], theDim[2]);
+   }
+
+   unsigned char* texels;
+   if (mPersistent)
+   {
+      // Wait until the GPU is done with the upload that last used this region.
+      if (mFences[mRegion])
+      {
+         while (gl.clientWaitSync(mFences[mRegion], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+         gl.deleteSync(mFences[mRegion]);
+         mFences[mRegion] = NULL;
+      }
+      texels = mMapped + mRegion * mRegionBytes;
+   }
+   else
+   {
+      mStaging.resize(mRegionBytes);
+      texels = &mStaging[0];
+   }
+   fillTexels(texels, density, temperature, light);
+
+   glBindTexture(GL_TEXTURE_3D, mTexture);
+   if (mPersistent)
+   {
+      gl.bindBuffer(GL_PIXEL_UNPACK_BUFFER, mBuffer);
+      gl.texSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, mDim[0], mDim[2], mDim[1], GL_RGBA, GL_UNSIGNED_BYTE,
+         (const void*) (mRegion * mRegionBytes));
+      gl.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      mFences[mRegion] = gl.fenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      mRegion = (mRegion + 1) % theNumRegions;
+   }
+   else
+   {
+      gl.texSubImage3D(GL_TEXTURE_3D, 0, 0, 0, 0, mDim[0], mDim[2], mDim[1], GL_RGBA, GL_UNSIGNED_BYTE, texels);
+   }
+
+   drawSlices(viewDir);
+   glBindTexture(GL_TEXTURE_3D, 0);
+   return true;
+}
+
+void SliceRenderer::drawSlices(const vec3& viewDir) const
+{
+   vec3 size(theDim[0] * theCellSize, theDim[1] * theCellSize, theDim[2] * theCellSize);
+   vec3 dir = viewDir;
+   dir.Normalize();
+
+   // Two axes spanning the slice planes, for ordering polygon corners.
+   vec3 axisU = fabs(dir[1]) < 0.9 ? dir.Cross(axisY) : dir.Cross(axisX);
+   axisU.Normalize();
+   vec3 axisV = dir.Cross(axisU);
+
+   vec3 corners[8];
+   double nearest = HUGE_VAL, farthest = -HUGE_VAL;
+   for (int c = 0; c < 8; c++)
+   {
+      corners[c] = vec3(c & 1 ? size[0] : 0.0, c & 2 ? size[1] : 0.0, c & 4 ? size[2] : 0.0);
+      double distance = Dot(corners[c], dir);
+      nearest = std::min(nearest, distance);
+      farthest = std::max(farthest, distance);
+   }
+   // The 12 box edges as pairs of corners that differ in one bit.
+   static const int edges[12][2] = { { 0, 1 }, { 2, 3 }, { 4, 5 }, { 6, 7 }, { 0, 2 }, { 1, 3 },
+      { 4, 6 }, { 5, 7 }, { 0, 4 }, { 1, 5 }, { 2, 6 }, { 3, 7 } };
+
+   glPushAttrib(GL_ENABLE_BIT | GL_TEXTURE_BIT | GL_DEPTH_BUFFER_BIT | GL_CURRENT_BIT);
+   glEnable(GL_TEXTURE_3D);
+   glDisable(GL_CULL_FACE);
+   glDisable(GL_LIGHTING);
+   glDepthMask(GL_FALSE);
+   glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+   glColor4d(1.0, 1.0, 1.0, 1.0);
+
+   // Back to front: the far side of the box is at the largest distance
+   // along the view direction.
+   double spacing = theCellSize / mSlicesPerCell;
+   for (double plane = farthest - 0.5 * spacing; plane > nearest; plane -= spacing)
+   {
+      vec3 points[6];
+      int numPoints = 0;
+      for (int e = 0; e < 12 && numPoints < 6; e++)
+      {
+         const vec3& a = corners[edges[e][0]];
+         const vec3& b = corners[edges[e][1]];
+         double da = Dot(a, dir) - plane, db = Dot(b, dir) - plane;
+         if ((da < 0.0) == (db < 0.0)) continue;
+         points[numPoints++] = a + (b - a) * (da / (da - db));
+      }
+      if (numPoints < 3) continue;
+
+      // Order the corners around their center.
+      vec3 center(0, 0, 0);
+      for (int p = 0; p < numPoints; p++) center += points[p];
+      center /= numPoints;
+      double angles[6];
+      for (int p = 0; p < numPoints; p++)
+      {
+         vec3 offset = points[p] - center;
+         angles[p] = atan2(Dot(offset, axisV), Dot(offset, axisU));
+      }
+      for (int p = 1; p < numPoints; p++)
+      {
+         for (int q = p; q > 0 && angles[q] < angles[q - 1]; q--)
+         {
+            std::swap(angles[q], angles[q - 1]);
+            std::swap(points[q], points[q - 1]);
+         }
+      }
+
+      glBegin(GL_POLYGON);
+      for (int p = 0; p < numPoints; p++)
+      {
+         glTexCoord3d(points[p][0] / size[0], points[p][2] / size[2], points[p][1] / size[1]);
+         glVertex3d(points[p][0], points[p][1], points[p][2]);
+      }
+      glEnd();
+   }
+   glPopAttrib();
+}
@@ -0,0 +1,77 @@
+// Interactive smoke drawing with a 3D texture.
+//
+// The sheet renderer (MACGrid::drawZSheets/drawXSheets) interpolates the
+// density on the CPU for every vertex of every quad strip.  SliceRenderer
+// instead converts the grid to one RGBA texel per cell once per frame,
+// uploads it as a 3D texture and draws a stack of polygons perpendicular
+// to the view direction, back to front, letting the texture unit do the
+// trilinear filtering.
+//
+// Texels are written straight into a persistently mapped pixel buffer
+// (ARB_buffer_storage) split into three regions, so the CPU fills one
+// region while the GPU may still be reading the others; a fence per region
+// keeps them apart.  Without buffer storage (older drivers, some Mesa
+// configurations) the texels go through a plain glTexSubImage3D from
+// memory.  Everything else is OpenGL 2.0 fixed function, so it also runs
+// on Mesa's software rasterizer.
+//
+// The texture's s, t and r axes are x, z and y: GridData stores i fastest,
+// then k, then j, so a grid copies into the texture in storage order.
+
+#ifndef SLICE_RENDERER_H
+#define SLICE_RENDERER_H
+
+#include <vector>
+#include "vec.h"
+
+class GridData;
+
+class SliceRenderer
+{
+public:
+   SliceRenderer();
+   // GL objects are only released by release(), with the context current.
+   ~SliceRenderer();
+
+   // Slices per cell width along the view direction (default 2).  Opacity
+   // is corrected for the spacing, so the smoke looks as dense either way.
+   void setSlicesPerCell(double slices);
+   // Colors the smoke by temperature, from white at Tamb towards orange at Tmax.
+   void setColorByTemperature(bool on);
+
+   // Uploads the grid and draws it for a camera looking along viewDir.
+   // light is per-cell transmittance (TransmittanceGrid) or NULL.  Returns
+   // false, without drawing, if the context can't do 3D textures.
+   bool draw(const GridData& density, const GridData& temperature, const std::vector<float>* light,
+      const vec3& viewDir);
+
+   // Whether the last draw went through the persistently mapped buffer.
+   bool isPersistent() const { return mPersistent; }
+   void release();
+
+protected:
+   bool initialize();
+   void allocate(int nx, int ny, int nz);
+   void fillTexels(unsigned char* texels, const GridData& density, const GridData& temperature,
+      const std::vector<float>* light) const;
+   void drawSlices(const vec3& viewDir) const;
+
+   double mSlicesPerCell;
+   bool mColorByTemperature;
+   // Texel alpha for density quantized to 1/(ALPHA_STEPS - 1), for the
+   // current slice spacing.
+   enum { ALPHA_STEPS = 1024 };
+   unsigned char mAlpha[ALPHA_STEPS];
+
+   bool mInitialized, mSupported, mPersistent;
+   int mDim[3];
+   unsigned int mTexture;
+   unsigned int mBuffer;
+   unsigned char* mMapped;
+   size_t mRegionBytes;
+   int mRegion;
+   void* mFences[3];
+   std::vector<unsigned char> mStaging;
+};
+
+#endif // SLICE_RENDERER_H
@@ -0,0 +1,212 @@
+// Headless runner for the distributed grid (distributed_grid.h).
+// Build with `make smoke_mpi` and launch through MPI, e.g.
+//
+//   mpirun -np 4 bin/smoke_mpi -frames 20 -verify     check against the serial solver
+//   mpirun -np 1 bin/smoke_mpi -verify -no-precondition    must match it bit for bit
+//   mpirun -np 4 bin/smoke_mpi -dim 128x256x64         strong scaling: fixed grid
+//   mpirun -np 4 bin/smoke_mpi -dim 64x32x64 -weak     weak scaling: 32 rows per rank
+//
+// Prints per-stage timings (slowest rank), halo traffic and solver
+// iterations at the end.
+
+#include "distributed_grid.h"
+#include "smoke_sim.h"
+#include "volume_cache.h"
+#include "constants.h"
+#include "custom_output.h"
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#undef max
+#undef min
+#include <algorithm>
+
+static void usage()
+{
+   PRINT_LINE("usage: mpirun -np N smoke_mpi [options]\n"
+      "  -frames N             steps to run (default 20)\n"
+      "  -dim XxYxZ            global grid size (default the compiled-in theDim)\n"
+      "  -weak                 multiply the y size by the number of ranks\n"
+      "  -verify               also run the serial solver on rank 0 and compare (grid must be theDim)\n"
+      "  -no-precondition      plain CG pressure solve, as in the serial solver\n"
+      "  -cache FILE           gather density on rank 0 into a volume cache every step\n"
+      "  -cache-bits 0|8|16    cache encoding, 0 = raw float32 (default 0)");
+}
+
+static double slowest(double seconds, MPI_Comm comm)
+{
+   double result;
+   MPI_Reduce(&seconds, &result, 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+   return result;
+}
+
+// Largest difference between a gathered field and the serial one.
+static double maxDifference(const std::vector<double>& a, const GridData::Storage& b)
+{
+   if (a.size() != b.size()) return HUGE_VAL;
+   double diff = 0.0;
+   for (size_t n = 0; n < a.size(); n++) diff = std::max(diff, fabs(a[n] - b[n]));
+   return diff;
+}
+
+int main(int argc, char **argv)
+{
+   MPI_Init(&argc, &argv);
+   int rank, numRanks;
+   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+   MPI_Comm_size(MPI_COMM_WORLD, &numRanks);
+
+   int frames = 20;
+   int dim[3] = { theDim[0], theDim[1], theDim[2] };
+   bool weak = false, verify = false, precondition = true;
+   std::string cacheFile;
+   int cacheBits = 0;
+
+   for (int a = 1; a < argc; a++)
+   {
+      bool hasValue = a + 1 < argc;
+      if (!strcmp(argv[a], "-frames") && hasValue) frames = atoi(argv[++a]);
+      else if (!strcmp(argv[a], "-dim") && hasValue &&
+         sscanf(argv[++a], "%dx%dx%d", &dim[0], &dim[1], &dim[2]) == 3) {}
+      else if (!strcmp(argv[a], "-weak")) weak = true;
+      else if (!strcmp(argv[a], "-verify")) verify = true;
+      else if (!strcmp(argv[a], "-no-precondition")) precondition = false;
+      else if (!strcmp(argv[a], "-cache") && hasValue) cacheFile = argv[++a];
+      else if (!strcmp(argv[a], "-cache-bits") && hasValue) cacheBits = atoi(argv[++a]);
+      else
+      {
+         if (rank == 0) usage();
+         MPI_Finalize();
+         return 1;
+      }
+   }
+   if (weak) dim[1] *= numRanks;
+   if (verify && (dim[0] != theDim[0] || dim[1] != theDim[1] || dim[2] != theDim[2]))
+   {
+      if (rank == 0) PRINT_LINE("-verify needs the " << theDim[0] << "x" << theDim[1] << "x" << theDim[2] << " grid");
+      MPI_Finalize();
+      return 1;
+   }
+
+   DistributedGrid grid(MPI_COMM_WORLD, dim);
+   grid.setPreconditioner(precondition);
+   double cells = (double) dim[0]*dim[1]*dim[2];
+   if (rank == 0)
+   {
+      PRINT_LINE("Simulating " << frames << " steps on a " << dim[0] << "x" << dim[1] << "x" << dim[2]
+         << " grid across " << numRanks << " ranks (" << dim[1] / numRanks << "+ rows each)");
+   }
+
+   VolumeCacheWriter cache;
+   std::vector<double> gathered;
+   std::vector<float> density;
+   if (!cacheFile.empty() && rank == 0)
+   {
+      VolumeCache::Encoding encoding = VolumeCache::RAW_FLOAT32;
+      if (cacheBits == 8) encoding = VolumeCache::QUANTIZED8;
+      else if (cacheBits == 16) encoding = VolumeCache::QUANTIZED16;
+      cache.open(cacheFile.c_str(), dim, theCellSize, VolumeCache::DENSITY_BIT, encoding);
+   }
+
+   MPI_Barrier(MPI_COMM_WORLD);
+   double runStart = MPI_Wtime();
+   double cacheSeconds = 0.0;
+   for (int f = 0; f < frames; f++)
+   {
+      grid.step(theTimeStep);
+      if (!cacheFile.empty())
+      {
+         double start = MPI_Wtime();
+         grid.gather(DistributedGrid::DENSITY, gathered);
+         if (rank == 0)
+         {
+            density.assign(gathered.begin(), gathered.end());
+            cache.writeDensity(density, f);
+         }
+         cacheSeconds += MPI_Wtime() - start;
+      }
+   }
+   double runSeconds = slowest(MPI_Wtime() - runStart, MPI_COMM_WORLD);
+
+   const DistributedGrid::Stats& stats = grid.getStats();
+   double advect = slowest(stats.advectSeconds, MPI_COMM_WORLD);
+   double forces = slowest(stats.forceSeconds, MPI_COMM_WORLD);
+   double project = slowest(stats.projectSeconds, MPI_COMM_WORLD);
+   double scalars = slowest(stats.scalarSeconds, MPI_COMM_WORLD);
+   double exchange = slowest(stats.exchangeSeconds, MPI_COMM_WORLD);
+   double reduce = slowest(stats.reduceSeconds, MPI_COMM_WORLD);
+   long long haloBytes = 0;
+   MPI_Reduce((void*) &stats.haloBytes, &haloBytes, 1, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+   int haloMisses = 0;
+   MPI_Reduce((void*) &stats.haloMisses, &haloMisses, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+
+   if (rank == 0)
+   {
+      int steps = std::max(1, frames);
+      PRINT_LINE("Steps: " << frames << ", " << 1000.0 * runSeconds / steps << " ms/step, "
+         << cells * frames / runSeconds / 1e6 << " Mcells/s, " << runSeconds << " s total");
+      PRINT_LINE("Stages (ms/step, slowest rank): advect " << 1000.0 * advect / steps
+         << ", forces " << 1000.0 * forces / steps << ", project " << 1000.0 * project / steps
+         << ", scalars " << 1000.0 * scalars / steps);
+      PRINT_LINE("Halo: " << stats.halo << " rows, " << haloBytes / steps / 1e6 << " MB/step sent, exchange "
+         << 1000.0 * exchange / steps << " ms/step, reductions " << 1000.0 * reduce / steps
+         << " ms/step, " << haloMisses << " misses");
+      PRINT_LINE("Solver: " << (double) stats.cgIterations / steps << " CG iterations/step");
+      if (!cacheFile.empty())
+      {
+         cache.close();
+         PRINT_LINE("Cache: " << 1000.0 * cacheSeconds / steps << " ms/step gathering and writing " << cacheFile);
+      }
+   }
+
+   int failed = 0;
+   if (verify)
+   {
+      // The serial reference runs on rank 0 only; the others just gather.
+      SmokeSim* serial = NULL;
+      if (rank == 0)
+      {
+         serial = new SmokeSim();
+         for (int f = 0; f < frames; f++) serial->step();
+      }
+
+      const char* names[DistributedGrid::NUM_FIELDS] = { "u", "v", "w", "pressure", "density", "temperature" };
+      // The serial solver's CG is unpreconditioned, so a preconditioned run
+      // only agrees to within the solver tolerance.  Its pressure is not
+      // checked then: the residual tolerance bounds the velocities, but
+      // the pressure can differ by more, mostly by a constant.
+      double worst = 0.0;
+      std::string report;
+      for (int f = 0; f < DistributedGrid::NUM_FIELDS; f++)
+      {
+         grid.gather((DistributedGrid::Field) f, gathered);
+         if (rank != 0) continue;
+
+         const MACGrid& g = serial->getGrid();
+         const GridData* reference[DistributedGrid::NUM_FIELDS] = { &g.getVelocityXGrid(), &g.getVelocityYGrid(),
+            &g.getVelocityZGrid(), &g.getPressureGrid(), &g.getDensityGrid(), &g.getTemperatureGrid() };
+         double diff = maxDifference(gathered, reference[f]->data());
+         char line[128];
+         sprintf(line, " %s %.3g", names[f], diff);
+         report += line;
+         if (!precondition || f != DistributedGrid::PRESSURE) worst = std::max(worst, diff);
+      }
+
+      if (rank == 0)
+      {
+         // Unpreconditioned, one rank should match exactly; more ranks only
+         // change the order the CG dot products are summed in.
+         double tolerance = precondition? 1e-5 : numRanks == 1? 0.0 : 1e-6;
+         failed = worst > tolerance;
+         PRINT_LINE("Verify against serial, max |difference|:" << report << (failed? " FAILED" : " OK"));
+         delete serial;
+      }
+      MPI_Bcast(&failed, 1, MPI_INT, 0, MPI_COMM_WORLD);
+   }
+
+   MPI_Finalize();
+   return failed;
+}
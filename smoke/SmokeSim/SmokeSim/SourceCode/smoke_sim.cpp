@@ -6,12 +6,17 @@
 #include "stb_image_write.h"
 #include "custom_output.h"
 #include "basic_math.h"
+#include <string>
 
-SmokeSim::SmokeSim() : mFrameNum(0), mTotalFrameNum(0), mRecordEnabled(false) {
+SmokeSim::SmokeSim() : mRecordEnabled(false), mOutput(NULL),
+    mCheckpoints(NULL), mFrameNum(0), mTotalFrameNum(0) {
    reset();
 }
 
 SmokeSim::~SmokeSim() {
+  setPipelined(false);
+  setCacheFile(NULL);
+  delete mCheckpoints;  // finishes a pending checkpoint
 }
 
 void SmokeSim::reset() {
@@ -19,33 +24,27 @@ void SmokeSim::reset() {
   mTotalFrameNum = 0;
 }
 
-void SmokeSim::step() {
-  static int count = 0;
-
-  double dt = 0.04;//0.1;
-  //double dt = 0.1;
-
-  // Step0: Gather user forces
-  mGrid.updateSources();
+void SmokeSim::setObstacles(const ObstacleMask& obstacles) {
+  mGrid.setObstacles(obstacles);
+}
 
-  // Step1: Calculate new velocities
-  mGrid.advectVelocity(dt);
-  mGrid.addExternalForces(dt);
-  mGrid.project(dt);
+void SmokeSim::setParameters(const MACGrid::Parameters& params) {
+  mGrid.setParameters(params);
+}
 
-  // Step2: Calculate new temperature
-  mGrid.advectTemperature(dt);
+void SmokeSim::step() {
+  double dt = theTimeStep;
 
-  // Step3: Calculate new density 
-  mGrid.advectDensity(dt);
+  mGrid.step(dt);
   
-  mTotalFrameNum++;
-
-  if (count >= 0) {
-    //exit(0);
+  if (mCache.isOpen()) {
+    mCache.writeFrame(mGrid, mTotalFrameNum);
+  }
+  if (mPublisher.isOpen()) {
+    mPublisher.publish(mGrid, mTotalFrameNum);
   }
 
-  count += 1;
+  mTotalFrameNum++;
 }
 
 void SmokeSim::setRecording(bool on, int width, int height) {
@@ -53,6 +52,11 @@ void SmokeSim::setRecording(bool on, int width, int height) {
   if (on && ! mRecordEnabled) {
     mFrameNum = 0;
   }
+  // finish writing queued frames when recording stops
+  if (!on && mRecordEnabled && mOutput) {
+    mOutput->flush();
+    mOutput->printStats();
+  }
   mRecordEnabled = on;
 
   recordWidth = width;
@@ -63,6 +67,96 @@ bool SmokeSim::isRecording() {
   return mRecordEnabled;
 }
 
+void SmokeSim::setPipelined(bool on) {
+  if (on && !mOutput) {
+    mOutput = new FramePipeline();
+  } else if (!on && mOutput) {
+    // drains the queue before the workers exit
+    mOutput->flush();
+    mOutput->printStats();
+    delete mOutput;
+    mOutput = NULL;
+  }
+}
+
+bool SmokeSim::isPipelined() {
+  return mOutput != NULL;
+}
+
+void SmokeSim::setCacheFile(const char* fileName, unsigned int channels, VolumeCache::Encoding encoding) {
+  if (mCache.isOpen()) {
+    mCache.flush();
+    mCache.printStats();
+    mCache.close();
+  }
+  if (fileName) {
+    mCache.open(fileName, channels, encoding);
+  }
+}
+
+bool SmokeSim::isCaching() {
+  return mCache.isOpen();
+}
+
+void SmokeSim::setCacheVerify(bool on) {
+  mCache.setVerify(on);
+}
+
+void SmokeSim::setCacheEmptyThreshold(float threshold) {
+  mCache.setEmptyThreshold(threshold);
+}
+
+int SmokeSim::getCacheVerifyFailures() const {
+  return mCache.getVerifyFailures();
+}
+
+void SmokeSim::setPublishName(const char* name) {
+  if (name) {
+    mPublisher.open(name);
+  } else {
+    mPublisher.close();
+  }
+}
+
+bool SmokeSim::isPublishing() {
+  return mPublisher.isOpen();
+}
+
+bool SmokeSim::checkpoint(const char* fileName) {
+  if (!mCheckpoints) {
+    mCheckpoints = new FramePipeline(1, 1);
+  }
+  // Only the six fields are copied here; the file is written in the background.
+  std::shared_ptr<MACGrid::CheckpointFields> fields(new MACGrid::CheckpointFields());
+  mGrid.copyCheckpointFields(*fields);
+  std::string name(fileName);
+  int step = mTotalFrameNum;
+  mCheckpoints->submit([fields, name, step]() { MACGrid::checkpoint(name.c_str(), step, *fields); });
+  return true;
+}
+
+void SmokeSim::flush() {
+  if (mOutput) {
+    mOutput->flush();
+  }
+  mCache.flush();
+  if (mCheckpoints) {
+    mCheckpoints->flush();
+  }
+}
+
+bool SmokeSim::restore(const char* fileName) {
+  if (mCheckpoints) {
+    mCheckpoints->flush();
+  }
+  int step = 0;
+  if (!mGrid.restore(fileName, &step)) {
+    return false;
+  }
+  mTotalFrameNum = step;
+  return true;
+}
+
 void SmokeSim::draw(const Camera& c) {
   drawAxes(); 
   mGrid.draw(c);
@@ -71,6 +165,10 @@ void SmokeSim::draw(const Camera& c) {
   }
 }
 
+void SmokeSim::releaseGL() {
+  mGrid.releaseGL();
+}
+
 void SmokeSim::drawAxes() {
   glPushAttrib(GL_LIGHTING_BIT | GL_LINE_BIT);
   glDisable(GL_LIGHTING);
@@ -94,25 +192,34 @@ void SmokeSim::drawAxes() {
   glPopAttrib();
 }
 
+// Writes one recorded frame; runs on a pipeline worker when pipelined.
+// Volumes go to the cache (setCacheFile) rather than with the images.
+static void writeFrame(const FrameSnapshot& snapshot) {
+  // Save an image:
+  char anim_filename[2048];
+#ifndef WIN32
+  sprintf(anim_filename, "smoke_%04d.png", snapshot.frame); 
+#else
+  sprintf_s(anim_filename, 2048, "smoke_%04d.png", snapshot.frame); 
+#endif
+  snapshot.savePng(anim_filename);
+}
+
 void SmokeSim::grabScreen() {
   
   if (mFrameNum > 9999) {
+    setPipelined(false);
     exit(0);
   }
-  
 
-  // TODO: Un-comment this to save each frame of smoke in CIS 460 volumetric text file format.
-  /*
-  // Save the smoke densities:
-  char smoke_filename[2048];
-  sprintf_s(smoke_filename, 2048, "smoke_%04d.txt", mFrameNum); // Use snprintf if your compiler supports C99.
-  mGrid.saveSmoke(smoke_filename);
-  */
-  
-
-  // Save an image:
+  std::shared_ptr<FrameSnapshot> snapshot(new FrameSnapshot());
+  snapshot->frame = mFrameNum;
 
-  unsigned char* bitmapData = new unsigned char[3 * recordWidth * recordHeight];
+  // The framebuffer has to be read back on the GL thread; only the encoding is deferred.
+  snapshot->width = recordWidth;
+  snapshot->height = recordHeight;
+  snapshot->image.resize(3 * recordWidth * recordHeight);
+  unsigned char* bitmapData = &snapshot->image[0];
 
   for (int i=0; i<recordHeight; i++) 
   {
@@ -120,18 +227,13 @@ void SmokeSim::grabScreen() {
       bitmapData + (recordWidth * 3 * ((recordHeight-1)-i)));
   }
 
-  char anim_filename[2048];
-#ifndef WIN32
-  sprintf(anim_filename, "smoke_%04d.png", mFrameNum); 
-#else
-  sprintf_s(anim_filename, 2048, "smoke_%04d.png", mFrameNum); 
-#endif
-  
-  stbi_write_png(anim_filename, recordWidth, recordHeight, 3, bitmapData, recordWidth * 3);
-  
-  delete [] bitmapData;
-  
-  
+  if (mOutput) {
+    // Blocks only if the writers are a full queue behind.
+    FrameSnapshotPtr frame = snapshot;
+    mOutput->submit([frame]() { writeFrame(*frame); });
+  } else {
+    writeFrame(*snapshot);
+  }
   
   mFrameNum++;
    
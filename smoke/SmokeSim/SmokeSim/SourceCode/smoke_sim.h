@@ -6,6 +6,9 @@
 #define smokeSim_H_
 
 #include "mac_grid.h"
+#include "frame_pipeline.h"
+#include "volume_cache.h"
+#include "frame_publisher.h"
 
 class Camera;
 class SmokeSim
@@ -17,10 +20,43 @@ public:
    virtual void reset();
    virtual void step();
    virtual void draw(const Camera& c);
+   // Frees the GL objects draw() made; the context must be current.
+   virtual void releaseGL();
    virtual void setRecording(bool on, int width, int height);
    virtual bool isRecording();
+   // Pipelined recording hands each frame to background writers so the
+   // solver doesn't wait on PNG encoding and file I/O.
+   virtual void setPipelined(bool on);
+   virtual bool isPipelined();
+   // Streams every simulated step into a binary volume cache (see volume_cache.h).
+   // Pass NULL to stop caching and close the file.
+   virtual void setCacheFile(const char* fileName, unsigned int channels = VolumeCache::DEFAULT_CHANNELS,
+      VolumeCache::Encoding encoding = VolumeCache::RAW_FLOAT32);
+   virtual bool isCaching();
+   // Options for quantized caches opened after the call (see VolumeCacheWriter).
+   virtual void setCacheVerify(bool on);
+   virtual void setCacheEmptyThreshold(float threshold);
+   // Verified channels of the last cache that exceeded the codec's error bound.
+   virtual int getCacheVerifyFailures() const;
+   // Publishes every simulated step to the named shared memory segment for
+   // live viewers (see frame_publisher.h).  Pass NULL to stop.
+   virtual void setPublishName(const char* name);
+   virtual bool isPublishing();
+   // Saves the grid and step counter.  The six fields are copied and written
+   // on a background thread, so the simulation only pauses for the copy.
+   virtual bool checkpoint(const char* fileName);
+   // Restarts from a checkpoint written by checkpoint().
+   virtual bool restore(const char* fileName);
+   // Static obstacles for the grid (see obstacle_mask.h).  They persist across reset().
+   virtual void setObstacles(const ObstacleMask& obstacles);
+   // Buoyancy and vorticity confinement coefficients for this simulation.
+   virtual void setParameters(const MACGrid::Parameters& params);
+   // Waits until queued recording frames, cache frames and checkpoints are on disk.
+   virtual void flush();
 	
 	int getTotalFrames();
+	const MACGrid& getGrid() const { return mGrid; }
+	SolverTelemetry& getTelemetry() { return mGrid.getTelemetry(); }
 
 protected:
    virtual void drawAxes();
@@ -29,6 +65,10 @@ protected:
 protected:
 	MACGrid mGrid;
 	bool mRecordEnabled;
+	FramePipeline* mOutput;
+	VolumeCacheWriter mCache;
+	FramePublisher mPublisher;
+	FramePipeline* mCheckpoints;
 	int mFrameNum;
 	int mTotalFrameNum;
 	
@@ -0,0 +1,86 @@
+#include "solver_telemetry.h"
+#include <stdio.h>
+#include <string.h>
+
+const char* SolverTelemetry::stageName(int stage)
+{
+   static const char* names[NUM_STAGES] = { "sources", "advect_velocity", "forces", "project",
+      "advect_temperature", "advect_density" };
+   return stage >= 0 && stage < NUM_STAGES? names[stage] : "unknown";
+}
+
+SolverTelemetry::SolverTelemetry(int capacity) : mSampleEvery(1)
+{
+   setCapacity(capacity);
+}
+
+void SolverTelemetry::setCapacity(int capacity)
+{
+   mRecords.assign(capacity > 0? capacity : 1, StepRecord());
+   clear();
+}
+
+void SolverTelemetry::clear()
+{
+   mFirst = 0;
+   mCount = 0;
+   mNextStep = 0;
+   resetCurrent();
+}
+
+void SolverTelemetry::resetCurrent()
+{
+   memset(&mCurrent, 0, sizeof(mCurrent));
+   mCurrent.step = mNextStep;
+}
+
+const SolverTelemetry::StepRecord& SolverTelemetry::get(int n) const
+{
+   return mRecords[(mFirst + n) % mRecords.size()];
+}
+
+bool SolverTelemetry::sampleThisStep() const
+{
+   return mSampleEvery > 0 && mNextStep % mSampleEvery == 0;
+}
+
+void SolverTelemetry::commit()
+{
+   int capacity = (int) mRecords.size();
+   if (mCount < capacity)
+   {
+      mRecords[(mFirst + mCount) % capacity] = mCurrent;
+      mCount++;
+   }
+   else
+   {
+      mRecords[mFirst] = mCurrent;
+      mFirst = (mFirst + 1) % capacity;
+   }
+   mNextStep++;
+   resetCurrent();
+}
+
+bool SolverTelemetry::writeCsv(const char* fileName) const
+{
+   FILE* fp = fopen(fileName, "w");
+   if (!fp) return false;
+
+   fprintf(fp, "step,cg_iterations,converged,initial_residual,final_residual,sampled,"
+      "max_divergence,max_velocity,cfl");
+   for (int s = 0; s < NUM_STAGES; s++) fprintf(fp, ",%s_ms", stageName(s));
+   fprintf(fp, ",total_ms\n");
+
+   for (int n = 0; n < mCount; n++)
+   {
+      const StepRecord& r = get(n);
+      fprintf(fp, "%d,%d,%d,%.6g,%.6g,%d,", r.step, r.cgIterations, r.converged? 1 : 0,
+         r.initialResidual, r.finalResidual, r.sampled? 1 : 0);
+      // Unsampled diagnostics are left empty rather than written as 0.
+      if (r.sampled) fprintf(fp, "%.6g,%.6g,%.6g", r.maxDivergence, r.maxVelocity, r.cfl);
+      else fprintf(fp, ",,");
+      for (int s = 0; s < NUM_STAGES; s++) fprintf(fp, ",%.4f", 1000.0 * r.stageSeconds[s]);
+      fprintf(fp, ",%.4f\n", 1000.0 * r.totalSeconds);
+   }
+   return fclose(fp) == 0;
+}
@@ -0,0 +1,82 @@
+// Per-step solver telemetry.
+//
+// MACGrid::step fills in one StepRecord per step: pressure solve iterations
+// and residuals, stage timings and, on sampled steps, the diagnostics that
+// need an extra pass over the grid (largest divergence left after the
+// projection, largest velocity and the CFL number).  The last `capacity`
+// records are kept in a ring buffer that can be read back from code or
+// written out as CSV.  Everything except the sampled diagnostics is free to
+// collect; setSampleEvery(N) runs those every N steps (0 turns them off), so
+// telemetry can stay on in long production runs.
+
+#ifndef SOLVER_TELEMETRY_H
+#define SOLVER_TELEMETRY_H
+
+#include <vector>
+
+class SolverTelemetry
+{
+public:
+   enum Stage
+   {
+      SOURCES,
+      ADVECT_VELOCITY,
+      FORCES,
+      PROJECT,
+      ADVECT_TEMPERATURE,
+      ADVECT_DENSITY,
+      NUM_STAGES
+   };
+   static const char* stageName(int stage);
+
+   struct StepRecord
+   {
+      int step;                  // 0 for the first step after reset()
+      int cgIterations;
+      bool converged;
+      double initialResidual;    // max |r| before the first CG iteration
+      double finalResidual;      // max |r| when CG stopped
+      bool sampled;              // whether the three fields below were computed
+      double maxDivergence;      // max |div u| over fluid cells after projection
+      double maxVelocity;        // max |face velocity component|
+      double cfl;                // maxVelocity * dt / theCellSize
+      double stageSeconds[NUM_STAGES];
+      double totalSeconds;
+   };
+
+   explicit SolverTelemetry(int capacity = 1000);
+
+   void setCapacity(int capacity);
+   int getCapacity() const { return (int) mRecords.size(); }
+   void setSampleEvery(int steps) { mSampleEvery = steps; }
+   int getSampleEvery() const { return mSampleEvery; }
+
+   // Records held, oldest first: get(0) .. get(size() - 1).
+   int size() const { return mCount; }
+   const StepRecord& get(int n) const;
+   const StepRecord& latest() const { return get(mCount - 1); }
+   // Steps recorded since the last clear(), including ones that fell out.
+   int totalSteps() const { return mNextStep; }
+   void clear();
+
+   // One line per record plus a header; false if the file can't be written.
+   bool writeCsv(const char* fileName) const;
+
+   // Filled in by MACGrid during a step:
+   StepRecord& current() { return mCurrent; }
+   // Whether the step being recorded should run the sampled diagnostics.
+   bool sampleThisStep() const;
+   // Files the current record and starts the next one.
+   void commit();
+
+protected:
+   void resetCurrent();
+
+   std::vector<StepRecord> mRecords;
+   int mFirst, mCount;
+   int mNextStep;
+   int mSampleEvery;
+   StepRecord mCurrent;
+};
+
+#endif // SOLVER_TELEMETRY_H
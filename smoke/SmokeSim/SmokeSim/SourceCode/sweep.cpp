@@ -0,0 +1,224 @@
+// Parameter sweep runner.
+// Runs the default smoke setup once for every combination of buoyancy and
+// vorticity confinement coefficients.  Each combination is its own SmokeSim
+// (and so its own MACGrid), and the runs are spread over a pool of threads
+// that pick up the next combination as soon as they finish one.  Every run
+// streams its own volume cache, and a manifest lists the caches with the
+// parameters that made them.
+//
+//   smoke_sweep -alpha 0.0001,0.0002 -beta 0.005:0.02:4 -epsilon 0,0.15,0.3
+//
+// runs 2 x 4 x 3 = 24 simulations into sweep_000.svol ... sweep_023.svol
+// and writes sweep.txt.
+
+#include "smoke_sim.h"
+#include "grid_storage.h"
+#include "parallel.h"
+#include "constants.h"
+#include "custom_output.h"
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#undef max
+#undef min
+#include <algorithm>
+
+static double secondsNow()
+{
+   using namespace std::chrono;
+   return duration_cast<duration<double> >(steady_clock::now().time_since_epoch()).count();
+}
+
+static void usage()
+{
+   PRINT_LINE("usage: smoke_sweep [options]\n"
+      "  -alpha LIST           buoyancy density coefficients (default " << buoyAlpha << ")\n"
+      "  -beta LIST            buoyancy temperature coefficients (default " << buoyBeta << ")\n"
+      "  -epsilon LIST         vorticity confinement strengths (default " << vorticityEpsilon << ")\n"
+      "  -frames N             steps per run (default 100)\n"
+      "  -threads N            runs in flight at once (default one per core)\n"
+      "  -prefix NAME          caches are NAME_NNN.svol, manifest NAME.txt (default sweep)\n"
+      "  -cache-bits 0|8|16    cache encoding, 0 = raw float32 (default 8)\n"
+      "  -cache-verify         decode quantized frames and fail the sweep if any exceeds the error bound\n"
+      "  -cache-empty T        quantized tiles within T of zero are stored empty (default 1e-4)\n"
+      "  -velocity             also cache the face velocities\n"
+      "  -advection SCHEME     semi-lagrangian, maccormack or bfecc for every run\n"
+      "LIST is comma separated values (0.1,0.2,0.4) or an even range lo:hi:count (0:0.3:4)");
+}
+
+// "a,b,c" or "lo:hi:count".
+static bool parseList(const char* text, std::vector<double>& values)
+{
+   values.clear();
+   double lo, hi;
+   int count;
+   char extra;
+   if (sscanf(text, "%lf:%lf:%d%c", &lo, &hi, &count, &extra) == 3)
+   {
+      if (count < 1) return false;
+      for (int n = 0; n < count; n++)
+      {
+         values.push_back(count == 1? lo : lo + (hi - lo) * n / (count - 1));
+      }
+      return true;
+   }
+
+   std::string list(text);
+   size_t start = 0;
+   while (start <= list.size())
+   {
+      size_t end = list.find(',', start);
+      if (end == std::string::npos) end = list.size();
+      std::string item = list.substr(start, end - start);
+      char* stop = NULL;
+      double value = strtod(item.c_str(), &stop);
+      if (item.empty() || *stop != '\0') return false;
+      values.push_back(value);
+      start = end + 1;
+   }
+   return !values.empty();
+}
+
+struct SweepRun
+{
+   MACGrid::Parameters params;
+   std::string cacheFile;
+   double seconds;
+   int verifyFailures;
+};
+
+int main(int argc, char **argv)
+{
+   std::vector<double> alphas(1, buoyAlpha), betas(1, buoyBeta), epsilons(1, vorticityEpsilon);
+   int frames = 100;
+   int numThreads = 0;
+   std::string prefix = "sweep";
+   int cacheBits = 8;
+   bool cacheVerify = false;
+   float cacheEmpty = -1.0f;
+   unsigned int channels = VolumeCache::DEFAULT_CHANNELS;
+   MACGrid::AdvectionScheme advection = MACGrid::SEMI_LAGRANGIAN;
+
+   for (int a = 1; a < argc; a++)
+   {
+      bool hasValue = a + 1 < argc;
+      if (!strcmp(argv[a], "-alpha") && hasValue && parseList(argv[++a], alphas)) {}
+      else if (!strcmp(argv[a], "-beta") && hasValue && parseList(argv[++a], betas)) {}
+      else if (!strcmp(argv[a], "-epsilon") && hasValue && parseList(argv[++a], epsilons)) {}
+      else if (!strcmp(argv[a], "-frames") && hasValue) frames = atoi(argv[++a]);
+      else if (!strcmp(argv[a], "-threads") && hasValue) numThreads = atoi(argv[++a]);
+      else if (!strcmp(argv[a], "-prefix") && hasValue) prefix = argv[++a];
+      else if (!strcmp(argv[a], "-cache-bits") && hasValue) cacheBits = atoi(argv[++a]);
+      else if (!strcmp(argv[a], "-cache-verify")) cacheVerify = true;
+      else if (!strcmp(argv[a], "-cache-empty") && hasValue) cacheEmpty = (float) atof(argv[++a]);
+      else if (!strcmp(argv[a], "-velocity")) channels |= VolumeCache::VELOCITY_BITS;
+      else if (!strcmp(argv[a], "-advection") && hasValue && MACGrid::parseAdvection(argv[++a], advection)) {}
+      else
+      {
+         usage();
+         return 1;
+      }
+   }
+
+   VolumeCache::Encoding encoding = VolumeCache::RAW_FLOAT32;
+   if (cacheBits == 8) encoding = VolumeCache::QUANTIZED8;
+   else if (cacheBits == 16) encoding = VolumeCache::QUANTIZED16;
+   if (numThreads <= 0) numThreads = parallelThreadCount();
+
+   // The runs already keep every core busy.  Each grid's row passes stay on
+   // the thread stepping it, which also first touches its pages, instead of
+   // starting threads of their own (see grid_storage.h).
+   if (numThreads > 1)
+   {
+      GridStorage::Policy storage = GridStorage::getPolicy();
+      storage.numThreads = 1;
+      storage.pinThreads = false;
+      GridStorage::setPolicy(storage);
+   }
+
+   std::vector<SweepRun> runs;
+   for (size_t a = 0; a < alphas.size(); a++)
+      for (size_t b = 0; b < betas.size(); b++)
+         for (size_t e = 0; e < epsilons.size(); e++)
+         {
+            SweepRun run;
+            run.params.buoyAlpha = alphas[a];
+            run.params.buoyBeta = betas[b];
+            run.params.vorticityEpsilon = epsilons[e];
+            run.params.advection = advection;
+            char name[2048];
+            sprintf(name, "%s_%03d.svol", prefix.c_str(), (int) runs.size());
+            run.cacheFile = name;
+            run.seconds = 0.0;
+            run.verifyFailures = 0;
+            runs.push_back(run);
+         }
+
+   int numRuns = (int) runs.size();
+   PRINT_LINE("Sweeping " << numRuns << " runs of " << frames << " steps on a " << theDim[0] << "x"
+      << theDim[1] << "x" << theDim[2] << " grid, " << std::min(numThreads, numRuns) << " at a time");
+
+   std::mutex printMutex;
+   int finished = 0;
+   double runStart = secondsNow();
+
+   // One run per work item: a thread that finishes early takes the next
+   // combination, so the pool stays busy even when runs differ in cost.
+   parallelFor(0, numRuns, [&](int r) {
+      SweepRun& run = runs[r];
+      double start = secondsNow();
+      {
+         SmokeSim sim;
+         sim.setParameters(run.params);
+         sim.setCacheVerify(cacheVerify);
+         if (cacheEmpty >= 0.0f) sim.setCacheEmptyThreshold(cacheEmpty);
+         sim.setCacheFile(run.cacheFile.c_str(), channels, encoding);
+         for (int f = 0; f < frames; f++) sim.step();
+         sim.setCacheFile(NULL);
+         run.verifyFailures = sim.getCacheVerifyFailures();
+      }
+      run.seconds = secondsNow() - start;
+
+      std::unique_lock<std::mutex> lock(printMutex);
+      finished++;
+      PRINT_LINE("[" << finished << "/" << numRuns << "] " << run.cacheFile << ": alpha " << run.params.buoyAlpha
+         << ", beta " << run.params.buoyBeta << ", epsilon " << run.params.vorticityEpsilon
+         << ", " << run.seconds << " s"
+         << (run.verifyFailures > 0? ", cache over error bound" : ""));
+   }, numThreads);
+
+   double runSeconds = secondsNow() - runStart;
+
+   std::string manifest = prefix + ".txt";
+   FILE* fp = fopen(manifest.c_str(), "w");
+   if (!fp)
+   {
+      PRINT_LINE("Couldn't write " << manifest);
+      return 1;
+   }
+   fprintf(fp, "# run alpha beta epsilon frames seconds cache\n");
+   double summedSeconds = 0.0;
+   int verifyFailures = 0;
+   for (int r = 0; r < numRuns; r++)
+   {
+      const SweepRun& run = runs[r];
+      fprintf(fp, "%d %.9g %.9g %.9g %d %.3f %s\n", r, run.params.buoyAlpha, run.params.buoyBeta,
+         run.params.vorticityEpsilon, frames, run.seconds, run.cacheFile.c_str());
+      summedSeconds += run.seconds;
+      verifyFailures += run.verifyFailures;
+   }
+   fclose(fp);
+
+   PRINT_LINE("Sweep: " << numRuns << " runs in " << runSeconds << " s wall, " << summedSeconds / std::max(1, numRuns)
+      << " s per run, " << numRuns * 3600.0 / std::max(runSeconds, 1e-9) << " runs/hour, manifest " << manifest);
+   if (verifyFailures > 0)
+   {
+      PRINT_LINE("Cache verification failed: " << verifyFailures << " channel(s) over the error bound");
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,101 @@
+#include "transmittance_grid.h"
+#include "grid_data.h"
+#include "grid_sample.h"
+#include "parallel.h"
+#include <math.h>
+
+TransmittanceGrid::TransmittanceGrid() :
+   mToLight(0.3, 1.0, -0.3), mExtinction(1.0), mNumThreads(0)
+{
+   mToLight.Normalize();
+}
+
+void TransmittanceGrid::setLightDirection(const vec3& toLight)
+{
+   mToLight = toLight;
+   mToLight.Normalize();
+}
+
+const vec3& TransmittanceGrid::getLightDirection() const
+{
+   return mToLight;
+}
+
+void TransmittanceGrid::setExtinction(double extinction)
+{
+   mExtinction = extinction;
+}
+
+void TransmittanceGrid::setNumThreads(int numThreads)
+{
+   mNumThreads = numThreads;
+}
+
+void TransmittanceGrid::compute(const GridData& density)
+{
+   const int n[3] = { theDim[0], theDim[1], theDim[2] };
+   const int stride[3] = { 1, n[0]*n[2], n[0] };   // GridData order: i, then k, then j
+   const double* d = &density.data()[0];
+   mValues.resize((size_t) n[0]*n[1]*n[2]);
+   float* T = &mValues[0];
+
+   // Sweep axis a is the one most aligned with the light; b and c span a slab.
+   int a = 0;
+   for (int axis = 1; axis < 3; axis++)
+   {
+      if (fabs(mToLight[axis]) > fabs(mToLight[a])) a = axis;
+   }
+   const int b = (a + 1) % 3, c = (a + 2) % 3;
+   const double la = fabs(mToLight[a]);
+   // Offset, in cells, of the point one slab toward the light.
+   const double ob = mToLight[b] / la, oc = mToLight[c] / la;
+   const double opticalStep = mExtinction * theCellSize / la;   // path length between slabs
+
+   // The light enters on the high side of axis a if it points that way.
+   const int first = mToLight[a] > 0.0? n[a] - 1 : 0;
+   const int dir = mToLight[a] > 0.0? -1 : 1;
+
+   for (int s = 0, slab = first; s < n[a]; s++, slab += dir)
+   {
+      const int upstream = slab - dir;   // one slab closer to the light
+      parallelFor(0, n[b], [&](int u) {
+         for (int v = 0; v < n[c]; v++)
+         {
+            int index = slab*stride[a] + u*stride[b] + v*stride[c];
+            double upT = 1.0, upD = 0.0;
+
+            double pu = u + ob, pv = v + oc;
+            if (s > 0 && pu > -0.5 && pu < n[b] - 0.5 && pv > -0.5 && pv < n[c] - 0.5)
+            {
+               // Bilinear lookup in the upstream slab.
+               pu = pu < 0.0? 0.0 : (pu > n[b] - 1.0? n[b] - 1.0 : pu);
+               pv = pv < 0.0? 0.0 : (pv > n[c] - 1.0? n[c] - 1.0 : pv);
+               int u0 = (int) pu, v0 = (int) pv;
+               int u1 = u0 + 1 < n[b]? u0 + 1 : u0, v1 = v0 + 1 < n[c]? v0 + 1 : v0;
+               double fu = pu - u0, fv = pv - v0;
+               int base = upstream*stride[a];
+               int i00 = base + u0*stride[b] + v0*stride[c], i01 = base + u0*stride[b] + v1*stride[c];
+               int i10 = base + u1*stride[b] + v0*stride[c], i11 = base + u1*stride[b] + v1*stride[c];
+               double w00 = (1-fu)*(1-fv), w01 = (1-fu)*fv, w10 = fu*(1-fv), w11 = fu*fv;
+               upT = w00*T[i00] + w01*T[i01] + w10*T[i10] + w11*T[i11];
+               upD = w00*d[i00] + w01*d[i01] + w10*d[i10] + w11*d[i11];
+            }
+
+            // Trapezoid rule for the density between the two slabs.
+            double tau = 0.5 * (upD + d[index]) * opticalStep;
+            T[index] = (float) (upT * exp(-(tau > 0.0? tau : 0.0)));
+         }
+      }, mNumThreads);
+   }
+}
+
+const std::vector<float>& TransmittanceGrid::values() const
+{
+   return mValues;
+}
+
+double TransmittanceGrid::sample(const vec3& pt) const
+{
+   if (mValues.empty()) return 1.0;
+   return sampleCentered(&mValues[0], pt[0]/theCellSize - 0.5, pt[1]/theCellSize - 0.5, pt[2]/theCellSize - 0.5);
+}
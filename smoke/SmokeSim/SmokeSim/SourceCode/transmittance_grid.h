@@ -0,0 +1,48 @@
+// Per-cell light transmittance for a directional light.
+//
+// compute() stores, for every cell center, the fraction of the light that
+// survives the smoke between the light and that cell.  It sweeps the grid
+// once, slab by slab along the axis closest to the light direction: each
+// cell takes the value one slab closer to the light (bilinearly
+// interpolated where the light comes in at an angle) and attenuates it by
+// the density in between.  Cells within a slab don't depend on each other,
+// so every slab is split across threads.  The cost is O(n^3) per frame, after
+// which shading a sample is one lookup instead of a march toward the light.
+//
+// Used by the GL sheet renderer (MACGrid::theLighting) and by VolumeRenderer.
+
+#ifndef TRANSMITTANCE_GRID_H
+#define TRANSMITTANCE_GRID_H
+
+#include <vector>
+#include "vec.h"
+
+class GridData;
+
+class TransmittanceGrid
+{
+public:
+   TransmittanceGrid();
+
+   // Direction pointing toward the light (needn't be normalized).
+   void setLightDirection(const vec3& toLight);
+   const vec3& getLightDirection() const;
+   // Per unit density per unit length; match the renderer's extinction.
+   void setExtinction(double extinction);
+   void setNumThreads(int numThreads);    // 0 = one per hardware thread
+
+   void compute(const GridData& density);
+
+   // Transmittance at cell centers, GridData order; empty before compute().
+   const std::vector<float>& values() const;
+   // Trilinear lookup at a world position.
+   double sample(const vec3& pt) const;
+
+protected:
+   vec3 mToLight;
+   double mExtinction;
+   int mNumThreads;
+   std::vector<float> mValues;
+};
+
+#endif // TRANSMITTANCE_GRID_H
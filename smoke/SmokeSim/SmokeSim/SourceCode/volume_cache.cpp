@@ -0,0 +1,458 @@
+#include "volume_cache.h"
+#include "volume_codec.h"
+#include "mac_grid.h"
+#include "constants.h"
+#include "custom_output.h"
+#include <string.h>
+#include <math.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#undef max
+#undef min
+#include <algorithm>
+
+using namespace VolumeCache;
+
+static_assert(sizeof(FileHeader) == 64, "FileHeader must stay 64 bytes");
+static_assert(sizeof(FrameHeader) == 32, "FrameHeader must stay 32 bytes");
+static_assert(sizeof(ChannelHeader) == 16, "ChannelHeader must stay 16 bytes");
+
+static const unsigned int kVersion = 1;
+
+static size_t padded(size_t bytes)
+{
+   return (bytes + 15) & ~(size_t) 15;
+}
+
+size_t VolumeCache::channelSize(int channel, const int dim[3])
+{
+   size_t x = dim[0], y = dim[1], z = dim[2];
+   switch (channel)
+   {
+   case VELOCITY_X: return (x+1)*y*z;
+   case VELOCITY_Y: return x*(y+1)*z;
+   case VELOCITY_Z: return x*y*(z+1);
+   default: return x*y*z;
+   }
+}
+
+const char* VolumeCache::channelName(int channel)
+{
+   switch (channel)
+   {
+   case DENSITY: return "density";
+   case TEMPERATURE: return "temperature";
+   case VELOCITY_X: return "velocity_x";
+   case VELOCITY_Y: return "velocity_y";
+   case VELOCITY_Z: return "velocity_z";
+   default: return "unknown";
+   }
+}
+
+static void copyToFloat(const GridData& grid, std::vector<float>& out)
+{
+   const GridData::Storage& data = grid.data();
+   out.resize(data.size());
+   for (size_t i = 0; i < data.size(); i++) out[i] = (float) data[i];
+}
+
+//---------------------------------------------------------------------
+// VolumeCacheWriter
+//---------------------------------------------------------------------
+
+VolumeCacheWriter::VolumeCacheWriter() : mFile(NULL), mChannels(0),
+   mEncoding(RAW_FLOAT32), mEmptyThreshold(1e-4f), mVerify(false), mWriter(NULL),
+   mNextSequence(0), mNextCommit(0)
+{
+   mDim[0] = mDim[1] = mDim[2] = 0;
+   memset(&mStats, 0, sizeof(mStats));
+}
+
+VolumeCacheWriter::~VolumeCacheWriter()
+{
+   close();
+}
+
+bool VolumeCacheWriter::open(const char* fileName, unsigned int channels, Encoding encoding)
+{
+   return open(fileName, theDim, theCellSize, channels, encoding);
+}
+
+bool VolumeCacheWriter::open(const char* fileName, const int dim[3], double cellSize,
+   unsigned int channels, Encoding encoding)
+{
+   close();
+
+   mFile = fopen(fileName, "wb");
+   if (!mFile)
+   {
+      PRINT_LINE("Could not open volume cache " << fileName);
+      return false;
+   }
+
+   mChannels = channels;
+   mEncoding = encoding;
+   for (int d = 0; d < 3; d++) mDim[d] = dim[d];
+   mNextSequence = mNextCommit = 0;
+   memset(&mStats, 0, sizeof(mStats));
+
+   FileHeader header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, "SVOL", 4);
+   header.version = kVersion;
+   for (int d = 0; d < 3; d++) header.dim[d] = mDim[d];
+   header.channels = mChannels;
+   header.cellSize = cellSize;
+   header.headerBytes = sizeof(FileHeader);
+   fwrite(&header, sizeof(header), 1, mFile);
+
+   // Raw frames are pure I/O, one writer is enough.  Quantizing is CPU bound,
+   // so spread it over the spare cores.
+   mWriter = new FramePipeline(mEncoding == RAW_FLOAT32? 1 : 0, 3);
+   return true;
+}
+
+void VolumeCacheWriter::close()
+{
+   if (mWriter)
+   {
+      mWriter->flush();
+      delete mWriter;
+      mWriter = NULL;
+   }
+   if (mFile)
+   {
+      fclose(mFile);
+      mFile = NULL;
+   }
+   mPending.clear();
+}
+
+bool VolumeCacheWriter::isOpen() const
+{
+   return mFile != NULL;
+}
+
+void VolumeCacheWriter::setEmptyThreshold(float threshold)
+{
+   mEmptyThreshold = threshold;
+}
+
+void VolumeCacheWriter::setVerify(bool on)
+{
+   mVerify = on;
+}
+
+int VolumeCacheWriter::getVerifyFailures() const
+{
+   std::unique_lock<std::mutex> lock(mCommitMutex);
+   return mStats.verifyFailures;
+}
+
+void VolumeCacheWriter::flush()
+{
+   if (mWriter) mWriter->flush();
+   if (mFile) fflush(mFile);
+}
+
+const FramePipeline* VolumeCacheWriter::getPipeline() const
+{
+   return mWriter;
+}
+
+void VolumeCacheWriter::printStats() const
+{
+   if (mWriter) mWriter->printStats();
+
+   std::unique_lock<std::mutex> lock(mCommitMutex);
+   if (mStats.writtenBytes == 0) return;
+   PRINT_LINE("Volume cache: " << (mStats.rawBytes >> 20) << " MB of fields in "
+      << (mStats.writtenBytes >> 20) << " MB, ratio "
+      << (double) mStats.rawBytes / mStats.writtenBytes << ":1");
+   if (mVerify && mEncoding != RAW_FLOAT32)
+   {
+      PRINT_LINE("Volume cache: worst error " << (int) (100.0 * mStats.maxErrorRatio)
+         << "% of bound, " << mStats.verifyFailures << " channel(s) over bound");
+   }
+}
+
+void VolumeCacheWriter::writeFrame(const MACGrid& grid, int frame)
+{
+   if (!mFile) return;
+
+   // Snapshot on the simulation thread; the grid keeps changing after we return.
+   std::shared_ptr<Frame> snapshot(new Frame());
+   snapshot->frame = frame;
+   snapshot->sequence = mNextSequence++;
+   if (mChannels & DENSITY_BIT) copyToFloat(grid.getDensityGrid(), snapshot->data[DENSITY]);
+   if (mChannels & TEMPERATURE_BIT) copyToFloat(grid.getTemperatureGrid(), snapshot->data[TEMPERATURE]);
+   if (mChannels & (1 << VELOCITY_X)) copyToFloat(grid.getVelocityXGrid(), snapshot->data[VELOCITY_X]);
+   if (mChannels & (1 << VELOCITY_Y)) copyToFloat(grid.getVelocityYGrid(), snapshot->data[VELOCITY_Y]);
+   if (mChannels & (1 << VELOCITY_Z)) copyToFloat(grid.getVelocityZGrid(), snapshot->data[VELOCITY_Z]);
+
+   submit(snapshot);
+}
+
+void VolumeCacheWriter::writeDensity(const std::vector<float>& density, int frame)
+{
+   if (!mFile) return;
+
+   std::shared_ptr<Frame> snapshot(new Frame());
+   snapshot->frame = frame;
+   snapshot->sequence = mNextSequence++;
+   snapshot->data[DENSITY] = density;
+
+   submit(snapshot);
+}
+
+void VolumeCacheWriter::submit(const std::shared_ptr<const Frame>& frame)
+{
+   mWriter->submit([this, frame]() {
+      std::vector<char> bytes;
+      encodeFrame(*frame, bytes);
+      commit(frame->sequence, bytes);
+   });
+}
+
+void VolumeCacheWriter::encodeFrame(const Frame& frame, std::vector<char>& out)
+{
+   out.resize(sizeof(FrameHeader));
+   unsigned int numChannels = 0;
+   unsigned long long rawBytes = 0;
+   double maxErrorRatio = 0.0;
+   int verifyFailures = 0;
+
+   for (int c = 0; c < NUM_CHANNELS; c++)
+   {
+      // Channels without data (e.g. temperature in a density-only frame) are left out.
+      if (!(mChannels & (1 << c)) || frame.data[c].empty()) continue;
+      const std::vector<float>& values = frame.data[c];
+      rawBytes += values.size() * sizeof(float);
+
+      size_t headerAt = out.size();
+      out.resize(headerAt + sizeof(ChannelHeader));
+
+      ChannelHeader channelHeader;
+      channelHeader.channel = c;
+      channelHeader.encoding = RAW_FLOAT32;
+      bool quantize = mEncoding != RAW_FLOAT32 && (c == DENSITY || c == TEMPERATURE);
+      if (quantize)
+      {
+         channelHeader.encoding = mEncoding;
+         size_t payloadAt = out.size();
+         double bound = VolumeCodec::encodeTiled(&values[0], mDim,
+            mEncoding == QUANTIZED16? 16 : 8, mEmptyThreshold, out);
+
+         if (mVerify)
+         {
+            std::vector<float> decoded(values.size());
+            double error = 0.0;
+            if (VolumeCodec::decodeTiled(&out[payloadAt], out.size() - payloadAt, mDim, &decoded[0]))
+            {
+               for (size_t n = 0; n < values.size(); n++)
+               {
+                  error = std::max(error, fabs((double) decoded[n] - values[n]));
+               }
+            }
+            else
+            {
+               error = HUGE_VAL;
+            }
+            if (error > bound) verifyFailures++;
+            if (bound > 0.0) maxErrorRatio = std::max(maxErrorRatio, error / bound);
+         }
+      }
+      else
+      {
+         const char* bytes = (const char*) &values[0];
+         out.insert(out.end(), bytes, bytes + values.size() * sizeof(float));
+      }
+
+      out.resize(headerAt + sizeof(ChannelHeader) + padded(out.size() - headerAt - sizeof(ChannelHeader)), 0);
+      channelHeader.bytes = out.size() - headerAt - sizeof(ChannelHeader);
+      memcpy(&out[headerAt], &channelHeader, sizeof(channelHeader));
+      numChannels++;
+   }
+
+   FrameHeader frameHeader;
+   memset(&frameHeader, 0, sizeof(frameHeader));
+   memcpy(frameHeader.magic, "FRAM", 4);
+   frameHeader.frame = frame.frame;
+   frameHeader.numChannels = numChannels;
+   frameHeader.bytes = out.size() - sizeof(FrameHeader);
+   memcpy(&out[0], &frameHeader, sizeof(frameHeader));
+
+   std::unique_lock<std::mutex> lock(mCommitMutex);
+   mStats.rawBytes += rawBytes;
+   mStats.maxErrorRatio = std::max(mStats.maxErrorRatio, maxErrorRatio);
+   mStats.verifyFailures += verifyFailures;
+}
+
+void VolumeCacheWriter::commit(int sequence, std::vector<char>& bytes)
+{
+   std::unique_lock<std::mutex> lock(mCommitMutex);
+   mPending[sequence].swap(bytes);
+
+   // Whoever completes the next frame in line writes it and any that were waiting on it.
+   std::map<int, std::vector<char> >::iterator next;
+   while ((next = mPending.find(mNextCommit)) != mPending.end())
+   {
+      fwrite(&next->second[0], 1, next->second.size(), mFile);
+      mStats.writtenBytes += next->second.size();
+      mPending.erase(next);
+      mNextCommit++;
+   }
+}
+
+//---------------------------------------------------------------------
+// VolumeCacheReader
+//---------------------------------------------------------------------
+
+VolumeCacheReader::VolumeCacheReader() : mBase(NULL), mSize(0), mMapping(NULL)
+{
+}
+
+VolumeCacheReader::~VolumeCacheReader()
+{
+   close();
+}
+
+bool VolumeCacheReader::open(const char* fileName)
+{
+   close();
+
+#ifdef _WIN32
+   HANDLE file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (file == INVALID_HANDLE_VALUE) return false;
+   LARGE_INTEGER size;
+   GetFileSizeEx(file, &size);
+   mSize = (size_t) size.QuadPart;
+   HANDLE mapping = mSize ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+   CloseHandle(file);
+   if (!mapping) return false;
+   mBase = (const char*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+   mMapping = mapping;
+#else
+   int fd = ::open(fileName, O_RDONLY);
+   if (fd < 0) return false;
+   struct stat st;
+   fstat(fd, &st);
+   mSize = (size_t) st.st_size;
+   void* base = mSize ? mmap(NULL, mSize, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+   ::close(fd);
+   if (base == MAP_FAILED) return false;
+   mBase = (const char*) base;
+#endif
+
+   const FileHeader& header = getHeader();
+   if (mSize < sizeof(FileHeader) || memcmp(header.magic, "SVOL", 4) != 0 || header.version > kVersion)
+   {
+      PRINT_LINE(fileName << " is not a volume cache");
+      close();
+      return false;
+   }
+
+   // Index the frames by hopping headers.  A partially written last frame is dropped.
+   size_t offset = header.headerBytes;
+   while (offset + sizeof(FrameHeader) <= mSize)
+   {
+      const FrameHeader* frame = (const FrameHeader*) (mBase + offset);
+      if (memcmp(frame->magic, "FRAM", 4) != 0) break;
+      size_t next = offset + sizeof(FrameHeader) + (size_t) frame->bytes;
+      if (next > mSize) break;
+      mFrameOffsets.push_back(offset);
+      mFrameNumbers.push_back(frame->frame);
+      offset = next;
+   }
+   return true;
+}
+
+void VolumeCacheReader::close()
+{
+#ifdef _WIN32
+   if (mBase) UnmapViewOfFile(mBase);
+   if (mMapping) CloseHandle((HANDLE) mMapping);
+#else
+   if (mBase) munmap((void*) mBase, mSize);
+#endif
+   mBase = NULL;
+   mMapping = NULL;
+   mSize = 0;
+   mFrameOffsets.clear();
+   mFrameNumbers.clear();
+}
+
+const FileHeader& VolumeCacheReader::getHeader() const
+{
+   return *(const FileHeader*) mBase;
+}
+
+int VolumeCacheReader::getNumFrames() const
+{
+   return (int) mFrameOffsets.size();
+}
+
+int VolumeCacheReader::getFrameNumber(int index) const
+{
+   return mFrameNumbers[index];
+}
+
+int VolumeCacheReader::findFrame(int frame) const
+{
+   for (size_t i = 0; i < mFrameNumbers.size(); i++)
+   {
+      if (mFrameNumbers[i] == frame) return (int) i;
+   }
+   return -1;
+}
+
+const ChannelHeader* VolumeCacheReader::channelHeader(int index, int channel) const
+{
+   if (index < 0 || index >= getNumFrames()) return NULL;
+
+   const FrameHeader* frame = (const FrameHeader*) (mBase + mFrameOffsets[index]);
+   size_t offset = mFrameOffsets[index] + sizeof(FrameHeader);
+   for (unsigned int c = 0; c < frame->numChannels; c++)
+   {
+      const ChannelHeader* header = (const ChannelHeader*) (mBase + offset);
+      if ((int) header->channel == channel) return header;
+      offset += sizeof(ChannelHeader) + (size_t) header->bytes;
+   }
+   return NULL;
+}
+
+bool VolumeCacheReader::readChannel(int index, int channel, std::vector<float>& out) const
+{
+   const ChannelHeader* header = channelHeader(index, channel);
+   if (!header) return false;
+
+   const int* dim = getHeader().dim;
+   out.resize(channelSize(channel, dim));
+   switch (header->encoding)
+   {
+   case RAW_FLOAT32:
+      memcpy(&out[0], header + 1, out.size() * sizeof(float));
+      return true;
+   case QUANTIZED8:
+   case QUANTIZED16:
+      return VolumeCodec::decodeTiled((const char*) (header + 1), (size_t) header->bytes, dim, &out[0]);
+   default:
+      return false;
+   }
+}
+
+const float* VolumeCacheReader::channel(int index, int channel, size_t* count) const
+{
+   const ChannelHeader* header = channelHeader(index, channel);
+   if (!header || header->encoding != RAW_FLOAT32) return NULL;
+   if (count) *count = channelSize(channel, getHeader().dim);
+   return (const float*) (header + 1);
+}
@@ -0,0 +1,201 @@
+// Binary volume sequence cache ("svol").
+//
+// One file holds a whole sequence of frames.  Layout (little endian):
+//
+//   FileHeader                      64 bytes: magic "SVOL", dims, cell size, channel mask
+//   for each frame:
+//     FrameHeader                   32 bytes: magic "FRAM", frame number, payload bytes
+//     for each channel in the mask:
+//       ChannelHeader               16 bytes: channel id, encoding, payload bytes
+//       payload                     encoded values, padded to a multiple of 16 bytes
+//
+// Values are stored in GridData order (i fastest, then k, then j), so a
+// density block is dim[1] x dim[2] x dim[0] floats in C order.  The face
+// velocity channels use the sizes of GridDataX/Y/Z.  Raw payloads are plain
+// float32; density and temperature can instead be stored quantized to 8 or
+// 16 bits per tile (see volume_codec.h), which is what long shots should use.
+// Every payload starts 16-byte aligned, so a reader that maps the file can
+// hand out pointers to raw channels straight into the mapping.  Frames are
+// self-delimiting: the reader finds them by hopping headers and ignores a
+// truncated last frame, so a cache written by a crashed run is still
+// readable.
+
+#ifndef VOLUME_CACHE_H
+#define VOLUME_CACHE_H
+
+#include <vector>
+#include <map>
+#include <string>
+#include <stdio.h>
+#include "frame_pipeline.h"
+
+class MACGrid;
+
+namespace VolumeCache
+{
+   enum Channel
+   {
+      DENSITY = 0,
+      TEMPERATURE,
+      VELOCITY_X,
+      VELOCITY_Y,
+      VELOCITY_Z,
+      NUM_CHANNELS
+   };
+
+   enum ChannelMask
+   {
+      DENSITY_BIT = 1 << DENSITY,
+      TEMPERATURE_BIT = 1 << TEMPERATURE,
+      VELOCITY_BITS = (1 << VELOCITY_X) | (1 << VELOCITY_Y) | (1 << VELOCITY_Z),
+      DEFAULT_CHANNELS = DENSITY_BIT | TEMPERATURE_BIT
+   };
+
+   enum Encoding
+   {
+      RAW_FLOAT32 = 0,
+      QUANTIZED8,    // tiled 8-bit, volume_codec.h
+      QUANTIZED16    // tiled 16-bit, volume_codec.h
+   };
+
+   struct FileHeader
+   {
+      char magic[4];          // "SVOL"
+      unsigned int version;
+      int dim[3];             // cells in x, y, z
+      unsigned int channels;  // ChannelMask
+      double cellSize;
+      unsigned int headerBytes;
+      unsigned int reserved[7];
+   };
+
+   struct FrameHeader
+   {
+      char magic[4];          // "FRAM"
+      int frame;
+      unsigned int numChannels;
+      unsigned int reserved0;
+      unsigned long long bytes;  // bytes following this header
+      unsigned long long reserved1;
+   };
+
+   struct ChannelHeader
+   {
+      unsigned int channel;   // Channel
+      unsigned int encoding;  // Encoding
+      unsigned long long bytes;  // payload bytes following this header (padded)
+   };
+
+   // Number of values stored for a channel of a dim[0] x dim[1] x dim[2] grid.
+   size_t channelSize(int channel, const int dim[3]);
+   const char* channelName(int channel);
+}
+
+// Appends frames to a cache file.  writeFrame() copies the requested fields
+// (as float32) on the calling thread and returns; encoding and file I/O
+// happen on background workers, with the same bounded-queue backpressure as
+// recording.  Frames may finish encoding out of order, so each one is held
+// until the frames before it are in the file.
+class VolumeCacheWriter
+{
+public:
+   VolumeCacheWriter();
+   ~VolumeCacheWriter();
+
+   // encoding applies to density and temperature; velocities are always raw.
+   bool open(const char* fileName, unsigned int channels = VolumeCache::DEFAULT_CHANNELS,
+      VolumeCache::Encoding encoding = VolumeCache::RAW_FLOAT32);
+   // For grids other than the simulation's (e.g. upsampled density).
+   bool open(const char* fileName, const int dim[3], double cellSize,
+      unsigned int channels, VolumeCache::Encoding encoding);
+   void close();
+   bool isOpen() const;
+
+   // Quantized tiles whose values are all within this of zero are stored as
+   // empty (default 1e-4).  Both settings carry over to later open() calls.
+   void setEmptyThreshold(float threshold);
+   // Decodes every quantized channel after encoding and checks it against the
+   // raw field and the codec's error bound.
+   void setVerify(bool on);
+   // Quantized channels that came back outside the bound since the last
+   // open(), with verification on.  Still valid after close().
+   int getVerifyFailures() const;
+
+   void writeFrame(const MACGrid& grid, int frame);
+   // Writes a density-only frame of the size given to open().
+   void writeDensity(const std::vector<float>& density, int frame);
+
+   // Waits for queued frames to reach the file.
+   void flush();
+   const FramePipeline* getPipeline() const;
+   void printStats() const;
+
+protected:
+   struct Frame
+   {
+      int frame;
+      int sequence;
+      std::vector<float> data[VolumeCache::NUM_CHANNELS];
+   };
+   void submit(const std::shared_ptr<const Frame>& frame);
+   void encodeFrame(const Frame& frame, std::vector<char>& out);
+   void commit(int sequence, std::vector<char>& bytes);
+
+   FILE* mFile;
+   unsigned int mChannels;
+   VolumeCache::Encoding mEncoding;
+   float mEmptyThreshold;
+   bool mVerify;
+   int mDim[3];
+   FramePipeline* mWriter;
+
+   // Ordered commit of encoded frames; guarded by mCommitMutex.
+   int mNextSequence;
+   int mNextCommit;
+   std::map<int, std::vector<char> > mPending;
+   mutable std::mutex mCommitMutex;
+
+   struct Stats
+   {
+      unsigned long long rawBytes;       // float32 size of the cached fields
+      unsigned long long writtenBytes;
+      double maxErrorRatio;              // worst verified error / bound
+      int verifyFailures;
+   } mStats;
+};
+
+// Random access to a cache file.  The file is memory mapped, so opening it
+// only walks the frame headers and channel() returns a pointer into the
+// mapping; nothing is parsed or copied.
+class VolumeCacheReader
+{
+public:
+   VolumeCacheReader();
+   ~VolumeCacheReader();
+
+   bool open(const char* fileName);
+   void close();
+
+   const VolumeCache::FileHeader& getHeader() const;
+   int getNumFrames() const;
+   int getFrameNumber(int index) const;
+   // Returns the index of the given frame number, or -1.
+   int findFrame(int frame) const;
+
+   // Raw float32 values of one channel, or NULL if the channel isn't stored
+   // raw (use readChannel for quantized channels).
+   const float* channel(int index, int channel, size_t* count = NULL) const;
+   // Decodes one channel of any encoding into out.
+   bool readChannel(int index, int channel, std::vector<float>& out) const;
+
+protected:
+   const VolumeCache::ChannelHeader* channelHeader(int index, int channel) const;
+
+   const char* mBase;
+   size_t mSize;
+   void* mMapping;
+   std::vector<size_t> mFrameOffsets;
+   std::vector<int> mFrameNumbers;
+};
+
+#endif // VOLUME_CACHE_H
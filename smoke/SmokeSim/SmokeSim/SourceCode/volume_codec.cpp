@@ -0,0 +1,233 @@
+#include "volume_codec.h"
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#undef max
+#undef min
+#include <algorithm>
+
+using namespace VolumeCodec;
+
+static_assert(sizeof(TiledHeader) == 32, "TiledHeader must stay 32 bytes");
+
+// Calls f(index) for every cell of tile (ti, tj, tk), in GridData order.
+template <class F>
+static void forEachInTile(const int dim[3], int ti, int tj, int tk, F f)
+{
+   int i0 = ti*TILE_SIZE, i1 = std::min(dim[0], i0 + TILE_SIZE);
+   int j0 = tj*TILE_SIZE, j1 = std::min(dim[1], j0 + TILE_SIZE);
+   int k0 = tk*TILE_SIZE, k1 = std::min(dim[2], k0 + TILE_SIZE);
+   for (int j = j0; j < j1; j++)
+      for (int k = k0; k < k1; k++)
+         for (int i = i0; i < i1; i++)
+            f(i + k*dim[0] + j*dim[0]*dim[2]);
+}
+
+static void tileCounts(const int dim[3], int tiles[3])
+{
+   for (int d = 0; d < 3; d++) tiles[d] = (dim[d] + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+double VolumeCodec::encodeTiled(const float* values, const int dim[3], int bits,
+   float emptyThreshold, std::vector<char>& out)
+{
+   int tiles[3];
+   tileCounts(dim, tiles);
+   int numTiles = tiles[0]*tiles[1]*tiles[2];
+   const double levels = (bits == 16)? 65535.0 : 255.0;
+
+   std::vector<float> ranges(2*numTiles);
+   std::vector<unsigned char> quantized;
+   quantized.reserve((size_t) dim[0]*dim[1]*dim[2]*(bits/8));
+   std::vector<unsigned short> tileValues;
+   double maxError = 0.0;
+
+   int t = 0;
+   for (int tj = 0; tj < tiles[1]; tj++)
+      for (int tk = 0; tk < tiles[2]; tk++)
+         for (int ti = 0; ti < tiles[0]; ti++, t++)
+         {
+            float lo = FLT_MAX, hi = -FLT_MAX, mag = 0.0f;
+            forEachInTile(dim, ti, tj, tk, [&](int index) {
+               float v = values[index];
+               lo = std::min(lo, v);
+               hi = std::max(hi, v);
+               mag = std::max(mag, fabsf(v));
+            });
+
+            if (mag <= emptyThreshold)
+            {
+               // Empty: decodes to zero.
+               lo = hi = 0.0f;
+               maxError = std::max(maxError, (double) mag);
+            }
+            ranges[2*t] = lo;
+            ranges[2*t+1] = hi;
+            if (lo == hi) continue;
+
+            double scale = levels / ((double) hi - lo);
+            tileValues.clear();
+            forEachInTile(dim, ti, tj, tk, [&](int index) {
+               double q = ((double) values[index] - lo) * scale + 0.5;
+               tileValues.push_back((unsigned short) std::min(levels, std::max(0.0, q)));
+            });
+
+            // High byte plane first, so the low bytes of a smooth tile don't break up its runs.
+            if (bits == 16)
+            {
+               for (size_t n = 0; n < tileValues.size(); n++) quantized.push_back(tileValues[n] >> 8);
+            }
+            for (size_t n = 0; n < tileValues.size(); n++) quantized.push_back(tileValues[n] & 0xff);
+
+            double ulp = 4.0 * FLT_EPSILON * std::max(fabs((double) lo), fabs((double) hi));
+            maxError = std::max(maxError, ((double) hi - lo) / (2.0 * levels) + ulp);
+         }
+
+   // Byte delta; smooth data becomes mostly zeros.
+   unsigned char prev = 0;
+   for (size_t n = 0; n < quantized.size(); n++)
+   {
+      unsigned char q = quantized[n];
+      quantized[n] = (unsigned char) (q - prev);
+      prev = q;
+   }
+
+   std::vector<char> packed;
+   packBits(quantized.empty()? NULL : &quantized[0], quantized.size(), packed);
+
+   TiledHeader header;
+   memset(&header, 0, sizeof(header));
+   header.tileSize = TILE_SIZE;
+   header.bits = bits;
+   header.numTiles = numTiles;
+   header.quantizedBytes = quantized.size();
+   header.packedBytes = packed.size();
+
+   const char* rangeBytes = (const char*) &ranges[0];
+   out.insert(out.end(), (const char*) &header, (const char*) (&header + 1));
+   out.insert(out.end(), rangeBytes, rangeBytes + ranges.size()*sizeof(float));
+   out.insert(out.end(), packed.begin(), packed.end());
+   return maxError;
+}
+
+bool VolumeCodec::decodeTiled(const char* data, size_t bytes, const int dim[3], float* values)
+{
+   if (bytes < sizeof(TiledHeader)) return false;
+   TiledHeader header;
+   memcpy(&header, data, sizeof(header));
+
+   int tiles[3];
+   tileCounts(dim, tiles);
+   size_t numTiles = (size_t) tiles[0]*tiles[1]*tiles[2];
+   size_t rangeBytes = 2*numTiles*sizeof(float);
+   if (header.tileSize != TILE_SIZE || header.numTiles != numTiles ||
+       (header.bits != 8 && header.bits != 16) ||
+       sizeof(TiledHeader) + rangeBytes + header.packedBytes > bytes)
+   {
+      return false;
+   }
+
+   std::vector<float> ranges(2*numTiles);
+   memcpy(&ranges[0], data + sizeof(TiledHeader), rangeBytes);
+
+   std::vector<unsigned char> quantized((size_t) header.quantizedBytes);
+   if (!unpackBits(data + sizeof(TiledHeader) + rangeBytes, (size_t) header.packedBytes,
+         quantized.empty()? NULL : &quantized[0], quantized.size()))
+   {
+      return false;
+   }
+
+   unsigned char prev = 0;
+   for (size_t n = 0; n < quantized.size(); n++)
+   {
+      prev = (unsigned char) (prev + quantized[n]);
+      quantized[n] = prev;
+   }
+
+   const float levels = (header.bits == 16)? 65535.0f : 255.0f;
+   size_t cursor = 0;
+   int t = 0;
+   for (int tj = 0; tj < tiles[1]; tj++)
+      for (int tk = 0; tk < tiles[2]; tk++)
+         for (int ti = 0; ti < tiles[0]; ti++, t++)
+         {
+            float lo = ranges[2*t], hi = ranges[2*t+1];
+            if (lo == hi)
+            {
+               forEachInTile(dim, ti, tj, tk, [&](int index) { values[index] = lo; });
+               continue;
+            }
+
+            size_t count = 0;
+            forEachInTile(dim, ti, tj, tk, [&](int) { count++; });
+            size_t planeBytes = count * (header.bits / 8);
+            if (cursor + planeBytes > quantized.size()) return false;
+
+            const unsigned char* high = &quantized[cursor];
+            const unsigned char* low = (header.bits == 16)? high + count : high;
+            float step = (hi - lo) / levels;
+            size_t n = 0;
+            forEachInTile(dim, ti, tj, tk, [&](int index) {
+               unsigned int q = low[n];
+               if (header.bits == 16) q |= (unsigned int) high[n] << 8;
+               values[index] = lo + q * step;
+               n++;
+            });
+            cursor += planeBytes;
+         }
+   return true;
+}
+
+void VolumeCodec::packBits(const unsigned char* in, size_t count, std::vector<char>& out)
+{
+   size_t n = 0;
+   while (n < count)
+   {
+      // Length of the run starting here (at most 128).
+      size_t run = 1;
+      while (n + run < count && run < 128 && in[n + run] == in[n]) run++;
+
+      if (run >= 3)
+      {
+         out.push_back((char) (1 - (int) run));
+         out.push_back((char) in[n]);
+         n += run;
+         continue;
+      }
+
+      // Literals until the next run of 3 or the 128 byte limit.
+      size_t start = n;
+      while (n < count && n - start < 128)
+      {
+         if (n + 2 < count && in[n] == in[n + 1] && in[n] == in[n + 2]) break;
+         n++;
+      }
+      out.push_back((char) (n - start - 1));
+      out.insert(out.end(), (const char*) in + start, (const char*) in + n);
+   }
+}
+
+bool VolumeCodec::unpackBits(const char* in, size_t count, unsigned char* out, size_t outCount)
+{
+   size_t n = 0, written = 0;
+   while (n < count)
+   {
+      int control = (signed char) in[n++];
+      if (control >= 0)
+      {
+         size_t literals = control + 1;
+         if (n + literals > count || written + literals > outCount) return false;
+         memcpy(out + written, in + n, literals);
+         n += literals;
+         written += literals;
+      }
+      else if (control != -128)
+      {
+         size_t run = 1 - control;
+         if (n >= count || written + run > outCount) return false;
+         memset(out + written, (unsigned char) in[n++], run);
+         written += run;
+      }
+   }
+   return written == outCount;
+}
@@ -0,0 +1,50 @@
+// Lossy tiled encoding for cached smoke volumes.
+//
+// The grid is cut into 8x8x8 tiles.  Each tile stores its own min/max as
+// float32 and its values quantized to 8 or 16 bits within that range, so the
+// absolute error in a tile is at most (max - min) / (2 * (2^bits - 1)).
+// Tiles whose values are all within emptyThreshold of zero, and tiles that
+// are constant, store only their range.  The quantized bytes (split into
+// byte planes for 16 bits) are delta coded and run-length encoded, which
+// turns the smooth, mostly empty smoke fields into long runs.
+//
+// Payload layout (follows a ChannelHeader in the svol file):
+//
+//   TiledHeader                     32 bytes
+//   float ranges[2 * numTiles]      min, max per tile
+//   packed bytes                    PackBits RLE of the delta coded quantized bytes
+
+#ifndef VOLUME_CODEC_H
+#define VOLUME_CODEC_H
+
+#include <vector>
+#include <stddef.h>
+
+namespace VolumeCodec
+{
+   enum { TILE_SIZE = 8 };
+
+   struct TiledHeader
+   {
+      unsigned int tileSize;
+      unsigned int bits;          // 8 or 16
+      unsigned int numTiles;
+      unsigned int reserved;
+      unsigned long long quantizedBytes;  // bytes after RLE decoding
+      unsigned long long packedBytes;     // bytes of RLE data following the ranges
+   };
+
+   // Appends the encoded payload for a dim[0] x dim[1] x dim[2] block (GridData
+   // order) to out.  Returns the largest error any value may have after decoding.
+   double encodeTiled(const float* values, const int dim[3], int bits,
+      float emptyThreshold, std::vector<char>& out);
+
+   // Decodes a payload written by encodeTiled into values (dim[0]*dim[1]*dim[2] floats).
+   bool decodeTiled(const char* data, size_t bytes, const int dim[3], float* values);
+
+   // PackBits run-length coding of a byte stream.
+   void packBits(const unsigned char* in, size_t count, std::vector<char>& out);
+   bool unpackBits(const char* in, size_t count, unsigned char* out, size_t outCount);
+}
+
+#endif // VOLUME_CODEC_H
@@ -0,0 +1,186 @@
+#include "volume_renderer.h"
+#include "grid_data.h"
+#include "constants.h"
+#include "parallel.h"
+#include "grid_sample.h"
+#include "basic_math.h"
+#include "stb_image_write.h"
+#include <math.h>
+#include <chrono>
+#undef max
+#undef min
+#include <algorithm>
+
+static const int theTileSize = 16;
+
+static double secondsNow()
+{
+   using namespace std::chrono;
+   return duration_cast<duration<double> >(steady_clock::now().time_since_epoch()).count();
+}
+
+VolumeRenderer::VolumeRenderer() :
+   mWidth(640), mHeight(480), mStepSize(0.5), mExtinction(1.0), mCutoff(0.01),
+   mSmokeColor(1.0, 1.0, 1.0), mBackground(0.1, 0.1, 0.1), mLightColor(1.0, 1.0, 1.0),
+   mAmbient(0.2), mNumThreads(0)
+{
+   mStats.seconds = 0.0;
+   mStats.samples = 0;
+   frameGrid();
+}
+
+void VolumeRenderer::setResolution(int width, int height)
+{
+   mWidth = width;
+   mHeight = height;
+}
+
+void VolumeRenderer::setCamera(const vec3& eye, const vec3& look, const vec3& up, double vfov)
+{
+   mEye = eye;
+   mForward = look - eye;
+   mForward.Normalize();
+   mRight = mForward.Cross(up);
+   mRight.Normalize();
+   mUp = mRight.Cross(mForward);
+   mTanHalfFov = tan(0.5 * vfov * BasicMath::PI / 180.0);
+}
+
+void VolumeRenderer::frameGrid()
+{
+   // Same framing as initCamera() in main.cpp.
+   double w = theDim[0]*theCellSize;
+   double h = theDim[1]*theCellSize;
+   double d = theDim[2]*theCellSize;
+   double vfov = 60.0;
+   double dist = std::max(w, h)*0.5 / tan(0.5 * vfov * BasicMath::PI / 180.0);
+   setCamera(vec3(w*0.5, h*0.5, -(dist + d*0.5)), vec3(w*0.5, h*0.5, 0.0), vec3(0.0, 1.0, 0.0), vfov);
+}
+
+void VolumeRenderer::setStepSize(double cells) { mStepSize = cells; }
+void VolumeRenderer::setExtinction(double extinction) { mExtinction = extinction; }
+void VolumeRenderer::setCutoff(double transmittance) { mCutoff = transmittance; }
+void VolumeRenderer::setSmokeColor(const vec3& color) { mSmokeColor = color; }
+void VolumeRenderer::setBackground(const vec3& color) { mBackground = color; }
+void VolumeRenderer::setNumThreads(int numThreads) { mNumThreads = numThreads; }
+
+void VolumeRenderer::setLight(const vec3& color, double ambient)
+{
+   mLightColor = color;
+   mAmbient = ambient;
+}
+
+void VolumeRenderer::render(const GridData& density, const std::vector<float>* lightTransmittance)
+{
+   double start = secondsNow();
+
+   mImage.resize(3 * mWidth * mHeight);
+   int tilesX = (mWidth + theTileSize - 1) / theTileSize;
+   int tilesY = (mHeight + theTileSize - 1) / theTileSize;
+   mTileSamples.assign(tilesX * tilesY, 0);
+
+   const double* d = &density.data()[0];
+   const float* light = lightTransmittance? &(*lightTransmittance)[0] : NULL;
+   parallelFor(0, tilesX * tilesY, [&](int tile) { renderTile(tile, d, light); }, mNumThreads);
+
+   mStats.samples = 0;
+   for (size_t t = 0; t < mTileSamples.size(); t++) mStats.samples += mTileSamples[t];
+   mStats.seconds = secondsNow() - start;
+}
+
+void VolumeRenderer::renderTile(int tile, const double* density, const float* light)
+{
+   const int tilesX = (mWidth + theTileSize - 1) / theTileSize;
+   const int x0 = (tile % tilesX) * theTileSize, y0 = (tile / tilesX) * theTileSize;
+   const int x1 = std::min(x0 + theTileSize, mWidth), y1 = std::min(y0 + theTileSize, mHeight);
+
+   const double h = theCellSize;
+   const double boxMax[3] = { theDim[0]*h, theDim[1]*h, theDim[2]*h };
+   const double aspect = (double) mWidth / mHeight;
+   const double step = mStepSize * h;
+   long long samples = 0;
+
+   for (int py = y0; py < y1; py++)
+   {
+      for (int px = x0; px < x1; px++)
+      {
+         // Row 0 is the top of the image.
+         double sx = (2.0 * (px + 0.5) / mWidth - 1.0) * mTanHalfFov * aspect;
+         double sy = (1.0 - 2.0 * (py + 0.5) / mHeight) * mTanHalfFov;
+         vec3 dir = mForward + mRight*sx + mUp*sy;
+         dir.Normalize();
+
+         // Clip the ray against the grid's bounding box.
+         double tNear = 0.0, tFar = 1e30;
+         for (int a = 0; a < 3; a++)
+         {
+            if (fabs(dir[a]) < 1e-12)
+            {
+               if (mEye[a] < 0.0 || mEye[a] > boxMax[a]) tFar = -1.0;
+               continue;
+            }
+            double ta = (0.0 - mEye[a]) / dir[a];
+            double tb = (boxMax[a] - mEye[a]) / dir[a];
+            tNear = std::max(tNear, std::min(ta, tb));
+            tFar = std::min(tFar, std::max(ta, tb));
+         }
+
+         double color[3] = { 0.0, 0.0, 0.0 };
+         double transmittance = 1.0;
+         if (tNear < tFar)
+         {
+            // Offset by half a step so samples sit inside the box.
+            for (double t = tNear + 0.5*step; t < tFar && transmittance > mCutoff; t += step)
+            {
+               double x = (mEye[0] + dir[0]*t) / h - 0.5;
+               double y = (mEye[1] + dir[1]*t) / h - 0.5;
+               double z = (mEye[2] + dir[2]*t) / h - 0.5;
+               samples++;
+
+               double value = sampleCentered(density, x, y, z);
+               if (value <= 0.0) continue;
+
+               double alpha = 1.0 - exp(-mExtinction * value * step);
+               double lit = light? sampleCentered(light, x, y, z) : 1.0;
+               double weight = transmittance * alpha * (mAmbient + (1.0 - mAmbient) * lit);
+               for (int c = 0; c < 3; c++) color[c] += weight * mSmokeColor[c] * mLightColor[c];
+               transmittance *= 1.0 - alpha;
+            }
+         }
+
+         unsigned char* pixel = &mImage[3 * (py * mWidth + px)];
+         for (int c = 0; c < 3; c++)
+         {
+            double value = color[c] + transmittance * mBackground[c];
+            pixel[c] = (unsigned char) (255.0 * std::min(1.0, std::max(0.0, value)) + 0.5);
+         }
+      }
+   }
+   mTileSamples[tile] = samples;
+}
+
+const std::vector<unsigned char>& VolumeRenderer::getImage() const
+{
+   return mImage;
+}
+
+int VolumeRenderer::getWidth() const
+{
+   return mWidth;
+}
+
+int VolumeRenderer::getHeight() const
+{
+   return mHeight;
+}
+
+bool VolumeRenderer::savePng(const char* fileName) const
+{
+   if (mImage.empty()) return false;
+   return stbi_write_png(fileName, mWidth, mHeight, 3, &mImage[0], mWidth * 3) != 0;
+}
+
+const VolumeRenderer::Stats& VolumeRenderer::getStats() const
+{
+   return mStats;
+}
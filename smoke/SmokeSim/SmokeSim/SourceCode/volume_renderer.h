@@ -0,0 +1,74 @@
+// Software volume renderer for the smoke density.
+//
+// Ray marches the density grid with emission/absorption compositing, front
+// to back, and stops a ray once its transmittance drops below a cutoff.  The
+// image is split into 16x16 pixel tiles that are rendered in parallel.  No
+// GL context is needed, so frames can be rendered on machines without a
+// display (see smoke_headless -render-every).
+//
+// Lighting is an ambient term plus one directional light.  Without a light
+// transmittance grid the light reaches every sample unattenuated; with one
+// (see TransmittanceGrid), each sample is shaded by the grid's value at that
+// point (one extra trilinear lookup), which gives self shadowing.
+
+#ifndef VOLUME_RENDERER_H
+#define VOLUME_RENDERER_H
+
+#include <vector>
+#include "vec.h"
+
+class GridData;
+
+class VolumeRenderer
+{
+public:
+   VolumeRenderer();
+
+   void setResolution(int width, int height);
+   // Same conventions as gluLookAt/gluPerspective; vfov in degrees.
+   void setCamera(const vec3& eye, const vec3& look, const vec3& up, double vfov);
+   // The GUI's default view: looking down +z at the middle of the grid.
+   void frameGrid();
+
+   void setStepSize(double cells);         // march step, in cells (default 0.5)
+   void setExtinction(double extinction);  // per unit density per unit length (default 1)
+   void setCutoff(double transmittance);   // early termination threshold (default 0.01)
+   void setSmokeColor(const vec3& color);
+   void setBackground(const vec3& color);
+   void setLight(const vec3& color, double ambient);
+   void setNumThreads(int numThreads);     // 0 = one per hardware thread
+
+   // Renders density (GridData order, theDim cells).  lightTransmittance, if
+   // given, holds the fraction of light reaching each cell center, same layout.
+   void render(const GridData& density, const std::vector<float>* lightTransmittance = NULL);
+
+   // RGB, top row first.
+   const std::vector<unsigned char>& getImage() const;
+   int getWidth() const;
+   int getHeight() const;
+   bool savePng(const char* fileName) const;
+
+   struct Stats
+   {
+      double seconds;
+      long long samples;   // density lookups, after early termination
+   };
+   const Stats& getStats() const;
+
+protected:
+   void renderTile(int tile, const double* density, const float* light);
+
+   int mWidth, mHeight;
+   vec3 mEye, mForward, mRight, mUp;
+   double mTanHalfFov;
+   double mStepSize, mExtinction, mCutoff;
+   vec3 mSmokeColor, mBackground, mLightColor;
+   double mAmbient;
+   int mNumThreads;
+
+   std::vector<unsigned char> mImage;
+   std::vector<long long> mTileSamples;
+   Stats mStats;
+};
+
+#endif // VOLUME_RENDERER_H
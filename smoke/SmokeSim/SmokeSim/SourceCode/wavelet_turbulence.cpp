@@ -0,0 +1,327 @@
+#include "wavelet_turbulence.h"
+#include "mac_grid.h"
+#include "constants.h"
+#include "grid_sample.h"
+#include "parallel.h"
+#include <math.h>
+#include <random>
+
+//---------------------------------------------------------------------
+// WaveletNoise
+//---------------------------------------------------------------------
+
+static inline int wrap(int x, int n)
+{
+   int m = x % n;
+   return m < 0? m + n : m;
+}
+
+// Analysis filter for the quadratic B-spline wavelet (Cook and DeRose, appendix).
+static const int theFilterRadius = 16;
+static const float theDownCoeffs[2*theFilterRadius] = {
+    0.000334f,-0.001528f, 0.000410f, 0.003545f,-0.000938f,-0.008233f, 0.002172f, 0.019120f,
+   -0.005040f,-0.044412f, 0.011655f, 0.103311f,-0.025936f,-0.243780f, 0.033979f, 0.655340f,
+    0.655340f, 0.033979f,-0.243780f,-0.025936f, 0.103311f, 0.011655f,-0.044412f,-0.005040f,
+    0.019120f, 0.002172f,-0.008233f,-0.000938f, 0.003546f, 0.000410f,-0.001528f, 0.000334f };
+
+static void downsample(const float* from, float* to, int n, int stride)
+{
+   const float* a = &theDownCoeffs[theFilterRadius];
+   for (int i = 0; i < n/2; i++)
+   {
+      float sum = 0.0f;
+      for (int k = 2*i - theFilterRadius; k < 2*i + theFilterRadius; k++)
+      {
+         sum += a[k - 2*i] * from[wrap(k, n)*stride];
+      }
+      to[i*stride] = sum;
+   }
+}
+
+static void upsample(const float* from, float* to, int n, int stride)
+{
+   static const float pCoeffs[4] = { 0.25f, 0.75f, 0.75f, 0.25f };
+   const float* p = &pCoeffs[2];
+   for (int i = 0; i < n; i++)
+   {
+      float sum = 0.0f;
+      for (int k = i/2; k <= i/2 + 1; k++)
+      {
+         sum += p[i - 2*k] * from[wrap(k, n/2)*stride];
+      }
+      to[i*stride] = sum;
+   }
+}
+
+WaveletNoise::WaveletNoise(int tileSize, unsigned int seed) : mSize(tileSize + tileSize % 2)
+{
+   const int n = mSize, cells = n*n*n;
+   std::vector<float> noise(cells), temp1(cells), temp2(cells);
+
+   std::mt19937 random(seed);
+   std::normal_distribution<float> gaussian(0.0f, 1.0f);
+   for (int i = 0; i < cells; i++) noise[i] = gaussian(random);
+
+   // Remove the part of the noise the next coarser level could represent,
+   // one axis at a time; what is left is band limited.
+   for (int iy = 0; iy < n; iy++)
+      for (int iz = 0; iz < n; iz++)
+      {
+         int i = iy*n + iz*n*n;
+         downsample(&noise[i], &temp1[i], n, 1);
+         upsample(&temp1[i], &temp2[i], n, 1);
+      }
+   for (int ix = 0; ix < n; ix++)
+      for (int iz = 0; iz < n; iz++)
+      {
+         int i = ix + iz*n*n;
+         downsample(&temp2[i], &temp1[i], n, n);
+         upsample(&temp1[i], &temp2[i], n, n);
+      }
+   for (int ix = 0; ix < n; ix++)
+      for (int iy = 0; iy < n; iy++)
+      {
+         int i = ix + iy*n;
+         downsample(&temp2[i], &temp1[i], n, n*n);
+         upsample(&temp1[i], &temp2[i], n, n*n);
+      }
+   for (int i = 0; i < cells; i++) noise[i] -= temp2[i];
+
+   // Even and odd coefficients have different variance; add an odd-offset copy to even it out.
+   int offset = n/2;
+   if (offset % 2 == 0) offset++;
+   for (int ix = 0, i = 0; ix < n; ix++)
+      for (int iy = 0; iy < n; iy++)
+         for (int iz = 0; iz < n; iz++)
+         {
+            temp1[i++] = noise[wrap(ix+offset, n) + wrap(iy+offset, n)*n + wrap(iz+offset, n)*n*n];
+         }
+   for (int i = 0; i < cells; i++) noise[i] += temp1[i];
+
+   mTile.swap(noise);
+}
+
+float WaveletNoise::evaluate(const float p[3]) const
+{
+   const int n = mSize;
+   int mid[3];
+   float w[3][3];
+
+   // Quadratic B-spline weights.
+   for (int a = 0; a < 3; a++)
+   {
+      mid[a] = (int) ceilf(p[a] - 0.5f);
+      float t = mid[a] - (p[a] - 0.5f);
+      w[a][0] = t*t*0.5f;
+      w[a][2] = (1.0f - t)*(1.0f - t)*0.5f;
+      w[a][1] = 1.0f - w[a][0] - w[a][2];
+   }
+
+   float result = 0.0f;
+   for (int fz = -1; fz <= 1; fz++)
+      for (int fy = -1; fy <= 1; fy++)
+         for (int fx = -1; fx <= 1; fx++)
+         {
+            float weight = w[0][fx+1] * w[1][fy+1] * w[2][fz+1];
+            result += weight * mTile[wrap(mid[0]+fx, n) + wrap(mid[1]+fy, n)*n + wrap(mid[2]+fz, n)*n*n];
+         }
+   return result;
+}
+
+float WaveletNoise::evaluate(const float p[3], float gradient[3]) const
+{
+   const int n = mSize;
+   int mid[3];
+   float w[3][3], dw[3][3];
+
+   // Quadratic B-spline weights and their derivatives (t falls as p grows).
+   for (int a = 0; a < 3; a++)
+   {
+      mid[a] = (int) ceilf(p[a] - 0.5f);
+      float t = mid[a] - (p[a] - 0.5f);
+      w[a][0] = t*t*0.5f;
+      w[a][2] = (1.0f - t)*(1.0f - t)*0.5f;
+      w[a][1] = 1.0f - w[a][0] - w[a][2];
+      dw[a][0] = -t;
+      dw[a][2] = 1.0f - t;
+      dw[a][1] = 2.0f*t - 1.0f;
+   }
+
+   float result = 0.0f;
+   gradient[0] = gradient[1] = gradient[2] = 0.0f;
+   for (int fz = -1; fz <= 1; fz++)
+      for (int fy = -1; fy <= 1; fy++)
+         for (int fx = -1; fx <= 1; fx++)
+         {
+            float value = mTile[wrap(mid[0]+fx, n) + wrap(mid[1]+fy, n)*n + wrap(mid[2]+fz, n)*n*n];
+            result += w[0][fx+1] * w[1][fy+1] * w[2][fz+1] * value;
+            gradient[0] += dw[0][fx+1] * w[1][fy+1] * w[2][fz+1] * value;
+            gradient[1] += w[0][fx+1] * dw[1][fy+1] * w[2][fz+1] * value;
+            gradient[2] += w[0][fx+1] * w[1][fy+1] * dw[2][fz+1] * value;
+         }
+   return result;
+}
+
+//---------------------------------------------------------------------
+// WaveletTurbulence
+//---------------------------------------------------------------------
+
+// The curl of the two octave noise varies about 2.3 times as much as one
+// channel of it; this keeps a strength of 1 as strong as a plain noise
+// velocity of the same amplitude would be.
+static const double theCurlScale = 0.44;
+
+WaveletTurbulence::WaveletTurbulence(int factor) :
+   mFactor(factor < 1? 1 : factor), mStrength(1.0), mNumThreads(0), mTime(0.0)
+{
+   for (int d = 0; d < 3; d++) mDim[d] = theDim[d] * mFactor;
+   mCellSize = theCellSize / mFactor;
+   reset();
+}
+
+void WaveletTurbulence::setStrength(double strength)
+{
+   mStrength = strength;
+}
+
+void WaveletTurbulence::setNumThreads(int numThreads)
+{
+   mNumThreads = numThreads;
+}
+
+void WaveletTurbulence::reset()
+{
+   mDensity.assign((size_t) mDim[0]*mDim[1]*mDim[2], 0.0f);
+   mScratch.assign(mDensity.size(), 0.0f);
+   mTime = 0.0;
+}
+
+int WaveletTurbulence::getFactor() const
+{
+   return mFactor;
+}
+
+const int* WaveletTurbulence::getDim() const
+{
+   return mDim;
+}
+
+double WaveletTurbulence::getCellSize() const
+{
+   return mCellSize;
+}
+
+const std::vector<float>& WaveletTurbulence::getDensity() const
+{
+   return mDensity;
+}
+
+void WaveletTurbulence::step(const MACGrid& grid, double dt)
+{
+   const int nx = theDim[0], ny = theDim[1], nz = theDim[2];
+   const int fx = mDim[0], fy = mDim[1], fz = mDim[2];
+   const int R = mFactor;
+   const double h = theCellSize, fh = mCellSize;
+
+   const double* u = &grid.getVelocityXGrid().data()[0];
+   const double* v = &grid.getVelocityYGrid().data()[0];
+   const double* w = &grid.getVelocityZGrid().data()[0];
+   const double* coarse = &grid.getDensityGrid().data()[0];
+   const int dimU[3] = { nx+1, ny, nz }, dimV[3] = { nx, ny+1, nz }, dimW[3] = { nx, ny, nz+1 };
+
+   // Coarse speed at cell centers, which sets the local turbulence amplitude.
+   mSpeed.resize((size_t) nx*ny*nz);
+   parallelForStatic(0, ny, [&](int j) {
+      for (int k = 0; k < nz; k++)
+         for (int i = 0; i < nx; i++)
+         {
+            double cu = 0.5 * (u[i + k*(nx+1) + j*(nx+1)*nz] + u[i+1 + k*(nx+1) + j*(nx+1)*nz]);
+            double cv = 0.5 * (v[i + k*nx + j*nx*nz] + v[i + k*nx + (j+1)*nx*nz]);
+            double cw = 0.5 * (w[i + k*nx + j*nx*(nz+1)] + w[i + (k+1)*nx + j*nx*(nz+1)]);
+            mSpeed[i + k*nx + j*nx*nz] = (float) sqrt(cu*cu + cv*cv + cw*cw);
+         }
+   }, mNumThreads);
+
+   // Advect the fine density with coarse velocity plus turbulence.
+   const float* src = &mDensity[0];
+   float* dst = &mScratch[0];
+   const float drift = (float) mTime;
+   const float octaveGain = powf(2.0f, -5.0f/6.0f);   // Kolmogorov falloff between octaves
+   parallelForStatic(0, fy, [&](int j) {
+      for (int k = 0; k < fz; k++)
+         for (int i = 0; i < fx; i++)
+         {
+            double x = (i + 0.5) * fh, y = (j + 0.5) * fh, z = (k + 0.5) * fh;
+
+            double vel[3];
+            vel[0] = sampleCentered(u, dimU, x/h, y/h - 0.5, z/h - 0.5);
+            vel[1] = sampleCentered(v, dimV, x/h - 0.5, y/h, z/h - 0.5);
+            vel[2] = sampleCentered(w, dimW, x/h - 0.5, y/h - 0.5, z/h);
+
+            double speed = sampleCentered(&mSpeed[0], x/h - 0.5, y/h - 0.5, z/h - 0.5);
+            if (speed > 0.0 && mStrength > 0.0)
+            {
+               // Two octaves of a vector noise, its three channels decorrelated
+               // by offsets into the tile.  Channel a drifts along axis a, so
+               // the curl changes shape over time instead of the whole pattern
+               // sliding one way through the smoke.  d[a][b] is channel a's
+               // derivative along b, taken in noise coordinates.
+               float d[3][3];
+               for (int a = 0; a < 3; a++)
+               {
+                  float p[3] = { (float) (i*0.5) + 17.0f*a,
+                                 (float) (j*0.5) + 31.0f*a,
+                                 (float) (k*0.5) + 47.0f*a };
+                  p[a] += drift;
+                  mNoise.evaluate(p, d[a]);
+                  float p2[3] = { 2.0f*p[0], 2.0f*p[1], 2.0f*p[2] };
+                  float d2[3];
+                  mNoise.evaluate(p2, d2);
+                  for (int b = 0; b < 3; b++) d[a][b] += octaveGain * d2[b];
+               }
+
+               // The curl has no divergence; only the slowly varying speed
+               // scale adds a little.
+               double scale = mStrength * speed * theCurlScale;
+               vel[0] += scale * (d[2][1] - d[1][2]);
+               vel[1] += scale * (d[0][2] - d[2][0]);
+               vel[2] += scale * (d[1][0] - d[0][1]);
+            }
+
+            dst[i + k*fx + j*fx*fz] = (float) sampleCentered(src, mDim,
+               (x - dt*vel[0]) / fh - 0.5, (y - dt*vel[1]) / fh - 0.5, (z - dt*vel[2]) / fh - 0.5);
+         }
+   }, mNumThreads);
+   mDensity.swap(mScratch);
+
+   // Pull the fine block averages back to the coarse density.
+   mCorrection.resize((size_t) nx*ny*nz);
+   const float* fine = &mDensity[0];
+   parallelForStatic(0, ny, [&](int j) {
+      for (int k = 0; k < nz; k++)
+         for (int i = 0; i < nx; i++)
+         {
+            double sum = 0.0;
+            for (int bj = j*R; bj < (j+1)*R; bj++)
+               for (int bk = k*R; bk < (k+1)*R; bk++)
+                  for (int bi = i*R; bi < (i+1)*R; bi++)
+                     sum += fine[bi + bk*fx + bj*fx*fz];
+            int index = i + k*nx + j*nx*nz;
+            mCorrection[index] = (float) (coarse[index] - sum / (R*R*R));
+         }
+   }, mNumThreads);
+
+   float* out = &mDensity[0];
+   parallelForStatic(0, fy, [&](int j) {
+      for (int k = 0; k < fz; k++)
+         for (int i = 0; i < fx; i++)
+         {
+            double c = sampleCentered(&mCorrection[0], (i + 0.5)/R - 0.5, (j + 0.5)/R - 0.5, (k + 0.5)/R - 0.5);
+            float& value = out[i + k*fx + j*fx*fz];
+            value = (float) (value + c);
+            if (value < 0.0f) value = 0.0f;
+         }
+   }, mNumThreads);
+
+   mTime += dt;
+}
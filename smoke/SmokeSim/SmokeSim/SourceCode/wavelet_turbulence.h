@@ -0,0 +1,76 @@
+// Wavelet turbulence upsampling (after Kim et al. 2008, "Wavelet Turbulence
+// for Fluid Simulation").
+//
+// Runs after each coarse step and carries a density grid `factor` times finer
+// along each axis.  The fine density is advected semi-Lagrangian with the
+// coarse MACGrid velocity plus a turbulent velocity: the curl of a vector of
+// band-limited wavelet noise (Cook and DeRose 2005), which is divergence free
+// so the detail swirls instead of compressing the smoke, scaled by the local
+// coarse speed so detail only appears where the flow has energy.  Afterwards
+// the fine density's per-cell averages are pulled back to the coarse density,
+// so sources and the large scale motion always follow the coarse solve and
+// the fine grid only adds detail.  No pressure projection happens at the fine
+// resolution.
+//
+// The fine grid is processed in parallel j slices (parallelForStatic), so
+// each thread reads the coarse rows it first touched (see grid_storage.h).
+
+#ifndef WAVELET_TURBULENCE_H
+#define WAVELET_TURBULENCE_H
+
+#include <vector>
+
+class MACGrid;
+
+// Periodic 3D wavelet noise tile.
+class WaveletNoise
+{
+public:
+   explicit WaveletNoise(int tileSize = 64, unsigned int seed = 1);
+
+   // Noise at p (in tile cells), roughly unit variance, band limited to one
+   // octave.
+   float evaluate(const float p[3]) const;
+   // Same, also returning the noise's derivatives along x, y and z.
+   float evaluate(const float p[3], float gradient[3]) const;
+
+protected:
+   int mSize;
+   std::vector<float> mTile;
+};
+
+class WaveletTurbulence
+{
+public:
+   explicit WaveletTurbulence(int factor = 4);
+
+   // Scales the turbulent velocity relative to the local coarse speed.
+   void setStrength(double strength);
+   void setNumThreads(int numThreads);   // 0 = one per hardware thread
+   void reset();
+
+   // Advances the fine density by dt using the grid's current state.
+   void step(const MACGrid& grid, double dt);
+
+   int getFactor() const;
+   const int* getDim() const;
+   double getCellSize() const;
+   // Fine density, GridData order over getDim() cells.
+   const std::vector<float>& getDensity() const;
+
+protected:
+   int mFactor;
+   int mDim[3];
+   double mCellSize;
+   double mStrength;
+   int mNumThreads;
+   double mTime;
+
+   WaveletNoise mNoise;
+   std::vector<float> mDensity;
+   std::vector<float> mScratch;
+   std::vector<float> mSpeed;        // coarse cell speed
+   std::vector<float> mCorrection;   // coarse density minus fine block average
+};
+
+#endif // WAVELET_TURBULENCE_H